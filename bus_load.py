@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+"""
+CAN Bus Load Analyzer
+Listens on a CAN interface and reports how busy the bus is, so update
+budgets can be chosen from the traffic that is really there:
+
+  - utilisation from the exact on-wire length of every frame (bit
+    stuffing of the actual identifier, data and CRC, not a worst case)
+  - broken down by J1939 PGN, source address and priority
+  - over sliding windows (1 s, 10 s and 60 s by default), with the
+    busiest 100 ms slot of each window next to the mean
+  - a recommended packet delay for an update that keeps the bus below
+    a load ceiling even at the observed peak
+
+j1939_firmware_sender.py uses BusLoadAnalyzer for --auto-rate.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    python3 bus_load.py -i can0 -b 250000
+    python3 bus_load.py -i can0 -b 500000 --windows 1 5 --time 30
+"""
+
+import argparse
+import time
+import can
+from collections import Counter, deque
+from typing import Dict, Iterable, Optional, Tuple
+
+DEFAULT_WINDOWS = (1.0, 10.0, 60.0)
+DEFAULT_MAX_LOAD = 0.7      # Ceiling for existing traffic plus the update
+SLOT = 0.1                  # Bucket length in seconds
+
+# CRC delimiter, ACK slot, ACK delimiter, EOF and IFS are never stuffed
+FRAME_TAIL_BITS = 13
+CRC15_POLY = 0x4599
+
+
+def _crc15(bits: Iterable[int]) -> int:
+    crc = 0
+    for bit in bits:
+        crc_next = bit ^ ((crc >> 14) & 1)
+        crc = (crc << 1) & 0x7FFF
+        if crc_next:
+            crc ^= CRC15_POLY
+    return crc
+
+
+def _append(bits: list, value: int, width: int):
+    for i in range(width - 1, -1, -1):
+        bits.append((value >> i) & 1)
+
+
+def frame_bits(can_id: int, extended: bool, data: bytes = b'',
+               remote: bool = False, dlc: Optional[int] = None) -> int:
+    """
+    Length of one classic CAN frame on the wire
+
+    Builds the frame from SOF to the CRC, inserts the stuff bits a
+    transmitter would and adds the fixed tail and interframe space.
+
+    Args:
+        can_id: 11- or 29-bit identifier
+        extended: 29-bit identifier
+        data: Payload (ignored for remote frames)
+        remote: Remote transmission request
+        dlc: Data length code, defaults to len(data)
+
+    Returns:
+        Bits, interframe space included
+    """
+    if dlc is None:
+        dlc = len(data)
+    payload = b'' if remote else bytes(data[:8])
+
+    bits = [0]  # SOF
+    if extended:
+        _append(bits, can_id >> 18, 11)
+        bits += [1, 1]  # SRR, IDE
+        _append(bits, can_id & 0x3FFFF, 18)
+        bits += [1 if remote else 0, 0, 0]  # RTR, r1, r0
+    else:
+        _append(bits, can_id & 0x7FF, 11)
+        bits += [1 if remote else 0, 0, 0]  # RTR, IDE, r0
+    _append(bits, dlc & 0xF, 4)
+    for byte in payload:
+        _append(bits, byte, 8)
+    _append(bits, _crc15(bits), 15)
+
+    stuff = 0
+    run_bit = bits[0]
+    run_len = 0
+    for bit in bits:
+        if bit == run_bit:
+            run_len += 1
+        else:
+            run_bit = bit
+            run_len = 1
+        if run_len == 5:
+            # The stuff bit is the complement and starts the next run
+            stuff += 1
+            run_bit ^= 1
+            run_len = 1
+
+    return len(bits) + stuff + FRAME_TAIL_BITS
+
+
+def worst_frame_bits(extended: bool, dlc: int = 8) -> int:
+    """Longest possible frame: one stuff bit after every four bits"""
+    stuffed = (54 if extended else 34) + 8 * dlc
+    return stuffed + (stuffed - 1) // 4 + FRAME_TAIL_BITS
+
+
+def j1939_fields(can_id: int, extended: bool) -> Tuple[str, str, str]:
+    """
+    Keys a frame is counted under
+
+    Returns:
+        (PGN, source address, priority) as display strings; 11-bit
+        frames count under their identifier
+    """
+    if not extended:
+        return f"std 0x{can_id:03X}", "-", "-"
+
+    priority = (can_id >> 26) & 0x7
+    pgn = (can_id >> 8) & 0x3FFFF
+    if ((pgn >> 8) & 0xFF) < 240:
+        pgn &= 0x3FF00  # PDU1: PS is the destination address
+    return f"0x{pgn:04X}", f"0x{can_id & 0xFF:02X}", str(priority)
+
+
+class _Slot:
+    """Traffic of one SLOT-long bucket"""
+
+    __slots__ = ('bits', 'frames', 'pgn', 'sa', 'prio')
+
+    def __init__(self):
+        self.bits = 0
+        self.frames = 0
+        self.pgn: Counter = Counter()
+        self.sa: Counter = Counter()
+        self.prio: Counter = Counter()
+
+
+class BusLoadAnalyzer:
+    """Sliding-window bus load from the frames fed to it"""
+
+    def __init__(self, bitrate: int, windows: Iterable[float] = DEFAULT_WINDOWS):
+        """
+        Initialize the analyzer
+
+        Args:
+            bitrate: Bus bitrate in bps
+            windows: Window lengths in seconds
+        """
+        self.bitrate = bitrate
+        self.windows = sorted(windows)
+        self.slots: deque = deque()   # (slot index, _Slot), oldest first
+        self.started: Optional[float] = None
+        self.last: Optional[float] = None
+        self.errors = 0
+
+    def feed(self, msg: can.Message, now: Optional[float] = None):
+        """
+        Count one received frame
+
+        Args:
+            msg: Frame as received; error frames are only counted
+            now: Receive time, defaults to msg.timestamp
+        """
+        now = now if now is not None else (msg.timestamp or time.time())
+        self.advance(now)
+
+        if getattr(msg, 'is_error_frame', False):
+            self.errors += 1
+            return
+
+        extended = msg.is_extended_id
+        remote = getattr(msg, 'is_remote_frame', False)
+        bits = frame_bits(msg.arbitration_id, extended, bytes(msg.data or b''),
+                          remote, msg.dlc if remote else None)
+        pgn, sa, prio = j1939_fields(msg.arbitration_id, extended)
+
+        slot = self.slots[-1][1]
+        slot.bits += bits
+        slot.frames += 1
+        slot.pgn[pgn] += bits
+        slot.sa[sa] += bits
+        slot.prio[prio] += bits
+
+    def advance(self, now: float):
+        """Move the window to @now, dropping slots older than the longest window"""
+        if self.started is None:
+            self.started = now
+        self.last = now if self.last is None else max(self.last, now)
+
+        index = int(self.last / SLOT)
+        if not self.slots or self.slots[-1][0] != index:
+            self.slots.append((index, _Slot()))
+
+        oldest = index - int(self.windows[-1] / SLOT)
+        while self.slots and self.slots[0][0] <= oldest:
+            self.slots.popleft()
+
+    def stats(self, window: float) -> Dict:
+        """
+        Load over the last @window seconds
+
+        Returns:
+            Dictionary with 'load' (mean, 0..1), 'peak' (busiest slot),
+            'frames', 'fps', 'span' (seconds covered so far) and 'pgn',
+            'sa', 'prio' (share of the bus per key, largest first)
+        """
+        if self.last is None:
+            return {'load': 0.0, 'peak': 0.0, 'frames': 0, 'fps': 0.0, 'span': 0.0,
+                    'pgn': [], 'sa': [], 'prio': []}
+
+        index = int(self.last / SLOT)
+        first = index - int(window / SLOT) + 1
+        span = min(window, self.last - self.started + SLOT)
+
+        bits = frames = 0
+        peak = 0
+        pgn: Counter = Counter()
+        sa: Counter = Counter()
+        prio: Counter = Counter()
+        for slot_index, slot in self.slots:
+            if slot_index < first:
+                continue
+            bits += slot.bits
+            frames += slot.frames
+            peak = max(peak, slot.bits)
+            pgn.update(slot.pgn)
+            sa.update(slot.sa)
+            prio.update(slot.prio)
+
+        capacity = self.bitrate * span
+
+        def shares(counter: Counter):
+            return [(key, value / capacity) for key, value in counter.most_common()]
+
+        return {
+            'load': bits / capacity,
+            'peak': peak / (self.bitrate * SLOT),
+            'frames': frames,
+            'fps': frames / span,
+            'span': span,
+            'pgn': shares(pgn),
+            'sa': shares(sa),
+            'prio': shares(prio),
+        }
+
+    def recommend_delay(self, max_load: float = DEFAULT_MAX_LOAD,
+                        window: Optional[float] = None) -> Tuple[float, float]:
+        """
+        Packet delay that keeps the bus below @max_load
+
+        Sizes the update's share from the busiest slot of the window
+        rather than its mean, so bursts of existing traffic still fit.
+        Update frames are counted at their worst-case length.
+
+        Args:
+            max_load: Ceiling for existing traffic plus the update (0..1)
+            window: Window to judge by, defaults to the longest
+
+        Returns:
+            (delay between update packets in seconds, update frames per
+            second); the delay is 0 when the bus is idle enough to send
+            back to back, inf when there is no room at all
+        """
+        stats = self.stats(window if window is not None else self.windows[-1])
+        room = max_load - stats['peak']
+        if room <= 0:
+            return float('inf'), 0.0
+
+        frame_time = worst_frame_bits(True) / self.bitrate
+        rate = room * self.bitrate / worst_frame_bits(True)
+        return max(1.0 / rate - frame_time, 0.0), rate
+
+
+def measure(bus: can.Bus, analyzer: BusLoadAnalyzer, duration: float):
+    """Feed @analyzer with everything received on @bus for @duration seconds"""
+    deadline = time.time() + duration
+    while True:
+        remaining = deadline - time.time()
+        if remaining <= 0:
+            break
+        msg = bus.recv(timeout=min(remaining, SLOT))
+        if msg is not None:
+            analyzer.feed(msg)
+        else:
+            analyzer.advance(time.time())
+
+
+def print_report(analyzer: BusLoadAnalyzer, top: int, max_load: float):
+    """Print load per window and the top PGNs, sources and priorities"""
+    print(f"\n{'='*60}")
+    print(f"Bus load at {analyzer.bitrate} bps")
+    print(f"{'='*60}")
+    print(f"{'Window':>8} {'Mean':>7} {'Peak':>7} {'Frames/s':>9}")
+    for window in analyzer.windows:
+        stats = analyzer.stats(window)
+        print(f"{window:>7.0f}s {stats['load']*100:>6.1f}% {stats['peak']*100:>6.1f}% "
+              f"{stats['fps']:>9.0f}")
+
+    stats = analyzer.stats(analyzer.windows[-1])
+    for title, key in (("PGN", 'pgn'), ("Source", 'sa'), ("Priority", 'prio')):
+        rows = stats[key][:top]
+        if not rows:
+            continue
+        print(f"\n  {title} (last {stats['span']:.0f} s)")
+        for name, share in rows:
+            print(f"    {name:<12} {share*100:>6.2f}%")
+
+    delay, rate = analyzer.recommend_delay(max_load)
+    print()
+    if rate == 0.0:
+        print(f"✗ Peak load already above {max_load*100:.0f}%, no room for an update")
+    else:
+        print(f"→ Update at up to {rate:.0f} frames/s: packet delay {delay*1000:.2f} ms "
+              f"(ceiling {max_load*100:.0f}%)")
+    if analyzer.errors:
+        print(f"  {analyzer.errors} error frame(s)")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure CAN bus load by PGN, source address and priority',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  # Report every second until interrupted
+  python3 bus_load.py -i can0 -b 250000
+
+  # 30 s measurement with 1 s and 5 s windows, one report at the end
+  python3 bus_load.py -i can0 -b 500000 --windows 1 5 --time 30 --interval 0
+
+  # Use the recommendation for an update
+  sudo python3 j1939_firmware_sender.py -i can0 -f zephyr.signed.bin --auto-rate 10
+        """)
+
+    parser.add_argument('-i', '--interface', default='can0',
+                        help='CAN interface name (default: can0)')
+    parser.add_argument('-b', '--bitrate', type=int, default=250000,
+                        help='CAN bitrate in bps (default: 250000)')
+    parser.add_argument('--windows', type=float, nargs='+', default=list(DEFAULT_WINDOWS),
+                        help='Sliding windows in seconds (default: 1 10 60)')
+    parser.add_argument('--interval', type=float, default=1.0,
+                        help='Seconds between reports, 0 for one at the end (default: 1)')
+    parser.add_argument('-t', '--time', type=float, default=0.0,
+                        help='Stop after this many seconds (default: run until Ctrl-C)')
+    parser.add_argument('--top', type=int, default=8,
+                        help='Rows per breakdown (default: 8)')
+    parser.add_argument('--max-load', type=float, default=DEFAULT_MAX_LOAD,
+                        help=f'Load ceiling for the recommendation (default: {DEFAULT_MAX_LOAD})')
+
+    args = parser.parse_args()
+
+    if args.interval <= 0 and args.time <= 0:
+        parser.error("--interval 0 needs --time")
+
+    analyzer = BusLoadAnalyzer(args.bitrate, args.windows)
+    try:
+        bus = can.Bus(interface='socketcan', channel=args.interface,
+                      receive_own_messages=False)
+    except (OSError, can.CanError) as e:
+        print(f"✗ Failed to open {args.interface}: {e}")
+        return 1
+
+    print(f"✓ Listening on {args.interface}")
+    start = time.time()
+    try:
+        while True:
+            remaining = args.time - (time.time() - start) if args.time > 0 else None
+            if remaining is not None and remaining <= 0:
+                break
+            step = args.interval if args.interval > 0 else remaining
+            if remaining is not None:
+                step = min(step, remaining)
+            measure(bus, analyzer, step)
+            if args.interval > 0:
+                print_report(analyzer, args.top, args.max_load)
+        if args.interval <= 0:
+            print_report(analyzer, args.top, args.max_load)
+    except KeyboardInterrupt:
+        print_report(analyzer, args.top, args.max_load)
+    finally:
+        bus.shutdown()
+
+    return 0
+
+
+if __name__ == '__main__':
+    exit(main())
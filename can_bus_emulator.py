@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+"""
+CAN Bus Emulator
+Bridges virtual CAN interfaces through a model of one physical bus, so
+benchmarks on vcan see the timing of a real 250 or 500 kbit/s bus
+instead of instant delivery:
+
+  - every frame occupies the bus for its exact on-wire length at the
+    configured bitrate, stuff bits included (bus_load.frame_bits)
+  - frames waiting on several ports arbitrate bit by bit on their
+    identifier; each port sends in order, like one controller
+  - background traffic profiles compete for the bus like extra nodes
+  - frames can be lost, or destroyed by an error frame and sent again
+
+Each port is one vcan interface. A frame read from one port is written
+to every other port when its transmission ends. Put every node (the
+native_sim device, the sender) on its own interface; nodes sharing an
+interface see each other instantly.
+
+Timing comes from Python's scheduler and is accurate to roughly 0.1 ms.
+When the host falls behind, the emulated bus keeps its own clock and
+frames are delivered late rather than the bus running faster.
+
+Requirements:
+    Linux with vcan
+    pip3 install python-can   (through bus_load.py)
+
+Usage:
+    sudo ip link add dev vcan0 type vcan && sudo ip link set vcan0 up
+    sudo ip link add dev vcan1 type vcan && sudo ip link set vcan1 up
+    python3 can_bus_emulator.py --port vcan0 --port vcan1 -b 250000
+    python3 can_bus_emulator.py --port vcan0 --port vcan1 -b 500000 \\
+        --background periodic:0x0CF00400:10 --background load:0.3 --error-rate 0.001
+"""
+
+import argparse
+import random
+import select
+import socket
+import struct
+import time
+from collections import deque
+from typing import Deque, List, Optional, Tuple
+
+from bus_load import frame_bits
+
+CAN_FRAME = struct.Struct('=IB3x8s')
+CAN_EFF_FLAG = 0x80000000
+CAN_RTR_FLAG = 0x40000000
+CAN_ERR_FLAG = 0x20000000
+CAN_EFF_MASK = 0x1FFFFFFF
+CAN_SFF_MASK = 0x7FF
+
+# Error frame as reported by SocketCAN (linux/can/error.h)
+CAN_ERR_PROT = 0x00000008
+CAN_ERR_PROT_BIT = 0x01
+CAN_ERR_DLC = 8
+
+# Error flag (6), error delimiter (8) and interframe space (3)
+ERROR_FRAME_BITS = 17
+
+DEFAULT_QUEUE_LEN = 256   # Frames a port buffers, like a socket TX queue
+DEFAULT_BACKGROUND_ID = 0x1CFFFF55  # Priority 7, proprietary B, SA 0x55
+IDLE_POLL = 0.05
+
+
+class Frame:
+    """One frame waiting for or on the bus"""
+
+    __slots__ = ('can_id', 'data', 'dlc', 'arrival', 'key', 'bits', 'source')
+
+    def __init__(self, can_id: int, dlc: int, data: bytes, arrival: float, source: int):
+        self.can_id = can_id
+        self.dlc = dlc
+        self.data = data
+        self.arrival = arrival
+        self.source = source
+        extended = bool(can_id & CAN_EFF_FLAG)
+        remote = bool(can_id & CAN_RTR_FLAG)
+        ident = can_id & (CAN_EFF_MASK if extended else CAN_SFF_MASK)
+        self.key = arbitration_key(ident, extended, remote)
+        self.bits = frame_bits(ident, extended, data[:dlc], remote, dlc)
+
+    def pack(self) -> bytes:
+        return CAN_FRAME.pack(self.can_id, self.dlc, self.data.ljust(8, b'\x00'))
+
+
+def arbitration_key(ident: int, extended: bool, remote: bool) -> Tuple[int, ...]:
+    """
+    Arbitration field as transmitted; the lowest tuple wins
+
+    A standard frame beats an extended one with the same base ID, since
+    its IDE bit is dominant; a data frame beats a remote frame.
+    """
+    if extended:
+        return (ident >> 18, 1, 1, ident & 0x3FFFF, int(remote))
+    return (ident, int(remote), 0)
+
+
+class Node:
+    """A transmitter on the emulated bus: a port or a background profile"""
+
+    def __init__(self, name: str, queue_len: int = DEFAULT_QUEUE_LEN):
+        self.name = name
+        self.queue: Deque[Frame] = deque()
+        self.queue_len = queue_len
+        self.sent = 0
+        self.lost_arbitration = 0
+        self.overflows = 0
+        self.max_queued = 0
+
+    def push(self, frame: Frame):
+        if len(self.queue) >= self.queue_len:
+            self.overflows += 1
+            return
+        self.queue.append(frame)
+        self.max_queued = max(self.max_queued, len(self.queue))
+
+
+class Port(Node):
+    """vcan interface: frames read from it go out to every other port"""
+
+    def __init__(self, index: int, interface: str, queue_len: int):
+        super().__init__(interface, queue_len)
+        self.index = index
+        self.sock = socket.socket(socket.PF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        self.sock.bind((interface,))
+        self.sock.setblocking(False)
+        self.received = 0
+
+    def drain(self, now: float):
+        while True:
+            try:
+                raw = self.sock.recv(CAN_FRAME.size)
+            except BlockingIOError:
+                return
+            if len(raw) != CAN_FRAME.size:
+                continue  # CAN FD frames are not modelled
+            can_id, dlc, data = CAN_FRAME.unpack(raw)
+            if can_id & CAN_ERR_FLAG:
+                continue
+            self.received += 1
+            self.push(Frame(can_id, min(dlc, 8), data, now, self.index))
+
+    def write(self, payload: bytes):
+        try:
+            self.sock.send(payload)
+        except OSError:
+            # Interface TX queue full: the receiver lost the frame
+            self.overflows += 1
+
+
+class Profile(Node):
+    """
+    Background traffic
+
+    Specs:
+        periodic:ID:PERIOD_MS[:DLC]   one frame every PERIOD_MS
+        burst:ID:COUNT:PERIOD_MS      COUNT frames at once every PERIOD_MS
+        load:FRACTION[:ID]            random frames at a mean bus load
+    """
+
+    def __init__(self, spec: str, bitrate: int, rng: random.Random, start: float):
+        super().__init__(f"bg {spec}")
+        parts = spec.split(':')
+        self.kind = parts[0]
+        self.rng = rng
+        self.count = 1
+        self.dlc = 8
+
+        if self.kind == 'periodic' and len(parts) in (3, 4):
+            ident = int(parts[1], 0)
+            self.period = float(parts[2]) / 1000.0
+            if len(parts) == 4:
+                self.dlc = int(parts[3])
+        elif self.kind == 'burst' and len(parts) == 4:
+            ident = int(parts[1], 0)
+            self.count = int(parts[2])
+            self.period = float(parts[3]) / 1000.0
+        elif self.kind == 'load' and len(parts) in (2, 3):
+            ident = int(parts[2], 0) if len(parts) == 3 else DEFAULT_BACKGROUND_ID
+            fraction = float(parts[1])
+            if not 0 < fraction < 1:
+                raise ValueError(f"load must be between 0 and 1: {spec}")
+            bits = frame_bits(ident & CAN_EFF_MASK, ident > CAN_SFF_MASK, bytes(8))
+            self.period = bits / bitrate / fraction
+        else:
+            raise ValueError(f"Bad background profile: {spec}")
+
+        if self.period <= 0 or not 0 <= self.dlc <= 8:
+            raise ValueError(f"Bad background profile: {spec}")
+
+        self.can_id = ident | (CAN_EFF_FLAG if ident > CAN_SFF_MASK else 0)
+        self.next = start + (self.rng.random() * self.period if self.kind == 'load' else 0)
+
+    def generate(self, now: float):
+        """Queue the frames due by @now"""
+        while self.next <= now:
+            for _ in range(self.count):
+                data = bytes(self.rng.getrandbits(8) for _ in range(self.dlc))
+                self.push(Frame(self.can_id, self.dlc, data, self.next, -1))
+            if self.kind == 'load':
+                self.next += self.rng.expovariate(1.0 / self.period)
+            else:
+                self.next += self.period
+
+
+class BusEmulator:
+    """One emulated bus shared by the ports and background profiles"""
+
+    def __init__(self, interfaces: List[str], bitrate: int, profiles: List[str],
+                 drop: float = 0.0, error_rate: float = 0.0, error_frames: bool = False,
+                 queue_len: int = DEFAULT_QUEUE_LEN, seed: Optional[int] = None):
+        self.bitrate = bitrate
+        self.drop = drop
+        self.error_rate = error_rate
+        self.error_frames = error_frames
+        self.rng = random.Random(seed)
+        self.ports = [Port(i, name, queue_len) for i, name in enumerate(interfaces)]
+        now = time.monotonic()
+        self.profiles = [Profile(spec, bitrate, self.rng, now) for spec in profiles]
+        self.nodes: List[Node] = self.ports + self.profiles
+
+        self.bus_free_at = now
+        self.current: Optional[Tuple[Node, Frame, bool]] = None  # node, frame, destroyed
+        self.busy_bits = 0
+        self.errors = 0
+        self.dropped = 0
+        self.delivered = 0
+        self.started = now
+
+    def start_next(self, now: float):
+        """Arbitrate among the frames waiting when the bus becomes free"""
+        heads = [(node, node.queue[0]) for node in self.nodes if node.queue]
+        if not heads:
+            return
+
+        start = max(self.bus_free_at, min(frame.arrival for _, frame in heads))
+        if start > now:
+            return
+
+        contenders = [(node, frame) for node, frame in heads if frame.arrival <= start]
+        node, frame = min(contenders, key=lambda c: c[1].key)
+        for other, _ in contenders:
+            if other is not node:
+                other.lost_arbitration += 1
+
+        if self.error_rate and self.rng.random() < self.error_rate:
+            # Destroyed somewhere in the frame; the error frame follows
+            bits = self.rng.randrange(1, frame.bits) + ERROR_FRAME_BITS
+            self.current = (node, frame, True)
+        else:
+            bits = frame.bits
+            self.current = (node, frame, False)
+
+        self.busy_bits += bits
+        self.bus_free_at = start + bits / self.bitrate
+
+    def finish(self):
+        node, frame, destroyed = self.current
+        self.current = None
+
+        if destroyed:
+            # The transmitter retries: the frame stays at the head
+            self.errors += 1
+            if self.error_frames:
+                err = CAN_FRAME.pack(CAN_ERR_FLAG | CAN_ERR_PROT, CAN_ERR_DLC,
+                                     bytes([0, 0, CAN_ERR_PROT_BIT, 0, 0, 0, 0, 0]))
+                for port in self.ports:
+                    port.write(err)
+            return
+
+        node.queue.popleft()
+        node.sent += 1
+
+        if self.drop and self.rng.random() < self.drop:
+            self.dropped += 1
+            return
+
+        payload = frame.pack()
+        for port in self.ports:
+            if port.index != frame.source:
+                port.write(payload)
+        self.delivered += 1
+
+    def step(self):
+        now = time.monotonic()
+
+        if self.current and now >= self.bus_free_at:
+            self.finish()
+
+        for profile in self.profiles:
+            profile.generate(now)
+
+        if not self.current:
+            self.start_next(now)
+
+        if self.current:
+            timeout = self.bus_free_at - now
+        else:
+            waiting = [n.queue[0].arrival for n in self.nodes if n.queue]
+            due = [p.next for p in self.profiles] + waiting
+            timeout = min(due) - now if due else IDLE_POLL
+        timeout = min(max(timeout, 0.0), IDLE_POLL)
+
+        readable, _, _ = select.select([p.sock for p in self.ports], [], [], timeout)
+        if readable:
+            now = time.monotonic()
+            for port in self.ports:
+                if port.sock in readable:
+                    port.drain(now)
+
+    def report(self, elapsed: float):
+        load = self.busy_bits / self.bitrate / elapsed if elapsed > 0 else 0.0
+        print(f"[{elapsed:7.1f} s] load {load * 100:5.1f}%, delivered {self.delivered}, "
+              f"errors {self.errors}, dropped {self.dropped}")
+        for node in self.nodes:
+            print(f"    {node.name:<28} sent {node.sent:>8}  lost arbitration "
+                  f"{node.lost_arbitration:>7}  max queued {node.max_queued:>4}  "
+                  f"overflows {node.overflows}")
+
+    def run(self, duration: float = 0.0, stats_interval: float = 0.0):
+        next_stats = self.started + stats_interval if stats_interval else None
+
+        try:
+            while not duration or time.monotonic() - self.started < duration:
+                self.step()
+                if next_stats and time.monotonic() >= next_stats:
+                    self.report(time.monotonic() - self.started)
+                    next_stats += stats_interval
+        except KeyboardInterrupt:
+            pass
+
+        self.report(time.monotonic() - self.started)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Bridge vcan interfaces through an emulated CAN bus',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Background profiles:
+  periodic:ID:PERIOD_MS[:DLC]   e.g. periodic:0x0CF00400:10 (EEC1 every 10 ms)
+  burst:ID:COUNT:PERIOD_MS      e.g. burst:0x18FECA00:5:1000
+  load:FRACTION[:ID]            e.g. load:0.3 (random frames, 30%% of the bus)
+
+IDs above 0x7FF are sent as extended frames.
+        """)
+    parser.add_argument('--port', action='append', required=True, metavar='IFACE',
+                        help='vcan interface to bridge (at least two)')
+    parser.add_argument('-b', '--bitrate', type=int, default=250000,
+                        help='Emulated bitrate in bps (default: 250000)')
+    parser.add_argument('--background', action='append', default=[], metavar='SPEC',
+                        help='Background traffic profile, repeatable')
+    parser.add_argument('--drop', type=float, default=0.0,
+                        help='Probability that a frame is lost for all receivers')
+    parser.add_argument('--error-rate', type=float, default=0.0,
+                        help='Probability that a transmission is destroyed and repeated')
+    parser.add_argument('--error-frames', action='store_true',
+                        help='Also write an error frame to every port for each error')
+    parser.add_argument('--queue-len', type=int, default=DEFAULT_QUEUE_LEN,
+                        help=f'Frames buffered per port (default: {DEFAULT_QUEUE_LEN})')
+    parser.add_argument('--seed', type=int, help='Random seed for repeatable runs')
+    parser.add_argument('--stats', type=float, default=5.0, metavar='SECONDS',
+                        help='Statistics interval, 0 for the summary only (default: 5)')
+    parser.add_argument('--time', type=float, default=0.0, metavar='SECONDS',
+                        help='Stop after this long (default: until Ctrl-C)')
+
+    args = parser.parse_args()
+
+    if len(args.port) < 2:
+        parser.error("At least two --port interfaces are needed")
+
+    try:
+        emulator = BusEmulator(args.port, args.bitrate, args.background, args.drop,
+                               args.error_rate, args.error_frames, args.queue_len,
+                               args.seed)
+    except ValueError as e:
+        parser.error(str(e))
+
+    print(f"Bridging {', '.join(args.port)} at {args.bitrate} bit/s"
+          + (f" with {len(args.background)} background profiles" if args.background else ""))
+    emulator.run(args.time, args.stats)
+    return 0
+
+
+if __name__ == '__main__':
+    exit(main())
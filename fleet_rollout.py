@@ -0,0 +1,531 @@
+#!/usr/bin/env python3
+"""
+Fleet Rollout Planner
+Plans and runs firmware updates for many ECUs on several CAN buses so the
+whole vehicle is done as early as possible:
+
+  - buses are updated in parallel, one sender thread per bus segment
+  - targets on one segment share its bandwidth and are updated in turn
+  - when every target on a bus takes the same image, it is sent once with
+    the legacy broadcast protocol instead of once per target
+
+After the run the actual time of every job and the total (makespan) are
+reported next to the prediction.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    python3 fleet_rollout.py manifest.json --plan-only
+    python3 fleet_rollout.py manifest.json
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import struct
+import threading
+import time
+import can
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional
+
+from j1939_firmware_sender import (J1939FirmwareSender, J1939_TP_MAX_SIZE,
+                                   J1939_BYTES_PER_PACKET, DEFAULT_SRC_ADDR,
+                                   DEFAULT_PRIORITY)
+
+# J1939-81 network management
+J1939_PGN_REQUEST = 0xEA00
+J1939_PGN_ADDRESS_CLAIMED = 0xEE00
+J1939_GLOBAL_ADDR = 0xFF
+J1939_NULL_ADDR = 0xFE
+
+# Legacy update protocol (standard ID, see can_update.h)
+DEFAULT_LEGACY_ID = 0x100
+CAN_UPDATE_START = 0x01
+CAN_UPDATE_DATA = 0x02
+CAN_UPDATE_END = 0x03
+LEGACY_DATA_PAYLOAD = 5   # DATA frames: type, 16-bit sequence, 5 bytes
+
+DEFAULT_TP_WINDOW = 32    # CONFIG_CAN_UPDATE_TP_WINDOW
+DEFAULT_ERASE_TIME = 4.0  # Seconds to erase slot1 before the first CTS
+DEFAULT_TURNAROUND = 0.005
+
+
+def frame_time(bitrate: int, extended: bool, dlc: int = 8) -> float:
+    """
+    Worst-case time of one data frame on the wire, bit stuffing included
+
+    Args:
+        bitrate: Bus bitrate in bps
+        extended: 29-bit identifier
+        dlc: Data length
+
+    Returns:
+        Seconds, interframe space included
+    """
+    # SOF up to the CRC is subject to stuffing; delimiters, ACK, EOF and
+    # IFS (13 bits) are not
+    stuffed = (54 if extended else 34) + 8 * dlc
+    bits = stuffed + (stuffed - 1) // 4 + 13
+    return bits / bitrate
+
+
+@dataclass
+class Target:
+    """One ECU from the manifest"""
+    label: str
+    bus: str
+    image: Path
+    address: Optional[int] = None
+    name: Optional[int] = None
+
+
+@dataclass
+class Job:
+    """One transfer on one bus: a unicast J1939 update or a broadcast"""
+    bus: str
+    kind: str                  # 'j1939' or 'broadcast'
+    targets: List[Target]
+    image: bytes
+    predicted: float = 0.0
+    actual: Optional[float] = None
+    ok: Optional[bool] = None
+
+
+@dataclass
+class Lane:
+    """Jobs that share one bus segment and therefore run in turn"""
+    segment: str
+    jobs: List[Job] = field(default_factory=list)
+
+    @property
+    def predicted(self) -> float:
+        return sum(job.predicted for job in self.jobs)
+
+
+class FleetPlanner:
+    """Builds and runs a rollout schedule from a manifest"""
+
+    def __init__(self, manifest: dict, base_dir: Path, packet_delay: float,
+                 erase_time: float, window: int, src_addr: int,
+                 broadcast: bool, max_parallel: int, legacy_id: int):
+        self.buses: Dict[str, dict] = manifest.get('buses', {})
+        self.base_dir = base_dir
+        self.packet_delay = packet_delay
+        self.erase_time = erase_time
+        self.window = window
+        self.src_addr = src_addr
+        self.broadcast = broadcast
+        self.max_parallel = max_parallel
+        self.legacy_id = legacy_id
+        self.targets = [self.parse_target(i, t) for i, t in enumerate(manifest['targets'])]
+        self.images: Dict[Path, bytes] = {}
+
+        for target in self.targets:
+            if target.bus not in self.buses:
+                self.buses[target.bus] = {}
+
+    def parse_target(self, index: int, entry: dict) -> Target:
+        """Validate one manifest entry"""
+        if 'bus' not in entry or 'image' not in entry:
+            raise ValueError(f"target {index}: 'bus' and 'image' are required")
+        if 'name' not in entry and 'address' not in entry:
+            raise ValueError(f"target {index}: 'name' or 'address' is required")
+
+        name = int(str(entry['name']), 0) if 'name' in entry else None
+        address = int(str(entry['address']), 0) if 'address' in entry else None
+        label = entry.get('label') or (f"NAME 0x{name:016X}" if name is not None
+                                       else f"0x{address:02X}")
+
+        return Target(label=label, bus=entry['bus'],
+                      image=self.resolve_path(entry['image']),
+                      address=address, name=name)
+
+    def resolve_path(self, image: str) -> Path:
+        path = Path(image)
+        return path if path.is_absolute() else self.base_dir / path
+
+    def bitrate(self, bus: str) -> int:
+        return int(self.buses[bus].get('bitrate', 250000))
+
+    def segment(self, bus: str) -> str:
+        """Buses on the same segment share bandwidth (e.g. two host ports on one wire)"""
+        return self.buses[bus].get('segment', bus)
+
+    def load_image(self, path: Path) -> bytes:
+        if path not in self.images:
+            self.images[path] = path.read_bytes()
+        return self.images[path]
+
+    # -- Topology ----------------------------------------------------------
+
+    def discover(self, timeout: float) -> Dict[str, List[dict]]:
+        """
+        Ask every bus for its address claims
+
+        Sends a global Request for Address Claimed and collects the
+        answers (and any claims that happen meanwhile).
+
+        Returns:
+            {bus: [{'address': int, 'name': int}, ...]}
+        """
+        topology = {}
+
+        for bus_name in self.buses:
+            nodes = {}
+            with can.Bus(interface='socketcan', channel=bus_name,
+                         receive_own_messages=False) as bus:
+                can_id = (6 << 26) | (J1939_PGN_REQUEST << 8) | \
+                         (J1939_GLOBAL_ADDR << 8) | self.src_addr
+                bus.send(can.Message(arbitration_id=can_id, is_extended_id=True,
+                                     data=[J1939_PGN_ADDRESS_CLAIMED & 0xFF,
+                                           (J1939_PGN_ADDRESS_CLAIMED >> 8) & 0xFF,
+                                           (J1939_PGN_ADDRESS_CLAIMED >> 16) & 0xFF]))
+
+                deadline = time.time() + timeout
+                while time.time() < deadline:
+                    msg = bus.recv(timeout=0.1)
+                    if not msg or not msg.is_extended_id or len(msg.data) < 8:
+                        continue
+                    if ((msg.arbitration_id >> 16) & 0xFF) != (J1939_PGN_ADDRESS_CLAIMED >> 8):
+                        continue
+
+                    address = msg.arbitration_id & 0xFF
+                    if address == J1939_NULL_ADDR:
+                        continue
+                    nodes[address] = int.from_bytes(msg.data, 'little')
+
+            topology[bus_name] = [{'address': a, 'name': n} for a, n in sorted(nodes.items())]
+            print(f"← {bus_name}: {len(nodes)} node(s) answered")
+
+        return topology
+
+    def resolve(self, topology: Optional[Dict[str, List[dict]]]):
+        """
+        Fill in target addresses from NAMEs
+
+        Raises:
+            ValueError: A NAME is not on its bus
+        """
+        for target in self.targets:
+            nodes = topology.get(target.bus, []) if topology else []
+
+            if target.name is not None:
+                if topology is None:
+                    raise ValueError(f"{target.label}: a NAME needs discovery or --topology")
+                match = [n for n in nodes if n['name'] == target.name]
+                if not match:
+                    raise ValueError(f"{target.label} not found on {target.bus}")
+                if target.address is not None and target.address != match[0]['address']:
+                    print(f"  {target.label}: manifest says 0x{target.address:02X}, "
+                          f"claimed 0x{match[0]['address']:02X}, using the claim")
+                target.address = match[0]['address']
+            elif topology and not any(n['address'] == target.address for n in nodes):
+                print(f"  {target.label}: no address claim seen on {target.bus}")
+
+    # -- Planning ----------------------------------------------------------
+
+    def predict_j1939(self, size: int, bitrate: int) -> float:
+        """Erase, packets at the paced rate and one CTS/DPO round trip per window"""
+        packets = math.ceil(size / J1939_BYTES_PER_PACKET)
+        windows = math.ceil(packets / self.window)
+        per_packet = max(frame_time(bitrate, True), self.packet_delay)
+        # CTS, plus DPO for ETP
+        cm_frames = 2 if size > J1939_TP_MAX_SIZE else 1
+        per_window = cm_frames * frame_time(bitrate, True) + DEFAULT_TURNAROUND
+
+        return self.erase_time + packets * per_packet + windows * per_window
+
+    def predict_broadcast(self, size: int, bitrate: int) -> float:
+        """Erase, then DATA frames at the paced rate; nothing is acknowledged"""
+        frames = math.ceil(size / LEGACY_DATA_PAYLOAD) + 2
+        return self.erase_time + frames * max(frame_time(bitrate, False), self.packet_delay)
+
+    def can_broadcast(self, targets: List[Target],
+                      topology: Optional[Dict[str, List[dict]]]) -> bool:
+        """
+        A legacy broadcast reaches every update listener on the bus, so it is
+        only used when all targets on the bus take the same image and the
+        topology shows no other node on that bus.
+        """
+        if not self.broadcast or topology is None or len(targets) < 2:
+            return False
+
+        if len({hashlib.sha256(self.load_image(t.image)).digest() for t in targets}) != 1:
+            return False
+
+        listed = {t.address for t in targets}
+        return all(n['address'] in listed for n in topology.get(targets[0].bus, []))
+
+    def plan(self, topology: Optional[Dict[str, List[dict]]]) -> List[List[Lane]]:
+        """
+        Build the schedule
+
+        Returns:
+            One list of lanes per worker; workers run in parallel, the lanes
+            of a worker and the jobs of a lane run in turn
+        """
+        lanes: Dict[str, Lane] = {}
+
+        for bus in self.buses:
+            targets = [t for t in self.targets if t.bus == bus]
+            if not targets:
+                continue
+
+            lane = lanes.setdefault(self.segment(bus), Lane(self.segment(bus)))
+            bitrate = self.bitrate(bus)
+
+            unicast = [Job(bus, 'j1939', [t], self.load_image(t.image),
+                           self.predict_j1939(len(self.load_image(t.image)), bitrate))
+                       for t in targets]
+
+            if self.can_broadcast(targets, topology):
+                image = unicast[0].image
+                broadcast = Job(bus, 'broadcast', targets, image,
+                                self.predict_broadcast(len(image), bitrate))
+                # Legacy frames carry 5 bytes instead of 7, so a broadcast
+                # only pays off for more than one target
+                if broadcast.predicted < sum(job.predicted for job in unicast):
+                    lane.jobs.append(broadcast)
+                    continue
+
+            lane.jobs.extend(unicast)
+
+        # Longest lane first onto the least loaded worker
+        workers: List[List[Lane]] = [[] for _ in range(min(self.max_parallel, len(lanes)) or 1)]
+        for lane in sorted(lanes.values(), key=lambda l: l.predicted, reverse=True):
+            min(workers, key=lambda w: sum(l.predicted for l in w)).append(lane)
+
+        return workers
+
+    # -- Execution ---------------------------------------------------------
+
+    def run_j1939(self, job: Job) -> bool:
+        target = job.targets[0]
+        sender = J1939FirmwareSender(interface=job.bus, src_addr=self.src_addr,
+                                     dst_addr=target.address, priority=DEFAULT_PRIORITY,
+                                     bitrate=self.bitrate(job.bus), verbose=False)
+        try:
+            sender.connect()
+            return sender.transfer(job.image, self.packet_delay,
+                                   cts_timeout=max(10.0, 2 * self.erase_time))
+        finally:
+            sender.disconnect()
+
+    def run_broadcast(self, job: Job) -> bool:
+        """
+        Send the image once with the legacy protocol
+
+        The protocol has no acknowledgment: START erases slot1 on every
+        listener, so data only follows after the erase time.
+        """
+        size = len(job.image)
+
+        with can.Bus(interface='socketcan', channel=job.bus,
+                     receive_own_messages=False) as bus:
+            def send(data):
+                bus.send(can.Message(arbitration_id=self.legacy_id,
+                                     is_extended_id=False, data=data))
+
+            send(bytes([CAN_UPDATE_START]) + struct.pack('<I', size))
+            time.sleep(self.erase_time)
+
+            for seq, offset in enumerate(range(0, size, LEGACY_DATA_PAYLOAD)):
+                send(bytes([CAN_UPDATE_DATA]) + struct.pack('<H', seq & 0xFFFF) +
+                     job.image[offset:offset + LEGACY_DATA_PAYLOAD])
+                time.sleep(self.packet_delay)
+
+            send(bytes([CAN_UPDATE_END, 0, 0, 0, 0]))
+
+        return True
+
+    def run_worker(self, lanes: List[Lane], lock: threading.Lock):
+        for lane in lanes:
+            for job in lane.jobs:
+                who = ', '.join(t.label for t in job.targets)
+                start = time.time()
+                try:
+                    ok = self.run_broadcast(job) if job.kind == 'broadcast' \
+                        else self.run_j1939(job)
+                except Exception as e:
+                    with lock:
+                        print(f"✗ {job.bus}: {who}: {e}")
+                    ok = False
+
+                job.actual = time.time() - start
+                job.ok = ok
+                with lock:
+                    mark = '✓' if ok else '✗'
+                    print(f"{mark} {job.bus}: {job.kind} {who} in {job.actual:.1f} s "
+                          f"(predicted {job.predicted:.1f} s)")
+
+    def run(self, workers: List[List[Lane]]) -> float:
+        """Run the schedule and return the makespan in seconds"""
+        lock = threading.Lock()
+        threads = [threading.Thread(target=self.run_worker, args=(w, lock)) for w in workers]
+
+        start = time.time()
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        return time.time() - start
+
+
+def print_plan(workers: List[List[Lane]]):
+    print(f"\n{'='*60}")
+    print("Rollout Plan")
+    print(f"{'='*60}")
+
+    for index, lanes in enumerate(workers):
+        total = sum(lane.predicted for lane in lanes)
+        print(f"Worker {index + 1} (predicted {total:.1f} s)")
+        for lane in lanes:
+            print(f"  Segment {lane.segment} ({lane.predicted:.1f} s)")
+            for job in lane.jobs:
+                who = ', '.join(t.label for t in job.targets)
+                addrs = ' '.join(f"0x{t.address:02X}" if t.address is not None else '?'
+                                 for t in job.targets)
+                print(f"    {job.bus:<8} {job.kind:<9} {len(job.image):>8} bytes "
+                      f"{job.predicted:>7.1f} s  {who} [{addrs}]")
+
+    makespan = max(sum(lane.predicted for lane in lanes) for lanes in workers)
+    sequential = sum(lane.predicted for lanes in workers for lane in lanes)
+    print(f"{'='*60}")
+    print(f"Predicted makespan: {makespan:.1f} s (one bus at a time: {sequential:.1f} s)")
+
+
+def print_report(workers: List[List[Lane]], makespan: float):
+    jobs = [job for lanes in workers for lane in lanes for job in lane.jobs]
+    predicted = max(sum(lane.predicted for lane in lanes) for lanes in workers)
+    failed = [job for job in jobs if not job.ok]
+
+    print(f"\n{'='*60}")
+    print("Rollout Report")
+    print(f"{'='*60}")
+    print(f"{'Bus':<8} {'Kind':<9} {'Predicted':>10} {'Actual':>10} {'Ratio':>7}  Targets")
+    for job in jobs:
+        ratio = job.actual / job.predicted if job.predicted > 0 else 0
+        who = ', '.join(t.label for t in job.targets)
+        print(f"{job.bus:<8} {job.kind:<9} {job.predicted:>9.1f}s {job.actual:>9.1f}s "
+              f"{ratio:>7.2f}  {'' if job.ok else '✗ '}{who}")
+    print(f"{'='*60}")
+    print(f"Makespan: {makespan:.1f} s actual, {predicted:.1f} s predicted "
+          f"({makespan / predicted if predicted > 0 else 0:.2f}x)")
+
+    if any(job.kind == 'broadcast' for job in jobs):
+        print("Broadcast jobs are not acknowledged; check the devices' status after reboot.")
+    if failed:
+        print(f"✗ {len(failed)} job(s) failed")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Plan and run firmware updates across several CAN buses',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Manifest (JSON):
+  {
+    "buses": {
+      "can0": {"bitrate": 250000},
+      "can1": {"bitrate": 500000, "segment": "body"}
+    },
+    "targets": [
+      {"label": "door_l", "bus": "can0", "name": "0xA00C810000001234", "image": "door.bin"},
+      {"label": "door_r", "bus": "can0", "name": "0xA00C810000001235", "image": "door.bin"},
+      {"label": "gw",     "bus": "can1", "address": "0x80", "image": "gw.bin"}
+    ]
+  }
+
+Targets are given by NAME (resolved through address claims) or address.
+Buses with the same "segment" share bandwidth and are updated in turn.
+
+Examples:
+  # Discover the buses and show the plan
+  python3 fleet_rollout.py vehicle.json --plan-only --save-topology topo.json
+
+  # Run the rollout with a saved topology
+  python3 fleet_rollout.py vehicle.json --topology topo.json
+        """)
+
+    parser.add_argument('manifest', type=Path, help='Rollout manifest (JSON)')
+    parser.add_argument('--topology', type=Path,
+                        help='Saved topology instead of discovering it on the buses')
+    parser.add_argument('--save-topology', type=Path,
+                        help='Write the discovered topology to this file')
+    parser.add_argument('--no-discover', action='store_true',
+                        help='Neither discover nor load a topology (targets by address only)')
+    parser.add_argument('--discover-time', type=float, default=1.25,
+                        help='Time to collect address claims per bus (default: 1.25 s)')
+    parser.add_argument('--plan-only', action='store_true',
+                        help='Print the plan without sending anything')
+    parser.add_argument('--no-broadcast', action='store_true',
+                        help='Always update targets one by one')
+    parser.add_argument('--max-parallel', type=int, default=8,
+                        help='Most buses updated at once (default: 8)')
+    parser.add_argument('-s', '--src-addr', type=lambda x: int(x, 0), default=DEFAULT_SRC_ADDR,
+                        help=f'Host J1939 address (default: 0x{DEFAULT_SRC_ADDR:02X})')
+    parser.add_argument('-D', '--delay', type=float, default=0.005,
+                        help='Delay between packets in seconds (default: 0.005)')
+    parser.add_argument('--erase-time', type=float, default=DEFAULT_ERASE_TIME,
+                        help=f'Slot1 erase time in seconds (default: {DEFAULT_ERASE_TIME})')
+    parser.add_argument('--window', type=int, default=DEFAULT_TP_WINDOW,
+                        help=f'Device TP/ETP window (default: {DEFAULT_TP_WINDOW})')
+    parser.add_argument('--legacy-id', type=lambda x: int(x, 0), default=DEFAULT_LEGACY_ID,
+                        help=f'Legacy protocol CAN ID (default: 0x{DEFAULT_LEGACY_ID:X})')
+
+    args = parser.parse_args()
+
+    try:
+        manifest = json.loads(args.manifest.read_text())
+        planner = FleetPlanner(manifest, args.manifest.parent, args.delay, args.erase_time,
+                               args.window, args.src_addr, not args.no_broadcast,
+                               args.max_parallel, args.legacy_id)
+
+        topology = None
+        if args.topology:
+            raw = json.loads(args.topology.read_text())
+            topology = {bus: [{'address': int(str(n['address']), 0),
+                               'name': int(str(n['name']), 0)} for n in nodes]
+                        for bus, nodes in raw.items()}
+        elif not args.no_discover:
+            topology = planner.discover(args.discover_time)
+
+        if topology is not None and args.save_topology:
+            args.save_topology.write_text(json.dumps(
+                {bus: [{'address': f"0x{n['address']:02X}", 'name': f"0x{n['name']:016X}"}
+                       for n in nodes] for bus, nodes in topology.items()}, indent=2))
+            print(f"✓ Topology saved to {args.save_topology}")
+
+        planner.resolve(topology)
+        workers = planner.plan(topology)
+    except (OSError, ValueError, KeyError, can.CanError) as e:
+        print(f"✗ {e}")
+        return 1
+
+    print_plan(workers)
+
+    if args.plan_only:
+        return 0
+
+    unresolved = [t.label for t in planner.targets if t.address is None]
+    if unresolved:
+        print(f"✗ No address for: {', '.join(unresolved)}")
+        return 1
+
+    try:
+        makespan = planner.run(workers)
+    except KeyboardInterrupt:
+        print("\n\n✗ Interrupted by user")
+        return 1
+
+    print_report(workers, makespan)
+    return 0 if all(job.ok for lanes in workers for lane in lanes for job in lane.jobs) else 1
+
+
+if __name__ == '__main__':
+    exit(main())
@@ -0,0 +1,843 @@
+#!/usr/bin/env python3
+"""
+J1939 Conformance Suite
+Runs the native_sim update listener (workspace/apps/j1939_conformance_device)
+against the Linux can-j1939 stack on vcan0 and records the outcome and
+throughput of every scenario:
+
+    transfer   TP and ETP images of several sizes, data checked on the device
+    request    Request PGN answered with a BAM from the device
+    reject     wrong source address, unknown PGN, image larger than slot1
+    busy       second originator while a session runs
+    shared     BAMs from another node during an ETP session
+    abort      originator aborts mid-window, the next transfer must work
+    stall      originator pauses below the device timeout
+    timeout    originator goes silent, the device must abort with reason 3
+
+The kernel stack is the originator wherever it can be; aborts and stalls
+need frame-level control and are sent on a raw socket instead. The CTS
+window is a build option of the device, so every window is its own
+build (--build) or executable (--device).
+
+Requirements:
+    Linux with can-j1939 (5.4+), Python 3.9+
+    west and a Zephyr workspace for --build
+
+Usage:
+    sudo modprobe can-j1939
+    sudo ip link add dev vcan0 type vcan && sudo ip link set vcan0 up
+    python3 j1939_conformance.py --build --windows 1 16 255
+    python3 j1939_conformance.py --device build/zephyr/zephyr.exe --json results.json
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from pathlib import Path
+
+from j1939_firmware_sender import (
+    DEFAULT_SRC_ADDR, DEFAULT_DST_ADDR,
+    J1939_TP_CM_RTS, J1939_TP_CM_CTS, J1939_TP_CM_EOM, J1939_TP_CM_ABORT,
+    J1939_ETP_CM_CTS,
+    J1939_PGN_TP_CM, J1939_PGN_TP_DT, J1939_PGN_ETP_CM, J1939_PGN_ETP_DT,
+    J1939_PGN_FIRMWARE_UPDATE, J1939_TP_MAX_SIZE, J1939_BYTES_PER_PACKET
+)
+
+CAN_FRAME = struct.Struct('=IB3x8s')
+CAN_EFF_FLAG = 0x80000000
+
+# can-j1939 socket API (linux/can/j1939.h); older Pythons lack some names
+CAN_J1939 = getattr(socket, 'CAN_J1939', 7)
+SOL_CAN_J1939 = getattr(socket, 'SOL_CAN_J1939', 107)
+J1939_NO_NAME = getattr(socket, 'J1939_NO_NAME', 0)
+J1939_NO_PGN = getattr(socket, 'J1939_NO_PGN', 0x40000)
+SO_J1939_ERRQUEUE = getattr(socket, 'SO_J1939_ERRQUEUE', 4)
+SCM_J1939_ERRQUEUE = getattr(socket, 'SCM_J1939_ERRQUEUE', 4)
+J1939_EE_INFO_TX_ABORT = getattr(socket, 'J1939_EE_INFO_TX_ABORT', 1)
+
+# Transmit completion reports (linux/net_tstamp.h, linux/errqueue.h)
+SO_TIMESTAMPING = getattr(socket, 'SO_TIMESTAMPING', 37)
+SOF_TIMESTAMPING = (1 << 4) | (1 << 7) | (1 << 8) | (1 << 9) | (1 << 10) | (1 << 11)
+SO_EE_ORIGIN_LOCAL = 1
+SO_EE_ORIGIN_TIMESTAMPING = 4
+SCM_TSTAMP_SCHED = 1
+SCM_TSTAMP_ACK = 2
+SOCK_EXTENDED_ERR = struct.Struct('=IBBBBII')
+SCM_TIMESTAMPING = struct.Struct('=qqqqqq')
+
+J1939_PGN_REQUEST = 0xEA00
+J1939_PGN_ADDRESS_CLAIMED = 0xEE00
+J1939_PGN_SOFTWARE_ID = 0xFEDA
+J1939_PGN_UNSUPPORTED = 0xCB00   # PDU1, no sink on the device
+J1939_PGN_BAM_TRAFFIC = 0xFF00   # Proprietary B, broadcast by the bystander
+
+J1939_ABORT_BUSY = 1
+J1939_ABORT_RESOURCES = 2
+J1939_ABORT_TIMEOUT = 3
+
+ABORT_NAMES = {1: 'busy', 2: 'resources', 3: 'timeout', 4: 'cts-during-dt',
+               5: 'max-retransmit', 6: 'unexpected-dt', 7: 'bad-sequence',
+               8: 'duplicate-sequence', 9: 'size'}
+
+OTHER_SRC_ADDR = 0x01      # Second originator, not the update host
+BYSTANDER_ADDR = 0x02      # Unrelated node broadcasting BAMs
+BYSTANDER_BAM_LEN = 64
+PATTERN_HEADER_LEN = 8     # Size and seed, see the device's check_pattern()
+T3_TIMEOUT = 1.25          # J1939-21: originator waits this long for a CTS
+DEVICE_START_TIMEOUT = 10.0
+CLAIM_TIMEOUT = 2.0
+
+DEFAULT_SIZES = (9, J1939_TP_MAX_SIZE, J1939_TP_MAX_SIZE + 1, 65536, 262144)
+DEFAULT_WINDOWS = (1, 16, 255)
+SCENARIO_GROUPS = ('transfer', 'request', 'reject', 'busy', 'shared',
+                   'abort', 'stall', 'timeout')
+REPO_DIR = Path(__file__).resolve().parent
+APP_DIR = Path('workspace/apps/j1939_conformance_device')
+
+
+def pattern_byte(i: int, seed: int) -> int:
+    """Byte i of the test image; must match pattern_byte() on the device"""
+    return (((i * 0x9E3779B1) & 0xFFFFFFFF) >> 24) ^ (seed & 0xFF)
+
+
+def make_pattern(size: int, seed: int) -> bytes:
+    """Test image: size and seed, then generated bytes"""
+    data = bytearray(pattern_byte(i, seed) for i in range(size))
+    data[:PATTERN_HEADER_LEN] = struct.pack('<II', size, seed)[:size]
+    return bytes(data[:size])
+
+
+def j1939_id(pgn: int, src: int, dst: int, priority: int = 6) -> int:
+    return CAN_EFF_FLAG | (priority << 26) | ((pgn >> 8) << 16) | (dst << 8) | src
+
+
+class Frame:
+    """One frame seen on the bus, decoded as J1939"""
+
+    __slots__ = ('time', 'pf', 'ps', 'sa', 'data')
+
+    def __init__(self, timestamp: float, can_id: int, data: bytes):
+        self.time = timestamp
+        self.pf = (can_id >> 16) & 0xFF
+        self.ps = (can_id >> 8) & 0xFF
+        self.sa = can_id & 0xFF
+        self.data = data
+
+    def is_cm(self) -> bool:
+        return self.pf in (J1939_PGN_TP_CM >> 8, J1939_PGN_ETP_CM >> 8)
+
+    def is_dt(self) -> bool:
+        return self.pf in (J1939_PGN_TP_DT >> 8, J1939_PGN_ETP_DT >> 8)
+
+
+class BusMonitor(threading.Thread):
+    """Records every extended frame on the interface with its arrival time"""
+
+    def __init__(self, interface: str):
+        super().__init__(daemon=True)
+        self.frames = []
+        self.lock = threading.Condition()
+        self.stop = threading.Event()
+
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+        self.sock.settimeout(0.1)
+        self.sock.bind((interface,))
+
+    def run(self):
+        while not self.stop.is_set():
+            try:
+                can_id, dlc, data = CAN_FRAME.unpack(self.sock.recv(CAN_FRAME.size))
+            except socket.timeout:
+                continue
+            if not can_id & CAN_EFF_FLAG:
+                continue
+            with self.lock:
+                self.frames.append(Frame(time.monotonic(), can_id, data[:dlc]))
+                self.lock.notify_all()
+        self.sock.close()
+
+    def mark(self) -> int:
+        with self.lock:
+            return len(self.frames)
+
+    def since(self, mark: int) -> list:
+        with self.lock:
+            return self.frames[mark:]
+
+    def wait_for(self, match, mark: int, timeout: float):
+        """First frame after mark for which match(frame) is true, or None"""
+        deadline = time.monotonic() + timeout
+        with self.lock:
+            while True:
+                for frame in self.frames[mark:]:
+                    if match(frame):
+                        return frame
+                mark = len(self.frames)
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return None
+                self.lock.wait(remaining)
+
+    def aborts(self, mark: int, src: int, dst: int) -> list:
+        """Abort reasons sent from src to dst after mark"""
+        return [f.data[1] for f in self.since(mark)
+                if f.is_cm() and f.sa == src and f.ps == dst and f.data[0] == J1939_TP_CM_ABORT]
+
+
+class Device:
+    """native_sim build of the conformance device with its console parsed"""
+
+    LINE = re.compile(r'conformance: (.*)')
+
+    def __init__(self, exe: Path):
+        self.exe = exe.resolve()
+        self.lines = []
+        self.lock = threading.Condition()
+        self.info = {}
+        # The flash simulator keeps flash.bin in the working directory
+        self.workdir = tempfile.TemporaryDirectory(prefix='j1939_conformance_')
+        self.proc = None
+
+    def start(self):
+        self.proc = subprocess.Popen([str(self.exe)], cwd=self.workdir.name,
+                                     stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                     stdin=subprocess.DEVNULL, text=True)
+        threading.Thread(target=self._read, daemon=True).start()
+
+        line = self.wait_line(lambda f: 'ready' in f, 0, DEVICE_START_TIMEOUT)
+        if line is None:
+            raise RuntimeError(f"{self.exe} did not report ready")
+        self.info = {k: int(v, 0) for k, v in
+                     (item.split('=') for item in line.split()[1:])}
+
+    def _read(self):
+        for raw in self.proc.stdout:
+            m = self.LINE.search(raw)
+            if not m:
+                continue
+            with self.lock:
+                self.lines.append(m.group(1).strip())
+                self.lock.notify_all()
+
+    def mark(self) -> int:
+        with self.lock:
+            return len(self.lines)
+
+    def wait_line(self, match, mark: int, timeout: float):
+        deadline = time.monotonic() + timeout
+        with self.lock:
+            while True:
+                for line in self.lines[mark:]:
+                    if match(self.fields(line)):
+                        return line
+                mark = len(self.lines)
+                remaining = deadline - time.monotonic()
+                if remaining <= 0 or self.proc.poll() is not None:
+                    return None
+                self.lock.wait(min(remaining, 0.5))
+
+    @staticmethod
+    def fields(line: str) -> dict:
+        return dict(item.split('=', 1) if '=' in item else (item, '')
+                    for item in line.split())
+
+    def wait_success(self, seed: int, mark: int, timeout: float):
+        """Device report of the transfer with this seed, or None"""
+        line = self.wait_line(lambda f: f.get('status') == 'success' and
+                              f.get('seed') == str(seed), mark, timeout)
+        return self.fields(line) if line else None
+
+    def stop(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.terminate()
+            try:
+                self.proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+        self.workdir.cleanup()
+
+
+class KernelSocket:
+    """can-j1939 socket with transmit completions from the error queue"""
+
+    def __init__(self, interface: str, address: int, broadcast: bool = False,
+                 timeout: float = 30.0):
+        self.interface = interface
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_DGRAM, CAN_J1939)
+        self.sock.setsockopt(SOL_CAN_J1939, SO_J1939_ERRQUEUE, 1)
+        self.sock.setsockopt(socket.SOL_SOCKET, SO_TIMESTAMPING, SOF_TIMESTAMPING)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 1 << 20)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDTIMEO,
+                             struct.pack('ll', int(timeout), 0))
+        if broadcast:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+        self.sock.bind((interface, J1939_NO_NAME, J1939_NO_PGN, address))
+
+    def close(self):
+        self.sock.close()
+
+    def send(self, pgn: int, dst: int, data: bytes) -> float:
+        """Queue a message; returns the host time it was handed over"""
+        start = time.monotonic()
+        self.sock.sendto(data, (self.interface, J1939_NO_NAME, pgn, dst))
+        return start
+
+    def wait_result(self, timeout: float) -> dict:
+        """
+        Wait for the session outcome
+
+        Returns {'result': 'done' | 'abort' | 'timeout', 'errno': int,
+        'kernel_seconds': float | None, 'time': float}; kernel_seconds runs
+        from the session start (SCHED) to the last acknowledgment (ACK).
+        """
+        poller = select.poll()
+        poller.register(self.sock, select.POLLERR)
+        deadline = time.monotonic() + timeout
+        sched = None
+
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0 or not poller.poll(int(remaining * 1000)):
+                return {'result': 'timeout', 'errno': 0, 'kernel_seconds': None,
+                        'time': time.monotonic()}
+
+            try:
+                _, ancdata, _, _ = self.sock.recvmsg(0, 1024, socket.MSG_ERRQUEUE)
+            except BlockingIOError:
+                continue
+
+            serr = None
+            stamp = None
+            for level, kind, payload in ancdata:
+                if level == SOL_CAN_J1939 and kind == SCM_J1939_ERRQUEUE:
+                    serr = SOCK_EXTENDED_ERR.unpack_from(payload)
+                elif level == socket.SOL_SOCKET and kind == SO_TIMESTAMPING and \
+                        len(payload) >= SCM_TIMESTAMPING.size:
+                    sec, nsec = SCM_TIMESTAMPING.unpack_from(payload)[:2]
+                    stamp = sec + nsec / 1e9
+            if serr is None:
+                continue
+
+            ee_errno, origin, _, _, _, info, _ = serr
+            now = time.monotonic()
+            if origin == SO_EE_ORIGIN_TIMESTAMPING and info == SCM_TSTAMP_SCHED:
+                sched = stamp
+            elif origin == SO_EE_ORIGIN_TIMESTAMPING and info == SCM_TSTAMP_ACK:
+                elapsed = stamp - sched if stamp is not None and sched is not None else None
+                return {'result': 'done', 'errno': 0, 'kernel_seconds': elapsed,
+                        'time': now}
+            elif origin == SO_EE_ORIGIN_LOCAL and info == J1939_EE_INFO_TX_ABORT:
+                return {'result': 'abort', 'errno': ee_errno, 'kernel_seconds': None,
+                        'time': now}
+
+    def recv(self, pgn: int, src: int, timeout: float):
+        """Next message with this PGN from src as (data, time), or None"""
+        deadline = time.monotonic() + timeout
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return None
+            self.sock.settimeout(remaining)
+            try:
+                data, addr = self.sock.recvfrom(J1939_TP_MAX_SIZE)
+            except socket.timeout:
+                return None
+            finally:
+                self.sock.settimeout(None)
+            if addr[2] == pgn and addr[3] == src:
+                return data, time.monotonic()
+
+
+class RawOriginator:
+    """TP originator on a raw socket, for faults the kernel never sends"""
+
+    def __init__(self, interface: str, src: int, dst: int):
+        self.src = src
+        self.dst = dst
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        filt = struct.pack('=II', j1939_id(J1939_PGN_TP_CM, dst, src, 0),
+                           CAN_EFF_FLAG | 0x03FFFFFF)
+        self.sock.setsockopt(socket.SOL_CAN_RAW, socket.CAN_RAW_FILTER, filt)
+        self.sock.bind((interface,))
+
+    def close(self):
+        self.sock.close()
+
+    def _send(self, pgn: int, data: bytes):
+        self.sock.send(CAN_FRAME.pack(j1939_id(pgn, self.src, self.dst), 8,
+                                      data.ljust(8, b'\xFF')))
+
+    def _cm(self, data: list):
+        pgn = J1939_PGN_FIRMWARE_UPDATE
+        self._send(J1939_PGN_TP_CM, bytes(data + [pgn & 0xFF, (pgn >> 8) & 0xFF, pgn >> 16]))
+
+    def recv_cm(self, timeout: float):
+        self.sock.settimeout(timeout)
+        try:
+            _, _, data = CAN_FRAME.unpack(self.sock.recv(CAN_FRAME.size))
+            return data
+        except socket.timeout:
+            return None
+
+    def transfer(self, data: bytes, fault_after: int = 0, fault: str = None,
+                 stall: float = 0.0) -> dict:
+        """
+        Send data with TP, injecting a fault once fault_after packets are out
+
+        fault is 'abort' (send ABORT and stop), 'silent' (stop sending) or
+        'stall' (wait stall seconds, then go on). Returns what the device
+        answered last: {'result': 'eom' | 'abort' | 'silent' | 'no-cts',
+        'reason': int, 'sent': packets, 'time': float}.
+        """
+        size = len(data)
+        packets = (size + J1939_BYTES_PER_PACKET - 1) // J1939_BYTES_PER_PACKET
+        sent = 0
+        faulted = False
+        self._cm([J1939_TP_CM_RTS, size & 0xFF, size >> 8, packets, 0xFF])
+
+        while True:
+            reply = self.recv_cm(T3_TIMEOUT)
+            if reply is None:
+                return {'result': 'no-cts', 'reason': 0, 'sent': sent, 'time': time.monotonic()}
+            if reply[0] == J1939_TP_CM_ABORT:
+                return {'result': 'abort', 'reason': reply[1], 'sent': sent,
+                        'time': time.monotonic()}
+            if reply[0] == J1939_TP_CM_EOM:
+                return {'result': 'eom', 'reason': 0, 'sent': sent, 'time': time.monotonic()}
+            if reply[0] != J1939_TP_CM_CTS or reply[1] == 0:
+                continue
+
+            for packet in range(reply[2], reply[2] + reply[1]):
+                if fault and not faulted and sent >= fault_after:
+                    faulted = True
+                    if fault == 'abort':
+                        self._cm([J1939_TP_CM_ABORT, J1939_ABORT_RESOURCES, 0xFF, 0xFF, 0xFF])
+                        return {'result': 'abort', 'reason': 0, 'sent': sent,
+                                'time': time.monotonic()}
+                    if fault == 'silent':
+                        return {'result': 'silent', 'reason': 0, 'sent': sent,
+                                'time': time.monotonic()}
+                    time.sleep(stall)
+                offset = (packet - 1) * J1939_BYTES_PER_PACKET
+                self._send(J1939_PGN_TP_DT,
+                           bytes([packet]) + data[offset:offset + J1939_BYTES_PER_PACKET])
+                sent += 1
+
+
+class Suite:
+    """Scenarios against one device build"""
+
+    def __init__(self, args, device: Device, monitor: BusMonitor):
+        self.args = args
+        self.device = device
+        self.monitor = monitor
+        self.window = device.info.get('window', 0)
+        self.dev_addr = device.info.get('address', DEFAULT_DST_ADDR)
+        self.host_addr = device.info.get('host', DEFAULT_SRC_ADDR)
+        self.timeout_s = device.info.get('timeout_ms', 5000) / 1000
+        self.slot = device.info.get('slot', 0)
+        self.seed = random.randrange(1 << 32)
+        self.results = []
+
+    def next_seed(self) -> int:
+        self.seed = (self.seed + 1) & 0xFFFFFFFF
+        return self.seed
+
+    def transfer_timeout(self, size: int) -> float:
+        return 10.0 + size / 2000
+
+    def record(self, scenario: str, group: str, ok: bool, detail: str = '',
+               size: int = 0, seconds: float = None, frames: list = None):
+        result = {'window': self.window, 'scenario': scenario, 'group': group,
+                  'ok': ok, 'detail': detail, 'size': size, 'seconds': seconds,
+                  'bytes_per_s': None, 'frames_per_s': None, 'cts': None, 'max_cts': None}
+        if seconds and size:
+            result['bytes_per_s'] = size / seconds
+        if frames:
+            cts = [f.data[1] for f in frames if f.is_cm() and f.sa == self.dev_addr and
+                   f.data[0] in (J1939_TP_CM_CTS, J1939_ETP_CM_CTS)]
+            result['cts'] = len(cts)
+            result['max_cts'] = max(cts) if cts else 0
+            if seconds:
+                result['frames_per_s'] = len(frames) / seconds
+        self.results.append(result)
+        self.print_result(result)
+        return result
+
+    @staticmethod
+    def print_header():
+        print(f"  {'scenario':<20} {'':2} {'bytes':>8} {'s':>7} {'KB/s':>7} "
+              f"{'frames/s':>9} {'CTS':>5} {'max':>4}  detail")
+
+    @staticmethod
+    def print_result(r: dict):
+        def num(value, fmt):
+            return format(value, fmt) if value is not None else '-'
+
+        kbs = r['bytes_per_s'] / 1024 if r['bytes_per_s'] else None
+        print(f"  {r['scenario']:<20} {'✓' if r['ok'] else '✗':2} {r['size']:>8} "
+              f"{num(r['seconds'], '.3f'):>7} {num(kbs, '.1f'):>7} "
+              f"{num(r['frames_per_s'], '.0f'):>9} {num(r['cts'], 'd'):>5} "
+              f"{num(r['max_cts'], 'd'):>4}  {r['detail']}")
+
+    def session_frames(self, mark: int, start: float, end: float) -> list:
+        """Frames of the host-device session between start and end"""
+        peers = (self.host_addr, self.dev_addr)
+        return [f for f in self.monitor.since(mark)
+                if start <= f.time <= end and f.sa in peers and f.ps in peers and
+                (f.is_cm() or f.is_dt())]
+
+    def kernel_transfer(self, size: int, src: int = None, pgn: int = J1939_PGN_FIRMWARE_UPDATE,
+                        started: threading.Event = None) -> dict:
+        """Send one pattern image with the kernel stack and wait for the outcome"""
+        src = self.host_addr if src is None else src
+        seed = self.next_seed()
+        data = make_pattern(size, seed)
+        timeout = self.transfer_timeout(size)
+        sock = KernelSocket(self.args.interface, src, timeout=timeout)
+        try:
+            if started:
+                started.set()
+            start = sock.send(pgn, self.dev_addr, data)
+            outcome = sock.wait_result(timeout)
+        except OSError as e:
+            outcome = {'result': 'error', 'errno': e.errno, 'kernel_seconds': None,
+                       'time': time.monotonic()}
+            start = time.monotonic()
+        finally:
+            sock.close()
+        outcome.update(seed=seed, start=start, size=size)
+        return outcome
+
+    def check_transfer(self, name: str, group: str, size: int, outcome: dict,
+                       dmark: int, bmark: int, detail: str = '', ok: bool = True):
+        """Record a transfer that should have completed with intact data"""
+        frames = self.session_frames(bmark, outcome['start'], outcome['time'])
+        seconds = outcome['kernel_seconds'] or (outcome['time'] - outcome['start'])
+        notes = [detail] if detail else []
+        passed = ok
+
+        if outcome['result'] != 'done':
+            notes.append(f"kernel {outcome['result']} {os.strerror(outcome['errno'])}"
+                         if outcome['errno'] else f"kernel {outcome['result']}")
+            return self.record(name, group, False, '; '.join(notes), size, None, frames)
+
+        report = self.device.wait_success(outcome['seed'], dmark, 5.0)
+        ok = passed and report is not None and report.get('pattern') == 'ok'
+        if report is None:
+            notes.append("no device report")
+        elif not ok:
+            notes.append(f"pattern {report.get('pattern')} at {report.get('offset', '?')}")
+
+        aborts = self.monitor.aborts(bmark, self.dev_addr, self.host_addr)
+        if aborts:
+            ok = False
+            notes.append("device aborted: " + ', '.join(ABORT_NAMES.get(a, str(a)) for a in aborts))
+
+        max_cts = max((f.data[1] for f in frames if f.is_cm() and f.sa == self.dev_addr and
+                       f.data[0] in (J1939_TP_CM_CTS, J1939_ETP_CM_CTS)), default=0)
+        if max_cts > self.window:
+            ok = False
+            notes.append(f"CTS for {max_cts} packets exceeds window {self.window}")
+
+        return self.record(name, group, ok, '; '.join(notes), size, seconds, frames)
+
+    def expect_reject(self, name: str, size: int, src: int, pgn: int, reason: int):
+        """Kernel transfer the device must refuse with an abort reason"""
+        dmark = self.device.mark()
+        bmark = self.monitor.mark()
+        outcome = self.kernel_transfer(size, src=src, pgn=pgn)
+        aborts = self.monitor.aborts(bmark, self.dev_addr, src)
+        # A kernel that fails the send itself also counts; the abort frame decides
+        ok = outcome['result'] != 'done' and reason in aborts
+        detail = (f"device {', '.join(ABORT_NAMES.get(a, str(a)) for a in aborts) or 'no abort'}, "
+                  f"kernel {outcome['result']}")
+        if outcome['errno']:
+            detail += f" ({os.strerror(outcome['errno'])})"
+        if self.device.wait_success(outcome['seed'], dmark, 0.2):
+            ok = False
+            detail += "; device accepted it"
+        self.record(name, 'reject', ok, detail, size)
+
+    # Scenario groups
+
+    def run_transfer(self):
+        for size in self.args.sizes:
+            if self.slot and size > self.slot:
+                continue
+            kind = 'tp' if size <= J1939_TP_MAX_SIZE else 'etp'
+            dmark = self.device.mark()
+            bmark = self.monitor.mark()
+            outcome = self.kernel_transfer(size)
+            self.check_transfer(f'{kind}-{size}', 'transfer', size, outcome, dmark, bmark)
+
+    def run_request(self):
+        sock = KernelSocket(self.args.interface, self.host_addr, broadcast=True)
+        try:
+            start = sock.send(J1939_PGN_REQUEST, self.dev_addr,
+                              bytes([J1939_PGN_SOFTWARE_ID & 0xFF,
+                                     (J1939_PGN_SOFTWARE_ID >> 8) & 0xFF, 0]))
+            reply = sock.recv(J1939_PGN_SOFTWARE_ID, self.dev_addr, 5.0)
+        finally:
+            sock.close()
+
+        if reply is None:
+            self.record('request-soft', 'request', False, "no SOFT reply")
+            return
+        data, end = reply
+        expected = f"\x01conformance-w{self.window}*".encode()
+        ok = data == expected
+        detail = 'BAM from device' if ok else f"got {data!r}"
+        self.record('request-soft', 'request', ok, detail, len(data), end - start)
+
+    def run_reject(self):
+        self.expect_reject('wrong-source', J1939_TP_MAX_SIZE, OTHER_SRC_ADDR,
+                           J1939_PGN_FIRMWARE_UPDATE, J1939_ABORT_RESOURCES)
+        self.expect_reject('unknown-pgn', 100, self.host_addr,
+                           J1939_PGN_UNSUPPORTED, J1939_ABORT_RESOURCES)
+        if self.slot:
+            self.expect_reject('oversize', self.slot + J1939_BYTES_PER_PACKET, self.host_addr,
+                               J1939_PGN_FIRMWARE_UPDATE, J1939_ABORT_RESOURCES)
+
+    def _background_transfer(self, size: int):
+        """Start a kernel transfer in a thread once the device sent its first CTS"""
+        holder = {}
+        bmark = self.monitor.mark()
+        thread = threading.Thread(target=lambda: holder.update(self.kernel_transfer(size)),
+                                  daemon=True)
+        thread.start()
+        first_cts = self.monitor.wait_for(
+            lambda f: f.is_cm() and f.sa == self.dev_addr and f.ps == self.host_addr and
+            f.data[0] in (J1939_TP_CM_CTS, J1939_ETP_CM_CTS), bmark, 5.0)
+        return thread, holder, first_cts
+
+    def run_busy(self):
+        size = 65536
+        dmark = self.device.mark()
+        bmark = self.monitor.mark()
+        thread, holder, first_cts = self._background_transfer(size)
+        if first_cts is None:
+            thread.join(self.transfer_timeout(size))
+            self.record('busy', 'busy', False, "first session never started", size)
+            return
+
+        other_mark = self.monitor.mark()
+        other = self.kernel_transfer(J1939_TP_MAX_SIZE, src=OTHER_SRC_ADDR)
+        thread.join(self.transfer_timeout(size))
+
+        aborts = self.monitor.aborts(other_mark, self.dev_addr, OTHER_SRC_ADDR)
+        busy_ok = other['result'] == 'abort' and J1939_ABORT_BUSY in aborts
+        detail = (f"second originator: {', '.join(ABORT_NAMES.get(a, str(a)) for a in aborts) or 'no abort'}"
+                  f", kernel {other['result']}")
+        if not holder:
+            self.record('busy', 'busy', False, detail + "; first session hung", size)
+            return
+        self.check_transfer('busy', 'busy', size, holder, dmark, bmark, detail, busy_ok)
+
+    def run_shared(self):
+        size = 65536
+        dmark = self.device.mark()
+        bmark = self.monitor.mark()
+        thread, holder, first_cts = self._background_transfer(size)
+
+        bams = 0
+        bystander = KernelSocket(self.args.interface, BYSTANDER_ADDR, broadcast=True)
+        try:
+            # The kernel spaces BAM packets 50 ms apart; keep them short
+            while first_cts and thread.is_alive():
+                bystander.send(J1939_PGN_BAM_TRAFFIC, 0xFF, bytes(range(BYSTANDER_BAM_LEN)))
+                if bystander.wait_result(5.0)['result'] != 'done':
+                    break
+                bams += 1
+        finally:
+            bystander.close()
+
+        thread.join(self.transfer_timeout(size))
+        if not holder:
+            self.record('shared-bam', 'shared', False, "session hung", size)
+            return
+        self.check_transfer('shared-bam', 'shared', size, holder, dmark, bmark,
+                            f"{bams} BAMs alongside")
+
+    def _raw_then_recover(self, name: str, group: str, fault: str, expect_reason: int = None,
+                          stall: float = 0.0):
+        seed = self.next_seed()
+        data = make_pattern(J1939_TP_MAX_SIZE, seed)
+        dmark = self.device.mark()
+        bmark = self.monitor.mark()
+        raw = RawOriginator(self.args.interface, self.host_addr, self.dev_addr)
+        try:
+            start = time.monotonic()
+            outcome = raw.transfer(data, fault_after=min(3, self.window), fault=fault,
+                                   stall=stall)
+            if fault == 'silent':
+                reply = raw.recv_cm(self.timeout_s + 2.0)
+                if reply is not None and reply[0] == J1939_TP_CM_ABORT:
+                    outcome = {'result': 'abort', 'reason': reply[1], 'sent': outcome['sent'],
+                               'time': time.monotonic(), 'silent_at': outcome['time']}
+        finally:
+            raw.close()
+
+        if fault == 'stall':
+            report = self.device.wait_success(seed, dmark, 2.0)
+            ok = outcome['result'] == 'eom' and report is not None and \
+                report.get('pattern') == 'ok'
+            detail = f"paused {stall:.2f} s, device {outcome['result']}"
+            self.record(name, group, ok, detail, J1939_TP_MAX_SIZE,
+                        outcome['time'] - start, self.session_frames(bmark, start, outcome['time']))
+            return
+
+        if fault == 'silent':
+            waited = outcome['time'] - outcome.get('silent_at', outcome['time'])
+            ok = outcome['result'] == 'abort' and outcome['reason'] == expect_reason and \
+                abs(waited - self.timeout_s) < 1.0
+            detail = (f"device {ABORT_NAMES.get(outcome['reason'], outcome['result'])} "
+                      f"after {waited:.2f} s (limit {self.timeout_s:.2f} s)")
+        else:
+            cts_after = self.monitor.wait_for(
+                lambda f: f.is_cm() and f.sa == self.dev_addr and
+                f.data[0] == J1939_TP_CM_CTS and f.time > outcome['time'] + 0.05, bmark, 1.0)
+            ok = cts_after is None and outcome['result'] == 'abort'
+            detail = "session dropped" if ok else "device kept the session"
+
+        self.record(name, group, ok, detail)
+
+        # The listener must take the next transfer as if nothing happened
+        dmark = self.device.mark()
+        bmark = self.monitor.mark()
+        recovery = self.kernel_transfer(J1939_TP_MAX_SIZE)
+        self.check_transfer(f'{name}+next', group, J1939_TP_MAX_SIZE, recovery, dmark, bmark)
+
+    def run_abort(self):
+        self._raw_then_recover('abort-originator', 'abort', 'abort')
+
+    def run_stall(self):
+        self._raw_then_recover('stall', 'stall', 'stall', stall=self.timeout_s * 0.6)
+
+    def run_timeout(self):
+        self._raw_then_recover('timeout', 'timeout', 'silent', J1939_ABORT_TIMEOUT)
+
+    def run(self, groups):
+        print(f"\nWindow {self.window} (device 0x{self.dev_addr:02X}, slot {self.slot} bytes, "
+              f"timeout {self.timeout_s:.1f} s)")
+        self.print_header()
+        for group in groups:
+            getattr(self, f'run_{group}')()
+        return self.results
+
+
+def build_device(window: int) -> Path:
+    """west build of the conformance device for one CTS window"""
+    build_dir = Path('build/j1939_conformance') / f'w{window}'
+    cmd = ['west', 'build', '-b', 'native_sim', str(APP_DIR), '-d', str(build_dir),
+           '--', f'-DCONFIG_CAN_UPDATE_TP_WINDOW={window}']
+    print(f"→ {' '.join(cmd)}")
+    subprocess.run(cmd, check=True, cwd=REPO_DIR, stdout=subprocess.DEVNULL)
+    return REPO_DIR / build_dir / 'zephyr' / 'zephyr.exe'
+
+
+def run_device(args, exe: Path) -> list:
+    device = Device(exe)
+    monitor = BusMonitor(args.interface)
+    monitor.start()
+    try:
+        mark = monitor.mark()
+        device.start()
+        # The update filters follow the claimed address; wait until it is out
+        addr = device.info.get('address', DEFAULT_DST_ADDR)
+        monitor.wait_for(lambda f: f.pf == J1939_PGN_ADDRESS_CLAIMED >> 8 and f.sa == addr,
+                         mark, CLAIM_TIMEOUT)
+        return Suite(args, device, monitor).run(args.groups)
+    finally:
+        device.stop()
+        monitor.stop.set()
+        monitor.join()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Interoperability and throughput of the update listener '
+                    'against the Linux can-j1939 stack',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog=f"""
+Scenario groups: {', '.join(SCENARIO_GROUPS)}
+
+Examples:
+  # Build and test three windows
+  python3 j1939_conformance.py --build --windows 1 16 255
+
+  # Existing builds, transfers only, results for later comparison
+  python3 j1939_conformance.py --device build/zephyr/zephyr.exe -g transfer --json run.json
+        """)
+
+    parser.add_argument('-i', '--interface', default='vcan0',
+                        help='Virtual CAN interface (default: vcan0, as in the device overlay)')
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--device', type=Path, action='append',
+                        help='zephyr.exe of a conformance device build (repeatable)')
+    source.add_argument('--build', action='store_true',
+                        help='Build the device for every --windows value with west')
+    parser.add_argument('--windows', type=int, nargs='+', default=list(DEFAULT_WINDOWS),
+                        help='CTS windows to build (default: 1 16 255)')
+    parser.add_argument('--sizes', type=int, nargs='+', default=list(DEFAULT_SIZES),
+                        help='Transfer sizes in bytes (default: 9 1785 1786 65536 262144)')
+    parser.add_argument('-g', '--groups', nargs='+', choices=SCENARIO_GROUPS,
+                        default=list(SCENARIO_GROUPS),
+                        help='Scenario groups to run (default: all)')
+    parser.add_argument('--json', type=Path,
+                        help='Write all results to this file')
+
+    args = parser.parse_args()
+
+    if not hasattr(socket, 'AF_CAN'):
+        print("✗ SocketCAN is not available on this system")
+        return 1
+    try:
+        socket.socket(socket.AF_CAN, socket.SOCK_DGRAM, CAN_J1939).close()
+    except OSError as e:
+        print(f"✗ can-j1939 not available ({e}), try: sudo modprobe can-j1939")
+        return 1
+    if any(size < PATTERN_HEADER_LEN + 1 for size in args.sizes):
+        parser.error(f"sizes must be at least {PATTERN_HEADER_LEN + 1} bytes (multi-packet)")
+    if any(not 1 <= w <= 255 for w in args.windows):
+        parser.error("windows must be 1-255")
+
+    try:
+        exes = [build_device(w) for w in args.windows] if args.build else args.device
+    except subprocess.CalledProcessError as e:
+        print(f"✗ Build failed: {e}")
+        return 1
+
+    results = []
+    for exe in exes:
+        try:
+            results += run_device(args, exe)
+        except (OSError, RuntimeError) as e:
+            print(f"✗ {exe}: {e}")
+            return 1
+
+    failed = [r for r in results if not r['ok']]
+    print(f"\n{len(results) - len(failed)}/{len(results)} scenarios passed")
+    for r in failed:
+        print(f"  ✗ window {r['window']}: {r['scenario']} - {r['detail']}")
+
+    if args.json:
+        args.json.write_text(json.dumps(results, indent=2))
+        print(f"Results written to {args.json}")
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -6,17 +6,29 @@ Sends firmware updates over CAN bus using J1939 Transport Protocol
 Requirements:
     pip3 install python-can
 
+Optional native frame pump (Linux), used automatically when built:
+    python3 setup.py build_ext --inplace
+
 Usage:
     sudo python3 j1939_firmware_sender.py -i can0 -f firmware.bin -d 0x80
 """
 
 import argparse
+import errno
 import time
 import struct
+import zlib
 import can
 from pathlib import Path
 from typing import Optional
 
+from bus_load import BusLoadAnalyzer, DEFAULT_MAX_LOAD, measure
+
+try:
+    import j1939_pump
+except ImportError:
+    j1939_pump = None
+
 # J1939 Protocol Definitions
 J1939_TP_CM_RTS = 16    # Request to Send
 J1939_TP_CM_CTS = 17    # Clear to Send
@@ -24,22 +36,55 @@ J1939_TP_CM_EOM = 19    # End of Message Acknowledgment
 J1939_TP_CM_BAM = 32    # Broadcast Announce Message
 J1939_TP_CM_ABORT = 255 # Connection Abort
 
+J1939_ETP_CM_RTS = 20   # Extended Request to Send
+J1939_ETP_CM_CTS = 21   # Extended Clear to Send
+J1939_ETP_CM_DPO = 22   # Data Packet Offset
+J1939_ETP_CM_EOMA = 23  # Extended End of Message Acknowledgment
+
 J1939_PGN_TP_CM = 0xEC00  # Transport Protocol - Connection Management
 J1939_PGN_TP_DT = 0xEB00  # Transport Protocol - Data Transfer
+J1939_PGN_ETP_CM = 0xC800  # Extended Transport Protocol - Connection Management
+J1939_PGN_ETP_DT = 0xC700  # Extended Transport Protocol - Data Transfer
 J1939_PGN_FIRMWARE_UPDATE = 0xEF00  # Custom PGN for firmware updates
+J1939_PGN_MODULE_UPDATE = 0x1EF00   # Loadable module (LLEXT) updates, no reboot
+
+# Image cache commands (single frames on J1939_PGN_FIRMWARE_UPDATE)
+CACHE_CMD_LIST = 0xC0       # [index] -> [C0, index, count, major, minor, rev LE]
+CACHE_CMD_RESTORE = 0xC1    # [select, key...] -> [C1, errno]
+CACHE_CMD_HASH = 0xC2       # Reply: [C2, index, first 6 hash bytes]
+CACHE_SELECT_VERSION = 0
+CACHE_SELECT_HASH = 1
+CACHE_SELECT_INDEX = 2
+CACHE_BUSY = 0xFF           # Entry count while the device is caching
+
+# Transfer tuning commands (single frames on J1939_PGN_FIRMWARE_UPDATE)
+TUNE_CMD_PARAMS = 0xD0      # -> [D0, window, flush LE16, gap us LE16, arrival us LE16]
+TUNE_CMD_RATES = 0xD1       # -> [D1, erase us/KiB LE24, program us/KiB LE24]
+TUNE_CMD_CALIBRATE = 0xD2   # -> [D2, errno]
+
+# Module header sent in front of the LLEXT ELF (can_update_module.h)
+MODULE_MAGIC = 0x444D5543  # "CUMD"
+MODULE_NAME_LEN = 24
+MODULE_HEADER = struct.Struct('<I24sIIII20s')
+
+J1939_TP_MAX_SIZE = 1785  # 255 packets of 7 bytes; larger images use ETP
+J1939_BYTES_PER_PACKET = 7
 
 # Default addresses
 DEFAULT_SRC_ADDR = 0x00   # Host (Raspberry Pi) address
 DEFAULT_DST_ADDR = 0x80   # Device address
 DEFAULT_PRIORITY = 6
 
+MAX_PACED_DELAY = 0.05    # Slowest --auto-rate pacing, even on a saturated bus
+
 
 class J1939FirmwareSender:
     """J1939 Firmware Update Sender"""
 
     def __init__(self, interface: str, src_addr: int = DEFAULT_SRC_ADDR,
                  dst_addr: int = DEFAULT_DST_ADDR, priority: int = DEFAULT_PRIORITY,
-                 bitrate: int = 250000):
+                 bitrate: int = 250000, verbose: bool = True, native: bool = True,
+                 pgn: int = J1939_PGN_FIRMWARE_UPDATE):
         """
         Initialize J1939 Firmware Sender
 
@@ -49,13 +94,30 @@ class J1939FirmwareSender:
             dst_addr: Destination address (target device)
             priority: J1939 priority (0-7, lower is higher priority)
             bitrate: CAN bus bitrate (default 250kbps)
+            verbose: Print protocol progress (off when several senders
+                     run in parallel, e.g. from fleet_rollout.py)
+            native: Use the j1939_pump extension for transfers if it is
+                    built
+            pgn: PGN carried by the transfers (J1939_PGN_MODULE_UPDATE
+                 for loadable modules)
         """
         self.interface = interface
         self.src_addr = src_addr
         self.dst_addr = dst_addr
         self.priority = priority
         self.bitrate = bitrate
+        self.verbose = verbose
+        self.native = native and j1939_pump is not None
+        self.pgn = pgn
         self.bus: Optional[can.Bus] = None
+        self.owns_bus = False
+        self.load: Optional[BusLoadAnalyzer] = None
+        self.max_load = DEFAULT_MAX_LOAD
+
+    def log(self, text: str):
+        """Print a progress line unless running quietly"""
+        if self.verbose:
+            print(text)
 
     def build_can_id(self, pgn: int) -> int:
         """
@@ -86,79 +148,140 @@ class J1939FirmwareSender:
             self.bus = can.Bus(interface='socketcan',
                               channel=self.interface,
                               bitrate=self.bitrate,
-                              can_filters=None,
+                              can_filters=response_filters(self.src_addr),
                               receive_own_messages=False)
-            print(f"✓ Connected to {self.interface} at {self.bitrate} bps")
+            self.owns_bus = True
+            self.log(f"✓ Connected to {self.interface} at {self.bitrate} bps")
         except Exception as e:
             raise RuntimeError(f"Failed to connect to CAN interface: {e}")
 
+    def attach(self, bus: can.Bus):
+        """
+        Use a bus opened elsewhere (update_daemon.py keeps one per
+        interface); disconnect() leaves it open
+
+        Args:
+            bus: SocketCAN bus with response_filters() for our address
+        """
+        self.bus = bus
+        self.owns_bus = False
+
     def disconnect(self):
         """Disconnect from CAN bus"""
-        if self.bus:
+        if self.bus and self.owns_bus:
             self.bus.shutdown()
-            self.bus = None
-            print("✓ Disconnected from CAN bus")
+            self.log("✓ Disconnected from CAN bus")
+        self.bus = None
 
-    def send_rts(self, data_size: int, num_packets: int) -> bool:
+    def send_cm(self, extended: bool, data: bytes):
         """
-        Send J1939 RTS (Request to Send) message
+        Send a TP.CM or ETP.CM message for the transfer PGN
 
         Args:
-            data_size: Total message size in bytes
-            num_packets: Total number of data packets
-
-        Returns:
-            True if CTS received, False otherwise
-        """
-        can_id = self.build_can_id(J1939_PGN_TP_CM)
-
-        # Build RTS message
-        data = bytearray([
-            J1939_TP_CM_RTS,
-            data_size & 0xFF,
-            (data_size >> 8) & 0xFF,
-            num_packets,
-            0xFF,  # Max packets (255 = no limit)
-            J1939_PGN_FIRMWARE_UPDATE & 0xFF,
-            (J1939_PGN_FIRMWARE_UPDATE >> 8) & 0xFF,
-            (J1939_PGN_FIRMWARE_UPDATE >> 16) & 0xFF
+            extended: ETP instead of TP
+            data: Control byte and the next four bytes
+        """
+        pgn = J1939_PGN_ETP_CM if extended else J1939_PGN_TP_CM
+        payload = bytearray(data) + bytearray([
+            self.pgn & 0xFF,
+            (self.pgn >> 8) & 0xFF,
+            (self.pgn >> 16) & 0xFF
         ])
 
-        msg = can.Message(arbitration_id=can_id,
+        msg = can.Message(arbitration_id=self.build_can_id(pgn),
                          is_extended_id=True,
-                         data=data)
-
+                         data=payload)
         self.bus.send(msg)
-        print(f"→ Sent RTS: {data_size} bytes, {num_packets} packets")
 
-        # Wait for CTS response
-        timeout = 5.0
-        start_time = time.time()
+    def recv_cm(self, extended: bool, timeout: float) -> Optional[bytes]:
+        """
+        Wait for a connection management message from the device
+
+        Only TP.CM/ETP.CM frames sent by the destination to our address
+        count, so other traffic on a busy bus is ignored.
 
-        while time.time() - start_time < timeout:
+        Args:
+            extended: ETP instead of TP
+            timeout: Timeout in seconds
+
+        Returns:
+            Message data, or None on timeout
+        """
+        pgn = J1939_PGN_ETP_CM if extended else J1939_PGN_TP_CM
+        deadline = time.time() + timeout
+
+        while time.time() < deadline:
             recv_msg = self.bus.recv(timeout=0.1)
-            if recv_msg and len(recv_msg.data) >= 1:
-                if recv_msg.data[0] == J1939_TP_CM_CTS:
-                    num_pkts = recv_msg.data[1]
-                    next_pkt = recv_msg.data[2]
-                    print(f"← Received CTS: {num_pkts} packets, next={next_pkt}")
-                    return True
-                elif recv_msg.data[0] == J1939_TP_CM_ABORT:
-                    print("✗ Received ABORT from device")
-                    return False
-
-        print("✗ Timeout waiting for CTS")
-        return False
+            if recv_msg and self.load:
+                self.load.feed(recv_msg)
+            if not recv_msg or not recv_msg.is_extended_id or len(recv_msg.data) < 8:
+                continue
 
-    def send_data_packet(self, seq_num: int, data: bytes):
+            can_id = recv_msg.arbitration_id
+            if ((can_id >> 16) & 0xFF) != (pgn >> 8) or \
+               ((can_id >> 8) & 0xFF) != self.src_addr or \
+               (can_id & 0xFF) != self.dst_addr:
+                continue
+
+            return bytes(recv_msg.data)
+
+        return None
+
+    def measure_load(self, duration: float, max_load: float = DEFAULT_MAX_LOAD) -> float:
         """
-        Send J1939 TP.DT (Data Transfer) packet
+        Measure the existing bus traffic before a transfer
+
+        Afterwards the transfers pace their packets with paced_delay(),
+        and the Python frame loop keeps feeding the analyzer with the
+        traffic it receives between windows.
 
         Args:
-            seq_num: Sequence number (1-255)
+            duration: Listening time in seconds
+            max_load: Ceiling for existing traffic plus the update (0..1)
+
+        Returns:
+            Recommended delay between packets in seconds
+        """
+        self.load = BusLoadAnalyzer(self.bitrate, (1.0, max(duration, 1.0)))
+        self.max_load = max_load
+
+        # The analyzer needs all traffic, not just the device's replies
+        self.bus.set_filters(None)
+
+        self.log(f"→ Measuring bus load for {duration:.0f} s...")
+        measure(self.bus, self.load, duration)
+
+        stats = self.load.stats(duration)
+        delay, rate = self.load.recommend_delay(max_load)
+        self.log(f"← Bus load {stats['load']*100:.1f}% mean, {stats['peak']*100:.1f}% peak; "
+                 f"room for {rate:.0f} frames/s below {max_load*100:.0f}%")
+        return delay
+
+    def paced_delay(self, packet_delay: float) -> float:
+        """
+        Delay between packets for the next window
+
+        Without measure_load() this is @packet_delay. With it, the delay
+        grows so existing traffic plus the update stay below the load
+        ceiling; @packet_delay stays the lower bound.
+        """
+        if self.load is None:
+            return packet_delay
+
+        self.load.advance(time.time())
+        delay, _ = self.load.recommend_delay(self.max_load)
+        return max(packet_delay, min(delay, MAX_PACED_DELAY))
+
+    def send_data_packet(self, seq_num: int, data: bytes, extended: bool = False):
+        """
+        Send J1939 TP.DT or ETP.DT (Data Transfer) packet
+
+        Args:
+            seq_num: Sequence number (1-255, relative to the DPO for ETP)
             data: Data payload (up to 7 bytes)
+            extended: ETP instead of TP
         """
-        can_id = self.build_can_id(J1939_PGN_TP_DT)
+        can_id = self.build_can_id(J1939_PGN_ETP_DT if extended else J1939_PGN_TP_DT)
 
         # Build TP.DT message: [seq_num, data...]
         payload = bytearray([seq_num]) + bytearray(data)
@@ -173,32 +296,143 @@ class J1939FirmwareSender:
 
         self.bus.send(msg)
 
-    def wait_for_eom(self, timeout: float = 10.0) -> bool:
+    def transfer(self, image: bytes, packet_delay: float = 0.005,
+                 cts_timeout: float = 10.0) -> bool:
         """
-        Wait for EOM (End of Message) acknowledgment
+        Send an image with TP (up to 1785 bytes) or ETP
+
+        Follows the device's CTS windows, including re-requests of
+        missing packets, until EOM/EOMA.
 
         Args:
-            timeout: Timeout in seconds
+            image: Image data
+            packet_delay: Delay between packets in seconds
+            cts_timeout: Time to wait for each CTS; the first one only
+                         arrives once the device has erased its slot
 
         Returns:
-            True if EOM received, False otherwise
+            True if the device acknowledged the whole image
         """
+        if self.native:
+            return self.transfer_native(image, packet_delay, cts_timeout)
+
+        size = len(image)
+        num_packets = (size + J1939_BYTES_PER_PACKET - 1) // J1939_BYTES_PER_PACKET
+        extended = size > J1939_TP_MAX_SIZE
+
+        if extended:
+            self.send_cm(True, [J1939_ETP_CM_RTS] + list(struct.pack('<I', size)))
+            self.log(f"→ Sent ETP RTS: {size} bytes, {num_packets} packets")
+        else:
+            self.send_cm(False, [J1939_TP_CM_RTS, size & 0xFF, (size >> 8) & 0xFF,
+                                 num_packets, 0xFF])
+            self.log(f"→ Sent RTS: {size} bytes, {num_packets} packets")
+
         start_time = time.time()
+        last_progress = 0
+        delay = packet_delay
 
-        while time.time() - start_time < timeout:
-            recv_msg = self.bus.recv(timeout=0.1)
-            if recv_msg and len(recv_msg.data) >= 1:
-                if recv_msg.data[0] == J1939_TP_CM_EOM:
-                    total_bytes = recv_msg.data[1] | (recv_msg.data[2] << 8)
-                    total_pkts = recv_msg.data[3]
-                    print(f"← Received EOM: {total_bytes} bytes, {total_pkts} packets")
-                    return True
-                elif recv_msg.data[0] == J1939_TP_CM_ABORT:
-                    print("✗ Received ABORT from device")
-                    return False
-
-        print("✗ Timeout waiting for EOM")
-        return False
+        while True:
+            data = self.recv_cm(extended, cts_timeout)
+            if data is None:
+                self.log("✗ Timeout waiting for CTS/EOM")
+                return False
+
+            control = data[0]
+
+            if control == J1939_TP_CM_ABORT:
+                self.log(f"✗ Received ABORT from device (reason {data[1]})")
+                return False
+
+            if control in (J1939_TP_CM_EOM, J1939_ETP_CM_EOMA):
+                elapsed = time.time() - start_time
+                self.log(f"← Received EOM: {size} bytes in {elapsed:.2f} s "
+                         f"({size / elapsed / 1024 if elapsed > 0 else 0:.1f} KB/s)")
+                return True
+
+            if control not in (J1939_TP_CM_CTS, J1939_ETP_CM_CTS):
+                continue
+
+            count = data[1]
+            if extended:
+                next_pkt = data[2] | (data[3] << 8) | (data[4] << 16)
+            else:
+                next_pkt = data[2]
+
+            if count == 0:
+                # Hold: the device asks us to wait for another CTS
+                continue
+
+            paced = self.paced_delay(packet_delay)
+            if paced != delay:
+                self.log(f"  Packet delay {paced*1000:.2f} ms for the bus load")
+                delay = paced
+
+            if extended:
+                # Packets of this window are numbered from the offset
+                self.send_cm(True, [J1939_ETP_CM_DPO, count,
+                                    (next_pkt - 1) & 0xFF, ((next_pkt - 1) >> 8) & 0xFF,
+                                    ((next_pkt - 1) >> 16) & 0xFF])
+
+            for i in range(count):
+                packet = next_pkt + i
+                if packet > num_packets:
+                    break
+
+                offset = (packet - 1) * J1939_BYTES_PER_PACKET
+                chunk = image[offset:offset + J1939_BYTES_PER_PACKET]
+                self.send_data_packet(i + 1 if extended else packet, chunk, extended)
+
+                # Delay between packets to avoid overwhelming receiver
+                time.sleep(delay)
+
+            progress = (min(next_pkt + count - 1, num_packets) * 100) // num_packets
+            if progress >= last_progress + 10:
+                sent = min((next_pkt + count - 1) * J1939_BYTES_PER_PACKET, size)
+                elapsed = time.time() - start_time
+                speed = sent / elapsed if elapsed > 0 else 0
+                self.log(f"  {progress}% ({sent}/{size} bytes) - {speed/1024:.1f} KB/s")
+                last_progress = progress
+
+    def transfer_native(self, image: bytes, packet_delay: float = 0.005,
+                        cts_timeout: float = 10.0) -> bool:
+        """
+        Send an image with the j1939_pump extension
+
+        Same protocol as transfer(), run by the extension on its own raw
+        socket without holding the GIL. No per-window progress is printed.
+
+        Args:
+            image: Image data
+            packet_delay: Delay between packets in seconds
+            cts_timeout: Time to wait for each CTS
+
+        Returns:
+            True if the device acknowledged the whole image
+        """
+        size = len(image)
+        self.log(f"→ Sending {size} bytes with {'ETP' if size > J1939_TP_MAX_SIZE else 'TP'} "
+                 f"(native frame pump)")
+
+        # The pump does not report foreign traffic; pace by the last measurement
+        start_time = time.time()
+        result, reason, frames = j1939_pump.transfer(
+            self.interface, image, self.src_addr, self.dst_addr,
+            priority=self.priority, pgn=self.pgn,
+            packet_delay=self.paced_delay(packet_delay), cts_timeout=cts_timeout)
+        elapsed = time.time() - start_time
+
+        if result == 'abort':
+            self.log(f"✗ Received ABORT from device (reason {reason})")
+            return False
+
+        if result == 'timeout':
+            self.log("✗ Timeout waiting for CTS/EOM")
+            return False
+
+        self.log(f"← Received EOM: {size} bytes in {elapsed:.2f} s, {frames} frames "
+                 f"({size / elapsed / 1024 if elapsed > 0 else 0:.1f} KB/s)")
+        return True
 
     def send_firmware(self, firmware_path: Path, packet_delay: float = 0.005):
         """
@@ -220,87 +454,376 @@ class J1939FirmwareSender:
         firmware_size = len(firmware_data)
 
         # Calculate number of packets (7 bytes of data per packet)
-        bytes_per_packet = 7
-        num_packets = (firmware_size + bytes_per_packet - 1) // bytes_per_packet
+        num_packets = (firmware_size + J1939_BYTES_PER_PACKET - 1) // J1939_BYTES_PER_PACKET
 
         print(f"\n{'='*60}")
         print(f"Firmware Update")
         print(f"{'='*60}")
         print(f"File: {firmware_path}")
         print(f"Size: {firmware_size} bytes")
-        print(f"Packets: {num_packets}")
+        print(f"Packets: {num_packets} ({'ETP' if firmware_size > J1939_TP_MAX_SIZE else 'TP'})")
         print(f"Source: 0x{self.src_addr:02X}")
         print(f"Destination: 0x{self.dst_addr:02X}")
+        print(f"Frame pump: {'native' if self.native else 'Python'}")
         print(f"{'='*60}\n")
 
-        # Send RTS and wait for CTS
-        if not self.send_rts(firmware_size, num_packets):
+        if self.transfer(firmware_data, packet_delay):
+            print("\n" + "="*60)
+            print("✓ FIRMWARE UPDATE SUCCESSFUL!")
+            print("="*60)
+            print("The device will reboot to apply the update.")
+            return True
+        else:
+            print("\n✗ Firmware update failed!")
             return False
 
-        # Small delay before starting data transfer
-        time.sleep(0.1)
-
-        # Send data packets
-        print("\nTransferring data...")
-        seq_num = 1
-        offset = 0
-
-        start_time = time.time()
-        last_progress = 0
-
-        while offset < firmware_size:
-            # Extract data chunk (up to 7 bytes)
-            end = min(offset + bytes_per_packet, firmware_size)
-            chunk = firmware_data[offset:end]
+    def send_module(self, module_path: Path, name: str, version: int = 0,
+                    packet_delay: float = 0.005):
+        """
+        Send a loadable module (LLEXT ELF) over J1939
 
-            # Send packet
-            self.send_data_packet(seq_num, chunk)
+        The ELF goes out behind a module header on J1939_PGN_MODULE_UPDATE.
+        The device writes it to a free module slot and swaps it in while
+        the application keeps running.
 
-            offset = end
-            seq_num += 1
+        Args:
+            module_path: Path to the .llext file
+            name: Module name the application calls it by
+            version: Product version stored in the header
+            packet_delay: Delay between packets in seconds (default 5ms)
 
-            # Progress reporting
-            progress = (offset * 100) // firmware_size
-            if progress >= last_progress + 10:
-                elapsed = time.time() - start_time
-                speed = offset / elapsed if elapsed > 0 else 0
-                print(f"  {progress}% ({offset}/{firmware_size} bytes) "
-                      f"- {speed/1024:.1f} KB/s")
-                last_progress = progress
+        Returns:
+            True if successful, False otherwise
+        """
+        if not module_path.exists():
+            print(f"✗ Module file not found: {module_path}")
+            return False
 
-            # Delay between packets to avoid overwhelming receiver
-            time.sleep(packet_delay)
+        elf = module_path.read_bytes()
+        try:
+            image = build_module_image(elf, name, version)
+        except ValueError as e:
+            print(f"✗ {e}")
+            return False
 
-        elapsed = time.time() - start_time
-        avg_speed = firmware_size / elapsed if elapsed > 0 else 0
+        print(f"\n{'='*60}")
+        print(f"Module Update")
+        print(f"{'='*60}")
+        print(f"File: {module_path}")
+        print(f"Module: {name} v{version}")
+        print(f"Size: {len(elf)} bytes + {MODULE_HEADER.size} byte header "
+              f"({'ETP' if len(image) > J1939_TP_MAX_SIZE else 'TP'})")
+        print(f"Source: 0x{self.src_addr:02X}")
+        print(f"Destination: 0x{self.dst_addr:02X}")
+        print(f"Frame pump: {'native' if self.native else 'Python'}")
+        print(f"{'='*60}\n")
 
-        print(f"\n✓ Data transfer complete")
-        print(f"  Total time: {elapsed:.2f} seconds")
-        print(f"  Average speed: {avg_speed/1024:.1f} KB/s")
+        saved_pgn = self.pgn
+        self.pgn = J1939_PGN_MODULE_UPDATE
+        try:
+            ok = self.transfer(image, packet_delay)
+        finally:
+            self.pgn = saved_pgn
 
-        # Wait for EOM acknowledgment
-        print("\nWaiting for device acknowledgment...")
-        if self.wait_for_eom():
+        if ok:
             print("\n" + "="*60)
-            print("✓ FIRMWARE UPDATE SUCCESSFUL!")
+            print("✓ MODULE UPDATE SUCCESSFUL!")
             print("="*60)
-            print("The device will reboot to apply the update.")
+            print("The device has switched to the new module, no reboot needed.")
             return True
         else:
-            print("\n✗ Firmware update failed!")
+            print("\n✗ Module update failed!")
+            return False
+
+
+    def send_command(self, data: bytes):
+        """
+        Send a single-frame command on J1939_PGN_FIRMWARE_UPDATE
+
+        Args:
+            data: Command bytes, padded to 8 with 0xFF
+        """
+        payload = bytes(data) + b'\xff' * (8 - len(data))
+        msg = can.Message(arbitration_id=self.build_can_id(J1939_PGN_FIRMWARE_UPDATE),
+                         is_extended_id=True,
+                         data=payload)
+        self.bus.send(msg)
+
+    def recv_reply(self, code: int, timeout: float) -> Optional[bytes]:
+        """
+        Wait for a single-frame reply from the device
+
+        Args:
+            code: First data byte of the expected reply
+            timeout: Timeout in seconds
+
+        Returns:
+            Reply data, or None on timeout
+        """
+        deadline = time.time() + timeout
+
+        while time.time() < deadline:
+            recv_msg = self.bus.recv(timeout=0.1)
+            if not recv_msg or not recv_msg.is_extended_id or len(recv_msg.data) < 8:
+                continue
+
+            can_id = recv_msg.arbitration_id
+            if ((can_id >> 16) & 0xFF) != (J1939_PGN_FIRMWARE_UPDATE >> 8) or \
+               ((can_id >> 8) & 0xFF) != self.src_addr or \
+               (can_id & 0xFF) != self.dst_addr or \
+               recv_msg.data[0] != code:
+                continue
+
+            return bytes(recv_msg.data)
+
+        return None
+
+    def cache_list(self) -> Optional[list]:
+        """
+        Read the device's image cache, newest first
+
+        Returns:
+            List of (major, minor, revision, hash prefix) tuples, or None
+            if the device did not answer
+        """
+        entries = []
+        index = 0
+
+        while True:
+            self.send_command(bytes([CACHE_CMD_LIST, index]))
+            reply = self.recv_reply(CACHE_CMD_LIST, 2.0)
+            if reply is None:
+                print("✗ No reply to the cache list request")
+                return None
+            if reply[2] == CACHE_BUSY:
+                self.log("  Device is caching its image, retrying...")
+                time.sleep(1.0)
+                continue
+            if index >= reply[2]:
+                return entries
+
+            major, minor = reply[3], reply[4]
+            revision = reply[5] | (reply[6] << 8)
+            hash_reply = self.recv_reply(CACHE_CMD_HASH, 2.0)
+            if hash_reply is None:
+                print("✗ Missing hash in the cache list reply")
+                return None
+
+            entries.append((major, minor, revision, hash_reply[2:8]))
+            index += 1
+
+    def cache_restore(self, key: str) -> bool:
+        """
+        Restore a cached image into the device's slot1
+
+        The device decompresses the image locally and requests a test
+        upgrade, exactly as after a transfer; nothing but the command
+        crosses the bus.
+
+        Args:
+            key: "MAJOR.MINOR.REVISION", "#INDEX" or a hash prefix of
+                 12 hex digits as shown by cache_list()
+
+        Returns:
+            True if successful, False otherwise
+        """
+        if key.startswith('#'):
+            command = bytes([CACHE_CMD_RESTORE, CACHE_SELECT_INDEX, int(key[1:], 0)])
+        elif key.count('.') == 2:
+            major, minor, revision = (int(x) for x in key.split('.'))
+            command = bytes([CACHE_CMD_RESTORE, CACHE_SELECT_VERSION, major, minor,
+                             revision & 0xFF, revision >> 8])
+        else:
+            prefix = bytes.fromhex(key)
+            if len(prefix) != 6:
+                print("✗ Hash prefix must be 12 hex digits")
+                return False
+            command = bytes([CACHE_CMD_RESTORE, CACHE_SELECT_HASH]) + prefix
+
+        print(f"→ Restoring cached image {key} on 0x{self.dst_addr:02X}...")
+        while True:
+            self.send_command(command)
+            # Decompressing and writing slot1 takes tens of seconds
+            reply = self.recv_reply(CACHE_CMD_RESTORE, 120.0)
+            if reply is None:
+                print("✗ No reply to the restore request")
+                return False
+            if reply[1] == errno.EBUSY:
+                self.log("  Device is busy, retrying...")
+                time.sleep(1.0)
+                continue
+            break
+
+        if reply[1] != 0:
+            print(f"✗ Restore failed: {errno.errorcode.get(reply[1], reply[1])}")
+            return False
+
+        print("✓ Image restored to slot1; the device will reboot to apply it.")
+        return True
+
+    def tune_params(self) -> Optional[dict]:
+        """
+        Read the transfer parameters the device tuned for itself
+
+        Returns:
+            Dict with window, flush_bytes, gap_us, arrival_us,
+            erase_us_per_kb and program_us_per_kb (0 where not measured
+            yet), or None if the device did not answer
+        """
+        self.send_command(bytes([TUNE_CMD_PARAMS]))
+        reply = self.recv_reply(TUNE_CMD_PARAMS, 1.0)
+        if reply is None:
+            return None
+
+        params = {
+            'window': reply[1],
+            'flush_bytes': reply[2] | (reply[3] << 8),
+            'gap_us': reply[4] | (reply[5] << 8),
+            'arrival_us': reply[6] | (reply[7] << 8),
+        }
+
+        self.send_command(bytes([TUNE_CMD_RATES]))
+        reply = self.recv_reply(TUNE_CMD_RATES, 1.0)
+        if reply is None:
+            return None
+
+        params['erase_us_per_kb'] = int.from_bytes(reply[1:4], 'little')
+        params['program_us_per_kb'] = int.from_bytes(reply[4:7], 'little')
+        return params
+
+    def tune_calibrate(self) -> bool:
+        """
+        Have the device measure its slot1 erase and program rates
+
+        The device erases the last page of slot1 twice, which takes up to
+        a few seconds, and keeps the result across reboots.
+
+        Returns:
+            True if successful, False otherwise
+        """
+        print(f"→ Calibrating flash rates on 0x{self.dst_addr:02X}...")
+        self.send_command(bytes([TUNE_CMD_CALIBRATE]))
+        reply = self.recv_reply(TUNE_CMD_CALIBRATE, 30.0)
+        if reply is None:
+            print("✗ No reply to the calibration request")
             return False
 
+        if reply[1] != 0:
+            print(f"✗ Calibration failed: {errno.errorcode.get(reply[1], reply[1])}")
+            return False
+
+        print("✓ Calibration complete")
+        return True
+
+    def tuned_delay(self, packet_delay: float) -> float:
+        """
+        Packet delay from the gap the device advertises
+
+        Args:
+            packet_delay: Delay used if the device has no tuned gap
+
+        Returns:
+            Delay between packets in seconds
+        """
+        params = self.tune_params()
+        if params is None:
+            print("  Device did not advertise tuned parameters, keeping -D")
+            return packet_delay
+
+        print(f"  Device tuning: window {params['window']}, "
+              f"flush {params['flush_bytes']} bytes, gap {params['gap_us']} us, "
+              f"arrival {params['arrival_us']} us")
+        if params['gap_us'] == 0:
+            return packet_delay
+
+        return params['gap_us'] / 1e6
+
+
+def response_filters(src_addr: int) -> list:
+    """
+    Kernel receive filters for what the device sends to the host
+
+    TP.CM/ETP.CM and single-frame replies addressed to src_addr pass;
+    all other bus traffic is dropped in the kernel instead of waking
+    Python for every frame.
+
+    Args:
+        src_addr: Host address
+
+    Returns:
+        python-can filter list
+    """
+    return [{'can_id': ((pgn >> 8) << 16) | (src_addr << 8),
+             'can_mask': 0x03FFFF00, 'extended': True}
+            for pgn in (J1939_PGN_TP_CM, J1939_PGN_ETP_CM, J1939_PGN_FIRMWARE_UPDATE)]
+
+
+def build_module_image(elf: bytes, name: str, version: int = 0) -> bytes:
+    """
+    Put the module header in front of an LLEXT ELF
+
+    Args:
+        elf: Module ELF
+        name: Module name the application calls it by
+        version: Product version stored in the header
+
+    Returns:
+        Image to send on J1939_PGN_MODULE_UPDATE
+    """
+    encoded = name.encode()
+    if not encoded or len(encoded) >= MODULE_NAME_LEN:
+        raise ValueError(f"Module name must be 1-{MODULE_NAME_LEN - 1} bytes")
+
+    header = MODULE_HEADER.pack(MODULE_MAGIC, encoded, version, len(elf),
+                                zlib.crc32(elf), 0xFFFFFFFF, b'\xff' * 20)
+    return header + elf
+
+
+def can_interface_bitrate(interface: str) -> Optional[int]:
+    """
+    Bitrate of a CAN interface that is up
+
+    Args:
+        interface: Interface name (e.g., 'can0')
+
+    Returns:
+        Bitrate in bps, 0 for an interface without bit timing (vcan),
+        None if the interface is down or missing
+    """
+    import json
+    import subprocess
+
+    try:
+        out = subprocess.run(['ip', '-details', '-json', 'link', 'show', interface],
+                             capture_output=True, text=True, check=True).stdout
+        link = json.loads(out)[0]
+    except (OSError, subprocess.CalledProcessError, ValueError, IndexError):
+        return None
+
+    if 'UP' not in link.get('flags', []):
+        return None
+    info = link.get('linkinfo', {}).get('info_data', {})
+    return info.get('bittiming', {}).get('bitrate', 0)
+
 
 def setup_can_interface(interface: str, bitrate: int = 250000):
     """
     Setup CAN interface on Raspberry Pi
 
+    An interface that is already up at this bitrate is left alone, so
+    other traffic on it is not interrupted.
+
     Args:
         interface: Interface name (e.g., 'can0')
         bitrate: Bitrate in bps
     """
     import subprocess
 
+    current = can_interface_bitrate(interface)
+    if current == bitrate or current == 0:
+        print(f"✓ {interface} already up" + (f" at {bitrate} bps" if current else ""))
+        return True
+
     print(f"Setting up {interface}...")
 
     try:
@@ -338,6 +861,20 @@ Examples:
   # Use custom bitrate and packet delay
   sudo python3 j1939_firmware_sender.py -i can0 -f firmware.bin -d 0x80 -b 500000 -D 0.01
 
+  # Replace the "product" loadable module without a reboot
+  sudo python3 j1939_firmware_sender.py -i can0 -f product_logic.llext --module product --module-version 2
+
+  # Roll back to a cached image without sending it again
+  sudo python3 j1939_firmware_sender.py -i can0 --cache-list
+  sudo python3 j1939_firmware_sender.py -i can0 --restore 1.2.0
+
+  # Calibrate the device once, then pace packets by its advertised gap
+  sudo python3 j1939_firmware_sender.py -i can0 --calibrate
+  sudo python3 j1939_firmware_sender.py -i can0 -f firmware.bin -d 0x80 --tuned
+
+  # Measure the bus for 10 s first and slow down if it is busy
+  sudo python3 j1939_firmware_sender.py -i can0 -f firmware.bin -d 0x80 --auto-rate 10
+
   # Just setup the CAN interface without sending
   sudo python3 j1939_firmware_sender.py -i can0 --setup-only
         """)
@@ -360,6 +897,24 @@ Examples:
                        help='Only setup CAN interface, do not send firmware')
     parser.add_argument('--no-setup', action='store_true',
                        help='Skip CAN interface setup (assume already configured)')
+    parser.add_argument('--no-native', action='store_true',
+                       help='Use the pure-Python frame loop even if j1939_pump is built')
+    parser.add_argument('--module', metavar='NAME',
+                       help='Send -f as a loadable module (LLEXT ELF) with this name')
+    parser.add_argument('--module-version', type=lambda x: int(x, 0), default=0,
+                       help='Version stored in the module header (default: 0)')
+    parser.add_argument('--auto-rate', type=float, default=0.0, metavar='SECONDS',
+                       help='Measure the bus load first and pace packets by it; -D is the lower bound')
+    parser.add_argument('--max-load', type=float, default=DEFAULT_MAX_LOAD,
+                       help=f'Bus load ceiling for --auto-rate (default: {DEFAULT_MAX_LOAD})')
+    parser.add_argument('--cache-list', action='store_true',
+                       help='List the images cached on the device')
+    parser.add_argument('--restore', metavar='KEY',
+                       help='Restore a cached image: MAJOR.MINOR.REVISION, #INDEX or hash prefix')
+    parser.add_argument('--calibrate', action='store_true',
+                       help='Have the device measure its flash rates and print its tuned parameters')
+    parser.add_argument('--tuned', action='store_true',
+                       help='Pace packets by the gap the device advertises instead of -D')
 
     args = parser.parse_args()
 
@@ -373,8 +928,9 @@ Examples:
         return 0
 
     # Validate firmware file
-    if not args.firmware:
-        parser.error("Firmware file (-f/--firmware) is required unless --setup-only is used")
+    cache_only = args.cache_list or args.restore
+    if not args.firmware and not cache_only and not args.calibrate:
+        parser.error("Firmware file (-f/--firmware) is required unless --setup-only, --cache-list, --restore or --calibrate is used")
 
     # Create sender and send firmware
     sender = J1939FirmwareSender(
@@ -382,12 +938,41 @@ Examples:
         src_addr=args.src_addr,
         dst_addr=args.dest_addr,
         priority=args.priority,
-        bitrate=args.bitrate
+        bitrate=args.bitrate,
+        native=not args.no_native
     )
 
     try:
         sender.connect()
-        success = sender.send_firmware(args.firmware, packet_delay=args.delay)
+        delay = args.delay
+        if args.calibrate:
+            if not sender.tune_calibrate():
+                return 1
+            if not args.tuned:
+                params = sender.tune_params()
+                for key, value in (params or {}).items():
+                    print(f"  {key}: {value}")
+            if not args.firmware and not cache_only:
+                return 0
+        if args.tuned and not cache_only:
+            delay = sender.tuned_delay(args.delay)
+        if args.auto_rate > 0 and not cache_only:
+            sender.measure_load(args.auto_rate, args.max_load)
+        if cache_only:
+            success = True
+            if args.cache_list:
+                entries = sender.cache_list()
+                success = entries is not None
+                for index, (major, minor, revision, prefix) in enumerate(entries or []):
+                    print(f"  #{index}  {major}.{minor}.{revision}  {prefix.hex()}")
+            if success and args.restore:
+                success = sender.cache_restore(args.restore)
+        elif args.module:
+            success = sender.send_module(args.firmware, args.module,
+                                         version=args.module_version,
+                                         packet_delay=delay)
+        else:
+            success = sender.send_firmware(args.firmware, packet_delay=delay)
         return 0 if success else 1
 
     except KeyboardInterrupt:
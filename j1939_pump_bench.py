@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+Frame Pump Benchmark
+Sends the same image over vcan with the pure-Python frame loop of
+j1939_firmware_sender.py and with the native j1939_pump extension, and
+compares frame rates.
+
+A simulated device in a thread answers RTS with CTS windows and
+acknowledges the message, so no target is needed. It runs in Python,
+concurrently with the sender: the native pump releases the GIL while it
+sends, the Python loop does not.
+
+Requirements:
+    pip3 install python-can
+    python3 setup.py build_ext --inplace   # for the native pump
+
+Usage:
+    sudo ip link add dev vcan0 type vcan && sudo ip link set vcan0 up
+    python3 j1939_pump_bench.py -i vcan0 --size 200000
+"""
+
+import argparse
+import os
+import socket
+import struct
+import threading
+import time
+
+from j1939_firmware_sender import (
+    J1939FirmwareSender, j1939_pump, DEFAULT_SRC_ADDR, DEFAULT_DST_ADDR,
+    J1939_TP_CM_RTS, J1939_TP_CM_CTS, J1939_TP_CM_EOM,
+    J1939_ETP_CM_RTS, J1939_ETP_CM_CTS, J1939_ETP_CM_DPO, J1939_ETP_CM_EOMA,
+    J1939_PGN_TP_CM, J1939_PGN_TP_DT, J1939_PGN_ETP_CM, J1939_PGN_ETP_DT,
+    J1939_PGN_FIRMWARE_UPDATE, J1939_BYTES_PER_PACKET
+)
+
+CAN_FRAME = struct.Struct('=IB3x8s')
+CAN_EFF_FLAG = 0x80000000
+
+# Re-send the CTS if the window stalls (frames lost in the socket queue)
+DEVICE_RESYNC_TIME = 0.2
+
+
+class SimulatedDevice(threading.Thread):
+    """Minimal TP/ETP receiver that checks the received image"""
+
+    def __init__(self, interface: str, window: int, src: int, dst: int):
+        super().__init__(daemon=True)
+        self.window = window
+        self.src = src        # Host
+        self.dst = dst        # Device
+        self.image = None
+        self.stop = threading.Event()
+
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+        filters = b''
+        for pgn in (J1939_PGN_TP_CM, J1939_PGN_TP_DT, J1939_PGN_ETP_CM, J1939_PGN_ETP_DT):
+            can_id = CAN_EFF_FLAG | ((pgn >> 8) << 16) | (dst << 8) | src
+            filters += struct.pack('=II', can_id, CAN_EFF_FLAG | 0x03FFFFFF)
+        self.sock.setsockopt(socket.SOL_CAN_RAW, socket.CAN_RAW_FILTER, filters)
+        self.sock.settimeout(DEVICE_RESYNC_TIME)
+        self.sock.bind((interface,))
+
+    def send_cm(self, extended: bool, data: list):
+        pgn = J1939_PGN_ETP_CM if extended else J1939_PGN_TP_CM
+        can_id = CAN_EFF_FLAG | (6 << 26) | ((pgn >> 8) << 16) | (self.src << 8) | self.dst
+        payload = bytes(data) + bytes([J1939_PGN_FIRMWARE_UPDATE & 0xFF,
+                                       (J1939_PGN_FIRMWARE_UPDATE >> 8) & 0xFF,
+                                       (J1939_PGN_FIRMWARE_UPDATE >> 16) & 0xFF])
+        self.sock.send(CAN_FRAME.pack(can_id, 8, payload))
+
+    def run(self):
+        extended = False
+        packets = 0
+        size = 0
+        next_pkt = 1
+        window_end = 0
+        dpo = 0
+        received = bytearray()
+
+        def cts():
+            nonlocal window_end
+            count = min(self.window, packets - next_pkt + 1)
+            if extended:
+                self.send_cm(True, [J1939_ETP_CM_CTS, count, next_pkt & 0xFF,
+                                    (next_pkt >> 8) & 0xFF, (next_pkt >> 16) & 0xFF])
+            else:
+                self.send_cm(False, [J1939_TP_CM_CTS, count, next_pkt, 0xFF, 0xFF])
+            window_end = next_pkt + count - 1
+
+        while not self.stop.is_set():
+            try:
+                can_id, _, data = CAN_FRAME.unpack(self.sock.recv(CAN_FRAME.size))
+            except socket.timeout:
+                if packets and next_pkt <= packets:
+                    cts()
+                continue
+
+            pf = (can_id >> 16) & 0xFF
+            if pf in (J1939_PGN_TP_CM >> 8, J1939_PGN_ETP_CM >> 8):
+                if data[0] in (J1939_TP_CM_RTS, J1939_ETP_CM_RTS):
+                    extended = data[0] == J1939_ETP_CM_RTS
+                    size = struct.unpack_from('<I' if extended else '<H', data, 1)[0]
+                    packets = (size + J1939_BYTES_PER_PACKET - 1) // J1939_BYTES_PER_PACKET
+                    next_pkt = 1
+                    received = bytearray(size)
+                    cts()
+                elif data[0] == J1939_ETP_CM_DPO:
+                    dpo = data[2] | (data[3] << 8) | (data[4] << 16)
+                continue
+
+            packet = dpo + data[0] if extended else data[0]
+            if packet != next_pkt:
+                if packet > next_pkt and packet == window_end:
+                    cts()
+                continue
+
+            offset = (packet - 1) * J1939_BYTES_PER_PACKET
+            chunk = min(J1939_BYTES_PER_PACKET, size - offset)
+            received[offset:offset + chunk] = data[1:1 + chunk]
+            next_pkt += 1
+
+            if next_pkt > packets:
+                self.image = bytes(received)
+                if extended:
+                    self.send_cm(True, [J1939_ETP_CM_EOMA] + list(struct.pack('<I', size)))
+                else:
+                    self.send_cm(False, [J1939_TP_CM_EOM, size & 0xFF, size >> 8, packets, 0xFF])
+                packets = 0
+            elif packet == window_end:
+                cts()
+
+        self.sock.close()
+
+
+def run_round(args, image: bytes, native: bool):
+    """Send the image once; returns (seconds, ok)"""
+    device = SimulatedDevice(args.interface, args.window, DEFAULT_SRC_ADDR, DEFAULT_DST_ADDR)
+    device.start()
+
+    sender = J1939FirmwareSender(interface=args.interface, verbose=False, native=native)
+    sender.connect()
+    try:
+        start = time.perf_counter()
+        ok = sender.transfer(image, packet_delay=args.delay, cts_timeout=2.0)
+        elapsed = time.perf_counter() - start
+    finally:
+        sender.disconnect()
+        device.stop.set()
+        device.join()
+
+    return elapsed, ok and device.image == image
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compare the Python and native J1939 frame pumps on vcan')
+    parser.add_argument('-i', '--interface', default='vcan0',
+                        help='Virtual CAN interface (default: vcan0)')
+    parser.add_argument('--size', type=int, default=200000,
+                        help='Image size in bytes (default: 200000, ETP)')
+    parser.add_argument('--window', type=int, default=255,
+                        help='Packets per CTS of the simulated device (default: 255)')
+    parser.add_argument('--rounds', type=int, default=3,
+                        help='Rounds per pump, best one counts (default: 3)')
+    parser.add_argument('-D', '--delay', type=float, default=0.0,
+                        help='Delay between packets in seconds (default: 0)')
+    args = parser.parse_args()
+
+    image = os.urandom(args.size)
+    packets = (args.size + J1939_BYTES_PER_PACKET - 1) // J1939_BYTES_PER_PACKET
+    pumps = [('python', False)]
+    if j1939_pump is not None:
+        pumps.append(('native', True))
+    else:
+        print("j1939_pump not built, benchmarking the Python loop only")
+
+    print(f"{args.size} bytes, {packets} packets, window {args.window} on {args.interface}\n")
+    print(f"{'pump':<8} {'best s':>8} {'frames/s':>10} {'KB/s':>8}")
+
+    for name, native in pumps:
+        best = None
+        for _ in range(args.rounds):
+            elapsed, ok = run_round(args, image, native)
+            if not ok:
+                print(f"{name:<8} ✗ transfer failed")
+                best = None
+                break
+            best = elapsed if best is None else min(best, elapsed)
+
+        if best is not None:
+            print(f"{name:<8} {best:>8.3f} {packets / best:>10.0f} "
+                  f"{args.size / best / 1024:>8.1f}")
+
+    return 0
+
+
+if __name__ == '__main__':
+    exit(main())
@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+"""
+Legacy Protocol Sender with Acknowledgments
+Sends an image with the legacy update protocol (standard IDs) to one
+device and lets its replies pace the transfer instead of fixed delays:
+
+  - START asks for an ACK every --window DATA frames; the first ACK
+    arrives once slot1 is erased
+  - DATA frames stream while the frames in flight fit in the receive
+    queue headroom the last ACK reported
+  - a NACK rewinds to the first missing sequence; silence is resolved
+    with a STATUS request
+
+Only for a single device per bus: replies from several devices on the
+same ID would collide. fleet_rollout.py keeps broadcasting without
+acknowledgments.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    sudo python3 legacy_sender.py -i can0 -f firmware.bin
+"""
+
+import argparse
+import errno
+import struct
+import time
+import zlib
+import can
+from pathlib import Path
+from typing import Optional
+
+from j1939_firmware_sender import setup_can_interface
+
+DEFAULT_LEGACY_ID = 0x100   # CONFIG_CAN_UPDATE_FILTER_ID
+DEFAULT_REPLY_ID = 0x101    # CONFIG_CAN_UPDATE_REPLY_ID
+
+CAN_UPDATE_START = 0x01
+CAN_UPDATE_DATA = 0x02
+CAN_UPDATE_END = 0x03
+CAN_UPDATE_ABORT = 0x04
+CAN_UPDATE_STATUS = 0x05
+CAN_UPDATE_ACK = 0x06
+CAN_UPDATE_NACK = 0x07
+
+STATUS_NAMES = {0: 'idle', 1: 'in progress', 2: 'success', 3: 'error'}
+
+LEGACY_DATA_PAYLOAD = 5     # DATA frames: type, 16-bit sequence, 5 bytes
+DEFAULT_WINDOW = 16
+ERASE_TIMEOUT = 60.0        # START to first ACK: the whole slot1 is erased
+REPLY_TIMEOUT = 1.0
+MAX_STALLS = 5
+
+
+class LegacySender:
+    """Legacy protocol sender driven by ACK/NACK/STATUS"""
+
+    def __init__(self, bus: can.Bus, legacy_id: int = DEFAULT_LEGACY_ID,
+                 reply_id: int = DEFAULT_REPLY_ID, window: int = DEFAULT_WINDOW,
+                 verbose: bool = True):
+        self.bus = bus
+        self.legacy_id = legacy_id
+        self.reply_id = reply_id
+        self.window = window
+        self.verbose = verbose
+        self.bus.set_filters([{'can_id': reply_id, 'can_mask': 0x7FF, 'extended': False}])
+
+    def log(self, text: str):
+        if self.verbose:
+            print(text)
+
+    def send(self, data: bytes):
+        self.bus.send(can.Message(arbitration_id=self.legacy_id,
+                                  is_extended_id=False, data=data))
+
+    def recv_reply(self, timeout: float) -> Optional[dict]:
+        """
+        Wait for an ACK, NACK or STATUS reply
+
+        Returns:
+            Dict with type, next_sequence and, depending on the type,
+            committed, headroom, status or error; None on timeout
+        """
+        deadline = time.time() + timeout
+
+        while True:
+            remaining = deadline - time.time()
+            if remaining < 0:
+                return None
+
+            msg = self.bus.recv(timeout=remaining)
+            if not msg or msg.is_extended_id or msg.arbitration_id != self.reply_id or \
+               len(msg.data) < 8:
+                continue
+
+            data = bytes(msg.data)
+            kind = data[0]
+            if kind == CAN_UPDATE_NACK:
+                return {'type': kind, 'next_sequence': data[1] | (data[2] << 8),
+                        'error': data[3]}
+            if kind == CAN_UPDATE_STATUS:
+                reply = {'type': kind, 'status': data[1]}
+                data = data[1:]
+            elif kind == CAN_UPDATE_ACK:
+                reply = {'type': kind}
+            else:
+                continue
+
+            reply['next_sequence'] = data[1] | (data[2] << 8)
+            reply['committed'] = int.from_bytes(data[3:6], 'little')
+            reply['headroom'] = data[6]
+            return reply
+
+    def status(self) -> Optional[dict]:
+        self.send(bytes([CAN_UPDATE_STATUS]))
+        while True:
+            reply = self.recv_reply(REPLY_TIMEOUT)
+            if reply is None or reply['type'] == CAN_UPDATE_STATUS:
+                return reply
+
+    @staticmethod
+    def unwrap(base: int, sequence: int) -> int:
+        """Absolute frame index of a 16-bit sequence near base"""
+        delta = (sequence - base) & 0xFFFF
+        if delta >= 0x8000:
+            delta -= 0x10000
+        return base + delta
+
+    def transfer(self, image: bytes) -> bool:
+        """
+        Send an image and wait for the device to accept it
+
+        Returns:
+            True if the device reports success, False otherwise
+        """
+        frames = (len(image) + LEGACY_DATA_PAYLOAD - 1) // LEGACY_DATA_PAYLOAD
+
+        print(f"→ Sending START ({len(image)} bytes, ACK every {self.window} frames)...")
+        self.send(bytes([CAN_UPDATE_START]) + struct.pack('<IB', len(image), self.window))
+
+        reply = self.recv_reply(ERASE_TIMEOUT)
+        if reply is None or reply['type'] != CAN_UPDATE_ACK:
+            if reply and reply['type'] == CAN_UPDATE_NACK:
+                print(f"✗ START refused: {errno.errorcode.get(reply['error'], reply['error'])}")
+            else:
+                print("✗ No ACK to START")
+            return False
+
+        acked = 0
+        credit = max(reply['headroom'], self.window)
+        nxt = 0
+        stalls = 0
+        rewinds = 0
+        start = time.time()
+
+        while acked < frames:
+            # Keep no more frames in flight than the device can queue, but
+            # at least one ACK window
+            while nxt < frames and nxt - acked < credit:
+                offset = nxt * LEGACY_DATA_PAYLOAD
+                self.send(bytes([CAN_UPDATE_DATA]) + struct.pack('<H', nxt & 0xFFFF) +
+                          image[offset:offset + LEGACY_DATA_PAYLOAD])
+                nxt += 1
+
+            reply = self.recv_reply(REPLY_TIMEOUT)
+            if reply is None:
+                # Lost frames or a lost ACK: ask where the device is
+                stalls += 1
+                if stalls > MAX_STALLS:
+                    print("✗ Device stopped answering")
+                    return False
+                reply = self.status()
+                if reply is None:
+                    continue
+                if reply['status'] != 1:
+                    print(f"✗ Device status: {STATUS_NAMES.get(reply['status'])}")
+                    return False
+
+            stalls = 0
+            position = self.unwrap(acked, reply['next_sequence'])
+
+            if reply['type'] == CAN_UPDATE_NACK:
+                if reply['error'] != errno.EILSEQ:
+                    print(f"✗ Device failed: {errno.errorcode.get(reply['error'], reply['error'])}")
+                    return False
+                rewinds += 1
+                self.log(f"  NACK: resending from frame {position}")
+                nxt = position
+            elif reply['type'] == CAN_UPDATE_STATUS and position < nxt:
+                rewinds += 1
+                self.log(f"  Resending from frame {position}")
+                nxt = position
+            else:
+                credit = max(reply['headroom'], self.window)
+
+            if position // 1024 != acked // 1024:
+                self.log(f"  Progress: {position * LEGACY_DATA_PAYLOAD}/{len(image)} bytes, "
+                         f"{reply.get('committed', 0)} committed")
+            acked = max(acked, position)
+
+        elapsed = time.time() - start
+        print(f"  {frames} frames in {elapsed:.1f} s, {rewinds} rewinds")
+
+        self.send(bytes([CAN_UPDATE_END]) + struct.pack('<I', zlib.crc32(image) & 0xFFFFFFFF))
+        while True:
+            reply = self.recv_reply(10.0)
+            if reply is None:
+                print("✗ No STATUS after END")
+                return False
+            if reply['type'] == CAN_UPDATE_STATUS:
+                break
+
+        if reply['status'] != 2:
+            print(f"✗ Update failed: {STATUS_NAMES.get(reply['status'])}")
+            return False
+
+        print("✓ Image accepted; the device will reboot to apply it.")
+        return True
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Send firmware with the legacy protocol, paced by device ACKs')
+    parser.add_argument('-i', '--interface', default='can0',
+                       help='CAN interface name (default: can0)')
+    parser.add_argument('-f', '--firmware', type=Path, required=True,
+                       help='Firmware binary file to send')
+    parser.add_argument('-b', '--bitrate', type=int, default=250000,
+                       help='CAN bitrate in bps (default: 250000)')
+    parser.add_argument('-w', '--window', type=int, default=DEFAULT_WINDOW,
+                       help=f'DATA frames per ACK, 1-255 (default: {DEFAULT_WINDOW})')
+    parser.add_argument('--legacy-id', type=lambda x: int(x, 0), default=DEFAULT_LEGACY_ID,
+                       help=f'ID of the update frames (default: 0x{DEFAULT_LEGACY_ID:03X})')
+    parser.add_argument('--reply-id', type=lambda x: int(x, 0), default=DEFAULT_REPLY_ID,
+                       help=f'ID of the device replies (default: 0x{DEFAULT_REPLY_ID:03X})')
+    parser.add_argument('--no-setup', action='store_true',
+                       help='Skip CAN interface setup (assume already configured)')
+
+    args = parser.parse_args()
+
+    if not 1 <= args.window <= 255:
+        parser.error("--window must be 1-255")
+
+    if not args.no_setup and not setup_can_interface(args.interface, args.bitrate):
+        return 1
+
+    image = args.firmware.read_bytes()
+
+    with can.Bus(interface='socketcan', channel=args.interface,
+                 receive_own_messages=False) as bus:
+        sender = LegacySender(bus, args.legacy_id, args.reply_id, args.window)
+        try:
+            return 0 if sender.transfer(image) else 1
+        except KeyboardInterrupt:
+            sender.send(bytes([CAN_UPDATE_ABORT]))
+            print("\n\n✗ Interrupted by user")
+            return 1
+
+
+if __name__ == '__main__':
+    exit(main())
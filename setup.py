@@ -0,0 +1,19 @@
+#!/usr/bin/env python3
+"""
+Build the optional native frame pump used by j1939_firmware_sender.py
+
+Usage (Linux, needs python3-dev):
+    python3 setup.py build_ext --inplace
+
+Without the module the sender runs its pure-Python loop.
+"""
+
+from setuptools import setup, Extension
+
+setup(
+    name='j1939_pump',
+    version='1.0',
+    description='Native J1939 TP/ETP frame pump',
+    ext_modules=[Extension('j1939_pump', sources=['j1939_pump.c'],
+                           extra_compile_args=['-O2'])],
+)
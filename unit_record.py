@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+"""
+Unit Personalization Records
+Reads and sets the record that carries a unit's serial number, NAME
+identity number and calibration offsets behind its MCUboot image
+(CONFIG_CAN_UPDATE_UNIT_RECORD), so all units run one signed image and a
+fleet is updated with a single broadcast:
+
+  - show: read the record the device will write with its next image
+  - set:  stage a new record on the device; it is appended to the next
+          image written to slot1 (a transfer or a cache restore) and
+          takes effect when that image boots
+  - append: write a personalized copy of a signed image for the first
+          programming of slot0 with a debugger
+
+A staged record lives in the device's RAM until the next reboot, so set
+the records first and then broadcast the image in the same power cycle.
+Without a staged record every update carries the running record over.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    sudo python3 unit_record.py show -i can0 -d 0x80
+    sudo python3 unit_record.py set -i can0 -d 0x80 --identity 1042 --serial SN-001042 --cal 12 -3
+    python3 unit_record.py append -f zephyr.signed.bin -o unit.bin --identity 1042 --serial SN-001042
+"""
+
+import argparse
+import errno
+import struct
+import zlib
+from pathlib import Path
+from typing import List, Optional, Tuple
+
+from j1939_firmware_sender import (J1939FirmwareSender, DEFAULT_DST_ADDR, DEFAULT_SRC_ADDR,
+                                   setup_can_interface)
+
+# Record commands (single frames on J1939_PGN_FIRMWARE_UPDATE)
+UNIT_CMD_READ = 0xE0        # [chunk] -> [E0, chunk, 6 record bytes]
+UNIT_CMD_WRITE = 0xE1       # [chunk, 6 record bytes] -> [E1, chunk, errno]
+UNIT_CMD_COMMIT = 0xE2      # -> [E2, errno]
+UNIT_CHUNK = 6
+UNIT_CHUNK_STAGED = 0x80    # READ reply: bytes of the staged record
+UNIT_CHUNK_NONE = 0xFF      # READ reply: no record, errno follows
+
+# Record layout (can_update_unit.h)
+UNIT_MAGIC = 0x54494E55     # "UNIT"
+UNIT_VERSION = 1
+UNIT_SERIAL_LEN = 16
+UNIT_CAL_COUNT = 8
+UNIT_RECORD = struct.Struct(f'<IB3xI{UNIT_SERIAL_LEN}s{UNIT_CAL_COUNT}i')
+UNIT_RECORD_SIZE = UNIT_RECORD.size + 4
+UNIT_ALIGN = 8
+UNIT_IDENTITY_MAX = 0x1FFFFF
+
+# MCUboot image format (bootutil/image.h)
+IMAGE_MAGIC = 0x96F3B83D
+IMAGE_TLV_INFO_MAGIC = 0x6907
+IMAGE_HEADER = struct.Struct('<IIHHI')
+
+REPLY_TIMEOUT = 1.0
+
+
+def build_record(identity: int, serial: str, calibration: List[int]) -> bytes:
+    """
+    Encode a record with its CRC-32
+
+    Args:
+        identity: NAME identity number, 21 bits
+        serial: Serial number, at most 16 ASCII characters
+        calibration: Up to 8 signed 32-bit offsets, the rest are 0
+    """
+    if not 0 <= identity <= UNIT_IDENTITY_MAX:
+        raise ValueError(f"Identity must be 0-{UNIT_IDENTITY_MAX}")
+    raw_serial = serial.encode('ascii')
+    if len(raw_serial) > UNIT_SERIAL_LEN:
+        raise ValueError(f"Serial number longer than {UNIT_SERIAL_LEN} characters")
+    if len(calibration) > UNIT_CAL_COUNT:
+        raise ValueError(f"At most {UNIT_CAL_COUNT} calibration offsets")
+
+    body = UNIT_RECORD.pack(UNIT_MAGIC, UNIT_VERSION, identity, raw_serial,
+                            *(list(calibration) + [0] * (UNIT_CAL_COUNT - len(calibration))))
+    return body + struct.pack('<I', zlib.crc32(body) & 0xFFFFFFFF)
+
+
+def parse_record(data: bytes) -> Optional[dict]:
+    """Decode a record, None if it is not a valid one"""
+    if len(data) < UNIT_RECORD_SIZE:
+        return None
+
+    body = data[:UNIT_RECORD.size]
+    crc, = struct.unpack_from('<I', data, UNIT_RECORD.size)
+    magic, version, identity, serial, *calibration = UNIT_RECORD.unpack(body)
+    if magic != UNIT_MAGIC or version != UNIT_VERSION or crc != zlib.crc32(body) & 0xFFFFFFFF:
+        return None
+
+    return {
+        'identity': identity,
+        'serial': serial.rstrip(b'\x00').decode('ascii', 'replace'),
+        'calibration': calibration,
+    }
+
+
+def record_offset(image: bytes) -> int:
+    """
+    Offset of the record behind a signed MCUboot image: the first 8-byte
+    boundary after the unprotected TLV area
+    """
+    magic, _, hdr_size, protect_tlv_size, img_size = IMAGE_HEADER.unpack_from(image)
+    if magic != IMAGE_MAGIC:
+        raise ValueError("Not an MCUboot image")
+
+    off = hdr_size + img_size + protect_tlv_size
+    info_magic, tlv_tot = struct.unpack_from('<HH', image, off)
+    if info_magic != IMAGE_TLV_INFO_MAGIC:
+        raise ValueError("No TLV area behind the image")
+
+    end = off + tlv_tot
+    if len(image) > end:
+        raise ValueError("Image is padded; sign it without --pad")
+
+    return (end + UNIT_ALIGN - 1) // UNIT_ALIGN * UNIT_ALIGN
+
+
+def read_record(sender: J1939FirmwareSender) -> Tuple[Optional[dict], bool]:
+    """
+    Read the record the device writes with its next image
+
+    Returns:
+        (record, staged): record None if the device has none; staged is
+        True for a record set since the last boot
+    """
+    data = b''
+    staged = False
+
+    for chunk in range((UNIT_RECORD_SIZE + UNIT_CHUNK - 1) // UNIT_CHUNK):
+        sender.send_command(bytes([UNIT_CMD_READ, chunk]))
+        reply = sender.recv_reply(UNIT_CMD_READ, REPLY_TIMEOUT)
+        if reply is None:
+            raise TimeoutError("No reply to the record read")
+        if reply[1] == UNIT_CHUNK_NONE:
+            if reply[2] == errno.ENOENT:
+                return None, False
+            raise OSError(reply[2], f"Record read failed: {errno.errorcode.get(reply[2])}")
+
+        staged = bool(reply[1] & UNIT_CHUNK_STAGED)
+        data += reply[2:8]
+
+    return parse_record(data), staged
+
+
+def write_record(sender: J1939FirmwareSender, record: bytes):
+    """Stage a record on the device, raising OSError if it refuses it"""
+    for chunk in range(0, len(record), UNIT_CHUNK):
+        sender.send_command(bytes([UNIT_CMD_WRITE, chunk // UNIT_CHUNK]) +
+                            record[chunk:chunk + UNIT_CHUNK])
+        reply = sender.recv_reply(UNIT_CMD_WRITE, REPLY_TIMEOUT)
+        if reply is None:
+            raise TimeoutError("No reply to the record write")
+        if reply[2] != 0:
+            raise OSError(reply[2], f"Record write failed: {errno.errorcode.get(reply[2])}")
+
+    sender.send_command(bytes([UNIT_CMD_COMMIT]))
+    reply = sender.recv_reply(UNIT_CMD_COMMIT, REPLY_TIMEOUT)
+    if reply is None:
+        raise TimeoutError("No reply to the record commit")
+    if reply[1] != 0:
+        raise OSError(reply[1], f"Record refused: {errno.errorcode.get(reply[1])}")
+
+
+def print_record(record: Optional[dict], staged: bool = False):
+    if record is None:
+        print("  No personalization record")
+        return
+
+    print(f"  Serial number: {record['serial']}{'  (staged, applies with the next image)' if staged else ''}")
+    print(f"  Identity:      {record['identity']}")
+    print(f"  Calibration:   {' '.join(str(x) for x in record['calibration'])}")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Read and set unit personalization records')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    device = argparse.ArgumentParser(add_help=False)
+    device.add_argument('-i', '--interface', default='can0',
+                        help='CAN interface name (default: can0)')
+    device.add_argument('-d', '--dest-addr', type=lambda x: int(x, 0), default=DEFAULT_DST_ADDR,
+                        help=f'Device address (default: 0x{DEFAULT_DST_ADDR:02X})')
+    device.add_argument('-s', '--src-addr', type=lambda x: int(x, 0), default=DEFAULT_SRC_ADDR,
+                        help=f'Host address (default: 0x{DEFAULT_SRC_ADDR:02X})')
+    device.add_argument('-b', '--bitrate', type=int, default=250000,
+                        help='CAN bitrate in bps (default: 250000)')
+    device.add_argument('--no-setup', action='store_true',
+                        help='Skip CAN interface setup (assume already configured)')
+
+    fields = argparse.ArgumentParser(add_help=False)
+    fields.add_argument('--identity', type=lambda x: int(x, 0), required=True,
+                        help='NAME identity number (21 bits)')
+    fields.add_argument('--serial', required=True,
+                        help=f'Serial number, up to {UNIT_SERIAL_LEN} characters')
+    fields.add_argument('--cal', type=int, nargs='*', default=[], metavar='OFFSET',
+                        help=f'Up to {UNIT_CAL_COUNT} calibration offsets')
+
+    commands.add_parser('show', parents=[device], help='Read the record from a device')
+    commands.add_parser('set', parents=[device, fields], help='Stage a record on a device')
+    append = commands.add_parser('append', parents=[fields],
+                                 help='Write a personalized copy of a signed image')
+    append.add_argument('-f', '--firmware', type=Path, required=True,
+                        help='Signed MCUboot image')
+    append.add_argument('-o', '--output', type=Path, required=True,
+                        help='Image with the record behind it')
+
+    args = parser.parse_args()
+
+    try:
+        record = build_record(args.identity, args.serial, args.cal) \
+            if args.command in ('set', 'append') else b''
+    except ValueError as e:
+        parser.error(str(e))
+
+    if args.command == 'append':
+        image = args.firmware.read_bytes()
+        try:
+            offset = record_offset(image)
+        except ValueError as e:
+            print(f"✗ {e}")
+            return 1
+
+        args.output.write_bytes(image + b'\xff' * (offset - len(image)) + record)
+        print(f"✓ Record at 0x{offset:x}, {args.output} written")
+        return 0
+
+    if not args.no_setup and not setup_can_interface(args.interface, args.bitrate):
+        return 1
+
+    sender = J1939FirmwareSender(interface=args.interface, src_addr=args.src_addr,
+                                 dst_addr=args.dest_addr, bitrate=args.bitrate,
+                                 verbose=False)
+    try:
+        sender.connect()
+        if args.command == 'set':
+            write_record(sender, record)
+            print(f"✓ Record staged on 0x{args.dest_addr:02X}")
+        print_record(*read_record(sender))
+        return 0
+
+    except (OSError, TimeoutError) as e:
+        print(f"✗ {e}")
+        return 1
+
+    finally:
+        sender.disconnect()
+
+
+if __name__ == '__main__':
+    exit(main())
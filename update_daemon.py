@@ -0,0 +1,540 @@
+#!/usr/bin/env python3
+"""
+J1939 Update Daemon
+Owns the CAN interfaces of an update station and runs update jobs that
+local clients submit over a Unix socket:
+
+  - every interface is opened once, with kernel receive filters for the
+    device replies, and stays open between jobs; nothing is brought down
+  - jobs on one interface run in submission order, interfaces run in
+    parallel
+  - clients submit, watch and cancel jobs; queued jobs wait without
+    holding anything on the bus
+
+The protocol is one JSON object per line in each direction.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    sudo python3 update_daemon.py serve -i can0 -i can1:500000
+    python3 update_daemon.py submit -i can0 -f zephyr.signed.bin -d 0x80 --wait
+    python3 update_daemon.py status
+"""
+
+import argparse
+import base64
+import itertools
+import json
+import os
+import queue
+import signal
+import socket
+import socketserver
+import sys
+import threading
+import time
+import can
+from pathlib import Path
+from typing import Dict, Optional
+
+from j1939_firmware_sender import (
+    J1939FirmwareSender, response_filters, build_module_image, setup_can_interface,
+    DEFAULT_SRC_ADDR, DEFAULT_DST_ADDR, DEFAULT_PRIORITY, J1939_PGN_FIRMWARE_UPDATE,
+    J1939_PGN_MODULE_UPDATE
+)
+from bus_load import DEFAULT_MAX_LOAD
+
+DEFAULT_SOCKET = '/tmp/j1939-update.sock'
+DEFAULT_BITRATE = 250000
+DEFAULT_CTS_TIMEOUT = 10.0
+MAX_JOBS_KEPT = 200        # Finished jobs remembered for status queries
+
+STATE_QUEUED = 'queued'
+STATE_RUNNING = 'running'
+STATE_DONE = 'done'
+STATE_FAILED = 'failed'
+STATE_CANCELLED = 'cancelled'
+FINAL_STATES = (STATE_DONE, STATE_FAILED, STATE_CANCELLED)
+
+
+class Job:
+    """One image for one device"""
+
+    def __init__(self, job_id: int, request: dict, image: bytes):
+        self.id = job_id
+        self.interface = request['interface']
+        self.dst_addr = request.get('dst', DEFAULT_DST_ADDR)
+        self.priority = request.get('priority', DEFAULT_PRIORITY)
+        self.packet_delay = request.get('delay', 0.005)
+        self.auto_rate = request.get('auto_rate', 0.0)
+        self.max_load = request.get('max_load', DEFAULT_MAX_LOAD)
+        self.native = request.get('native', True)
+        self.label = request.get('label', '')
+        self.module = request.get('module')
+        self.image = image
+        self.state = STATE_QUEUED
+        self.message = ''
+        self.submitted = time.time()
+        self.started: Optional[float] = None
+        self.finished: Optional[float] = None
+        self.done = threading.Event()
+
+    def note(self, text: str):
+        """Keep the sender's latest progress line"""
+        self.message = text.strip()
+
+    def finish(self, state: str, message: str = ''):
+        self.state = state
+        if message:
+            self.message = message
+        self.finished = time.time()
+        self.image = b''
+        self.done.set()
+
+    def to_dict(self) -> dict:
+        return {
+            'id': self.id,
+            'interface': self.interface,
+            'dst': self.dst_addr,
+            'label': self.label,
+            'module': self.module,
+            'state': self.state,
+            'message': self.message,
+            'submitted': self.submitted,
+            'started': self.started,
+            'finished': self.finished,
+            'seconds': (self.finished - self.started)
+            if self.started and self.finished else None,
+        }
+
+
+class JobSender(J1939FirmwareSender):
+    """Sender that reports progress into its job instead of stdout"""
+
+    def __init__(self, job: Job, **kwargs):
+        super().__init__(verbose=True, **kwargs)
+        self.job = job
+
+    def log(self, text: str):
+        self.job.note(text)
+
+
+class Station:
+    """Open buses, their job queues and worker threads"""
+
+    def __init__(self, interfaces: Dict[str, int], src_addr: int):
+        self.interfaces = interfaces
+        self.src_addr = src_addr
+        self.buses: Dict[str, Optional[can.Bus]] = {name: None for name in interfaces}
+        self.queues = {name: queue.Queue() for name in interfaces}
+        self.jobs: Dict[int, Job] = {}
+        self.lock = threading.Lock()
+        self.ids = itertools.count(1)
+        self.stopping = threading.Event()
+        self.workers = [threading.Thread(target=self.run_worker, args=(name,), daemon=True)
+                        for name in interfaces]
+
+    def start(self):
+        for name in self.interfaces:
+            self.open_bus(name)
+        for worker in self.workers:
+            worker.start()
+
+    def open_bus(self, name: str) -> can.Bus:
+        """Open (or reopen after an error) the bus of an interface"""
+        bus = can.Bus(interface='socketcan', channel=name,
+                      can_filters=response_filters(self.src_addr),
+                      receive_own_messages=False)
+        self.buses[name] = bus
+        print(f"✓ {name} open, receiving device replies to 0x{self.src_addr:02X} only")
+        return bus
+
+    def close_bus(self, name: str):
+        bus = self.buses.get(name)
+        if bus:
+            bus.shutdown()
+        self.buses[name] = None
+
+    # -- Jobs --------------------------------------------------------------
+
+    def submit(self, request: dict) -> Job:
+        interface = request.get('interface')
+        if interface not in self.interfaces:
+            raise ValueError(f"interface {interface!r} is not served "
+                             f"(have: {', '.join(self.interfaces)})")
+
+        image = base64.b64decode(request.get('image', ''))
+        if not image:
+            raise ValueError("empty image")
+        if request.get('module'):
+            image = build_module_image(image, request['module'],
+                                       request.get('module_version', 0))
+
+        with self.lock:
+            if self.stopping.is_set():
+                raise ValueError("daemon is shutting down")
+            job = Job(next(self.ids), request, image)
+            self.jobs[job.id] = job
+            self.prune()
+
+        self.queues[interface].put(job)
+        print(f"→ Job {job.id}: {len(image)} bytes for 0x{job.dst_addr:02X} on {interface}"
+              f"{' (' + job.label + ')' if job.label else ''}")
+        return job
+
+    def prune(self):
+        """Forget the oldest finished jobs beyond MAX_JOBS_KEPT"""
+        finished = [j for j in self.jobs.values() if j.state in FINAL_STATES]
+        for job in finished[:max(0, len(finished) - MAX_JOBS_KEPT)]:
+            del self.jobs[job.id]
+
+    def cancel(self, job_id: int) -> Job:
+        with self.lock:
+            job = self.jobs.get(job_id)
+            if job is None:
+                raise ValueError(f"no job {job_id}")
+            if job.state != STATE_QUEUED:
+                raise ValueError(f"job {job_id} is {job.state}; only queued jobs can be cancelled")
+            job.finish(STATE_CANCELLED, "cancelled by client")
+        print(f"✗ Job {job.id} cancelled")
+        return job
+
+    def get(self, job_id: int) -> Job:
+        with self.lock:
+            job = self.jobs.get(job_id)
+        if job is None:
+            raise ValueError(f"no job {job_id}")
+        return job
+
+    def snapshot(self) -> list:
+        with self.lock:
+            return [job.to_dict() for job in self.jobs.values()]
+
+    def run_worker(self, name: str):
+        jobs = self.queues[name]
+
+        while True:
+            job = jobs.get()
+            if job is None:
+                return
+            with self.lock:
+                if job.state != STATE_QUEUED:
+                    continue
+                job.state = STATE_RUNNING
+                job.started = time.time()
+
+            state, message = self.run_job(name, job)
+            with self.lock:
+                job.finish(state, message)
+
+            mark = '✓' if state == STATE_DONE else '✗'
+            print(f"{mark} Job {job.id}: {state} after {job.finished - job.started:.1f} s"
+                  f"{' - ' + job.message if job.message else ''}")
+
+    def run_job(self, name: str, job: Job):
+        """Send the job's image on the open bus; returns (state, message)"""
+        sender = JobSender(job, interface=name, src_addr=self.src_addr,
+                           dst_addr=job.dst_addr, priority=job.priority,
+                           bitrate=self.interfaces[name] or DEFAULT_BITRATE,
+                           native=job.native,
+                           pgn=J1939_PGN_MODULE_UPDATE if job.module else J1939_PGN_FIRMWARE_UPDATE)
+        try:
+            bus = self.buses[name] or self.open_bus(name)
+            # Late replies to an earlier job must not pass for this one's
+            while bus.recv(timeout=0) is not None:
+                pass
+            sender.attach(bus)
+            if job.auto_rate > 0:
+                sender.measure_load(job.auto_rate, job.max_load)
+            ok = sender.transfer(job.image, job.packet_delay, cts_timeout=DEFAULT_CTS_TIMEOUT)
+            return (STATE_DONE, '') if ok else (STATE_FAILED, '')
+        except (can.CanError, OSError) as e:
+            # Reopen on the next job, e.g. after the interface went down
+            self.close_bus(name)
+            return STATE_FAILED, f"bus error: {e}"
+        finally:
+            sender.disconnect()
+            if job.auto_rate > 0 and self.buses[name]:
+                self.buses[name].set_filters(response_filters(self.src_addr))
+
+    def stop(self):
+        """Cancel queued jobs, let running ones finish, close the buses"""
+        self.stopping.set()
+        with self.lock:
+            for job in self.jobs.values():
+                if job.state == STATE_QUEUED:
+                    job.finish(STATE_CANCELLED, "daemon stopped")
+        for name in self.interfaces:
+            self.queues[name].put(None)
+        for worker in self.workers:
+            worker.join()
+        for name in self.interfaces:
+            self.close_bus(name)
+
+
+class RequestHandler(socketserver.StreamRequestHandler):
+    """One client connection: a JSON request per line, a JSON reply per line"""
+
+    def handle(self):
+        station: Station = self.server.station
+
+        for line in self.rfile:
+            try:
+                request = json.loads(line)
+                reply = self.dispatch(station, request)
+            except (ValueError, KeyError, TypeError) as e:
+                reply = {'ok': False, 'error': str(e)}
+            self.wfile.write((json.dumps(reply) + '\n').encode())
+            self.wfile.flush()
+
+    @staticmethod
+    def dispatch(station: Station, request: dict) -> dict:
+        cmd = request.get('cmd')
+
+        if cmd == 'submit':
+            return {'ok': True, 'job': station.submit(request).to_dict()}
+        if cmd == 'status':
+            if 'job' in request:
+                return {'ok': True, 'job': station.get(int(request['job'])).to_dict()}
+            return {'ok': True, 'jobs': station.snapshot(),
+                    'interfaces': list(station.interfaces)}
+        if cmd == 'wait':
+            job = station.get(int(request['job']))
+            job.done.wait(request.get('timeout'))
+            return {'ok': True, 'job': job.to_dict()}
+        if cmd == 'cancel':
+            return {'ok': True, 'job': station.cancel(int(request['job'])).to_dict()}
+
+        raise ValueError(f"unknown command {cmd!r}")
+
+
+class UnixServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+def parse_interface(text: str, bitrate: int):
+    """NAME or NAME:BITRATE"""
+    name, _, rate = text.partition(':')
+    return name, int(rate) if rate else bitrate
+
+
+def serve(args) -> int:
+    interfaces = dict(parse_interface(i, args.bitrate) for i in args.interface)
+
+    if args.setup:
+        for name, bitrate in interfaces.items():
+            if not setup_can_interface(name, bitrate):
+                return 1
+
+    station = Station(interfaces, args.src_addr)
+    try:
+        station.start()
+    except (OSError, can.CanError) as e:
+        print(f"✗ Failed to open CAN interface: {e}")
+        return 1
+
+    path = Path(args.socket)
+    if path.is_socket():
+        path.unlink()
+
+    server = UnixServer(str(path), RequestHandler)
+    server.station = station
+    os.chmod(path, args.socket_mode)
+    signal.signal(signal.SIGTERM, lambda *_: threading.Thread(target=server.shutdown).start())
+
+    print(f"✓ Serving {', '.join(interfaces)} on {path}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        print("→ Stopping: queued jobs are cancelled, running ones finish")
+        server.server_close()
+        path.unlink(missing_ok=True)
+        station.stop()
+
+    return 0
+
+
+# -- Client ---------------------------------------------------------------
+
+class Client:
+    """Connection to a running daemon"""
+
+    def __init__(self, path: str):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.file = self.sock.makefile('rwb')
+
+    def call(self, request: dict) -> dict:
+        self.file.write((json.dumps(request) + '\n').encode())
+        self.file.flush()
+        line = self.file.readline()
+        if not line:
+            raise ConnectionError("daemon closed the connection")
+        reply = json.loads(line)
+        if not reply.get('ok'):
+            raise RuntimeError(reply.get('error', 'request failed'))
+        return reply
+
+    def close(self):
+        self.file.close()
+        self.sock.close()
+
+
+def print_job(job: dict):
+    seconds = f"{job['seconds']:.1f} s" if job['seconds'] is not None else ''
+    what = f"module {job['module']}" if job['module'] else 'image'
+    print(f"  #{job['id']:<4} {job['state']:<9} {job['interface']:<6} 0x{job['dst']:02X}  "
+          f"{what:<16} {seconds:>8}  {job['label']} {job['message']}")
+
+
+def wait_job(client: Client, job_id: int) -> int:
+    """Show progress until the job is finished; exit code by its outcome"""
+    last = None
+    while True:
+        job = client.call({'cmd': 'wait', 'job': job_id, 'timeout': 1.0})['job']
+        line = f"{job['state']}: {job['message']}"
+        if line != last:
+            print(f"  {line}")
+            last = line
+        if job['state'] in FINAL_STATES:
+            return 0 if job['state'] == STATE_DONE else 1
+
+
+def client_main(args) -> int:
+    try:
+        client = Client(args.socket)
+    except OSError as e:
+        print(f"✗ No daemon on {args.socket}: {e}")
+        return 1
+
+    try:
+        if args.command == 'submit':
+            if not args.firmware.exists():
+                print(f"✗ File not found: {args.firmware}")
+                return 1
+            request = {
+                'cmd': 'submit',
+                'interface': args.interface,
+                'dst': args.dest_addr,
+                'priority': args.priority,
+                'delay': args.delay,
+                'auto_rate': args.auto_rate,
+                'max_load': args.max_load,
+                'native': not args.no_native,
+                'label': args.label or args.firmware.name,
+                'image': base64.b64encode(args.firmware.read_bytes()).decode(),
+            }
+            if args.module:
+                request.update(module=args.module, module_version=args.module_version)
+            job = client.call(request)['job']
+            print(f"✓ Job {job['id']} queued on {job['interface']}")
+            return wait_job(client, job['id']) if args.wait else 0
+
+        if args.command == 'status':
+            if args.job is not None:
+                print_job(client.call({'cmd': 'status', 'job': args.job})['job'])
+                return 0
+            reply = client.call({'cmd': 'status'})
+            print(f"Interfaces: {', '.join(reply['interfaces'])}")
+            for job in reply['jobs']:
+                print_job(job)
+            return 0
+
+        if args.command == 'wait':
+            return wait_job(client, args.job)
+
+        if args.command == 'cancel':
+            client.call({'cmd': 'cancel', 'job': args.job})
+            print(f"✓ Job {args.job} cancelled")
+            return 0
+
+    except (RuntimeError, ConnectionError) as e:
+        print(f"✗ {e}")
+        return 1
+    finally:
+        client.close()
+
+    return 1
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Long-running J1939 update service with a job queue',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  # Serve two buses; can1 runs at 500 kbit/s
+  sudo python3 update_daemon.py serve -i can0 -i can1:500000
+
+  # Queue two devices back to back and follow the second one
+  python3 update_daemon.py submit -i can0 -f app.signed.bin -d 0x80
+  python3 update_daemon.py submit -i can0 -f app.signed.bin -d 0x81 --wait
+
+  # Replace a loadable module
+  python3 update_daemon.py submit -i can0 -f product_logic.llext --module product
+
+  # Show and cancel jobs
+  python3 update_daemon.py status
+  python3 update_daemon.py cancel 3
+        """)
+    parser.add_argument('--socket', default=DEFAULT_SOCKET,
+                        help=f'Unix socket of the daemon (default: {DEFAULT_SOCKET})')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    p = commands.add_parser('serve', help='Run the daemon')
+    p.add_argument('-i', '--interface', action='append', required=True,
+                   help='CAN interface to serve, NAME or NAME:BITRATE (repeatable)')
+    p.add_argument('-b', '--bitrate', type=int, default=DEFAULT_BITRATE,
+                   help=f'Bitrate of interfaces without one (default: {DEFAULT_BITRATE})')
+    p.add_argument('-s', '--src-addr', type=lambda x: int(x, 0), default=DEFAULT_SRC_ADDR,
+                   help=f'Host address for all jobs (default: 0x{DEFAULT_SRC_ADDR:02X})')
+    p.add_argument('--setup', action='store_true',
+                   help='Configure interfaces that are not up at their bitrate, once at start')
+    p.add_argument('--socket-mode', type=lambda x: int(x, 8), default=0o660,
+                   help='Permissions of the socket, octal (default: 660)')
+
+    p = commands.add_parser('submit', help='Queue an update job')
+    p.add_argument('-i', '--interface', default='can0',
+                   help='CAN interface (default: can0)')
+    p.add_argument('-f', '--firmware', type=Path, required=True,
+                   help='Image to send (read by the client)')
+    p.add_argument('-d', '--dest-addr', type=lambda x: int(x, 0), default=DEFAULT_DST_ADDR,
+                   help=f'Destination address (default: 0x{DEFAULT_DST_ADDR:02X})')
+    p.add_argument('-p', '--priority', type=int, default=DEFAULT_PRIORITY,
+                   help=f'J1939 priority 0-7 (default: {DEFAULT_PRIORITY})')
+    p.add_argument('-D', '--delay', type=float, default=0.005,
+                   help='Delay between packets in seconds (default: 0.005)')
+    p.add_argument('--auto-rate', type=float, default=0.0, metavar='SECONDS',
+                   help='Measure the bus load first and pace packets by it')
+    p.add_argument('--max-load', type=float, default=DEFAULT_MAX_LOAD,
+                   help=f'Bus load ceiling for --auto-rate (default: {DEFAULT_MAX_LOAD})')
+    p.add_argument('--no-native', action='store_true',
+                   help='Use the pure-Python frame loop even if j1939_pump is built')
+    p.add_argument('--module', metavar='NAME',
+                   help='Send -f as a loadable module (LLEXT ELF) with this name')
+    p.add_argument('--module-version', type=lambda x: int(x, 0), default=0,
+                   help='Version stored in the module header (default: 0)')
+    p.add_argument('--label', help='Shown in the status list (default: file name)')
+    p.add_argument('--wait', action='store_true',
+                   help='Follow the job until it is finished')
+
+    p = commands.add_parser('status', help='List jobs')
+    p.add_argument('job', type=int, nargs='?', help='Only this job')
+
+    p = commands.add_parser('wait', help='Follow a job until it is finished')
+    p.add_argument('job', type=int)
+
+    p = commands.add_parser('cancel', help='Cancel a queued job')
+    p.add_argument('job', type=int)
+
+    args = parser.parse_args()
+    if args.command == 'serve':
+        return serve(args)
+    return client_main(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,40 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Product Logic Module
+ * Example LLEXT module for CONFIG_CAN_UPDATE_MODULES. Built as
+ * product_logic.llext and installed with
+ *   j1939_firmware_sender.py --module product product_logic.llext
+ * The application calls product_tick() every 100 ms.
+ */
+
+#include <stdint.h>
+#include <zephyr/llext/symbol.h>
+#include <zephyr/sys/printk.h>
+
+#define PRODUCT_LOGIC_VERSION 1
+
+static uint32_t ticks;
+
+int module_start(void)
+{
+	ticks = 0;
+	printk("product_logic v%d started\n", PRODUCT_LOGIC_VERSION);
+	return 0;
+}
+EXPORT_SYMBOL(module_start);
+
+void module_stop(void)
+{
+	printk("product_logic stopped after %u ticks\n", ticks);
+}
+EXPORT_SYMBOL(module_stop);
+
+void product_tick(void)
+{
+	ticks++;
+	if ((ticks % 100) == 0) {
+		printk("product_logic: %u ticks\n", ticks);
+	}
+}
+EXPORT_SYMBOL(product_tick);
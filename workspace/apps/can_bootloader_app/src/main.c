@@ -15,6 +15,35 @@
 
 #include "can_update.h"
 
+#if defined(CONFIG_XCP_SLAVE)
+#include "xcp_slave.h"
+#endif
+
+#if defined(CONFIG_FAST_BOOT_INFO)
+#include "fast_boot.h"
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+#include "can_update_module.h"
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_IMAGE_CACHE)
+#include "can_update_cache.h"
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+#include "can_update_unit.h"
+#endif
+
+#if defined(CONFIG_J1939_REQUEST) && defined(CONFIG_CAN_UPDATE_ADDRESS_CLAIM)
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/storage/flash_map.h>
+#include "j1939_address_claim.h"
+#include "j1939_request.h"
+#define HAS_J1939_REQUEST 1
+#endif
+
 LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
 /* LED0 for status indication */
@@ -30,6 +59,89 @@ static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
 #warning "No CAN bus available on this board"
 #endif
 
+#if HAS_CAN_BUS
+/**
+ * @brief Log the boot-time breakdown up to CAN-ready
+ */
+static void log_boot_timing(void)
+{
+	struct can_update_stats stats;
+
+	can_update_get_stats(&stats);
+
+#if defined(CONFIG_FAST_BOOT_INFO)
+	struct fast_boot_info info;
+	int ret = fast_boot_get_info(&info);
+
+	if (ret == 0) {
+		LOG_INF("Boot timing: MCUboot %u us (%s, %u boots since full check), "
+		        "CAN ready %u us after app start",
+		        info.bootloader_us, info.fast ? "slot0 hash skipped" : "slot0 hashed",
+		        info.boots_since_check, stats.ready_us);
+		return;
+	}
+	LOG_WRN("No fast boot record: %d", ret);
+#endif
+
+	LOG_INF("Boot timing: CAN ready %u us after app start", stats.ready_us);
+}
+#endif /* HAS_CAN_BUS */
+
+#if defined(HAS_J1939_REQUEST)
+/**
+ * @brief Answer identification requests from service tools
+ *
+ * SOFT carries the running image version, ECUID the part name and the
+ * unit's serial number (the NAME identity if the unit has no
+ * personalization record). Both are encoded once here.
+ */
+static void register_identification(const struct device *can_dev)
+{
+	struct mcuboot_img_header header;
+	char text[64];
+	char serial[24];
+	int cf = j1939_address_claim_get_cf();
+	int len;
+	int ret;
+
+	ret = j1939_req_init(can_dev);
+	if (ret) {
+		LOG_WRN("Failed to start the request responder: %d", ret);
+		return;
+	}
+
+	ret = boot_read_bank_header(FIXED_PARTITION_ID(slot0_partition), &header,
+	                            sizeof(header));
+	if (ret == 0) {
+		/* One field, '*'-terminated */
+		len = snprintf(text, sizeof(text), "%c%u.%u.%u+%u*", 1,
+		               header.h.v1.sem_ver.major, header.h.v1.sem_ver.minor,
+		               header.h.v1.sem_ver.revision, header.h.v1.sem_ver.build_num);
+		ret = j1939_req_register(cf, J1939_PGN_SOFTWARE_ID, (const uint8_t *)text, len, len);
+	}
+	if (ret < 0) {
+		LOG_WRN("Failed to register software identification: %d", ret);
+	}
+
+	snprintf(serial, sizeof(serial), "%u", CONFIG_CAN_UPDATE_J1939_IDENTITY);
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+	struct can_update_unit_record unit;
+
+	if (can_update_unit_get(&unit) == 0) {
+		memcpy(serial, unit.serial, sizeof(unit.serial));
+		serial[sizeof(unit.serial)] = '\0';
+	}
+#endif
+
+	/* Part number*serial number*location*type*manufacturer* */
+	len = snprintf(text, sizeof(text), "can_bootloader_app*%s****", serial);
+	ret = j1939_req_register(cf, J1939_PGN_ECU_ID, (const uint8_t *)text, len, len);
+	if (ret < 0) {
+		LOG_WRN("Failed to register ECU identification: %d", ret);
+	}
+}
+#endif /* HAS_J1939_REQUEST */
+
 /* Status LED blink thread */
 #define LED_THREAD_STACK_SIZE 512
 #define LED_THREAD_PRIORITY 5
@@ -83,7 +195,10 @@ int main(void)
 		LOG_INF("Image already confirmed");
 	} else {
 		LOG_INF("Confirming image...");
+		/* The SYS_INIT listener may already be writing slot1 */
+		can_update_flash_lock();
 		ret = boot_write_img_confirmed();
+		can_update_flash_unlock();
 		if (ret) {
 			LOG_ERR("Failed to confirm image: %d", ret);
 		} else {
@@ -103,14 +218,48 @@ int main(void)
 		return -1;
 	}
 
-	/* Initialize CAN update driver */
+	/* Initialize CAN update driver (or attach to the listener that
+	 * CONFIG_CAN_UPDATE_SYS_INIT already started before main)
+	 */
 #if HAS_CAN_BUS
 	ret = can_update_init(CAN_DEV);
 	if (ret) {
 		LOG_ERR("Failed to initialize CAN update: %d", ret);
 		return -1;
 	}
+
+#if defined(CONFIG_XCP_SLAVE)
+	/* Measurement access on the same bus; not fatal if it fails */
+	ret = xcp_slave_init(CAN_DEV);
+	if (ret) {
+		LOG_WRN("Failed to initialize XCP slave: %d", ret);
+	}
+#endif
+
+#if defined(HAS_J1939_REQUEST)
+	register_identification(CAN_DEV);
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+	/* Product logic runs from module slots; none installed is fine */
+	ret = can_update_modules_start();
+	if (ret < 0) {
+		LOG_WRN("Failed to load modules: %d", ret);
+	} else {
+		LOG_INF("%d module(s) running", ret);
+	}
+#endif
+	log_boot_timing();
 	LOG_INF("System initialized, waiting for CAN updates...");
+#if defined(CONFIG_CAN_UPDATE_IMAGE_CACHE)
+	/* Keep the confirmed image for local rollback; only the first boot
+	 * of a new image pays for the compression
+	 */
+	ret = can_update_cache_store_running();
+	if (ret && ret != -EALREADY) {
+		LOG_WRN("Failed to cache running image: %d", ret);
+	}
+#endif
 #else
 	LOG_WRN("CAN bus not available, update functionality disabled");
 	LOG_INF("System initialized");
@@ -130,6 +279,10 @@ int main(void)
 		}
 
 		last_status = status;
+
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+		(void)can_update_module_call("product", "product_tick");
+#endif
 		k_sleep(K_MSEC(100));
 	}
 #else
@@ -0,0 +1,222 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Interrupt-Driven Flash Benchmark
+ * Erases and programs part of slot1 twice while a lower-priority thread
+ * does busy work, and reports how much of the CPU that thread got:
+ *
+ * - busy:  Zephyr flash API, followed by a busy-wait of the emulated
+ *          controller time, which is what the polling driver does on
+ *          hardware
+ * - async: flash_async, which sleeps until the emulated completion
+ *          interrupt
+ *
+ * Both phases take the same time; the difference is the background
+ * work. Each phase reads the data back.
+ *
+ * Build and run on native_sim:
+ *   west build -b native_sim workspace/apps/flash_async_bench
+ *   ./build/zephyr/zephyr.exe
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_async.h"
+
+#define BACKGROUND_STACK_SIZE 1024
+#define BACKGROUND_PRIORITY 5
+
+static uint8_t chunk[CONFIG_BENCH_FLASH_CHUNK];
+
+static volatile uint32_t work_units;
+
+/**
+ * @brief Stands in for application threads below the update thread
+ */
+static void background_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (1) {
+		k_busy_wait(CONFIG_BENCH_WORK_US);
+		work_units++;
+	}
+}
+
+K_THREAD_DEFINE(background_tid, BACKGROUND_STACK_SIZE, background_thread,
+                NULL, NULL, NULL, BACKGROUND_PRIORITY, 0, 0);
+
+static uint8_t pattern(uint32_t offset, uint8_t seed)
+{
+	return (uint8_t)(offset ^ (offset >> 8) ^ seed);
+}
+
+static uint32_t emulated_us(size_t len, uint32_t us_per_kb)
+{
+	return (uint32_t)DIV_ROUND_UP((uint64_t)len * us_per_kb, 1024);
+}
+
+/**
+ * @brief Polling driver: the caller spins for the controller time
+ */
+static int busy_erase(const struct flash_area *fa, off_t offset, size_t len)
+{
+	int ret = flash_area_erase(fa, offset, len);
+
+	k_busy_wait(emulated_us(len, CONFIG_FLASH_ASYNC_SIM_ERASE_US_PER_KB));
+	return ret;
+}
+
+static int busy_write(const struct flash_area *fa, off_t offset, const void *data, size_t len)
+{
+	int ret = flash_area_write(fa, offset, data, len);
+
+	k_busy_wait(emulated_us(len, CONFIG_FLASH_ASYNC_SIM_WRITE_US_PER_KB));
+	return ret;
+}
+
+struct method {
+	const char *name;
+	int (*erase)(const struct flash_area *fa, off_t offset, size_t len);
+	int (*write)(const struct flash_area *fa, off_t offset, const void *data, size_t len);
+};
+
+static const struct method methods[] = {
+	{ "busy", busy_erase, busy_write },
+	{ "async", flash_async_area_erase, flash_async_area_write },
+};
+
+/**
+ * @brief Erase page by page, then program chunk by chunk
+ *
+ * @param size Set to the bytes covered (whole pages)
+ */
+static int erase_and_program(const struct method *m, const struct flash_area *fa, uint8_t seed,
+                             uint32_t *size)
+{
+	const struct device *dev = flash_area_get_device(fa);
+	struct flash_pages_info info;
+	uint32_t off = 0;
+	int ret;
+
+	while (off < CONFIG_BENCH_FLASH_BYTES) {
+		ret = flash_get_page_info_by_offs(dev, fa->fa_off + off, &info);
+		if (ret) {
+			return ret;
+		}
+
+		ret = m->erase(fa, off, info.size);
+		if (ret) {
+			return ret;
+		}
+		off += info.size;
+	}
+	*size = off;
+
+	for (off = 0; off < *size; off += sizeof(chunk)) {
+		size_t len = MIN(sizeof(chunk), *size - off);
+
+		for (size_t i = 0; i < len; i++) {
+			chunk[i] = pattern(off + i, seed);
+		}
+
+		ret = m->write(fa, off, chunk, len);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @return Offset of the first wrong byte, -1 if all match, or negative
+ *         errno (< -1) on read failure
+ */
+static int check(const struct flash_area *fa, uint32_t size, uint8_t seed)
+{
+	for (uint32_t off = 0; off < size; off += sizeof(chunk)) {
+		size_t len = MIN(sizeof(chunk), size - off);
+		int ret = flash_area_read(fa, off, chunk, len);
+
+		if (ret) {
+			return ret < -1 ? ret : -EIO;
+		}
+
+		for (size_t i = 0; i < len; i++) {
+			if (chunk[i] != pattern(off + i, seed)) {
+				return off + i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static void run_phase(const struct method *m, const struct flash_area *fa, uint8_t seed)
+{
+	uint32_t size = 0;
+	uint32_t units;
+	int64_t start;
+	int64_t ms;
+	int ret;
+
+	units = work_units;
+	start = k_uptime_get();
+
+	ret = erase_and_program(m, fa, seed, &size);
+
+	ms = MAX(k_uptime_get() - start, 1);
+	units = work_units - units;
+
+	if (ret) {
+		printk("%-6s failed: %d\n", m->name, ret);
+		return;
+	}
+
+	ret = check(fa, size, seed);
+
+	printk("%-6s %u bytes in %u ms, background %u ms (%u%%), data %s",
+	       m->name, size, (uint32_t)ms, units * CONFIG_BENCH_WORK_US / 1000U,
+	       (uint32_t)(units * CONFIG_BENCH_WORK_US / 10U / ms), ret == -1 ? "ok" : "bad");
+	if (ret >= 0) {
+		printk(" at 0x%x", ret);
+	} else if (ret < -1) {
+		printk(" (read %d)", ret);
+	}
+	printk("\n");
+}
+
+int main(void)
+{
+	const struct flash_area *fa;
+	struct flash_async_stats stats;
+	int ret;
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &fa);
+	if (ret) {
+		printk("Failed to open slot1: %d\n", ret);
+		return ret;
+	}
+
+	printk("Flash benchmark: %d bytes, %d byte writes, erase %d us/KiB, program %d us/KiB\n",
+	       CONFIG_BENCH_FLASH_BYTES, CONFIG_BENCH_FLASH_CHUNK,
+	       CONFIG_FLASH_ASYNC_SIM_ERASE_US_PER_KB, CONFIG_FLASH_ASYNC_SIM_WRITE_US_PER_KB);
+
+	for (size_t i = 0; i < ARRAY_SIZE(methods); i++) {
+		run_phase(&methods[i], fa, (uint8_t)(0x5A + i));
+	}
+
+	flash_async_get_stats(&stats);
+	printk("flash_async: erases=%u writes=%u errors=%u max_busy=%u us\n",
+	       stats.erases, stats.writes, stats.errors, stats.max_busy_us);
+
+	flash_area_close(fa);
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * J1939 Conformance Device
+ * Update listener on vcan0 for j1939_conformance.py, which drives it from
+ * the Linux can-j1939 stack. Every status change is reported on the
+ * console, and completed transfers are checked against the data pattern
+ * the host sends.
+ *
+ * Build and run on native_sim (one build per CTS window):
+ *   west build -b native_sim workspace/apps/j1939_conformance_device \
+ *       -- -DCONFIG_CAN_UPDATE_TP_WINDOW=32
+ *   ./build/zephyr/zephyr.exe
+ *
+ * j1939_conformance.py --build does both for each window it tests.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <stdio.h>
+
+#include "can_update.h"
+#include "j1939_address_claim.h"
+#include "j1939_request.h"
+
+#define CAN_DEV DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus))
+
+/* Size (LE32) and seed (LE32) ahead of the generated bytes */
+#define PATTERN_HEADER_LEN 8
+#define PATTERN_CHUNK 256
+
+static const char *const status_names[] = {
+	[CAN_UPDATE_STATUS_IDLE] = "idle",
+	[CAN_UPDATE_STATUS_IN_PROGRESS] = "in_progress",
+	[CAN_UPDATE_STATUS_SUCCESS] = "success",
+	[CAN_UPDATE_STATUS_ERROR] = "error",
+};
+
+/**
+ * @brief Byte @p i of the host pattern
+ *
+ * Must match pattern_byte() in j1939_conformance.py. The high bits of a
+ * Fibonacci hash change with every byte position, so a packet stored at
+ * the wrong offset does not match by accident.
+ */
+static inline uint8_t pattern_byte(uint32_t i, uint32_t seed)
+{
+	return (uint8_t)(((i * 0x9E3779B1u) >> 24) ^ seed);
+}
+
+#if defined(CONFIG_CONFORMANCE_CHECK_PATTERN)
+/**
+ * @brief Compare slot1 with the pattern the host sent
+ *
+ * @param size Set to the size from the pattern header
+ * @param seed Set to the seed from the pattern header
+ * @return Offset of the first wrong byte (always past the header), 0 if
+ *         all match, -ENOENT without a valid header, negative errno on
+ *         read failure
+ */
+static int check_pattern(uint32_t *size, uint32_t *seed)
+{
+	const struct flash_area *fa;
+	uint8_t buf[PATTERN_CHUNK];
+	int ret;
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = flash_area_read(fa, 0, buf, PATTERN_HEADER_LEN);
+	if (ret) {
+		goto out;
+	}
+
+	*size = sys_get_le32(&buf[0]);
+	*seed = sys_get_le32(&buf[4]);
+	if (*size <= PATTERN_HEADER_LEN || *size > fa->fa_size) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	for (uint32_t off = PATTERN_HEADER_LEN; off < *size; off += sizeof(buf)) {
+		uint32_t len = MIN(sizeof(buf), *size - off);
+
+		ret = flash_area_read(fa, off, buf, len);
+		if (ret) {
+			goto out;
+		}
+
+		for (uint32_t i = 0; i < len; i++) {
+			if (buf[i] != pattern_byte(off + i, *seed)) {
+				ret = off + i;
+				goto out;
+			}
+		}
+	}
+
+out:
+	flash_area_close(fa);
+	return ret;
+}
+#endif /* CONFIG_CONFORMANCE_CHECK_PATTERN */
+
+static void report_success(void)
+{
+#if defined(CONFIG_CONFORMANCE_CHECK_PATTERN)
+	uint32_t size = 0;
+	uint32_t seed = 0;
+	int ret = check_pattern(&size, &seed);
+
+	if (ret == 0) {
+		printk("conformance: status=success size=%u seed=%u pattern=ok\n", size, seed);
+	} else if (ret > 0) {
+		printk("conformance: status=success size=%u seed=%u pattern=bad offset=%d\n",
+		       size, seed, ret);
+	} else {
+		printk("conformance: status=success pattern=none err=%d\n", ret);
+	}
+#else
+	printk("conformance: status=success\n");
+#endif
+}
+
+/**
+ * @brief Register a multi-packet SOFT reply
+ *
+ * Requesting it makes the device the originator of a BAM, the other
+ * direction of the transport protocol.
+ */
+static void register_identification(void)
+{
+	char text[32];
+	int len;
+	int ret;
+
+	ret = j1939_req_init(CAN_DEV);
+	if (ret) {
+		printk("Failed to start the request responder: %d\n", ret);
+		return;
+	}
+
+	len = snprintf(text, sizeof(text), "%cconformance-w%u*", 1, CONFIG_CAN_UPDATE_TP_WINDOW);
+	ret = j1939_req_register(j1939_address_claim_get_cf(), J1939_PGN_SOFTWARE_ID,
+	                         (const uint8_t *)text, len, len);
+	if (ret < 0) {
+		printk("Failed to register software identification: %d\n", ret);
+	}
+}
+
+int main(void)
+{
+	enum can_update_status last = CAN_UPDATE_STATUS_IDLE;
+	struct can_update_stats stats;
+	uint32_t last_frames = 0;
+	int ret;
+
+	ret = can_update_init(CAN_DEV);
+	if (ret) {
+		printk("Failed to initialize CAN update: %d\n", ret);
+		return ret;
+	}
+
+	register_identification();
+
+	printk("conformance: ready window=%u timeout_ms=%u address=0x%02x host=0x%02x slot=%u\n",
+	       CONFIG_CAN_UPDATE_TP_WINDOW, CONFIG_CAN_UPDATE_TIMEOUT_MS,
+	       CONFIG_CAN_UPDATE_J1939_ADDRESS, CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS,
+	       (uint32_t)FIXED_PARTITION_SIZE(slot1_partition));
+
+	while (1) {
+		enum can_update_status status = can_update_get_status();
+
+		can_update_get_stats(&stats);
+
+		/* A short transfer can start and finish between two polls, so
+		 * new frames while in SUCCESS are reported too; the host tells
+		 * its transfers apart by the pattern seed.
+		 */
+		if (status != last ||
+		    (status == CAN_UPDATE_STATUS_SUCCESS && stats.frames_received != last_frames)) {
+			last = status;
+			if (status == CAN_UPDATE_STATUS_SUCCESS) {
+				report_success();
+			} else if (status < ARRAY_SIZE(status_names)) {
+				printk("conformance: status=%s\n", status_names[status]);
+			}
+
+			printk("conformance: frames=%u dropped=%u\n",
+			       stats.frames_received, stats.frames_dropped);
+		}
+		last_frames = stats.frames_received;
+
+		k_msleep(CONFIG_CONFORMANCE_POLL_MS);
+	}
+
+	return 0;
+}
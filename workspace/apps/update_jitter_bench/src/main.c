@@ -0,0 +1,217 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Jitter Benchmark
+ * Runs a periodic control thread beside a full-speed CAN update and
+ * reports the control loop's wake-up jitter percentiles.
+ *
+ * Build and run on native_sim:
+ *   west build -b native_sim workspace/apps/update_jitter_bench
+ *   ./build/zephyr/zephyr.exe
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/sys/printk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_update.h"
+
+#define CAN_DEV DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus))
+
+#define CONTROL_STACK_SIZE 1024
+#define SENDER_STACK_SIZE 1024
+#define SENDER_PRIORITY (CONFIG_BENCH_CONTROL_PRIORITY + 1)
+
+/* Legacy DATA frames carry 5 payload bytes after type and sequence */
+#define LEGACY_DATA_PAYLOAD 5
+
+static uint32_t samples[CONFIG_BENCH_SAMPLES];
+static volatile size_t sample_count;
+static volatile bool recording;
+
+static volatile uint32_t release_cycles;
+static K_SEM_DEFINE(control_sem, 0, 1);
+static K_SEM_DEFINE(phase_done, 0, 1);
+
+static void control_timer_handler(struct k_timer *timer)
+{
+	ARG_UNUSED(timer);
+
+	release_cycles = k_cycle_get_32();
+	k_sem_give(&control_sem);
+}
+
+static K_TIMER_DEFINE(control_timer, control_timer_handler, NULL);
+
+/**
+ * @brief Simulated application control loop
+ *
+ * Records the delay between the timer release and the thread actually
+ * running, then burns its per-period work budget.
+ */
+static void control_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (1) {
+		k_sem_take(&control_sem, K_FOREVER);
+
+		uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - release_cycles);
+
+		if (recording) {
+			samples[sample_count++] = latency_us;
+			if (sample_count == ARRAY_SIZE(samples)) {
+				recording = false;
+				k_sem_give(&phase_done);
+			}
+		}
+
+		k_busy_wait(CONFIG_BENCH_CONTROL_WORK_US);
+	}
+}
+
+K_THREAD_DEFINE(control_tid, CONTROL_STACK_SIZE, control_thread,
+                NULL, NULL, NULL, CONFIG_BENCH_CONTROL_PRIORITY, 0, 0);
+
+static void send_legacy(const uint8_t *data, uint8_t len)
+{
+	struct can_frame frame = {
+		.id = CONFIG_CAN_UPDATE_FILTER_ID,
+		.flags = 0,
+		.dlc = len,
+	};
+
+	memcpy(frame.data, data, len);
+	can_send(CAN_DEV, &frame, K_FOREVER, NULL, NULL);
+}
+
+/**
+ * @brief Simulated update sender
+ *
+ * Streams a legacy-protocol image at CONFIG_BENCH_BUS_FRAMES_PER_MS,
+ * which keeps the device's RX path and flash writer saturated.
+ */
+static void sender_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	uint32_t size = CONFIG_BENCH_IMAGE_SIZE;
+	uint32_t offset = 0;
+	uint16_t sequence = 0;
+	uint8_t buf[CAN_MAX_DLC];
+
+	buf[0] = CAN_UPDATE_START;
+	buf[1] = size & 0xFF;
+	buf[2] = (size >> 8) & 0xFF;
+	buf[3] = (size >> 16) & 0xFF;
+	buf[4] = (size >> 24) & 0xFF;
+	send_legacy(buf, 5);
+
+	/* The START frame erases the slot; wait until the session is open */
+	while (can_update_get_status() != CAN_UPDATE_STATUS_IN_PROGRESS) {
+		k_sleep(K_MSEC(1));
+	}
+
+	while (offset < size) {
+		for (int i = 0; i < CONFIG_BENCH_BUS_FRAMES_PER_MS && offset < size; i++) {
+			uint8_t len = MIN(LEGACY_DATA_PAYLOAD, size - offset);
+
+			buf[0] = CAN_UPDATE_DATA;
+			buf[1] = sequence & 0xFF;
+			buf[2] = (sequence >> 8) & 0xFF;
+			for (uint8_t j = 0; j < len; j++) {
+				buf[3 + j] = (uint8_t)(offset + j);
+			}
+			send_legacy(buf, 3 + len);
+
+			offset += len;
+			sequence++;
+		}
+		k_sleep(K_MSEC(1));
+	}
+
+	buf[0] = CAN_UPDATE_END;
+	memset(&buf[1], 0, 4);
+	send_legacy(buf, 5);
+}
+
+static K_THREAD_STACK_DEFINE(sender_stack, SENDER_STACK_SIZE);
+static struct k_thread sender_data;
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(size_t count, uint32_t permille)
+{
+	size_t idx = (count * permille) / 1000;
+
+	return samples[MIN(idx, count - 1)];
+}
+
+static void run_phase(const char *name)
+{
+	sample_count = 0;
+	recording = true;
+	k_sem_take(&phase_done, K_FOREVER);
+
+	qsort(samples, sample_count, sizeof(samples[0]), compare_u32);
+
+	printk("%-8s n=%u p50=%u p90=%u p99=%u p99.9=%u max=%u us\n",
+	       name, (unsigned int)sample_count,
+	       percentile(sample_count, 500), percentile(sample_count, 900),
+	       percentile(sample_count, 990), percentile(sample_count, 999),
+	       samples[sample_count - 1]);
+}
+
+int main(void)
+{
+	struct can_update_stats stats;
+	int ret;
+
+	printk("CAN update jitter benchmark: period %d us, work %d us, %d frames/ms\n",
+	       CONFIG_BENCH_CONTROL_PERIOD_US, CONFIG_BENCH_CONTROL_WORK_US,
+	       CONFIG_BENCH_BUS_FRAMES_PER_MS);
+
+	ret = can_update_init(CAN_DEV);
+	if (ret) {
+		printk("Failed to initialize CAN update: %d\n", ret);
+		return ret;
+	}
+
+	k_timer_start(&control_timer, K_USEC(CONFIG_BENCH_CONTROL_PERIOD_US),
+	              K_USEC(CONFIG_BENCH_CONTROL_PERIOD_US));
+
+	run_phase("idle");
+
+	k_thread_create(&sender_data, sender_stack, K_THREAD_STACK_SIZEOF(sender_stack),
+	                sender_thread, NULL, NULL, NULL, SENDER_PRIORITY, 0, K_NO_WAIT);
+
+	run_phase("update");
+
+	/* Let the update finish so the statistics cover the whole transfer */
+	k_thread_join(&sender_data, K_FOREVER);
+	while (can_update_get_status() == CAN_UPDATE_STATUS_IN_PROGRESS) {
+		k_sleep(K_MSEC(10));
+	}
+
+	k_timer_stop(&control_timer);
+
+	can_update_get_stats(&stats);
+	printk("update: status=%d frames=%u dropped=%u slices_exhausted=%u max_slice=%u us\n",
+	       can_update_get_status(), stats.frames_received, stats.frames_dropped,
+	       stats.slices_exhausted, stats.max_slice_us);
+
+	return 0;
+}
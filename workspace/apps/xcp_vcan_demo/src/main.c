@@ -0,0 +1,71 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * XCP on vcan Demo
+ * Runs the CAN update listener and the XCP slave on the same CAN device
+ * with a small simulated control loop to measure.
+ *
+ * Build and run on native_sim (32-bit, the XCP address space is 32 bits):
+ *   sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+ *   west build -b native_sim workspace/apps/xcp_vcan_demo
+ *   ./build/zephyr/zephyr.exe
+ *   python3 xcp_master.py --elf build/zephyr/zephyr.elf \
+ *       --event control demo_angle demo_speed demo_iterations
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/sys/printk.h>
+
+#include "can_update.h"
+#include "xcp_slave.h"
+
+#define CAN_DEV DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus))
+
+/* Measured variables: kept global so the master finds them in the ELF */
+volatile uint32_t demo_iterations;
+volatile int16_t demo_angle;
+volatile uint16_t demo_speed;
+
+int main(void)
+{
+	uint8_t control_event;
+	int16_t step = 1;
+	int ret;
+
+	ret = can_update_init(CAN_DEV);
+	if (ret) {
+		printk("Failed to initialize CAN update: %d\n", ret);
+		return 0;
+	}
+
+	ret = xcp_slave_add_event("control", CONFIG_DEMO_CONTROL_PERIOD_MS * 1000,
+	                          &control_event);
+	if (ret) {
+		printk("Failed to add control event: %d\n", ret);
+		return 0;
+	}
+
+	ret = xcp_slave_init(CAN_DEV);
+	if (ret) {
+		printk("Failed to initialize XCP slave: %d\n", ret);
+		return 0;
+	}
+
+	printk("XCP demo running, control event channel %u\n", control_event);
+
+	while (1) {
+		/* Triangle wave between -1800 and 1800 (0.1 deg) */
+		if (demo_angle >= 1800 || demo_angle <= -1800) {
+			step = -step;
+		}
+		demo_angle += step * 10;
+		demo_speed = (uint16_t)(demo_angle < 0 ? -demo_angle : demo_angle);
+		demo_iterations++;
+
+		xcp_event(control_event);
+		k_sleep(K_MSEC(CONFIG_DEMO_CONTROL_PERIOD_MS));
+	}
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Dual-bank option bit check for stm32f7_custom_dualbank
+ * Built into MCUboot and the application. Runs before either touches
+ * flash, so a device still in single-bank mode stops with a message
+ * instead of erasing across partition boundaries.
+ */
+
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fatal.h>
+#include <zephyr/sys/printk.h>
+#include <soc.h>
+
+static int dualbank_check(void)
+{
+	if ((FLASH->OPTCR & FLASH_OPTCR_nDBANK) == 0U) {
+		return 0;
+	}
+
+	printk("Flash is in single-bank mode but the partition map is dual-bank\n");
+	printk("Clear nDBANK: STM32_Programmer_CLI -c port=SWD -ob nDBANK=0\n");
+	k_fatal_halt(K_ERR_KERNEL_PANIC);
+
+	return -EIO;
+}
+
+SYS_INIT(dualbank_check, POST_KERNEL, 0);
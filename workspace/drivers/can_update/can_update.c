@@ -3,48 +3,348 @@
  */
 
 #include "can_update.h"
+#include "can_update_internal.h"
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
+#include <zephyr/init.h>
 #include <zephyr/drivers/can.h>
 #include <zephyr/drivers/flash.h>
 #include <zephyr/storage/flash_map.h>
 #include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/logging/log.h>
+#include <string.h>
+
+#if defined(CONFIG_CAN_UPDATE_ADDRESS_CLAIM)
+#include "j1939_address_claim.h"
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_XCP_EVENTS)
+#include "xcp_slave.h"
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_FLASH_ASYNC)
+#include "flash_async.h"
+#endif
 
 LOG_MODULE_REGISTER(can_update, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define CAN_UPDATE_FILTER_ID CONFIG_CAN_UPDATE_FILTER_ID
-#define CAN_UPDATE_CHUNK_SIZE CONFIG_CAN_UPDATE_CHUNK_SIZE
+
+#if defined(CONFIG_CAN_UPDATE_PRIORITY_FIXED)
+#define CAN_UPDATE_THREAD_PRIORITY CONFIG_CAN_UPDATE_THREAD_PRIORITY
+#else
+#define CAN_UPDATE_THREAD_PRIORITY K_LOWEST_APPLICATION_THREAD_PRIO
+#endif
 
 /* J1939 Configuration */
-#define J1939_SRC_ADDR 0x80  /* Our device address */
-#define J1939_DST_ADDR 0x00  /* Host address */
+#define J1939_SRC_ADDR CONFIG_CAN_UPDATE_J1939_ADDRESS      /* Our (preferred) device address */
+#define J1939_DST_ADDR CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS /* Host address */
 #define J1939_PRIORITY 6     /* Default priority */
+#define J1939_NULL_ADDR 0xFE /* No address claimed */
 
 static const struct device *can_dev;
+static bool initialized;  /* can_dev is up and the update thread runs */
+static uint8_t device_addr = J1939_SRC_ADDR;
+static int j1939_filter_id = -1;
 static enum can_update_status current_status = CAN_UPDATE_STATUS_IDLE;
 static struct k_mutex update_mutex;
+
+/* Serializes every erase/program of the update paths, see can_update_flash_lock() */
+static K_MUTEX_DEFINE(flash_lock);
+
+/* Legacy protocol session */
 static uint32_t image_offset;
 static uint32_t image_size;
 static uint16_t current_sequence;
-static uint8_t total_packets;
-static uint8_t packets_received;
+static uint8_t ack_window;    /* DATA frames per ACK, 0 if the sender wants no replies */
+static uint8_t unacked;       /* DATA frames accepted since the last ACK */
+static bool nack_sent;        /* Gap reported, waiting for current_sequence */
 
 /* Flash area for image update */
 static const struct flash_area *flash_area_image;
 
+/* End of the data programmed so far, and the offset below which rewound
+ * data is already in flash and skipped
+ */
+static uint32_t write_end;
+static uint32_t write_floor;
+
 /**
- * @brief Process CAN update start message
+ * @brief Frame handed from the CAN RX callbacks to the update thread
+ *
+ * The RX callbacks run in interrupt context, so they only copy the frame
+ * into a queue. Flash erase and write happen in the update thread, which
+ * runs under the CPU budget below.
  */
-static int process_start_message(const uint8_t *data, uint8_t len)
+enum rx_kind {
+	RX_KIND_J1939,
+	RX_KIND_LEGACY,
+	RX_KIND_TIMEOUT,
+	RX_KIND_CALL,
+};
+
+struct rx_msg {
+	uint8_t kind;
+	uint8_t src;  /* J1939 source address */
+	uint8_t dlc;
+	uint32_t pgn; /* J1939 PGN, destination address masked out */
+	union {
+		uint8_t data[CAN_MAX_DLC];
+		void (*call)(void);  /* RX_KIND_CALL */
+	};
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	uint32_t cycles;  /* Cycle count at reception */
+#endif
+};
+
+K_MSGQ_DEFINE(rx_msgq, sizeof(struct rx_msg), CONFIG_CAN_UPDATE_RX_QUEUE_LEN, 4);
+
+static K_THREAD_STACK_DEFINE(update_thread_stack, CONFIG_CAN_UPDATE_THREAD_STACK_SIZE);
+static struct k_thread update_thread_data;
+
+static struct can_update_stats stats;
+
+/* Cycle count at which the update thread last started running */
+static uint32_t slice_start;
+
+/**
+ * @brief Start a new CPU slice for the update thread
+ */
+static void budget_slice_begin(void)
+{
+	slice_start = k_cycle_get_32();
+}
+
+/**
+ * @brief Cooperative yield point for the update thread
+ *
+ * Called between units of work (one frame, one flash page). Once the
+ * thread has run for longer than CONFIG_CAN_UPDATE_SLICE_MAX_US without
+ * blocking, it gives up the CPU so application control loops keep their
+ * timing while an update streams in.
+ */
+static void budget_checkpoint(void)
+{
+	uint32_t run_us = k_cyc_to_us_floor32(k_cycle_get_32() - slice_start);
+
+	if (run_us > stats.max_slice_us) {
+		stats.max_slice_us = run_us;
+	}
+
+	if (CONFIG_CAN_UPDATE_SLICE_MAX_US == 0 ||
+	    run_us < CONFIG_CAN_UPDATE_SLICE_MAX_US) {
+		return;
+	}
+
+	stats.slices_exhausted++;
+
+	if (CONFIG_CAN_UPDATE_SLICE_REST_US > 0) {
+		k_sleep(K_USEC(CONFIG_CAN_UPDATE_SLICE_REST_US));
+	} else {
+		k_yield();
+	}
+
+	budget_slice_begin();
+}
+
+/**
+ * @brief Update pipeline stages
+ *
+ * With CONFIG_CAN_UPDATE_XCP_EVENTS each stage is an XCP event channel,
+ * so a measurement tool can sample DAQ lists in step with the pipeline
+ * (e.g. the update statistics after every written block).
+ */
+enum pipeline_stage {
+	STAGE_FRAME,   /* Frame processed by the update thread */
+	STAGE_WRITE,   /* Block written to slot1 */
+	STAGE_ERASE,   /* Flash page erased */
+	STAGE_STATUS,  /* Update finished or aborted */
+	STAGE_COUNT,
+};
+
+#if defined(CONFIG_CAN_UPDATE_XCP_EVENTS)
+static const char *const stage_names[STAGE_COUNT] = {
+	[STAGE_FRAME] = "upd_frame",
+	[STAGE_WRITE] = "upd_write",
+	[STAGE_ERASE] = "upd_erase",
+	[STAGE_STATUS] = "upd_status",
+};
+
+static uint8_t stage_event[STAGE_COUNT];
+static bool stage_events_ready;
+
+#define PIPELINE_EVENT(stage)                                   \
+	do {                                                    \
+		if (stage_events_ready) {                       \
+			xcp_event(stage_event[stage]);          \
+		}                                               \
+	} while (0)
+
+static void register_stage_events(void)
+{
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		if (xcp_slave_add_event(stage_names[i], 0, &stage_event[i])) {
+			LOG_WRN("No XCP event channel left for %s", stage_names[i]);
+			return;
+		}
+	}
+
+	stage_events_ready = true;
+}
+#else
+#define PIPELINE_EVENT(stage) do { } while (0)
+#endif
+
+void can_update_flash_lock(void)
+{
+	k_mutex_lock(&flash_lock, K_FOREVER);
+}
+
+void can_update_flash_unlock(void)
+{
+	k_mutex_unlock(&flash_lock);
+}
+
+int can_update_flash_erase(const struct flash_area *fa, off_t offset, size_t len)
 {
 	int ret;
 
-	if (len < 4) {
-		LOG_ERR("Invalid start message length");
-		return -EINVAL;
+	can_update_flash_lock();
+#if defined(CONFIG_CAN_UPDATE_FLASH_ASYNC)
+	ret = flash_async_area_erase(fa, offset, len);
+	budget_slice_begin();
+#else
+	ret = flash_area_erase(fa, offset, len);
+#endif
+	can_update_flash_unlock();
+
+	return ret;
+}
+
+int can_update_flash_write(const struct flash_area *fa, off_t offset, const void *data,
+                           size_t len)
+{
+	int ret;
+
+	can_update_flash_lock();
+#if defined(CONFIG_CAN_UPDATE_FLASH_ASYNC)
+	ret = flash_async_area_write(fa, offset, data, len);
+	budget_slice_begin();
+#else
+	ret = flash_area_write(fa, offset, data, len);
+#endif
+	can_update_flash_unlock();
+
+	return ret;
+}
+
+/**
+ * @brief Erase the flash pages covering a range of a flash area
+ *
+ * A single erase of a whole slot would keep the update thread busy for
+ * seconds; erasing page by page gives the budget a yield point after each
+ * page.
+ */
+int can_update_flash_erase_range(const struct flash_area *fa, uint32_t offset, uint32_t len)
+{
+	const struct device *flash_dev = flash_area_get_device(fa);
+	struct flash_pages_info info;
+	off_t off = offset;
+	int ret;
+
+	while (off < offset + len) {
+		ret = flash_get_page_info_by_offs(flash_dev, fa->fa_off + off, &info);
+		if (ret) {
+			return ret;
+		}
+
+		off = info.start_offset - fa->fa_off;
+		ret = can_update_flash_erase(fa, off, info.size);
+		if (ret) {
+			return ret;
+		}
+
+		off += info.size;
+		PIPELINE_EVENT(STAGE_ERASE);
+		budget_checkpoint();
 	}
 
+	return 0;
+}
+
+static int erase_image_range(uint32_t offset, uint32_t len)
+{
+	return can_update_flash_erase_range(flash_area_image, offset, len);
+}
+
+/**
+ * @brief Give up the transfer after a write failure
+ */
+static void writer_fail(void)
+{
+	can_update_stream_abort();
+
+	k_mutex_lock(&update_mutex, K_FOREVER);
+	if (flash_area_image) {
+		flash_area_close(flash_area_image);
+		flash_area_image = NULL;
+	}
+	current_status = CAN_UPDATE_STATUS_ERROR;
+	k_mutex_unlock(&update_mutex);
+}
+
+/**
+ * @brief Terminal stage: program a buffer into slot1
+ *
+ * Buffers are at most CONFIG_CAN_UPDATE_STREAM_BUF_SIZE bytes, so large
+ * blocks (UDS TransferData) get a budget yield point after each buffer.
+ */
+static int flash_stage_process(struct can_update_stage *stage, struct net_buf *buf)
+{
+	uint32_t offset = can_update_buf_meta(buf)->offset;
+	int ret;
+
+	if (offset > flash_area_image->fa_size ||
+	    buf->len > flash_area_image->fa_size - offset) {
+		net_buf_unref(buf);
+		return -ERANGE;
+	}
+
+	ret = can_update_flash_write(flash_area_image, offset, buf->data, buf->len);
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+	if (ret == 0) {
+		ret = can_update_verify_add(flash_area_image, offset, buf->data, buf->len);
+	}
+#endif
+	if (ret == 0) {
+		/* Only bytes that made it to flash count as written */
+		write_end = MAX(write_end, offset + buf->len);
+	}
+	net_buf_unref(buf);
+	if (ret) {
+		LOG_ERR("Failed to write to flash at offset %u: %d", offset, ret);
+		return ret;
+	}
+
+	PIPELINE_EVENT(STAGE_WRITE);
+	budget_checkpoint();
+	return 0;
+}
+
+static const struct can_update_stage_api flash_stage_api = {
+	.process = flash_stage_process,
+};
+
+static struct can_update_stage flash_stage = {
+	.name = "flash",
+	.api = &flash_stage_api,
+};
+
+int can_update_writer_open(enum can_update_mode mode, bool erase)
+{
+	int ret;
+
 	k_mutex_lock(&update_mutex, K_FOREVER);
 
 	if (current_status == CAN_UPDATE_STATUS_IN_PROGRESS) {
@@ -53,27 +353,36 @@ static int process_start_message(const uint8_t *data, uint8_t len)
 		return -EBUSY;
 	}
 
-	/* Extract image size from message (4 bytes, little-endian) */
-	image_size = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
-	image_offset = 0;
-	current_sequence = 0;
-
-	LOG_INF("Starting CAN update, image size: %u bytes", image_size);
-
 	/* Open flash area for update (slot 1) */
 	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &flash_area_image);
 	if (ret) {
 		LOG_ERR("Failed to open flash area: %d", ret);
+		flash_area_image = NULL;
 		current_status = CAN_UPDATE_STATUS_ERROR;
 		k_mutex_unlock(&update_mutex);
 		return ret;
 	}
 
-	/* Erase flash area */
-	ret = flash_area_erase(flash_area_image, 0, flash_area_image->fa_size);
+	if (erase) {
+		ret = erase_image_range(0, flash_area_image->fa_size);
+		if (ret) {
+			LOG_ERR("Failed to erase flash area: %d", ret);
+		}
+	}
+
+	if (ret == 0) {
+		ret = can_update_stream_open(mode, &flash_stage);
+	}
+
+	write_end = 0;
+	write_floor = 0;
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+	can_update_verify_reset();
+#endif
+
 	if (ret) {
-		LOG_ERR("Failed to erase flash area: %d", ret);
 		flash_area_close(flash_area_image);
+		flash_area_image = NULL;
 		current_status = CAN_UPDATE_STATUS_ERROR;
 		k_mutex_unlock(&update_mutex);
 		return ret;
@@ -82,6 +391,348 @@ static int process_start_message(const uint8_t *data, uint8_t len)
 	current_status = CAN_UPDATE_STATUS_IN_PROGRESS;
 	k_mutex_unlock(&update_mutex);
 
+	return 0;
+}
+
+int can_update_writer_erase(uint32_t offset, uint32_t len)
+{
+	int ret;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	if (offset > flash_area_image->fa_size ||
+	    len > flash_area_image->fa_size - offset) {
+		return -ERANGE;
+	}
+
+	/* Data accepted before the erase request reaches flash first */
+	ret = can_update_writer_sync();
+	if (ret) {
+		return ret;
+	}
+
+	ret = erase_image_range(offset, len);
+	if (ret) {
+		LOG_ERR("Failed to erase 0x%x+0x%x: %d", offset, len, ret);
+	}
+
+	return ret;
+}
+
+int can_update_writer_write(uint32_t offset, const uint8_t *data, size_t len)
+{
+	int ret;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	if (offset > flash_area_image->fa_size ||
+	    len > flash_area_image->fa_size - offset) {
+		return -ERANGE;
+	}
+
+	if (offset < write_floor) {
+		/* Resent after a rewind, but ahead of the erased pages */
+		size_t skip = MIN(len, write_floor - offset);
+
+		offset += skip;
+		data += skip;
+		len -= skip;
+		if (len == 0) {
+			return 0;
+		}
+	}
+
+	ret = can_update_stream_write(offset, data, len);
+	if (ret) {
+		writer_fail();
+	}
+
+	return ret;
+}
+
+int can_update_writer_sync(void)
+{
+	int ret;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	if (IS_ENABLED(CONFIG_CAN_UPDATE_VERIFY)) {
+		uint32_t bad_offset;
+
+		ret = can_update_writer_verify(true, &bad_offset);
+	} else {
+		ret = can_update_stream_sync();
+	}
+
+	if (ret) {
+		writer_fail();
+	}
+
+	return ret;
+}
+
+bool can_update_writer_verify_pending(void)
+{
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+	return flash_area_image && can_update_verify_pending();
+#else
+	return false;
+#endif
+}
+
+int can_update_writer_verify(bool all, uint32_t *bad_offset)
+{
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+	int ret = 0;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	if (all) {
+		ret = can_update_stream_sync();
+		if (ret) {
+			return ret;
+		}
+	}
+
+	ret = all ? can_update_verify_all(flash_area_image, bad_offset)
+		  : can_update_verify_step(flash_area_image, bad_offset);
+	if (ret == -EIO) {
+		stats.verify_failures++;
+	}
+
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+int can_update_writer_rewind(uint32_t bad_offset, uint32_t *resume)
+{
+	struct flash_pages_info info;
+	uint32_t page;
+	int ret;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	ret = flash_get_page_info_by_offs(flash_area_get_device(flash_area_image),
+	                                  flash_area_image->fa_off + bad_offset, &info);
+	if (ret) {
+		return ret;
+	}
+
+	page = info.start_offset - flash_area_image->fa_off;
+
+	/* Whatever the chain still holds goes to flash before the pages are erased */
+	ret = can_update_stream_sync();
+	if (ret == 0 && write_end > page) {
+		ret = erase_image_range(page, write_end - page);
+	}
+	if (ret) {
+		return ret;
+	}
+
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+	can_update_verify_discard_from(page);
+#endif
+	write_end = page;
+	write_floor = page;
+	*resume = page;
+
+	LOG_WRN("Rewriting slot1 from 0x%x", page);
+	return 0;
+}
+
+int can_update_writer_finish(void)
+{
+	int ret;
+
+	if (!flash_area_image) {
+		return -EINVAL;
+	}
+
+	/* Drain the chain before slot1 is closed */
+	ret = can_update_stream_close();
+	if (ret == 0 && IS_ENABLED(CONFIG_CAN_UPDATE_VERIFY)) {
+		uint32_t bad_offset;
+
+		ret = can_update_writer_verify(true, &bad_offset);
+	}
+	if (ret) {
+		writer_fail();
+		return ret;
+	}
+
+	k_mutex_lock(&update_mutex, K_FOREVER);
+
+	flash_area_close(flash_area_image);
+	flash_area_image = NULL;
+
+	/* Mark image as pending for MCUboot */
+	can_update_flash_lock();
+	ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
+	can_update_flash_unlock();
+	if (ret) {
+		LOG_ERR("Failed to request upgrade: %d", ret);
+		current_status = CAN_UPDATE_STATUS_ERROR;
+		k_mutex_unlock(&update_mutex);
+		return ret;
+	}
+
+	current_status = CAN_UPDATE_STATUS_SUCCESS;
+	k_mutex_unlock(&update_mutex);
+
+	PIPELINE_EVENT(STAGE_STATUS);
+	LOG_INF("CAN update completed successfully, reboot to apply");
+	return 0;
+}
+
+void can_update_writer_abort(void)
+{
+	can_update_stream_abort();
+
+	k_mutex_lock(&update_mutex, K_FOREVER);
+	if (flash_area_image) {
+		flash_area_close(flash_area_image);
+		flash_area_image = NULL;
+	}
+	/* A failed write has already closed the slot and reported ERROR */
+	if (current_status == CAN_UPDATE_STATUS_IN_PROGRESS) {
+		current_status = CAN_UPDATE_STATUS_IDLE;
+	}
+	k_mutex_unlock(&update_mutex);
+
+	PIPELINE_EVENT(STAGE_STATUS);
+}
+
+uint32_t can_update_writer_capacity(void)
+{
+	return FIXED_PARTITION_SIZE(slot1_partition);
+}
+
+/**
+ * @brief Send a legacy protocol reply on CONFIG_CAN_UPDATE_REPLY_ID
+ *
+ * Short payloads are padded with 0xFF to 8 bytes.
+ */
+static void legacy_send(const uint8_t *data, uint8_t len)
+{
+	struct can_frame frame = {
+		.id = CONFIG_CAN_UPDATE_REPLY_ID,
+		.dlc = 8,
+	};
+
+	memcpy(frame.data, data, len);
+	memset(&frame.data[len], 0xFF, 8 - len);
+
+	if (can_send(can_dev, &frame, K_MSEC(100), NULL, NULL)) {
+		LOG_WRN("Failed to send legacy reply 0x%02x", data[0]);
+	}
+}
+
+/**
+ * @brief Next sequence, committed offset and receive headroom
+ *
+ * The committed offset counts the bytes programmed into slot1; data
+ * still collected in stream buffers is not included. Headroom is the
+ * number of free receive queue entries.
+ */
+static void legacy_fill_progress(uint8_t *reply)
+{
+	sys_put_le16(current_sequence, &reply[0]);
+	sys_put_le24(MIN(write_end, 0xFFFFFFU), &reply[2]);
+	reply[5] = MIN(k_msgq_num_free_get(&rx_msgq), 0xFF);
+}
+
+/**
+ * @brief ACK: [0x06, next sequence LE16, committed LE24, headroom]
+ */
+static void legacy_send_ack(void)
+{
+	uint8_t reply[7] = { CAN_UPDATE_ACK };
+
+	legacy_fill_progress(&reply[1]);
+	legacy_send(reply, sizeof(reply));
+	unacked = 0;
+}
+
+/**
+ * @brief NACK: [0x07, next sequence LE16, errno]
+ */
+static void legacy_send_nack(int err)
+{
+	uint8_t reply[4] = { CAN_UPDATE_NACK };
+
+	sys_put_le16(current_sequence, &reply[1]);
+	reply[3] = MIN(-err, 0xFF);
+	legacy_send(reply, sizeof(reply));
+}
+
+/**
+ * @brief STATUS: [0x05, status, next sequence LE16, committed LE24, headroom]
+ */
+static void legacy_send_status(void)
+{
+	uint8_t reply[8] = { CAN_UPDATE_STATUS, current_status };
+
+	legacy_fill_progress(&reply[2]);
+	legacy_send(reply, sizeof(reply));
+}
+
+/**
+ * @brief Process CAN update start message
+ *
+ * An optional fifth byte asks for an ACK every that many DATA frames and
+ * a NACK for the first missing one. Without it the device stays silent,
+ * as a broadcast to several listeners requires.
+ */
+static int process_start_message(const uint8_t *data, uint8_t len)
+{
+	int ret;
+	uint32_t size;
+	uint8_t window;
+
+	if (len < 4) {
+		LOG_ERR("Invalid start message length");
+		return -EINVAL;
+	}
+
+	/* Extract image size from message (4 bytes, little-endian) */
+	size = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+	window = len > 4 ? data[4] : 0;
+
+	LOG_INF("Starting CAN update, image size: %u bytes", size);
+
+	/* A START refused here must leave a running session untouched */
+	ret = can_update_writer_open(CAN_UPDATE_MODE_LEGACY, true);
+	if (ret) {
+		if (window) {
+			legacy_send_nack(ret);
+		}
+		return ret;
+	}
+
+	image_size = size;
+	image_offset = 0;
+	current_sequence = 0;
+	ack_window = window;
+	unacked = 0;
+	nack_sent = false;
+
+	/* Tells the sender the erase is done */
+	if (ack_window) {
+		legacy_send_ack();
+	}
+
 	LOG_INF("CAN update started successfully");
 	return 0;
 }
@@ -99,33 +750,48 @@ static int process_data_message(const uint8_t *data, uint8_t len)
 		return -EINVAL;
 	}
 
-	k_mutex_lock(&update_mutex, K_FOREVER);
-
 	if (current_status != CAN_UPDATE_STATUS_IN_PROGRESS) {
 		LOG_ERR("No update in progress");
-		k_mutex_unlock(&update_mutex);
 		return -EINVAL;
 	}
 
 	/* Extract sequence number (2 bytes) */
 	sequence = data[0] | (data[1] << 8);
 
+	if ((int16_t)(sequence - current_sequence) < 0) {
+		/* Already written: in flight when the sender rewound */
+		return 0;
+	}
+
 	if (sequence != current_sequence) {
 		LOG_ERR("Sequence mismatch: expected %u, got %u", current_sequence, sequence);
-		k_mutex_unlock(&update_mutex);
+		/* One NACK per gap; the frames behind it are dropped as well */
+		if (ack_window && !nack_sent) {
+			legacy_send_nack(-EILSEQ);
+			nack_sent = true;
+		}
 		return -EINVAL;
 	}
 
+	nack_sent = false;
+
 	/* Data starts at byte 2 */
 	uint8_t data_len = len - 2;
 	const uint8_t *payload = &data[2];
 
-	/* Write to flash */
-	ret = flash_area_write(flash_area_image, image_offset, payload, data_len);
+	if (data_len > image_size - image_offset) {
+		LOG_ERR("Data past the announced image size of %u bytes", image_size);
+		if (ack_window) {
+			legacy_send_nack(-EFBIG);
+		}
+		return -EFBIG;
+	}
+
+	ret = can_update_writer_write(image_offset, payload, data_len);
 	if (ret) {
-		LOG_ERR("Failed to write to flash at offset %u: %d", image_offset, ret);
-		current_status = CAN_UPDATE_STATUS_ERROR;
-		k_mutex_unlock(&update_mutex);
+		if (ack_window) {
+			legacy_send_nack(ret);
+		}
 		return ret;
 	}
 
@@ -136,7 +802,11 @@ static int process_data_message(const uint8_t *data, uint8_t len)
 		LOG_INF("Progress: %u/%u bytes", image_offset, image_size);
 	}
 
-	k_mutex_unlock(&update_mutex);
+	/* The last window may be short */
+	if (ack_window && (++unacked >= ack_window || image_offset >= image_size)) {
+		legacy_send_ack();
+	}
+
 	return 0;
 }
 
@@ -147,300 +817,649 @@ static int process_end_message(void)
 {
 	int ret;
 
-	k_mutex_lock(&update_mutex, K_FOREVER);
-
 	if (current_status != CAN_UPDATE_STATUS_IN_PROGRESS) {
 		LOG_ERR("No update in progress");
-		k_mutex_unlock(&update_mutex);
 		return -EINVAL;
 	}
 
-	flash_area_close(flash_area_image);
-
 	if (image_offset != image_size) {
 		LOG_ERR("Image size mismatch: expected %u, received %u",
 		        image_size, image_offset);
+		can_update_writer_abort();
+		k_mutex_lock(&update_mutex, K_FOREVER);
 		current_status = CAN_UPDATE_STATUS_ERROR;
 		k_mutex_unlock(&update_mutex);
+		ret = -EINVAL;
+	} else {
+		ret = can_update_writer_finish();
+	}
+
+	/* SUCCESS or ERROR, with the final committed offset */
+	if (ack_window) {
+		legacy_send_status();
+	}
+
+	return ret;
+}
+
+uint8_t can_update_j1939_addr(void)
+{
+	return device_addr;
+}
+
+int can_update_j1939_send(uint32_t pgn, uint8_t dst, const uint8_t *data, uint8_t len)
+{
+	struct can_frame frame;
+
+	if (len > 8) {
 		return -EINVAL;
 	}
 
-	/* Mark image as pending for MCUboot */
-	ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
-	if (ret) {
-		LOG_ERR("Failed to request upgrade: %d", ret);
-		current_status = CAN_UPDATE_STATUS_ERROR;
-		k_mutex_unlock(&update_mutex);
-		return ret;
+	frame.id = j1939_build_can_id(J1939_PRIORITY, pgn, device_addr, dst);
+	frame.flags = CAN_FRAME_IDE; /* Extended ID */
+	frame.dlc = 8;
+
+	memcpy(frame.data, data, len);
+	memset(&frame.data[len], 0xFF, 8 - len);
+
+	return can_send(can_dev, &frame, K_MSEC(100), NULL, NULL);
+}
+
+/**
+ * @brief J1939 TP/ETP Receive Session
+ *
+ * One connection-mode session at a time. Packet numbers are absolute and
+ * 1-based for both TP and ETP; for ETP the DT sequence number is added to
+ * the offset announced in the last DPO.
+ */
+static struct tp_session {
+	const struct can_update_tp_sink *sink;
+	bool extended;          /* ETP (ETP.CM/ETP.DT) rather than TP */
+	bool resync;            /* Gap seen, waiting for the re-requested packet */
+	uint8_t src;            /* Originator address */
+	uint8_t rts_max;        /* TP: max packets per CTS requested in RTS */
+	uint8_t retries;        /* Re-requests sent in this session */
+	uint8_t window;         /* Packets per CTS, fixed at RTS */
+	uint32_t size;          /* Message size in bytes */
+	uint32_t packets;       /* Total packets */
+	uint32_t next_packet;   /* Next packet expected */
+	uint32_t window_end;    /* Last packet of the current CTS window */
+	uint32_t dpo_offset;    /* ETP: packet offset from the last DPO */
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	uint32_t window_start;  /* First packet of the current CTS window */
+	uint32_t window_cycles; /* Reception of window_start */
+#endif
+	int64_t last_activity;  /* Uptime of the last accepted frame */
+} session;
+
+static int image_sink_begin(uint8_t src, uint32_t size)
+{
+	if (src != J1939_DST_ADDR) {
+		LOG_WRN("Image transfer from unexpected address 0x%02x", src);
+		return -EPERM;
 	}
 
-	current_status = CAN_UPDATE_STATUS_SUCCESS;
-	k_mutex_unlock(&update_mutex);
+	if (size > can_update_writer_capacity()) {
+		LOG_ERR("Image too large: %u bytes", size);
+		return -EFBIG;
+	}
 
-	LOG_INF("CAN update completed successfully, reboot to apply");
-	return 0;
+	return can_update_writer_open(CAN_UPDATE_MODE_J1939, true);
+}
+
+static int image_sink_data(uint32_t offset, const uint8_t *data, size_t len)
+{
+	return can_update_writer_write(offset, data, len);
+}
+
+static int image_sink_end(uint8_t src)
+{
+	ARG_UNUSED(src);
+
+	return can_update_writer_finish();
+}
+
+static void image_sink_abort(void)
+{
+	can_update_writer_abort();
+}
+
+static int image_sink_verify(bool all, uint32_t *resume)
+{
+	uint32_t bad_offset;
+	int ret;
+
+	ret = can_update_writer_verify(all, &bad_offset);
+	if (ret == -EIO) {
+		ret = can_update_writer_rewind(bad_offset, resume);
+		return ret ? ret : -EAGAIN;
+	}
+
+	return ret;
+}
+
+static const struct can_update_tp_sink image_sink = {
+	.pgn = J1939_PGN_FIRMWARE_UPDATE,
+	.begin = image_sink_begin,
+	.data = image_sink_data,
+	.end = image_sink_end,
+	.abort = image_sink_abort,
+	.verify = image_sink_verify,
+};
+
+static const struct can_update_tp_sink *const tp_sinks[] = {
+	&image_sink,
+#if defined(CONFIG_CAN_UPDATE_DM14)
+	&can_update_dm16_sink,
+#endif
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+	&can_update_module_sink,
+#endif
+};
+
+static void session_timeout_handler(struct k_work *work)
+{
+	struct rx_msg msg = {
+		.kind = RX_KIND_TIMEOUT,
+	};
+
+	ARG_UNUSED(work);
+
+	/* Handled in the update thread, which owns the session */
+	k_msgq_put(&rx_msgq, &msg, K_NO_WAIT);
+}
+
+static K_WORK_DELAYABLE_DEFINE(session_timeout_work, session_timeout_handler);
+
+static void session_touch(void)
+{
+	session.last_activity = k_uptime_get();
+	k_work_reschedule(&session_timeout_work, K_MSEC(CONFIG_CAN_UPDATE_TIMEOUT_MS));
+}
+
+static void session_close(void)
+{
+	session.sink = NULL;
+	k_work_cancel_delayable(&session_timeout_work);
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	can_update_tune_session_end();
+#endif
 }
 
 /**
- * @brief Send J1939 CTS (Clear to Send) message
+ * @brief Send a TP.CM or ETP.CM frame to the session originator
  */
-static void send_j1939_cts(uint8_t num_packets, uint8_t next_packet)
+static void send_cm(bool extended, uint8_t dst, const uint8_t *data, uint32_t pgn)
 {
-	struct can_frame frame;
-	uint32_t can_id;
+	uint8_t frame[8];
+
+	memcpy(frame, data, 5);
+	frame[5] = pgn & 0xFF;
+	frame[6] = (pgn >> 8) & 0xFF;
+	frame[7] = (pgn >> 16) & 0xFF;
+
+	can_update_j1939_send(extended ? J1939_PGN_ETP_CM : J1939_PGN_TP_CM, dst, frame, 8);
+}
+
+static void send_abort(bool extended, uint8_t dst, uint8_t reason, uint32_t pgn)
+{
+	uint8_t data[5] = { J1939_TP_CM_ABORT, reason, 0xFF, 0xFF, 0xFF };
+
+	send_cm(extended, dst, data, pgn);
+	LOG_WRN("Aborted transfer from 0x%02x, reason %u", dst, reason);
+}
+
+/**
+ * @brief Abort the current session, telling the originator why
+ */
+static void session_abort(uint8_t reason)
+{
+	send_abort(session.extended, session.src, reason, session.sink->pgn);
+	session.sink->abort();
+	session_close();
+}
 
-	can_id = j1939_build_can_id(J1939_PRIORITY, J1939_PGN_TP_CM,
-	                              J1939_SRC_ADDR, J1939_DST_ADDR);
+/**
+ * @brief Clear the originator to send the next window, starting at next_packet
+ */
+static void send_cts(void)
+{
+	uint32_t count = MIN(session.packets - session.next_packet + 1, session.window);
+	uint8_t data[5];
+
+	data[0] = session.extended ? J1939_ETP_CM_CTS : J1939_TP_CM_CTS;
+
+	if (session.extended) {
+		data[1] = count;
+		data[2] = session.next_packet & 0xFF;
+		data[3] = (session.next_packet >> 8) & 0xFF;
+		data[4] = (session.next_packet >> 16) & 0xFF;
+	} else {
+		count = MIN(count, session.rts_max);
+		data[1] = count;
+		data[2] = session.next_packet;
+		data[3] = 0xFF;
+		data[4] = 0xFF;
+	}
+
+	session.window_end = session.next_packet + count - 1;
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	session.window_start = session.next_packet;
+#endif
+	send_cm(session.extended, session.src, data, session.sink->pgn);
+	LOG_DBG("Sent CTS: %u packets, next=%u", count, session.next_packet);
+}
+
+/**
+ * @brief Acknowledge the whole message (TP EOM / ETP EOMA)
+ */
+static void send_eom(void)
+{
+	uint8_t data[5];
+
+	if (session.extended) {
+		data[0] = J1939_ETP_CM_EOMA;
+		data[1] = session.size & 0xFF;
+		data[2] = (session.size >> 8) & 0xFF;
+		data[3] = (session.size >> 16) & 0xFF;
+		data[4] = (session.size >> 24) & 0xFF;
+	} else {
+		data[0] = J1939_TP_CM_EOM;
+		data[1] = session.size & 0xFF;
+		data[2] = (session.size >> 8) & 0xFF;
+		data[3] = session.packets;
+		data[4] = 0xFF;
+	}
+
+	send_cm(session.extended, session.src, data, session.sink->pgn);
+	LOG_INF("Sent EOM acknowledgment");
+}
+
+/**
+ * @brief Process a TP.CM or ETP.CM RTS (Request to Send)
+ */
+static void process_rts(bool extended, uint8_t src, const uint8_t *data)
+{
+	const struct can_update_tp_sink *sink = NULL;
+	uint32_t pgn = data[5] | (data[6] << 8) | (data[7] << 16);
+	uint32_t size;
+	uint32_t packets;
+	int ret;
+
+	if (session.sink) {
+		if (session.src != src) {
+			send_abort(extended, src, J1939_ABORT_BUSY, pgn);
+			return;
+		}
+
+		/* A new RTS from the same originator replaces its old session */
+		session.sink->abort();
+		session_close();
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(tp_sinks); i++) {
+		if (tp_sinks[i]->pgn == pgn) {
+			sink = tp_sinks[i];
+			break;
+		}
+	}
+
+	if (!sink) {
+		send_abort(extended, src, J1939_ABORT_RESOURCES, pgn);
+		return;
+	}
+
+	if (extended) {
+		size = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+		packets = DIV_ROUND_UP(size, 7);
+	} else {
+		size = data[1] | (data[2] << 8);
+		packets = data[3];
+	}
+
+	if (size == 0 || packets != DIV_ROUND_UP(size, 7) ||
+	    (!extended && size > J1939_TP_MAX_SIZE) ||
+	    (extended && packets > J1939_ETP_MAX_PACKETS)) {
+		send_abort(extended, src, J1939_ABORT_SIZE, pgn);
+		return;
+	}
 
-	frame.id = can_id;
-	frame.flags = CAN_FRAME_IDE; /* Extended ID */
-	frame.dlc = 8;
+	LOG_INF("J1939 %s RTS from 0x%02x: PGN 0x%05x, %u bytes, %u packets",
+	        extended ? "ETP" : "TP", src, pgn, size, packets);
 
-	frame.data[0] = J1939_TP_CM_CTS;
-	frame.data[1] = num_packets;  /* Number of packets that can be sent */
-	frame.data[2] = next_packet;  /* Next packet number to be sent */
-	frame.data[3] = 0xFF;         /* Reserved */
-	frame.data[4] = 0xFF;         /* Reserved */
-	frame.data[5] = (J1939_PGN_FIRMWARE_UPDATE) & 0xFF;
-	frame.data[6] = (J1939_PGN_FIRMWARE_UPDATE >> 8) & 0xFF;
-	frame.data[7] = (J1939_PGN_FIRMWARE_UPDATE >> 16) & 0xFF;
+	ret = sink->begin(src, size);
+	if (ret) {
+		send_abort(extended, src,
+		           ret == -EBUSY ? J1939_ABORT_BUSY : J1939_ABORT_RESOURCES, pgn);
+		return;
+	}
 
-	can_send(can_dev, &frame, K_MSEC(100), NULL, NULL);
-	LOG_DBG("Sent CTS: %d packets, next=%d", num_packets, next_packet);
+	session = (struct tp_session) {
+		.sink = sink,
+		.extended = extended,
+		.src = src,
+		/* 0xFF (and the pre-2005 value 0) mean no limit */
+		.rts_max = (extended || data[4] == 0) ? 0xFF : data[4],
+		.window = can_update_tune_window(),
+		.size = size,
+		.packets = packets,
+		.next_packet = 1,
+	};
+
+	send_cts();
+	session_touch();
 }
 
 /**
- * @brief Send J1939 EOM (End of Message) acknowledgment
+ * @brief Handle TP.CM and ETP.CM messages
  */
-static void send_j1939_eom(uint32_t total_bytes, uint8_t total_pkts)
+static void handle_cm(bool extended, const struct rx_msg *msg)
 {
-	struct can_frame frame;
-	uint32_t can_id;
+	if (msg->dlc < 8) {
+		return;
+	}
 
-	can_id = j1939_build_can_id(J1939_PRIORITY, J1939_PGN_TP_CM,
-	                              J1939_SRC_ADDR, J1939_DST_ADDR);
+	uint8_t control_byte = msg->data[0];
 
-	frame.id = can_id;
-	frame.flags = CAN_FRAME_IDE;
-	frame.dlc = 8;
+	if (control_byte == (extended ? J1939_ETP_CM_RTS : J1939_TP_CM_RTS)) {
+		process_rts(extended, msg->src, msg->data);
+		return;
+	}
 
-	frame.data[0] = J1939_TP_CM_EOM;
-	frame.data[1] = total_bytes & 0xFF;
-	frame.data[2] = (total_bytes >> 8) & 0xFF;
-	frame.data[3] = total_pkts;
-	frame.data[4] = 0xFF;
-	frame.data[5] = (J1939_PGN_FIRMWARE_UPDATE) & 0xFF;
-	frame.data[6] = (J1939_PGN_FIRMWARE_UPDATE >> 8) & 0xFF;
-	frame.data[7] = (J1939_PGN_FIRMWARE_UPDATE >> 16) & 0xFF;
+	if (!session.sink || session.src != msg->src || session.extended != extended) {
+		return;
+	}
 
-	can_send(can_dev, &frame, K_MSEC(100), NULL, NULL);
-	LOG_INF("Sent EOM acknowledgment");
+	if (control_byte == J1939_TP_CM_ABORT) {
+		session.sink->abort();
+		session_close();
+		LOG_INF("J1939 connection aborted by 0x%02x", msg->src);
+	} else if (extended && control_byte == J1939_ETP_CM_DPO) {
+		session.dpo_offset = msg->data[2] | (msg->data[3] << 8) | (msg->data[4] << 16);
+		session_touch();
+	} else {
+		LOG_DBG("Unhandled CM control byte: 0x%02x", control_byte);
+	}
 }
 
 /**
- * @brief Process J1939 TP.CM RTS (Request to Send)
+ * @brief Check the data the sink has written so far
+ *
+ * A block that reads back wrong rewinds the session: the originator is
+ * sent a CTS for the packet holding the first byte to be written again.
+ *
+ * @param all Check every written block, not just the oldest
+ * @return 0 if the session can go on, -EAGAIN after a rewind, negative
+ *         errno if the session was aborted
  */
-static int process_j1939_rts(const uint8_t *data)
+static int session_verify(bool all)
 {
+	uint32_t resume;
 	int ret;
-	uint16_t msg_size;
-	uint8_t num_packets;
 
-	msg_size = data[1] | (data[2] << 8);
-	num_packets = data[3];
-
-	k_mutex_lock(&update_mutex, K_FOREVER);
-
-	if (current_status == CAN_UPDATE_STATUS_IN_PROGRESS) {
-		LOG_WRN("Update already in progress");
-		k_mutex_unlock(&update_mutex);
-		return -EBUSY;
+	if (!session.sink->verify) {
+		return 0;
 	}
 
-	image_size = msg_size;
-	image_offset = 0;
-	current_sequence = 0;
-	total_packets = num_packets;
-	packets_received = 0;
-
-	LOG_INF("J1939 RTS: size=%u bytes, packets=%u", msg_size, num_packets);
-
-	/* Open flash area for update (slot 1) */
-	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &flash_area_image);
-	if (ret) {
-		LOG_ERR("Failed to open flash area: %d", ret);
-		current_status = CAN_UPDATE_STATUS_ERROR;
-		k_mutex_unlock(&update_mutex);
-		return ret;
+	ret = session.sink->verify(all, &resume);
+	if (ret == 0) {
+		return 0;
 	}
 
-	/* Erase flash area */
-	ret = flash_area_erase(flash_area_image, 0, flash_area_image->fa_size);
-	if (ret) {
-		LOG_ERR("Failed to erase flash area: %d", ret);
-		flash_area_close(flash_area_image);
-		current_status = CAN_UPDATE_STATUS_ERROR;
-		k_mutex_unlock(&update_mutex);
+	if (ret != -EAGAIN) {
+		session_abort(J1939_ABORT_RESOURCES);
 		return ret;
 	}
 
-	current_status = CAN_UPDATE_STATUS_IN_PROGRESS;
-	k_mutex_unlock(&update_mutex);
-
-	/* Send CTS to start receiving packets */
-	send_j1939_cts(255, 1); /* Request all packets starting from 1 */
+	if (++session.retries > CONFIG_CAN_UPDATE_TP_MAX_RETRANSMIT) {
+		session_abort(J1939_ABORT_MAX_RETRANSMIT);
+		return -EIO;
+	}
 
-	return 0;
+	session.next_packet = resume / 7 + 1;
+	session.resync = true;
+	send_cts();
+	session_touch();
+	return -EAGAIN;
 }
 
 /**
- * @brief Process J1939 TP.DT (Data Transfer) packet
+ * @brief Process a TP.DT or ETP.DT packet
  */
-static int process_j1939_dt(const uint8_t *data, uint8_t len)
+static void process_dt(bool extended, const struct rx_msg *msg)
 {
+	uint32_t packet;
+	uint32_t offset;
 	int ret;
-	uint8_t seq_num;
 
-	if (len < 2) {
-		LOG_ERR("Invalid TP.DT length");
-		return -EINVAL;
+	if (!session.sink || session.src != msg->src || session.extended != extended ||
+	    msg->dlc < 2) {
+		return;
 	}
 
-	k_mutex_lock(&update_mutex, K_FOREVER);
+	packet = extended ? session.dpo_offset + msg->data[0] : msg->data[0];
 
-	if (current_status != CAN_UPDATE_STATUS_IN_PROGRESS) {
-		LOG_ERR("No update in progress");
-		k_mutex_unlock(&update_mutex);
-		return -EINVAL;
+	if (packet < session.next_packet) {
+		/* Duplicate of a packet already written */
+		return;
 	}
 
-	seq_num = data[0];
-
-	if (seq_num != (current_sequence + 1)) {
-		LOG_ERR("Sequence error: expected %u, got %u", current_sequence + 1, seq_num);
-		k_mutex_unlock(&update_mutex);
-		return -EINVAL;
+	if (packet > session.window_end) {
+		/* Not cleared by a CTS: the originator has run past the window */
+		LOG_DBG("Packet %u outside the window ending at %u", packet, session.window_end);
+		return;
 	}
 
-	/* Data starts at byte 1, up to 7 bytes per packet */
-	uint8_t data_len = len - 1;
-	const uint8_t *payload = &data[1];
+	if (packet > session.next_packet) {
+		if (session.resync) {
+			/* Rest of the window the originator sent before our re-CTS */
+			return;
+		}
+
+		LOG_WRN("Sequence error: expected %u, got %u", session.next_packet, packet);
+		if (++session.retries > CONFIG_CAN_UPDATE_TP_MAX_RETRANSMIT) {
+			session_abort(J1939_ABORT_MAX_RETRANSMIT);
+			return;
+		}
 
-	/* Don't write beyond image size */
-	if (image_offset + data_len > image_size) {
-		data_len = image_size - image_offset;
+		session.resync = true;
+		send_cts();
+		session_touch();
+		return;
 	}
 
-	/* Write to flash */
-	ret = flash_area_write(flash_area_image, image_offset, payload, data_len);
+	session.resync = false;
+
+	/* Data starts at byte 1, up to 7 bytes per packet */
+	offset = (packet - 1) * 7;
+	ret = session.sink->data(offset, &msg->data[1],
+	                         MIN(msg->dlc - 1, session.size - offset));
 	if (ret) {
-		LOG_ERR("Failed to write to flash at offset %u: %d", image_offset, ret);
-		current_status = CAN_UPDATE_STATUS_ERROR;
-		k_mutex_unlock(&update_mutex);
-		return ret;
+		session_abort(J1939_ABORT_RESOURCES);
+		return;
 	}
 
-	image_offset += data_len;
-	current_sequence = seq_num;
-	packets_received++;
+	session.next_packet++;
 
-	if (image_offset % 1024 == 0) {
-		LOG_INF("Progress: %u/%u bytes (%u%%)",
-		        image_offset, image_size, (image_offset * 100) / image_size);
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	/* Spacing of a window received without a re-request */
+	if (packet == session.window_start) {
+		session.window_cycles = msg->cycles;
+	} else if (packet == session.window_end) {
+		can_update_tune_window_done(packet - session.window_start,
+		                            msg->cycles - session.window_cycles);
 	}
+#endif
 
-	/* Check if transfer is complete */
-	if (image_offset >= image_size) {
-		flash_area_close(flash_area_image);
+	if (session.next_packet % 1024 == 0) {
+		LOG_INF("Progress: %u/%u bytes", offset + 7, session.size);
+	}
 
-		/* Mark image as pending for MCUboot */
-		ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
+	if (session.next_packet > session.packets) {
+		if (session_verify(true)) {
+			return;
+		}
+
+		ret = session.sink->end(session.src);
 		if (ret) {
-			LOG_ERR("Failed to request upgrade: %d", ret);
-			current_status = CAN_UPDATE_STATUS_ERROR;
-			k_mutex_unlock(&update_mutex);
-			return ret;
+			send_abort(session.extended, session.src, J1939_ABORT_RESOURCES,
+			           session.sink->pgn);
+		} else {
+			send_eom();
 		}
+		session_close();
+		return;
+	}
 
-		current_status = CAN_UPDATE_STATUS_SUCCESS;
-		k_mutex_unlock(&update_mutex);
+	/* Window complete: clear the next one */
+	if (packet == session.window_end) {
+		send_cts();
+	}
 
-		/* Send EOM acknowledgment */
-		send_j1939_eom(image_size, total_packets);
-		LOG_INF("J1939 update completed successfully");
-		return 0;
+	session_touch();
+}
+
+/**
+ * @brief Abort the session if the originator has gone quiet
+ */
+static void process_timeout(void)
+{
+	if (!session.sink) {
+		return;
 	}
 
-	k_mutex_unlock(&update_mutex);
-	return 0;
+	if (k_uptime_get() - session.last_activity < CONFIG_CAN_UPDATE_TIMEOUT_MS) {
+		/* Stale timeout; the session saw traffic since it was queued */
+		return;
+	}
+
+	session_abort(J1939_ABORT_TIMEOUT);
 }
 
 /**
- * @brief CAN RX callback for J1939 TP.CM messages
+ * @brief Read back one written block while the bus is quiet
  */
-static void can_rx_tp_cm_callback(const struct device *dev, struct can_frame *frame,
-                                   void *user_data)
+static void verify_idle(void)
 {
-	ARG_UNUSED(dev);
-	ARG_UNUSED(user_data);
+	uint32_t bad_offset;
+	int ret;
 
-	if (frame->dlc < 8) {
+	if (session.sink && session.sink->verify) {
+		session_verify(false);
 		return;
 	}
 
-	uint8_t control_byte = frame->data[0];
+	/* No way to have the data resent: fail before the next acknowledgment */
+	ret = can_update_writer_verify(false, &bad_offset);
+	if (ret) {
+		LOG_ERR("Verification failed: %d", ret);
+		writer_fail();
+	}
+}
 
-	switch (control_byte) {
-	case J1939_TP_CM_RTS:
-		process_j1939_rts(frame->data);
+/**
+ * @brief Dispatch a J1939 frame addressed to us by PDU format
+ */
+static void handle_j1939(const struct rx_msg *msg)
+{
+	switch (msg->pgn) {
+	case J1939_PGN_TP_CM:
+		handle_cm(false, msg);
 		break;
-	case J1939_TP_CM_ABORT:
-		k_mutex_lock(&update_mutex, K_FOREVER);
-		if (flash_area_image) {
-			flash_area_close(flash_area_image);
-		}
-		current_status = CAN_UPDATE_STATUS_IDLE;
-		k_mutex_unlock(&update_mutex);
-		LOG_INF("J1939 connection aborted");
+	case J1939_PGN_TP_DT:
+		process_dt(false, msg);
+		break;
+	case J1939_PGN_ETP_CM:
+		handle_cm(true, msg);
+		break;
+	case J1939_PGN_ETP_DT:
+		process_dt(true, msg);
+		break;
+#if defined(CONFIG_CAN_UPDATE_DM14)
+	case J1939_PGN_DM14:
+		can_update_dm_handle_dm14(msg->src, msg->data, msg->dlc);
 		break;
+	case J1939_PGN_DM16:
+		can_update_dm_handle_dm16(msg->src, msg->data, msg->dlc);
+		break;
+#endif
+#if defined(CONFIG_CAN_UPDATE_IMAGE_CACHE) || defined(CONFIG_CAN_UPDATE_TUNE) || \
+	defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+	case J1939_PGN_FIRMWARE_UPDATE:
+		/* Each handler ignores the other's command codes */
+#if defined(CONFIG_CAN_UPDATE_IMAGE_CACHE)
+		can_update_cache_handle_cmd(msg->src, msg->data, msg->dlc);
+#endif
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+		can_update_tune_handle_cmd(msg->src, msg->data, msg->dlc);
+#endif
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+		can_update_unit_handle_cmd(msg->src, msg->data, msg->dlc);
+#endif
+		break;
+#endif
 	default:
-		LOG_DBG("Unhandled TP.CM control byte: 0x%02x", control_byte);
 		break;
 	}
 }
 
 /**
- * @brief CAN RX callback for J1939 TP.DT messages
+ * @brief PGN of a 29-bit identifier: EDP, DP and PF, plus PS for PDU2
+ *
+ * In PDU1 formats PS is the destination address, not part of the PGN.
  */
-static void can_rx_tp_dt_callback(const struct device *dev, struct can_frame *frame,
-                                   void *user_data)
+static uint32_t j1939_pgn(uint32_t id)
 {
-	ARG_UNUSED(dev);
-	ARG_UNUSED(user_data);
+	uint32_t pgn = (id >> 8) & 0x3FFFF;
 
-	if (frame->dlc < 2) {
-		return;
+	return ((pgn >> 8) & 0xFF) < 240 ? pgn & 0x3FF00 : pgn;
+}
+
+/**
+ * @brief Queue a received frame for the update thread
+ */
+static void queue_rx_frame(enum rx_kind kind, const struct can_frame *frame)
+{
+	struct rx_msg msg = {
+		.kind = kind,
+		.pgn = j1939_pgn(frame->id),
+		.src = frame->id & 0xFF,
+		.dlc = MIN(frame->dlc, CAN_MAX_DLC),
+	};
+
+	memcpy(msg.data, frame->data, msg.dlc);
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	msg.cycles = k_cycle_get_32();
+#endif
+
+	stats.frames_received++;
+	if (k_msgq_put(&rx_msgq, &msg, K_NO_WAIT) != 0) {
+		stats.frames_dropped++;
 	}
+}
 
-	process_j1939_dt(frame->data, frame->dlc);
+int can_update_call(void (*handler)(void), k_timeout_t timeout)
+{
+	struct rx_msg msg = {
+		.kind = RX_KIND_CALL,
+		.call = handler,
+	};
+
+	return k_msgq_put(&rx_msgq, &msg, timeout);
 }
 
 /**
- * @brief CAN RX callback (legacy protocol support)
+ * @brief Handle legacy protocol messages
  */
-static void can_rx_callback(const struct device *dev, struct can_frame *frame,
-			     void *user_data)
+static void handle_legacy(const struct rx_msg *msg)
 {
-	ARG_UNUSED(dev);
-	ARG_UNUSED(user_data);
-
-	if (frame->dlc < 1) {
+	if (msg->dlc < 1) {
 		return;
 	}
 
-	uint8_t msg_type = frame->data[0];
-	const uint8_t *data = &frame->data[1];
-	uint8_t len = frame->dlc - 1;
+	uint8_t msg_type = msg->data[0];
+	const uint8_t *data = &msg->data[1];
+	uint8_t len = msg->dlc - 1;
 
 	switch (msg_type) {
 	case CAN_UPDATE_START:
@@ -453,65 +1472,238 @@ static void can_rx_callback(const struct device *dev, struct can_frame *frame,
 		process_end_message();
 		break;
 	case CAN_UPDATE_ABORT:
-		k_mutex_lock(&update_mutex, K_FOREVER);
-		if (flash_area_image) {
-			flash_area_close(flash_area_image);
-		}
-		current_status = CAN_UPDATE_STATUS_IDLE;
-		k_mutex_unlock(&update_mutex);
+		can_update_writer_abort();
 		LOG_INF("CAN update aborted");
 		break;
+	case CAN_UPDATE_STATUS:
+		/* Answered even without an ACK window: only sent by a unicast sender */
+		legacy_send_status();
+		break;
 	default:
 		LOG_WRN("Unknown message type: 0x%02x", msg_type);
 		break;
 	}
 }
 
+/**
+ * @brief Update thread: drains the RX queue under the CPU budget
+ */
+static void update_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	struct rx_msg msg;
+
+	while (1) {
+		/* Blocking on an empty queue ends the current slice */
+		if (k_msgq_get(&rx_msgq, &msg, K_NO_WAIT) != 0) {
+			if (can_update_writer_verify_pending()) {
+				/* Nothing received yet: read back a written block */
+				verify_idle();
+				budget_checkpoint();
+				continue;
+			}
+
+			k_msgq_get(&rx_msgq, &msg, K_FOREVER);
+			budget_slice_begin();
+		}
+
+		switch (msg.kind) {
+		case RX_KIND_J1939:
+			handle_j1939(&msg);
+			break;
+		case RX_KIND_LEGACY:
+			handle_legacy(&msg);
+			break;
+		case RX_KIND_TIMEOUT:
+			process_timeout();
+			break;
+		case RX_KIND_CALL:
+			msg.call();
+			break;
+		default:
+			break;
+		}
+
+		PIPELINE_EVENT(STAGE_FRAME);
+		budget_checkpoint();
+	}
+}
+
+/**
+ * @brief CAN RX callback for J1939 frames addressed to the device
+ */
+static void can_rx_j1939_callback(const struct device *dev, struct can_frame *frame,
+                                  void *user_data)
+{
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	/* PDU2 formats carry group extension, not a destination address */
+	if (((frame->id >> 16) & 0xFF) >= 240) {
+		return;
+	}
+
+	queue_rx_frame(RX_KIND_J1939, frame);
+}
+
+/**
+ * @brief CAN RX callback (legacy protocol support)
+ */
+static void can_rx_callback(const struct device *dev, struct can_frame *frame,
+			     void *user_data)
+{
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	queue_rx_frame(RX_KIND_LEGACY, frame);
+}
+
+/**
+ * @brief Register the J1939 filter for a device address
+ *
+ * A single filter on the destination address field takes every PDU1
+ * frame addressed to us (TP, ETP, DM14/DM16) from any sender, which
+ * keeps the hardware filter bank usage to one entry. Called again
+ * whenever address claim moves the device to a new address. Must run in
+ * thread context.
+ */
+static int register_j1939_filters(uint8_t addr)
+{
+	struct can_filter filter;
+	int ret;
+
+	if (j1939_filter_id >= 0) {
+		can_remove_rx_filter(can_dev, j1939_filter_id);
+		j1939_filter_id = -1;
+	}
+
+	if (addr == J1939_NULL_ADDR) {
+		return 0;
+	}
+
+	filter.id = (uint32_t)addr << 8;
+	filter.mask = 0xFF << 8;
+	filter.flags = CAN_FILTER_IDE;
+
+	ret = can_add_rx_filter(can_dev, can_rx_j1939_callback, NULL, &filter);
+	if (ret < 0) {
+		LOG_ERR("Failed to add J1939 filter: %d", ret);
+		return ret;
+	}
+	j1939_filter_id = ret;
+
+	return 0;
+}
+
+#if defined(CONFIG_CAN_UPDATE_ADDRESS_CLAIM)
+/**
+ * @brief Move the J1939 filter to the address we ended up claiming
+ */
+static void address_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	register_j1939_filters(device_addr);
+	LOG_INF("Update listener now at address 0x%02x", device_addr);
+}
+
+static K_WORK_DEFINE(address_work, address_work_handler);
+
+/**
+ * @brief Address claim state change callback
+ *
+ * May be called from the CAN RX callback, so filter changes are deferred
+ * to the system work queue.
+ */
+static void address_claim_callback(uint8_t address, enum j1939_ac_state state,
+                                   void *user_data)
+{
+	ARG_UNUSED(user_data);
+
+	if (state != J1939_AC_STATE_CLAIMED && state != J1939_AC_STATE_CANNOT_CLAIM) {
+		return;
+	}
+
+	if (address != device_addr) {
+		device_addr = address;
+		k_work_submit(&address_work);
+	}
+}
+
+static int start_address_claim(void)
+{
+	bool arbitrary = IS_ENABLED(CONFIG_J1939_AC_ARBITRARY_CAPABLE);
+	struct j1939_ac_config config = {
+		.can_dev = can_dev,
+		.name = j1939_name_build(can_update_unit_identity(CONFIG_CAN_UPDATE_J1939_IDENTITY),
+		                         CONFIG_J1939_AC_DEFAULT_MANUFACTURER_CODE,
+		                         0, 0, CONFIG_CAN_UPDATE_J1939_FUNCTION,
+		                         0, 0, 0, arbitrary),
+		.preferred_address = CONFIG_CAN_UPDATE_J1939_ADDRESS,
+		.priority = CONFIG_J1939_AC_DEFAULT_PRIORITY,
+		.arbitrary_capable = arbitrary,
+		.claim_timeout_ms = CONFIG_J1939_AC_CLAIM_TIMEOUT_MS,
+	};
+	int ret;
+
+	ret = j1939_address_claim_init(&config, address_claim_callback, NULL);
+	if (ret) {
+		return ret;
+	}
+
+	return j1939_address_claim_start();
+}
+#endif /* CONFIG_CAN_UPDATE_ADDRESS_CLAIM */
+
 int can_update_init(const struct device *dev)
 {
 	int ret;
+	int legacy_filter_id;
 	struct can_filter filter;
-	uint32_t tp_cm_id, tp_dt_id;
+
+	if (initialized) {
+		/* Already brought up (e.g. at SYS_INIT time): just attach */
+		return (dev == can_dev) ? 0 : -EALREADY;
+	}
 
 	if (!device_is_ready(dev)) {
 		LOG_ERR("CAN device not ready");
 		return -ENODEV;
 	}
 
+	/* Not published through initialized until every step below passed */
 	can_dev = dev;
 	k_mutex_init(&update_mutex);
 
+#if defined(CONFIG_CAN_UPDATE_XCP_EVENTS)
+	if (!stage_events_ready) {
+		register_stage_events();
+	}
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+	/* Without stored measurements the defaults apply */
+	(void)can_update_tune_init();
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+	/* Without a record the Kconfig identity applies */
+	(void)can_update_unit_init();
+#endif
+
 	/* Configure CAN mode */
 	ret = can_set_mode(can_dev, CAN_MODE_NORMAL);
 	if (ret) {
 		LOG_ERR("Failed to set CAN mode: %d", ret);
-		return ret;
-	}
-
-	/* Setup J1939 TP.CM filter (Connection Management) */
-	tp_cm_id = j1939_build_can_id(J1939_PRIORITY, J1939_PGN_TP_CM,
-	                               J1939_DST_ADDR, J1939_SRC_ADDR);
-	filter.id = tp_cm_id;
-	filter.mask = CAN_EXT_ID_MASK;
-	filter.flags = CAN_FILTER_IDE;
-
-	ret = can_add_rx_filter(can_dev, can_rx_tp_cm_callback, NULL, &filter);
-	if (ret < 0) {
-		LOG_ERR("Failed to add TP.CM filter: %d", ret);
-		return ret;
+		goto err;
 	}
 
-	/* Setup J1939 TP.DT filter (Data Transfer) */
-	tp_dt_id = j1939_build_can_id(J1939_PRIORITY, J1939_PGN_TP_DT,
-	                               J1939_DST_ADDR, J1939_SRC_ADDR);
-	filter.id = tp_dt_id;
-	filter.mask = CAN_EXT_ID_MASK;
-	filter.flags = CAN_FILTER_IDE;
-
-	ret = can_add_rx_filter(can_dev, can_rx_tp_dt_callback, NULL, &filter);
-	if (ret < 0) {
-		LOG_ERR("Failed to add TP.DT filter: %d", ret);
-		return ret;
+	ret = register_j1939_filters(device_addr);
+	if (ret) {
+		goto err;
 	}
 
 	/* Also setup legacy filter for backward compatibility */
@@ -519,27 +1711,68 @@ int can_update_init(const struct device *dev)
 	filter.mask = CAN_STD_ID_MASK;
 	filter.flags = 0; /* Standard 11-bit ID, data frames */
 
-	ret = can_add_rx_filter(can_dev, can_rx_callback, NULL, &filter);
-	if (ret < 0) {
-		LOG_WRN("Failed to add legacy filter: %d", ret);
+	legacy_filter_id = can_add_rx_filter(can_dev, can_rx_callback, NULL, &filter);
+	if (legacy_filter_id < 0) {
+		LOG_WRN("Failed to add legacy filter: %d", legacy_filter_id);
 		/* Not fatal, continue */
 	}
 
 	ret = can_start(can_dev);
 	if (ret) {
 		LOG_ERR("Failed to start CAN: %d", ret);
-		return ret;
+		goto err_filters;
+	}
+
+#if defined(CONFIG_CAN_UPDATE_UDS)
+	ret = can_update_uds_init(can_dev);
+	if (ret) {
+		LOG_ERR("Failed to start UDS server: %d", ret);
+		goto err_stop;
 	}
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_ADDRESS_CLAIM)
+	ret = start_address_claim();
+	if (ret) {
+		LOG_ERR("Failed to start address claim: %d", ret);
+		goto err_stop;
+	}
+#endif
+
+	/* Frames received so far wait in rx_msgq */
+	k_thread_create(&update_thread_data, update_thread_stack,
+	                K_THREAD_STACK_SIZEOF(update_thread_stack),
+	                update_thread, NULL, NULL, NULL,
+	                CAN_UPDATE_THREAD_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&update_thread_data, "can_update");
+	initialized = true;
+
+	/* Boot-time instrumentation: ignition-to-CAN-ready on this image */
+	stats.ready_us = k_ticks_to_us_floor32(k_uptime_ticks());
 
 	LOG_INF("CAN update driver initialized with J1939 support");
 	LOG_INF("Device address: 0x%02x, Host address: 0x%02x",
-	        J1939_SRC_ADDR, J1939_DST_ADDR);
+	        device_addr, J1939_DST_ADDR);
 	return 0;
+
+#if defined(CONFIG_CAN_UPDATE_UDS) || defined(CONFIG_CAN_UPDATE_ADDRESS_CLAIM)
+err_stop:
+	(void)can_stop(can_dev);
+#endif
+err_filters:
+	if (legacy_filter_id >= 0) {
+		can_remove_rx_filter(can_dev, legacy_filter_id);
+	}
+	(void)register_j1939_filters(J1939_NULL_ADDR);
+err:
+	/* A later call starts over */
+	can_dev = NULL;
+	return ret;
 }
 
 int can_update_start(void)
 {
-	if (!can_dev) {
+	if (!initialized) {
 		return -ENODEV;
 	}
 
@@ -548,7 +1781,7 @@ int can_update_start(void)
 
 int can_update_stop(void)
 {
-	if (!can_dev) {
+	if (!initialized) {
 		return -ENODEV;
 	}
 
@@ -559,3 +1792,33 @@ enum can_update_status can_update_get_status(void)
 {
 	return current_status;
 }
+
+void can_update_get_stats(struct can_update_stats *out)
+{
+	*out = stats;
+}
+
+#if defined(CONFIG_CAN_UPDATE_SYS_INIT)
+/**
+ * @brief Bring the update listener up before application init
+ *
+ * The application later attaches with can_update_init(), which returns
+ * immediately once the listener is running.
+ */
+static int can_update_sys_init(void)
+{
+	int ret = can_update_init(DEVICE_DT_GET(DT_CHOSEN(zephyr_canbus)));
+
+	if (ret) {
+		LOG_ERR("Failed to start CAN update listener: %d", ret);
+	}
+
+	return ret;
+}
+
+#if defined(CONFIG_CAN_UPDATE_SYS_INIT_POST_KERNEL)
+SYS_INIT(can_update_sys_init, POST_KERNEL, CONFIG_CAN_UPDATE_INIT_PRIORITY);
+#else
+SYS_INIT(can_update_sys_init, APPLICATION, CONFIG_CAN_UPDATE_INIT_PRIORITY);
+#endif
+#endif /* CONFIG_CAN_UPDATE_SYS_INIT */
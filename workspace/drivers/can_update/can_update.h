@@ -21,13 +21,27 @@ extern "C" {
 #define J1939_TP_CM_BAM   32  /* Broadcast Announce Message */
 #define J1939_TP_CM_ABORT 255 /* Connection Abort */
 
+/**
+ * @brief J1939 Extended Transport Protocol Control Bytes
+ */
+#define J1939_ETP_CM_RTS  20  /* Request to Send */
+#define J1939_ETP_CM_CTS  21  /* Clear to Send */
+#define J1939_ETP_CM_DPO  22  /* Data Packet Offset */
+#define J1939_ETP_CM_EOMA 23  /* End of Message Acknowledgment */
+
 /**
  * @brief J1939 PGN Definitions
  */
 #define J1939_PGN_TP_CM 0xEC00  /* Transport Protocol - Connection Management */
 #define J1939_PGN_TP_DT 0xEB00  /* Transport Protocol - Data Transfer */
 #define J1939_PGN_REQUEST 0xEA00 /* Request PGN */
+#define J1939_PGN_ETP_CM 0xC800 /* Extended Transport Protocol - Connection Management */
+#define J1939_PGN_ETP_DT 0xC700 /* Extended Transport Protocol - Data Transfer */
+#define J1939_PGN_DM14 0xD900   /* Memory Access Request */
+#define J1939_PGN_DM15 0xD800   /* Memory Access Response */
+#define J1939_PGN_DM16 0xD700   /* Binary Data Transfer */
 #define J1939_PGN_FIRMWARE_UPDATE 0xEF00 /* Custom PGN for firmware updates */
+#define J1939_PGN_MODULE_UPDATE 0x1EF00  /* Custom PGN for LLEXT module updates */
 
 /**
  * @brief CAN Update Protocol Message Types
@@ -52,9 +66,24 @@ enum can_update_status {
 	CAN_UPDATE_STATUS_ERROR = 0x03,
 };
 
+/**
+ * @brief CAN Update Pipeline Statistics
+ */
+struct can_update_stats {
+	uint32_t frames_received;   /* Frames accepted by the RX filters */
+	uint32_t frames_dropped;    /* Frames lost because the RX queue was full */
+	uint32_t slices_exhausted;  /* Times the CPU budget forced a yield */
+	uint32_t max_slice_us;      /* Longest continuous run of the update thread */
+	uint32_t ready_us;          /* Uptime at which the listener was ready */
+	uint32_t verify_failures;   /* Written blocks that read back wrong */
+};
+
 /**
  * @brief Initialize CAN update driver
  *
+ * If the listener is already running (CONFIG_CAN_UPDATE_SYS_INIT brings it
+ * up before application init), this only attaches to it and returns 0.
+ *
  * @param dev CAN device
  * @return 0 on success, negative errno on failure
  */
@@ -81,6 +110,65 @@ int can_update_stop(void);
  */
 enum can_update_status can_update_get_status(void);
 
+/**
+ * @brief Get update pipeline statistics
+ *
+ * @param stats Filled with a snapshot of the current counters
+ */
+void can_update_get_stats(struct can_update_stats *stats);
+
+/**
+ * @brief Take the lock every flash erase and program of the driver holds
+ *
+ * With CONFIG_CAN_UPDATE_FLASH_ASYNC the flash controller must not be
+ * touched while an operation sleeps. Slot1, the image cache, module
+ * slots, calibration, tuned settings and the upgrade request all go
+ * through this lock; application code that writes flash while the
+ * listener may run (e.g. confirming the image) takes it as well.
+ * Recursive. Never wait for the update thread while holding it.
+ */
+void can_update_flash_lock(void);
+
+/**
+ * @brief Release the lock taken by can_update_flash_lock()
+ */
+void can_update_flash_unlock(void);
+
+/**
+ * @brief DM14 security seed callback
+ *
+ * @param requester Source address of the service tool
+ * @param user_data User data passed to can_update_dm_set_security()
+ * @return Seed to send in DM15; 0xFFFF grants access without a key
+ */
+typedef uint16_t (*can_update_dm_seed_cb_t)(uint8_t requester, void *user_data);
+
+/**
+ * @brief DM14 security key callback
+ *
+ * @param requester Source address of the service tool
+ * @param seed Seed previously returned by the seed callback
+ * @param key Key received in DM14
+ * @param user_data User data passed to can_update_dm_set_security()
+ * @return true if the key unlocks memory access
+ */
+typedef bool (*can_update_dm_key_cb_t)(uint8_t requester, uint16_t seed, uint16_t key,
+                                       void *user_data);
+
+/**
+ * @brief Install the DM14 seed/key exchange hooks
+ *
+ * Requires CONFIG_CAN_UPDATE_DM14. Until hooks are installed, memory
+ * access is refused when CONFIG_CAN_UPDATE_DM_SECURITY is enabled and
+ * open otherwise.
+ *
+ * @param seed_cb Seed generator
+ * @param key_cb Key checker
+ * @param user_data Passed to both callbacks
+ */
+void can_update_dm_set_security(can_update_dm_seed_cb_t seed_cb,
+                                can_update_dm_key_cb_t key_cb, void *user_data);
+
 /**
  * @brief Helper to build J1939 29-bit CAN ID
  *
@@ -93,7 +181,7 @@ enum can_update_status can_update_get_status(void);
 static inline uint32_t j1939_build_can_id(uint8_t priority, uint32_t pgn,
                                            uint8_t src_addr, uint8_t dst_addr)
 {
-	uint32_t can_id = 0x80000000; /* Extended frame */
+	uint32_t can_id = 0; /* Extended frame is flagged with CAN_FRAME_IDE */
 	can_id |= (priority & 0x07) << 26;
 	can_id |= (pgn & 0x3FFFF) << 8;
 	can_id |= (src_addr & 0xFF);
@@ -0,0 +1,1123 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Image Cache
+ * A ring of erase pages in storage_partition holds LZSS-compressed copies
+ * of confirmed images. Every entry starts on a page of its own with its
+ * header, which is written last. A new entry only erases the pages in
+ * front of the newest one, so the first page it takes from an older entry
+ * is the one holding that entry's header: an entry disappears before any
+ * of its data is overwritten.
+ */
+
+#include "can_update.h"
+#include "can_update_cache.h"
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define CACHE_MAGIC 0x43495543  /* "CUIC" */
+#define CACHE_AREA_OFFSET CONFIG_CAN_UPDATE_IMAGE_CACHE_OFFSET
+
+/* Flash write chunk and decompression I/O buffers */
+#define CACHE_CHUNK 256
+
+/* Memory-mapped slot0, read directly by the compressor */
+#define CACHE_SLOT0_BASE \
+	(DT_REG_ADDR(DT_CHOSEN(zephyr_flash)) + FIXED_PARTITION_OFFSET(slot0_partition))
+
+/* J1939 cache commands, single frames on PGN 0xEF00 from the host */
+#define CACHE_CMD_LIST    0xC0  /* [index] -> entry info and CACHE_CMD_HASH */
+#define CACHE_CMD_RESTORE 0xC1  /* [select, key...] -> [status] when done */
+#define CACHE_CMD_HASH    0xC2  /* Reply: [index, first 6 hash bytes] */
+
+#define CACHE_SELECT_VERSION 0  /* major, minor, revision (LE) */
+#define CACHE_SELECT_HASH    1  /* First 6 bytes of the hash */
+#define CACHE_SELECT_INDEX   2  /* Position in the list, newest first */
+
+/* LZSS: 4 KiB window, matches of 3..18 bytes coded in two bytes, a flag
+ * byte in front of every 8 items
+ */
+#define LZ_WINDOW      4096
+#define LZ_MIN_MATCH   3
+#define LZ_MAX_MATCH   18
+#define LZ_HASH_BITS   11
+#define LZ_CHAIN_DEPTH 16
+
+/* MCUboot image format (bootutil/image.h) */
+#define IMAGE_MAGIC          0x96f3b83d
+#define IMAGE_TLV_INFO_MAGIC 0x6907
+#define IMAGE_TLV_SHA256     0x10
+
+struct cache_image_version {
+	uint8_t major;
+	uint8_t minor;
+	uint16_t revision;
+	uint32_t build;
+} __packed;
+
+struct cache_image_header {
+	uint32_t magic;
+	uint32_t load_addr;
+	uint16_t hdr_size;
+	uint16_t protect_tlv_size;
+	uint32_t img_size;
+	uint32_t flags;
+	struct cache_image_version ver;
+	uint32_t pad;
+} __packed;
+
+struct cache_tlv {
+	uint16_t type;
+	uint16_t len;
+} __packed;
+
+/**
+ * @brief Entry Header
+ *
+ * At the start of the entry's first page, followed by the compressed
+ * image.
+ */
+struct cache_header {
+	uint32_t magic;                           /* CACHE_MAGIC */
+	uint32_t seq;                             /* Entry id */
+	uint8_t hash[CAN_UPDATE_CACHE_HASH_LEN];
+	struct cache_image_version ver;
+	uint32_t image_size;
+	uint32_t packed_size;
+	uint32_t image_crc;                       /* CRC-32 of the image */
+	uint32_t packed_crc;                      /* CRC-32 of the compressed data */
+	uint8_t reserved[28];                     /* 0xFF */
+	uint32_t hdr_crc;                         /* CRC-32 of the fields above */
+} __packed;
+
+BUILD_ASSERT(sizeof(struct cache_header) == 96, "cache header must stay 96 bytes");
+
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+BUILD_ASSERT(CONFIG_CAN_UPDATE_IMAGE_CACHE_OFFSET >=
+             CONFIG_CAN_UPDATE_MODULE_AREA_OFFSET +
+             CONFIG_CAN_UPDATE_MODULE_SLOTS * CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE ||
+             (CONFIG_CAN_UPDATE_IMAGE_CACHE_SIZE != 0 &&
+              CONFIG_CAN_UPDATE_IMAGE_CACHE_OFFSET + CONFIG_CAN_UPDATE_IMAGE_CACHE_SIZE <=
+              CONFIG_CAN_UPDATE_MODULE_AREA_OFFSET),
+             "image cache overlaps the module slots");
+#endif
+
+struct cache_slot {
+	struct cache_header hdr;
+	uint32_t start;          /* Area offset of the header */
+};
+
+struct unlz_ctx {
+	uint32_t start;          /* Area offset of the compressed data */
+	uint32_t packed;
+	uint32_t read;           /* Compressed bytes read so far */
+	size_t in_idx;
+	size_t in_len;
+	uint32_t out;            /* Image bytes produced so far */
+	size_t out_len;          /* Bytes waiting in the output buffer */
+	uint32_t crc;            /* CRC-32 of the image bytes written */
+};
+
+static struct {
+	const struct flash_area *fa;
+	uint32_t size;           /* Area size */
+
+	/* Valid entries, newest first */
+	struct cache_slot index[CONFIG_CAN_UPDATE_IMAGE_CACHE_ENTRIES];
+	size_t count;
+
+	/* Entry being written; positions are relative to w_start */
+	uint32_t w_start;
+	uint32_t w_pos;
+	uint32_t w_erased;
+	uint32_t w_crc;
+	uint8_t wbuf[CACHE_CHUNK];
+	size_t wbuf_len;
+
+	/* Compression and restore never run at the same time */
+	union {
+		struct {
+			uint32_t head[1 << LZ_HASH_BITS];  /* Position + 1 of the last string, 0 if none */
+			uint16_t prev[LZ_WINDOW];          /* Distance to the previous string, 0 if none */
+		} lz;
+		struct {
+			uint8_t window[LZ_WINDOW];
+			uint8_t in[CACHE_CHUNK];
+			uint8_t out[CACHE_CHUNK];
+		} unlz;
+	};
+} cache;
+
+/* Held while the cache is read or written */
+static K_MUTEX_DEFINE(cache_lock);
+
+/* can_update_cache_restore() hands the request to the update thread */
+static K_MUTEX_DEFINE(restore_lock);
+static K_SEM_DEFINE(restore_done, 0, 1);
+static struct {
+	uint32_t id;
+	int result;
+} restore_req;
+
+/**
+ * @brief Bounds of the erase page holding an area offset, clipped to the area
+ */
+static int cache_page_bounds(uint32_t off, uint32_t *start, uint32_t *end)
+{
+	uint32_t base = cache.fa->fa_off + CACHE_AREA_OFFSET;
+	struct flash_pages_info info;
+	int ret;
+
+	ret = flash_get_page_info_by_offs(flash_area_get_device(cache.fa), base + off, &info);
+	if (ret) {
+		return ret;
+	}
+
+	*start = MAX((uint32_t)info.start_offset, base) - base;
+	*end = MIN((uint32_t)info.start_offset + info.size - base, cache.size);
+	return 0;
+}
+
+static bool cache_header_valid(const struct cache_header *hdr)
+{
+	return hdr->magic == CACHE_MAGIC &&
+	       hdr->hdr_crc == crc32_ieee((const uint8_t *)hdr,
+	                                  offsetof(struct cache_header, hdr_crc)) &&
+	       hdr->packed_size > 0 &&
+	       hdr->packed_size <= cache.size - sizeof(struct cache_header);
+}
+
+/**
+ * @brief Add an entry to the index, keeping it sorted newest first
+ *
+ * With the index full, the oldest entry is dropped (or @p slot, if it is
+ * older than all of them).
+ */
+static void cache_index_insert(const struct cache_slot *slot)
+{
+	size_t pos = 0;
+
+	while (pos < cache.count && cache.index[pos].hdr.seq > slot->hdr.seq) {
+		pos++;
+	}
+
+	if (pos == ARRAY_SIZE(cache.index)) {
+		return;
+	}
+
+	if (cache.count == ARRAY_SIZE(cache.index)) {
+		cache.count--;
+	}
+
+	memmove(&cache.index[pos + 1], &cache.index[pos],
+	        (cache.count - pos) * sizeof(cache.index[0]));
+	cache.index[pos] = *slot;
+	cache.count++;
+}
+
+/**
+ * @brief Drop index entries whose header lies in [start, end)
+ */
+static void cache_index_forget(uint32_t start, uint32_t end)
+{
+	size_t i = 0;
+
+	while (i < cache.count) {
+		if (cache.index[i].start >= start && cache.index[i].start < end) {
+			LOG_INF("Image cache: evicting entry %u", cache.index[i].hdr.seq);
+			cache.count--;
+			memmove(&cache.index[i], &cache.index[i + 1],
+			        (cache.count - i) * sizeof(cache.index[0]));
+		} else {
+			i++;
+		}
+	}
+}
+
+static void cache_scan(void)
+{
+	struct cache_slot slot;
+	uint32_t start;
+	uint32_t end;
+
+	cache.count = 0;
+
+	for (uint32_t off = 0; off < cache.size; off = end) {
+		if (cache_page_bounds(off, &start, &end)) {
+			break;
+		}
+
+		if (flash_area_read(cache.fa, CACHE_AREA_OFFSET + off, &slot.hdr,
+		                    sizeof(slot.hdr)) == 0 &&
+		    cache_header_valid(&slot.hdr)) {
+			slot.start = off;
+			cache_index_insert(&slot);
+		}
+	}
+
+	LOG_INF("Image cache: %u bytes, %zu entries", cache.size, cache.count);
+}
+
+static int cache_open(void)
+{
+	uint32_t part_size = FIXED_PARTITION_SIZE(storage_partition);
+	uint32_t start;
+	uint32_t end;
+	int ret;
+
+	if (cache.fa) {
+		return 0;
+	}
+
+	cache.size = CONFIG_CAN_UPDATE_IMAGE_CACHE_SIZE ? CONFIG_CAN_UPDATE_IMAGE_CACHE_SIZE :
+	             part_size - MIN(CACHE_AREA_OFFSET, part_size);
+	if (CACHE_AREA_OFFSET >= part_size || cache.size > part_size - CACHE_AREA_OFFSET ||
+	    cache.size <= sizeof(struct cache_header)) {
+		LOG_ERR("Image cache does not fit in storage_partition");
+		return -ENOSPC;
+	}
+
+	ret = flash_area_open(FIXED_PARTITION_ID(storage_partition), &cache.fa);
+	if (ret) {
+		cache.fa = NULL;
+		return ret;
+	}
+
+	/* Entries start on pages; the area has to as well */
+	ret = cache_page_bounds(0, &start, &end);
+	if (ret == 0 && start != 0) {
+		LOG_ERR("Image cache offset 0x%x is not page aligned", CACHE_AREA_OFFSET);
+		ret = -EINVAL;
+	}
+	if (ret) {
+		flash_area_close(cache.fa);
+		cache.fa = NULL;
+		return ret;
+	}
+
+	cache_scan();
+	return 0;
+}
+
+/**
+ * @brief Read from the ring; @p pos may run past the end of the area
+ */
+static int cache_read(uint32_t pos, void *data, size_t len)
+{
+	uint8_t *p = data;
+
+	while (len > 0) {
+		uint32_t off = pos % cache.size;
+		size_t n = MIN(len, cache.size - off);
+		int ret = flash_area_read(cache.fa, CACHE_AREA_OFFSET + off, p, n);
+
+		if (ret) {
+			return ret;
+		}
+
+		pos += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int cache_write(uint32_t pos, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		uint32_t off = pos % cache.size;
+		size_t n = MIN(len, cache.size - off);
+		int ret;
+
+		/* Also called from main(); not through can_update_flash_write(),
+		 * which restarts the update thread's slice
+		 */
+		can_update_flash_lock();
+		ret = flash_area_write(cache.fa, CACHE_AREA_OFFSET + off, p, n);
+		can_update_flash_unlock();
+		if (ret) {
+			return ret;
+		}
+
+		pos += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Erase the pages the entry being written needs up to @p pos_end
+ */
+static int cache_prepare(uint32_t pos_end)
+{
+	uint32_t start;
+	uint32_t end;
+	int ret;
+
+	if (pos_end > cache.size) {
+		/* Would wrap onto its own header */
+		return -ENOSPC;
+	}
+
+	while (cache.w_erased < pos_end) {
+		uint32_t off = (cache.w_start + cache.w_erased) % cache.size;
+
+		ret = cache_page_bounds(off, &start, &end);
+		if (ret) {
+			return ret;
+		}
+
+		cache_index_forget(start, end);
+		can_update_flash_lock();
+		ret = flash_area_erase(cache.fa, CACHE_AREA_OFFSET + start, end - start);
+		can_update_flash_unlock();
+		if (ret) {
+			return ret;
+		}
+
+		cache.w_erased += end - off;
+	}
+
+	return 0;
+}
+
+static int cache_flush(void)
+{
+	size_t block = flash_get_write_block_size(flash_area_get_device(cache.fa));
+	size_t len = ROUND_UP(cache.wbuf_len, block);
+	int ret;
+
+	if (cache.wbuf_len == 0) {
+		return 0;
+	}
+
+	memset(&cache.wbuf[cache.wbuf_len], 0xFF, len - cache.wbuf_len);
+
+	ret = cache_prepare(cache.w_pos + len);
+	if (ret == 0) {
+		ret = cache_write(cache.w_start + cache.w_pos, cache.wbuf, len);
+	}
+
+	cache.w_pos += cache.wbuf_len;
+	cache.wbuf_len = 0;
+	return ret;
+}
+
+static int cache_put(const uint8_t *data, size_t len)
+{
+	int ret;
+
+	cache.w_crc = crc32_ieee_update(cache.w_crc, data, len);
+
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(cache.wbuf) - cache.wbuf_len);
+
+		memcpy(&cache.wbuf[cache.wbuf_len], data, n);
+		cache.wbuf_len += n;
+		data += n;
+		len -= n;
+
+		if (cache.wbuf_len == sizeof(cache.wbuf)) {
+			ret = cache_flush();
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_insert(const uint8_t *src, uint32_t pos)
+{
+	uint32_t h = lz_hash(&src[pos]);
+	uint32_t last = cache.lz.head[h];
+
+	cache.lz.prev[pos % LZ_WINDOW] =
+		(last != 0 && pos + 1 - last < LZ_WINDOW) ? pos + 1 - last : 0;
+	cache.lz.head[h] = pos + 1;
+}
+
+/**
+ * @brief Longest match for the string at @p pos within the window
+ */
+static uint32_t lz_match(const uint8_t *src, uint32_t pos, uint32_t n, uint32_t *dist)
+{
+	uint32_t max = MIN(LZ_MAX_MATCH, n - pos);
+	uint32_t last = cache.lz.head[lz_hash(&src[pos])];
+	uint32_t best = 0;
+	uint32_t cand;
+
+	if (last == 0) {
+		return 0;
+	}
+
+	cand = last - 1;
+	for (int depth = 0; depth < LZ_CHAIN_DEPTH; depth++) {
+		uint32_t d = pos - cand;
+		uint32_t len = 0;
+		uint16_t step;
+
+		if (d == 0 || d > LZ_WINDOW) {
+			break;
+		}
+
+		while (len < max && src[cand + len] == src[pos + len]) {
+			len++;
+		}
+
+		if (len > best) {
+			best = len;
+			*dist = d;
+			if (len == max) {
+				break;
+			}
+		}
+
+		step = cache.lz.prev[cand % LZ_WINDOW];
+		if (step == 0 || step > cand) {
+			break;
+		}
+		cand -= step;
+	}
+
+	return best;
+}
+
+/**
+ * @brief Compress @p n bytes into the entry being written
+ */
+static int cache_compress(const uint8_t *src, uint32_t n)
+{
+	uint8_t group[1 + 8 * 2];
+	size_t group_len = 1;
+	int items = 0;
+	uint32_t pos = 0;
+	int ret;
+
+	memset(&cache.lz, 0, sizeof(cache.lz));
+	group[0] = 0;
+
+	while (pos < n) {
+		uint32_t dist = 0;
+		uint32_t len = (n - pos >= LZ_MIN_MATCH) ? lz_match(src, pos, n, &dist) : 0;
+
+		if (len >= LZ_MIN_MATCH) {
+			group[0] |= BIT(items);
+			group[group_len++] = (dist - 1) & 0xFF;
+			group[group_len++] = ((dist - 1) >> 8) | ((len - LZ_MIN_MATCH) << 4);
+		} else {
+			len = 1;
+			group[group_len++] = src[pos];
+		}
+
+		for (uint32_t end = pos + len; pos < end; pos++) {
+			if (n - pos >= LZ_MIN_MATCH) {
+				lz_insert(src, pos);
+			}
+		}
+
+		if (++items == 8) {
+			ret = cache_put(group, group_len);
+			if (ret) {
+				return ret;
+			}
+			group[0] = 0;
+			group_len = 1;
+			items = 0;
+		}
+	}
+
+	if (items > 0) {
+		ret = cache_put(group, group_len);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return cache_flush();
+}
+
+static int unlz_get(struct unlz_ctx *ctx)
+{
+	if (ctx->in_idx == ctx->in_len) {
+		size_t n = MIN(sizeof(cache.unlz.in), ctx->packed - ctx->read);
+		int ret;
+
+		if (n == 0) {
+			return -EIO;
+		}
+
+		ret = cache_read(ctx->start + ctx->read, cache.unlz.in, n);
+		if (ret) {
+			return ret;
+		}
+
+		ctx->read += n;
+		ctx->in_idx = 0;
+		ctx->in_len = n;
+	}
+
+	return cache.unlz.in[ctx->in_idx++];
+}
+
+static int unlz_flush(struct unlz_ctx *ctx)
+{
+	int ret;
+
+	if (ctx->out_len == 0) {
+		return 0;
+	}
+
+	ctx->crc = crc32_ieee_update(ctx->crc, cache.unlz.out, ctx->out_len);
+	ret = can_update_writer_write(ctx->out - ctx->out_len, cache.unlz.out, ctx->out_len);
+	ctx->out_len = 0;
+	return ret;
+}
+
+static int unlz_put(struct unlz_ctx *ctx, uint8_t byte)
+{
+	cache.unlz.window[ctx->out % LZ_WINDOW] = byte;
+	cache.unlz.out[ctx->out_len++] = byte;
+	ctx->out++;
+
+	return ctx->out_len == sizeof(cache.unlz.out) ? unlz_flush(ctx) : 0;
+}
+
+/**
+ * @brief Decompress an entry into the open slot1 writer
+ */
+static int cache_unpack(const struct cache_slot *slot, uint32_t *crc)
+{
+	struct unlz_ctx ctx = {
+		.start = slot->start + sizeof(struct cache_header),
+		.packed = slot->hdr.packed_size,
+	};
+	uint32_t size = slot->hdr.image_size;
+	int ret = 0;
+
+	while (ret == 0 && ctx.out < size) {
+		int flags = unlz_get(&ctx);
+
+		if (flags < 0) {
+			return flags;
+		}
+
+		for (int bit = 0; bit < 8 && ret == 0 && ctx.out < size; bit++) {
+			int lo = unlz_get(&ctx);
+
+			if (lo < 0) {
+				return lo;
+			}
+
+			if (!(flags & BIT(bit))) {
+				ret = unlz_put(&ctx, lo);
+				continue;
+			}
+
+			int hi = unlz_get(&ctx);
+
+			if (hi < 0) {
+				return hi;
+			}
+
+			uint32_t dist = (lo | ((hi & 0x0F) << 8)) + 1;
+			uint32_t len = (hi >> 4) + LZ_MIN_MATCH;
+
+			if (dist > ctx.out) {
+				return -EIO;
+			}
+
+			for (uint32_t i = 0; i < len && ret == 0 && ctx.out < size; i++) {
+				ret = unlz_put(&ctx, cache.unlz.window[(ctx.out - dist) % LZ_WINDOW]);
+			}
+		}
+	}
+
+	if (ret == 0) {
+		ret = unlz_flush(&ctx);
+	}
+
+	*crc = ctx.crc;
+	return ret;
+}
+
+/**
+ * @brief CRC-32 of the compressed data of an entry, read back from flash
+ */
+static int cache_check(const struct cache_slot *slot)
+{
+	uint32_t pos = slot->start + sizeof(struct cache_header);
+	uint32_t crc = 0;
+
+	for (uint32_t done = 0; done < slot->hdr.packed_size;) {
+		size_t n = MIN(sizeof(cache.unlz.in), slot->hdr.packed_size - done);
+		int ret = cache_read(pos + done, cache.unlz.in, n);
+
+		if (ret) {
+			return ret;
+		}
+
+		crc = crc32_ieee_update(crc, cache.unlz.in, n);
+		done += n;
+	}
+
+	return crc == slot->hdr.packed_crc ? 0 : -EIO;
+}
+
+/**
+ * @brief Restore an entry into slot1. Update thread, cache_lock held.
+ */
+static int cache_restore_slot(const struct cache_slot *slot)
+{
+	uint32_t crc;
+	int ret;
+
+	/* Check before slot1 is erased: a corrupt entry leaves slot1 alone */
+	ret = cache_check(slot);
+	if (ret) {
+		LOG_ERR("Image cache entry %u is corrupt", slot->hdr.seq);
+		return ret;
+	}
+
+	LOG_INF("Restoring cached image %u.%u.%u+%u (entry %u)", slot->hdr.ver.major,
+	        slot->hdr.ver.minor, slot->hdr.ver.revision, slot->hdr.ver.build, slot->hdr.seq);
+
+	ret = can_update_writer_open(CAN_UPDATE_MODE_CACHE, true);
+	if (ret) {
+		return ret;
+	}
+
+	ret = cache_unpack(slot, &crc);
+	if (ret == 0 && crc != slot->hdr.image_crc) {
+		LOG_ERR("Restored image CRC 0x%08x, expected 0x%08x", crc, slot->hdr.image_crc);
+		ret = -EIO;
+	}
+	if (ret) {
+		can_update_writer_abort();
+		return ret;
+	}
+
+	return can_update_writer_finish();
+}
+
+/**
+ * @brief Restore the entry at @p pos of the index. Update thread.
+ */
+static int cache_restore_index(int pos)
+{
+	struct cache_slot slot;
+
+	if (pos < 0 || (size_t)pos >= cache.count) {
+		return -ENOENT;
+	}
+
+	/* The index can change while slot1 is written */
+	slot = cache.index[pos];
+	return cache_restore_slot(&slot);
+}
+
+static int cache_find_id(uint32_t id)
+{
+	for (size_t i = 0; i < cache.count; i++) {
+		if (cache.index[i].hdr.seq == id) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int cache_find_hash(const uint8_t *hash, size_t len)
+{
+	for (size_t i = 0; i < cache.count; i++) {
+		if (memcmp(cache.index[i].hdr.hash, hash, len) == 0) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int cache_find_version(uint8_t major, uint8_t minor, uint16_t revision)
+{
+	/* Newest build of that version */
+	for (size_t i = 0; i < cache.count; i++) {
+		const struct cache_image_version *ver = &cache.index[i].hdr.ver;
+
+		if (ver->major == major && ver->minor == minor && ver->revision == revision) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * @brief Identify an MCUboot image: header, SHA-256 TLV and total size
+ */
+static int image_identity(const struct flash_area *fa, struct cache_image_header *ih,
+                          uint8_t *hash, uint32_t *total)
+{
+	struct cache_tlv info;
+	struct cache_tlv tlv;
+	uint32_t off;
+	uint32_t end;
+	int ret;
+
+	ret = flash_area_read(fa, 0, ih, sizeof(*ih));
+	if (ret) {
+		return ret;
+	}
+	if (ih->magic != IMAGE_MAGIC) {
+		return -ENOENT;
+	}
+
+	/* Unprotected TLV area, behind the protected one */
+	off = ih->hdr_size + ih->img_size + ih->protect_tlv_size;
+	ret = flash_area_read(fa, off, &info, sizeof(info));
+	if (ret) {
+		return ret;
+	}
+	if (info.type != IMAGE_TLV_INFO_MAGIC) {
+		return -ENOENT;
+	}
+
+	end = off + info.len;
+	if (end > flash_area_get_size(fa)) {
+		return -E2BIG;
+	}
+
+	for (off += sizeof(info); off + sizeof(tlv) <= end; off += sizeof(tlv) + tlv.len) {
+		ret = flash_area_read(fa, off, &tlv, sizeof(tlv));
+		if (ret) {
+			return ret;
+		}
+
+		if (tlv.type == IMAGE_TLV_SHA256 && tlv.len == CAN_UPDATE_CACHE_HASH_LEN) {
+			*total = end;
+			return flash_area_read(fa, off + sizeof(tlv), hash, CAN_UPDATE_CACHE_HASH_LEN);
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * @brief First page after the newest entry
+ */
+static uint32_t cache_next_start(void)
+{
+	const struct cache_slot *newest = &cache.index[0];
+	uint32_t last;
+	uint32_t start;
+	uint32_t end;
+
+	if (cache.count == 0) {
+		return 0;
+	}
+
+	last = (newest->start + sizeof(struct cache_header) + newest->hdr.packed_size - 1) %
+	       cache.size;
+	if (cache_page_bounds(last, &start, &end)) {
+		return 0;
+	}
+
+	return end % cache.size;
+}
+
+static int cache_evict_oldest(void)
+{
+	const struct cache_slot *oldest = &cache.index[cache.count - 1];
+	uint32_t start;
+	uint32_t end;
+	int ret;
+
+	/* Entries own their pages, so erasing the header page drops only this one */
+	ret = cache_page_bounds(oldest->start, &start, &end);
+	if (ret == 0) {
+		can_update_flash_lock();
+		ret = flash_area_erase(cache.fa, CACHE_AREA_OFFSET + start, end - start);
+		can_update_flash_unlock();
+	}
+	if (ret == 0) {
+		cache_index_forget(start, end);
+	}
+
+	return ret;
+}
+
+int can_update_cache_store_running(void)
+{
+	const struct flash_area *slot0;
+	const uint8_t *src = (const uint8_t *)CACHE_SLOT0_BASE;
+	struct cache_image_header ih;
+	struct cache_slot slot;
+	uint32_t total;
+	size_t block;
+	int ret;
+
+	if (!boot_is_img_confirmed()) {
+		return -EPERM;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+
+	ret = cache_open();
+	if (ret) {
+		goto out;
+	}
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot0_partition), &slot0);
+	if (ret) {
+		goto out;
+	}
+	ret = image_identity(slot0, &ih, slot.hdr.hash, &total);
+	flash_area_close(slot0);
+	if (ret) {
+		LOG_ERR("Cannot identify the running image: %d", ret);
+		goto out;
+	}
+
+	if (cache_find_hash(slot.hdr.hash, CAN_UPDATE_CACHE_HASH_LEN) >= 0) {
+		ret = -EALREADY;
+		goto out;
+	}
+
+	block = flash_get_write_block_size(flash_area_get_device(cache.fa));
+	if (sizeof(cache.wbuf) % block != 0 || sizeof(struct cache_header) % block != 0) {
+		ret = -ENOTSUP;
+		goto out;
+	}
+
+	while (cache.count >= ARRAY_SIZE(cache.index)) {
+		ret = cache_evict_oldest();
+		if (ret) {
+			goto out;
+		}
+	}
+
+	slot.hdr.magic = CACHE_MAGIC;
+	slot.hdr.seq = cache.count > 0 ? cache.index[0].hdr.seq + 1 : 1;
+	slot.hdr.ver = ih.ver;
+	slot.hdr.image_size = total;
+	slot.hdr.image_crc = crc32_ieee(src, total);
+	memset(slot.hdr.reserved, 0xFF, sizeof(slot.hdr.reserved));
+
+	slot.start = cache_next_start();
+	cache.w_start = slot.start;
+	cache.w_pos = sizeof(struct cache_header);
+	cache.w_erased = 0;
+	cache.w_crc = 0;
+	cache.wbuf_len = 0;
+
+	ret = cache_compress(src, total);
+	if (ret) {
+		/* No header, so the partial entry is invisible */
+		LOG_ERR("Caching the running image failed: %d", ret);
+		goto out;
+	}
+
+	slot.hdr.packed_size = cache.w_pos - sizeof(struct cache_header);
+	slot.hdr.packed_crc = cache.w_crc;
+	slot.hdr.hdr_crc = crc32_ieee((const uint8_t *)&slot.hdr,
+	                              offsetof(struct cache_header, hdr_crc));
+
+	ret = cache_write(slot.start, &slot.hdr, sizeof(slot.hdr));
+	if (ret) {
+		goto out;
+	}
+
+	cache_index_insert(&slot);
+	LOG_INF("Cached image %u.%u.%u+%u as entry %u: %u -> %u bytes", ih.ver.major,
+	        ih.ver.minor, ih.ver.revision, ih.ver.build, slot.hdr.seq, total,
+	        slot.hdr.packed_size);
+
+out:
+	k_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+int can_update_cache_list(struct can_update_cache_entry *entries, size_t max)
+{
+	size_t n;
+	int ret;
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+
+	ret = cache_open();
+	if (ret) {
+		k_mutex_unlock(&cache_lock);
+		return ret;
+	}
+
+	n = MIN(max, cache.count);
+	for (size_t i = 0; i < n; i++) {
+		const struct cache_header *hdr = &cache.index[i].hdr;
+
+		entries[i].id = hdr->seq;
+		memcpy(entries[i].hash, hdr->hash, sizeof(entries[i].hash));
+		entries[i].major = hdr->ver.major;
+		entries[i].minor = hdr->ver.minor;
+		entries[i].revision = hdr->ver.revision;
+		entries[i].build = hdr->ver.build;
+		entries[i].image_size = hdr->image_size;
+		entries[i].packed_size = hdr->packed_size;
+	}
+
+	k_mutex_unlock(&cache_lock);
+	return n;
+}
+
+static void cache_restore_handler(void)
+{
+	int ret;
+
+	/* Caching the running image takes seconds; do not stall the thread */
+	if (k_mutex_lock(&cache_lock, K_NO_WAIT) != 0) {
+		restore_req.result = -EBUSY;
+		k_sem_give(&restore_done);
+		return;
+	}
+
+	ret = cache_open();
+	if (ret == 0) {
+		ret = cache_restore_index(cache_find_id(restore_req.id));
+	}
+
+	k_mutex_unlock(&cache_lock);
+
+	restore_req.result = ret;
+	k_sem_give(&restore_done);
+}
+
+int can_update_cache_restore(uint32_t id)
+{
+	int ret;
+
+	k_mutex_lock(&restore_lock, K_FOREVER);
+
+	restore_req.id = id;
+	k_sem_reset(&restore_done);
+
+	ret = can_update_call(cache_restore_handler, K_FOREVER);
+	if (ret == 0) {
+		k_sem_take(&restore_done, K_FOREVER);
+		ret = restore_req.result;
+	}
+
+	k_mutex_unlock(&restore_lock);
+	return ret;
+}
+
+static void cache_cmd_list(uint8_t src, uint8_t index)
+{
+	uint8_t reply[8];
+
+	memset(reply, 0xFF, sizeof(reply));
+	reply[0] = CACHE_CMD_LIST;
+	reply[1] = index;
+	reply[2] = cache.count;
+
+	if (index < cache.count) {
+		const struct cache_header *hdr = &cache.index[index].hdr;
+
+		reply[3] = hdr->ver.major;
+		reply[4] = hdr->ver.minor;
+		sys_put_le16(hdr->ver.revision, &reply[5]);
+	}
+
+	can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+
+	if (index < cache.count) {
+		reply[0] = CACHE_CMD_HASH;
+		memcpy(&reply[2], cache.index[index].hdr.hash, 6);
+		can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+	}
+}
+
+static void cache_cmd_restore(uint8_t src, const uint8_t *data)
+{
+	uint8_t reply[8];
+	int pos;
+	int ret;
+
+	switch (data[1]) {
+	case CACHE_SELECT_VERSION:
+		pos = cache_find_version(data[2], data[3], sys_get_le16(&data[4]));
+		break;
+	case CACHE_SELECT_HASH:
+		pos = cache_find_hash(&data[2], 6);
+		break;
+	case CACHE_SELECT_INDEX:
+		pos = data[2] < cache.count ? data[2] : -ENOENT;
+		break;
+	default:
+		pos = -EINVAL;
+		break;
+	}
+
+	ret = pos < 0 ? pos : cache_restore_index(pos);
+
+	memset(reply, 0xFF, sizeof(reply));
+	reply[0] = CACHE_CMD_RESTORE;
+	reply[1] = -ret;
+	can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+}
+
+void can_update_cache_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len)
+{
+	if (src != CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS || len < 8) {
+		return;
+	}
+
+	if (data[0] != CACHE_CMD_LIST && data[0] != CACHE_CMD_RESTORE) {
+		return;
+	}
+
+	if (k_mutex_lock(&cache_lock, K_NO_WAIT) != 0) {
+		uint8_t reply[8] = {data[0], data[1], 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+		/* Caching in progress; the host asks again */
+		if (data[0] == CACHE_CMD_RESTORE) {
+			reply[1] = EBUSY;
+		}
+		can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+		return;
+	}
+
+	/* If the area cannot be opened the index stays empty and the
+	 * commands report that
+	 */
+	(void)cache_open();
+	if (data[0] == CACHE_CMD_LIST) {
+		cache_cmd_list(src, data[1]);
+	} else {
+		cache_cmd_restore(src, data);
+	}
+
+	k_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Image Cache
+ * Keeps the last verified images compressed in storage_partition, so a
+ * rollback or an A/B switch restores slot1 locally instead of sending
+ * the image over the bus again.
+ */
+
+#ifndef CAN_UPDATE_CACHE_H_
+#define CAN_UPDATE_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAN_UPDATE_CACHE_HASH_LEN 32
+
+/**
+ * @brief Cached Image
+ */
+struct can_update_cache_entry {
+	uint32_t id;                              /* Unique, grows with every store */
+	uint8_t hash[CAN_UPDATE_CACHE_HASH_LEN];  /* SHA-256 TLV of the MCUboot image */
+	uint8_t major;                            /* Image version */
+	uint8_t minor;
+	uint16_t revision;
+	uint32_t build;
+	uint32_t image_size;                      /* Header, image and TLVs */
+	uint32_t packed_size;                     /* Bytes used in the cache */
+};
+
+/**
+ * @brief Add the running image to the cache
+ *
+ * Compresses slot0 into the cache if the image is confirmed and not
+ * cached yet, evicting the oldest entries when space or the entry limit
+ * runs out. Takes a few seconds; call it from a low priority thread once
+ * the application considers the image good.
+ *
+ * @return 0 on success, -EALREADY if the image is cached, -EPERM if it is
+ *         not confirmed, -ENOSPC if it does not fit, negative errno on
+ *         failure
+ */
+int can_update_cache_store_running(void);
+
+/**
+ * @brief List the cached images
+ *
+ * @param entries Filled newest first
+ * @param max Size of @p entries
+ * @return Number of entries filled, negative errno on failure
+ */
+int can_update_cache_list(struct can_update_cache_entry *entries, size_t max);
+
+/**
+ * @brief Restore a cached image into slot1
+ *
+ * Decompresses the image into slot1 in the update thread and requests an
+ * MCUboot test upgrade, like a completed transfer: the update status
+ * becomes CAN_UPDATE_STATUS_SUCCESS and the next reboot swaps it in.
+ * Blocks until slot1 is written. Must be called from thread context,
+ * not from the update thread.
+ *
+ * @param id Entry id from can_update_cache_list()
+ * @return 0 on success, -ENOENT if no such entry, -EBUSY during an
+ *         update, -EIO if the cached data is corrupt, negative errno on
+ *         failure
+ */
+int can_update_cache_restore(uint32_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_CACHE_H_ */
@@ -0,0 +1,436 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * J1939-73 Memory Access (DM14/DM15/DM16)
+ * Lets standard service tools erase and program slot1 through Memory
+ * Access Request/Response and Binary Data Transfer. Binary data larger
+ * than one frame arrives over TP/ETP and streams into the slot1 writer.
+ */
+
+#include "can_update.h"
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+/**
+ * @brief DM14 Commands
+ */
+#define DM14_CMD_ERASE           0
+#define DM14_CMD_READ            1
+#define DM14_CMD_WRITE           2
+#define DM14_CMD_STATUS          3
+#define DM14_CMD_COMPLETED       4
+#define DM14_CMD_FAILED          5
+#define DM14_CMD_BOOT_LOAD       6
+
+/**
+ * @brief DM15 Status Values
+ */
+#define DM15_STATUS_PROCEED      0
+#define DM15_STATUS_BUSY         1
+#define DM15_STATUS_COMPLETED    4
+#define DM15_STATUS_FAILED       5
+
+/**
+ * @brief DM15 Error Indicators
+ */
+#define DM15_ERR_NONE            0xFFFFFF
+#define DM15_ERR_NOT_IDENTIFIED  0x000001
+#define DM15_ERR_BUSY            0x00000F
+#define DM15_ERR_INTERNAL        0x000014
+#define DM15_ERR_ADDRESSING      0x000100
+#define DM15_ERR_LENGTH          0x000102
+#define DM15_ERR_SECURITY        0x001000
+#define DM15_ERR_INVALID_KEY     0x001003
+
+/* Seed value meaning "no key required" */
+#define DM_SEED_NONE             0xFFFF
+
+/* Retry delay when the update thread's queue has no room for the timeout */
+#define DM_TIMEOUT_RETRY_MS      10
+
+/**
+ * @brief Memory access session with one service tool
+ */
+static struct {
+	bool active;
+	bool unlocked;       /* Seed/key exchange passed */
+	bool seed_issued;    /* Seed sent, waiting for the key */
+	bool write_pending;  /* DM14 write accepted, waiting for DM16 */
+	uint8_t requester;
+	uint16_t seed;
+	uint32_t offset;     /* Slot1 offset of the pending write */
+	uint16_t length;     /* Bytes of the pending write */
+	int64_t last_activity;
+} dm;
+
+/* Slot1 writer opened through DM14; open until boot load, failure or timeout */
+static bool writer_open;
+
+static can_update_dm_seed_cb_t seed_cb;
+static can_update_dm_key_cb_t key_cb;
+static void *security_user_data;
+
+void can_update_dm_set_security(can_update_dm_seed_cb_t seed, can_update_dm_key_cb_t key,
+                                void *user_data)
+{
+	seed_cb = seed;
+	key_cb = key;
+	security_user_data = user_data;
+}
+
+/**
+ * @brief Send DM15 Memory Access Response
+ */
+static void send_dm15(uint8_t dst, uint8_t status, uint16_t length, uint32_t error,
+                      uint16_t seed)
+{
+	uint8_t data[8];
+
+	data[0] = length & 0xFF;
+	data[1] = ((length >> 3) & 0xE0) | 0x10 | ((status & 0x07) << 1) | 0x01;
+	data[2] = error & 0xFF;
+	data[3] = (error >> 8) & 0xFF;
+	data[4] = (error >> 16) & 0xFF;
+	data[5] = 0xFF; /* EDCP extension not used */
+	data[6] = seed & 0xFF;
+	data[7] = (seed >> 8) & 0xFF;
+
+	can_update_j1939_send(J1939_PGN_DM15, dst, data, sizeof(data));
+}
+
+static void send_dm15_failed(uint8_t dst, uint32_t error)
+{
+	send_dm15(dst, DM15_STATUS_FAILED, 0, error, DM_SEED_NONE);
+}
+
+static void dm_timeout_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(dm_timeout_work, dm_timeout_work_handler);
+
+/**
+ * @brief Give up the session, aborting the writer if it was ours
+ */
+static void dm_session_end(bool abort_writer)
+{
+	if (writer_open && abort_writer) {
+		can_update_writer_abort();
+		writer_open = false;
+	}
+
+	k_work_cancel_delayable(&dm_timeout_work);
+	memset(&dm, 0, sizeof(dm));
+}
+
+static void dm_touch(void)
+{
+	dm.last_activity = k_uptime_get();
+	k_work_reschedule(&dm_timeout_work, K_MSEC(CONFIG_CAN_UPDATE_TIMEOUT_MS));
+}
+
+/**
+ * @brief Drop a silent session so a vanished tool does not hold slot1
+ */
+static void dm_timeout_handler(void)
+{
+	if (!dm.active || k_uptime_get() - dm.last_activity < CONFIG_CAN_UPDATE_TIMEOUT_MS) {
+		return;
+	}
+
+	LOG_WRN("DM14 session of 0x%02x timed out", dm.requester);
+	dm_session_end(true);
+}
+
+static void dm_timeout_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	/* Handled in the update thread, which owns the session; never block
+	 * the system work queue on a full rx queue, try again shortly
+	 */
+	if (can_update_call(dm_timeout_handler, K_NO_WAIT)) {
+		k_work_reschedule(&dm_timeout_work, K_MSEC(DM_TIMEOUT_RETRY_MS));
+	}
+}
+
+/**
+ * @brief Open the slot1 writer on first use within the session
+ */
+static int dm_writer_open(void)
+{
+	int ret;
+
+	if (writer_open) {
+		return 0;
+	}
+
+	ret = can_update_writer_open(CAN_UPDATE_MODE_DM, false);
+	if (ret == 0) {
+		writer_open = true;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Run the seed/key exchange
+ *
+ * @return true if the request may proceed; otherwise a DM15 has been sent
+ */
+static bool dm_check_security(uint8_t src, uint16_t length, uint16_t key)
+{
+	if (dm.unlocked) {
+		return true;
+	}
+
+	if (!seed_cb || !key_cb) {
+		/* Without hooks only the configured host gets in */
+		if (IS_ENABLED(CONFIG_CAN_UPDATE_DM_SECURITY) ||
+		    src != CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS) {
+			send_dm15_failed(src, DM15_ERR_SECURITY);
+			return false;
+		}
+
+		dm.unlocked = true;
+		return true;
+	}
+
+	if (key == DM_SEED_NONE || !dm.seed_issued) {
+		/* First request: hand out a seed, the tool repeats it with the key */
+		dm.seed = seed_cb(src, security_user_data);
+		if (dm.seed == DM_SEED_NONE) {
+			dm.unlocked = true;
+			return true;
+		}
+
+		dm.seed_issued = true;
+		send_dm15(src, DM15_STATUS_PROCEED, length, DM15_ERR_NONE, dm.seed);
+		return false;
+	}
+
+	if (!key_cb(src, dm.seed, key, security_user_data)) {
+		LOG_WRN("DM14 key rejected for 0x%02x", src);
+		dm.seed_issued = false;
+		send_dm15_failed(src, DM15_ERR_INVALID_KEY);
+		return false;
+	}
+
+	dm.unlocked = true;
+	return true;
+}
+
+void can_update_dm_handle_dm14(uint8_t src, const uint8_t *data, uint8_t len)
+{
+	uint16_t length;
+	uint8_t command;
+	bool spatial;
+	uint32_t pointer;
+	uint16_t key;
+	uint32_t capacity = can_update_writer_capacity();
+	int ret;
+
+	if (len < 8) {
+		return;
+	}
+
+	length = data[0] | ((data[1] & 0xE0) << 3);
+	spatial = data[1] & 0x10;
+	command = (data[1] >> 1) & 0x07;
+	pointer = data[2] | (data[3] << 8) | (data[4] << 16);
+	key = data[6] | (data[7] << 8);
+
+	if (dm.active && dm.requester != src) {
+		if (k_uptime_get() - dm.last_activity < CONFIG_CAN_UPDATE_TIMEOUT_MS) {
+			send_dm15(src, DM15_STATUS_BUSY, 0, DM15_ERR_BUSY, DM_SEED_NONE);
+			return;
+		}
+
+		LOG_WRN("DM14 session of 0x%02x timed out", dm.requester);
+		dm_session_end(true);
+	}
+
+	if (!dm.active) {
+		dm.active = true;
+		dm.requester = src;
+	}
+	dm_touch();
+
+	switch (command) {
+	case DM14_CMD_COMPLETED:
+		/* End of one erase or write; slot1 stays open for the next until
+		 * a boot load, or the idle timeout gives it up
+		 */
+		dm.write_pending = false;
+		return;
+	case DM14_CMD_FAILED:
+		LOG_INF("DM14 session aborted by 0x%02x", src);
+		dm_session_end(true);
+		return;
+	case DM14_CMD_STATUS:
+		send_dm15(src, dm.write_pending ? DM15_STATUS_BUSY : DM15_STATUS_COMPLETED,
+		          0, DM15_ERR_NONE, DM_SEED_NONE);
+		return;
+	default:
+		break;
+	}
+
+	if (!dm_check_security(src, length, key)) {
+		return;
+	}
+
+	if (command == DM14_CMD_BOOT_LOAD) {
+		ret = writer_open ? can_update_writer_finish() : -EINVAL;
+		writer_open = false;
+		if (ret) {
+			send_dm15_failed(src, DM15_ERR_INTERNAL);
+		} else {
+			send_dm15(src, DM15_STATUS_COMPLETED, 0, DM15_ERR_NONE, DM_SEED_NONE);
+		}
+		dm_session_end(ret != 0);
+		return;
+	}
+
+	if (command != DM14_CMD_ERASE && command != DM14_CMD_WRITE) {
+		/* Reading back slot1 is not supported */
+		send_dm15_failed(src, DM15_ERR_NOT_IDENTIFIED);
+		return;
+	}
+
+	if (spatial || pointer < CONFIG_CAN_UPDATE_DM_BASE_ADDRESS ||
+	    pointer - CONFIG_CAN_UPDATE_DM_BASE_ADDRESS >= capacity) {
+		send_dm15_failed(src, DM15_ERR_ADDRESSING);
+		return;
+	}
+
+	pointer -= CONFIG_CAN_UPDATE_DM_BASE_ADDRESS;
+
+	if (length == 0 || length > capacity - pointer) {
+		send_dm15_failed(src, DM15_ERR_LENGTH);
+		return;
+	}
+
+	ret = dm_writer_open();
+	if (ret) {
+		send_dm15(src, ret == -EBUSY ? DM15_STATUS_BUSY : DM15_STATUS_FAILED, 0,
+		          ret == -EBUSY ? DM15_ERR_BUSY : DM15_ERR_INTERNAL, DM_SEED_NONE);
+		return;
+	}
+
+	if (command == DM14_CMD_ERASE) {
+		send_dm15(src, DM15_STATUS_PROCEED, length, DM15_ERR_NONE, DM_SEED_NONE);
+
+		ret = can_update_writer_erase(pointer, length);
+		if (ret) {
+			send_dm15_failed(src, DM15_ERR_INTERNAL);
+			return;
+		}
+
+		dm_touch();
+		send_dm15(src, DM15_STATUS_COMPLETED, length, DM15_ERR_NONE, DM_SEED_NONE);
+		return;
+	}
+
+	dm.write_pending = true;
+	dm.offset = pointer;
+	dm.length = length;
+
+	send_dm15(src, DM15_STATUS_PROCEED, length, DM15_ERR_NONE, DM_SEED_NONE);
+}
+
+/**
+ * @brief Finish a pending write once all its DM16 bytes are in flash
+ */
+static void dm_write_done(uint8_t src, int ret)
+{
+	dm.write_pending = false;
+	dm_touch();
+
+	if (ret == 0) {
+		/* Completed means the block is in flash */
+		ret = can_update_writer_sync();
+	}
+
+	if (ret) {
+		send_dm15_failed(src, DM15_ERR_INTERNAL);
+		dm_session_end(true);
+		return;
+	}
+
+	send_dm15(src, DM15_STATUS_COMPLETED, dm.length, DM15_ERR_NONE, DM_SEED_NONE);
+}
+
+void can_update_dm_handle_dm16(uint8_t src, const uint8_t *data, uint8_t len)
+{
+	uint8_t count;
+
+	if (!dm.write_pending || dm.requester != src || len < 1) {
+		return;
+	}
+
+	/* Single-frame transfer: byte 0 is the number of data bytes */
+	count = data[0];
+	if (count != dm.length || count > len - 1) {
+		send_dm15_failed(src, DM15_ERR_LENGTH);
+		dm.write_pending = false;
+		return;
+	}
+
+	dm_write_done(src, can_update_writer_write(dm.offset, &data[1], count));
+}
+
+/*
+ * DM16 over TP/ETP. The first message byte is the byte count (saturated
+ * at 255 for long transfers); the DM14 length is authoritative.
+ */
+static int dm16_sink_begin(uint8_t src, uint32_t size)
+{
+	if (!dm.write_pending || dm.requester != src) {
+		return -EINVAL;
+	}
+
+	if (size != dm.length + 1U) {
+		LOG_ERR("DM16 of %u bytes for a %u byte write", size - 1, dm.length);
+		return -EINVAL;
+	}
+
+	dm_touch();
+	return 0;
+}
+
+static int dm16_sink_data(uint32_t offset, const uint8_t *data, size_t len)
+{
+	if (offset == 0) {
+		/* Skip the count byte */
+		data++;
+		len--;
+	} else {
+		offset--;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	return can_update_writer_write(dm.offset + offset, data, len);
+}
+
+static int dm16_sink_end(uint8_t src)
+{
+	dm_write_done(src, 0);
+	return 0;
+}
+
+static void dm16_sink_abort(void)
+{
+	dm.write_pending = false;
+}
+
+const struct can_update_tp_sink can_update_dm16_sink = {
+	.pgn = J1939_PGN_DM16,
+	.begin = dm16_sink_begin,
+	.data = dm16_sink_data,
+	.end = dm16_sink_end,
+	.abort = dm16_sink_abort,
+};
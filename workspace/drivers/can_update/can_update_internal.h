@@ -0,0 +1,355 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Interfaces shared between the can_update driver source files.
+ * Not part of the public API; unless noted otherwise, everything here runs
+ * in the update thread.
+ */
+
+#ifndef CAN_UPDATE_INTERNAL_H_
+#define CAN_UPDATE_INTERNAL_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "can_update_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct flash_area;
+
+/**
+ * @brief J1939 TP/ETP Abort Reasons (J1939-21)
+ */
+#define J1939_ABORT_BUSY           1   /* Already in a connection managed session */
+#define J1939_ABORT_RESOURCES      2   /* Resources needed for another task */
+#define J1939_ABORT_TIMEOUT        3   /* Timeout occurred */
+#define J1939_ABORT_MAX_RETRANSMIT 5   /* Maximum retransmit requests reached */
+#define J1939_ABORT_BAD_SEQUENCE   7   /* Bad sequence number */
+#define J1939_ABORT_SIZE           9   /* Message size not supported */
+
+/**
+ * @brief J1939 Transport Limits
+ */
+#define J1939_TP_MAX_SIZE      1785      /* 255 packets of 7 bytes */
+#define J1939_ETP_MAX_PACKETS  0xFFFFFF  /* 24-bit packet number */
+
+/**
+ * @brief Slot1 Writer
+ *
+ * The write pipeline behind every transfer mode: legacy, J1939 TP/ETP,
+ * DM14/DM16 and UDS all end up in these calls. Data goes through the
+ * mode's stage chain (can_update_stream.h) before it reaches flash, so a
+ * successful write only means the data was accepted by the chain.
+ * Offsets are relative to the start of slot1_partition.
+ */
+
+/**
+ * @brief Open slot1 for writing and mark the update in progress
+ *
+ * @param mode Transfer mode, selects the stage chain
+ * @param erase Erase the whole slot before returning
+ * @return 0 on success, -EBUSY if an update is already in progress,
+ *         negative errno on flash or stage failure
+ */
+int can_update_writer_open(enum can_update_mode mode, bool erase);
+
+/**
+ * @brief Erase the flash pages covering a range of slot1
+ *
+ * @param offset Start of the range
+ * @param len Length of the range
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_writer_erase(uint32_t offset, uint32_t len);
+
+/**
+ * @brief Write data into slot1
+ *
+ * Copies the data into pool buffers and pushes every full buffer down
+ * the stage chain.
+ *
+ * @param offset Destination offset
+ * @param data Data to write
+ * @param len Number of bytes
+ * @return 0 on success, -ENOBUFS if the chain stalled, negative errno on
+ *         failure
+ */
+int can_update_writer_write(uint32_t offset, const uint8_t *data, size_t len);
+
+/**
+ * @brief Push a partially filled buffer down the stage chain
+ *
+ * For protocols that acknowledge each block (DM15, UDS TransferData):
+ * call before the positive response so write errors are still reported
+ * against the block that caused them. With CONFIG_CAN_UPDATE_VERIFY the
+ * written blocks are also read back; a mismatch fails the update.
+ *
+ * @return 0 on success, -EIO on verification failure, negative errno on
+ *         failure
+ */
+int can_update_writer_sync(void);
+
+/**
+ * @brief Written blocks are waiting to be read back
+ */
+bool can_update_writer_verify_pending(void);
+
+/**
+ * @brief Read back written blocks
+ *
+ * Unlike can_update_writer_sync(), a mismatch leaves the writer open so
+ * the caller can rewind and have the data resent.
+ *
+ * @param all Push pending data and check every block, or only the oldest
+ * @param bad_offset Set to the offset of the bad block on -EIO
+ * @return 0 on success, -EIO on mismatch, negative errno on failure
+ */
+int can_update_writer_verify(bool all, uint32_t *bad_offset);
+
+/**
+ * @brief Erase slot1 from the page holding a bad block onward
+ *
+ * NOR flash cannot be reprogrammed without an erase, so the whole page is
+ * written again. Data below the returned offset that is written again is
+ * skipped.
+ *
+ * @param bad_offset Offset reported by can_update_writer_verify()
+ * @param resume Set to the offset the data must be resent from
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_writer_rewind(uint32_t bad_offset, uint32_t *resume);
+
+/**
+ * @brief Close slot1 and request an MCUboot test upgrade
+ *
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_writer_finish(void);
+
+/**
+ * @brief Close slot1 without requesting an upgrade
+ */
+void can_update_writer_abort(void);
+
+/**
+ * @brief Size of slot1 in bytes
+ */
+uint32_t can_update_writer_capacity(void);
+
+/**
+ * @brief Erase part of a flash area the way the writer does
+ *
+ * Holds can_update_flash_lock() for the erase.
+ * With CONFIG_CAN_UPDATE_FLASH_ASYNC the thread sleeps until the
+ * controller is done, which ends the current slice.
+ *
+ * @param fa Open flash area
+ * @param offset Offset from the start of @p fa, page aligned
+ * @param len Length, whole pages
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_flash_erase(const struct flash_area *fa, off_t offset, size_t len);
+
+/**
+ * @brief Erase the pages covering a range of a flash area, one at a time
+ *
+ * Update thread only: runs the CPU budget after every page, so erasing a
+ * whole slot does not hold the CPU for seconds.
+ *
+ * @param fa Open flash area
+ * @param offset Offset from the start of @p fa
+ * @param len Length; every page the range touches is erased
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_flash_erase_range(const struct flash_area *fa, uint32_t offset, uint32_t len);
+
+/**
+ * @brief Program part of a flash area, see can_update_flash_erase()
+ */
+int can_update_flash_write(const struct flash_area *fa, off_t offset, const void *data,
+                           size_t len);
+
+/**
+ * @brief Stage Chain (can_update_stream.c)
+ *
+ * Driven by the slot1 writer; @p sink is the terminal stage that programs
+ * flash.
+ */
+int can_update_stream_open(enum can_update_mode mode, struct can_update_stage *sink);
+int can_update_stream_write(uint32_t offset, const uint8_t *data, size_t len);
+int can_update_stream_sync(void);
+int can_update_stream_close(void);
+void can_update_stream_abort(void);
+
+/**
+ * @brief Run a handler in the update thread
+ *
+ * Queues @p handler behind the frames already received, so requests that
+ * arrive through another receive path (e.g. ISO-TP) are serialized with
+ * every other use of the slot1 writer and run under the CPU budget.
+ * Must be called from thread context. Work queue items pass K_NO_WAIT:
+ * the queue is full for most of a transfer, and waiting there would hold
+ * up everything else on the queue.
+ *
+ * @param handler Function to call
+ * @param timeout How long to wait for room in the queue
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_call(void (*handler)(void), k_timeout_t timeout);
+
+/**
+ * @brief J1939 Helpers
+ */
+
+/**
+ * @brief Current J1939 address of the update listener
+ */
+uint8_t can_update_j1939_addr(void);
+
+/**
+ * @brief Send a single-frame J1939 message from the update listener
+ *
+ * Short payloads are padded with 0xFF to 8 bytes.
+ *
+ * @param pgn Parameter Group Number
+ * @param dst Destination address (ignored for PDU2 PGNs)
+ * @param data Payload
+ * @param len Payload length (at most 8)
+ * @return 0 on success, negative errno on failure
+ */
+int can_update_j1939_send(uint32_t pgn, uint8_t dst, const uint8_t *data, uint8_t len);
+
+/**
+ * @brief Receiver of a J1939 TP/ETP message
+ *
+ * The transport layer matches the PGN announced in RTS against the
+ * registered sinks and streams the message into the matching one, packet
+ * by packet, without buffering it.
+ */
+struct can_update_tp_sink {
+	uint32_t pgn;
+	/* RTS accepted: message of @p size bytes from @p src follows */
+	int (*begin)(uint8_t src, uint32_t size);
+	/* In-order message bytes at @p offset within the message */
+	int (*data)(uint32_t offset, const uint8_t *data, size_t len);
+	/* Whole message received; EOM/EOMA is sent after this returns */
+	int (*end)(uint8_t src);
+	/* Session aborted or timed out */
+	void (*abort)(void);
+	/*
+	 * Check written data (optional). Returns -EAGAIN with the message
+	 * offset to resend from, or another negative errno to abort.
+	 */
+	int (*verify)(bool all, uint32_t *resume);
+};
+
+#if defined(CONFIG_CAN_UPDATE_VERIFY)
+/**
+ * @brief Verify-After-Write Queue (can_update_verify.c)
+ *
+ * Blocks are queued as the flash stage writes them and read back in
+ * write order. When the queue is full the oldest block is checked right
+ * away.
+ */
+void can_update_verify_reset(void);
+bool can_update_verify_pending(void);
+int can_update_verify_add(const struct flash_area *fa, uint32_t offset,
+                          const uint8_t *data, size_t len);
+int can_update_verify_step(const struct flash_area *fa, uint32_t *bad_offset);
+int can_update_verify_all(const struct flash_area *fa, uint32_t *bad_offset);
+void can_update_verify_discard_from(uint32_t offset);
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_DM14)
+/**
+ * @brief J1939-73 Memory Access (can_update_dm.c)
+ */
+extern const struct can_update_tp_sink can_update_dm16_sink;
+
+void can_update_dm_handle_dm14(uint8_t src, const uint8_t *data, uint8_t len);
+void can_update_dm_handle_dm16(uint8_t src, const uint8_t *data, uint8_t len);
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_MODULES)
+/**
+ * @brief LLEXT Module Store (can_update_module.c)
+ */
+extern const struct can_update_tp_sink can_update_module_sink;
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_IMAGE_CACHE)
+/**
+ * @brief Image Cache Commands (can_update_cache.c)
+ *
+ * Single frames on PGN 0xEF00 from the host: list the cached images and
+ * restore one into slot1.
+ */
+void can_update_cache_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len);
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_TUNE)
+/**
+ * @brief Transfer Tuning (can_update_tune.c)
+ *
+ * The transport layer takes the window for each new session and reports
+ * the spacing of the DT frames in every window it completes without a
+ * re-request; the stream takes the flush size when it opens.
+ */
+int can_update_tune_init(void);
+uint8_t can_update_tune_window(void);
+size_t can_update_tune_flush(void);
+void can_update_tune_window_done(uint32_t gaps, uint32_t cycles);
+void can_update_tune_session_end(void);
+void can_update_tune_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len);
+#else
+static inline uint8_t can_update_tune_window(void)
+{
+	return CONFIG_CAN_UPDATE_TP_WINDOW;
+}
+
+static inline size_t can_update_tune_flush(void)
+{
+	return CONFIG_CAN_UPDATE_STREAM_BUF_SIZE;
+}
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+/**
+ * @brief Personalization Record (can_update_unit.c)
+ *
+ * The record of the running image is read before address claim starts,
+ * which takes the NAME identity from it. Single frames on PGN 0xEF00
+ * from the host read the record and stage a new one.
+ */
+int can_update_unit_init(void);
+uint32_t can_update_unit_identity(uint32_t fallback);
+void can_update_unit_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len);
+#else
+static inline uint32_t can_update_unit_identity(uint32_t fallback)
+{
+	return fallback;
+}
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_UDS)
+/**
+ * @brief UDS Server (can_update_uds.c)
+ *
+ * Binds the ISO-TP addresses and starts the server thread. Called from
+ * can_update_init() once the CAN controller is started.
+ */
+int can_update_uds_init(const struct device *dev);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_INTERNAL_H_ */
@@ -0,0 +1,476 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Loadable Modules
+ * storage_partition holds CONFIG_CAN_UPDATE_MODULE_SLOTS slots, each an
+ * erase-page multiple. A module is written to a slot no running module
+ * uses, checked, and only then swapped in for the running copy, so a
+ * failed transfer or a module that does not load leaves the old one
+ * running. Modules are loaded straight from memory-mapped flash.
+ */
+
+#include "can_update.h"
+#include "can_update_module.h"
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/llext/llext.h>
+#include <zephyr/llext/buf_loader.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define MODULE_HDR_SIZE sizeof(struct can_update_module_header)
+#define MODULE_SLOT_OFFSET(slot) \
+	(CONFIG_CAN_UPDATE_MODULE_AREA_OFFSET + (slot) * CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE)
+#define MODULE_NO_SEQ 0xFFFFFFFF
+
+/* Flash write buffer */
+#define MODULE_WRITE_CHUNK 64
+
+BUILD_ASSERT(MODULE_HDR_SIZE == 64, "module header must stay 64 bytes");
+BUILD_ASSERT(MODULE_WRITE_CHUNK % DT_PROP(DT_CHOSEN(zephyr_flash), write_block_size) == 0,
+             "module writes must be whole flash write blocks");
+BUILD_ASSERT(CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE > MODULE_HDR_SIZE);
+
+/* Memory-mapped base of the flash holding storage_partition */
+#define MODULE_FLASH_BASE DT_REG_ADDR(DT_CHOSEN(zephyr_flash))
+
+struct module_slot {
+	struct can_update_module_header hdr;
+	bool valid;              /* Header complete, not checked against the CRC */
+	struct llext *ext;       /* Loaded from this slot */
+};
+
+static struct {
+	const struct flash_area *fa;
+	struct module_slot slots[CONFIG_CAN_UPDATE_MODULE_SLOTS];
+
+	/* Transfer in progress */
+	int rx_slot;
+	uint32_t rx_size;
+	struct can_update_module_header rx_hdr;
+	uint8_t wbuf[MODULE_WRITE_CHUNK];
+	uint32_t wbuf_off;       /* Slot offset of wbuf[0] */
+	size_t wbuf_len;
+} modules = {
+	.rx_slot = -1,
+};
+
+/* Held while a module is called, loaded or unloaded */
+static K_MUTEX_DEFINE(module_lock);
+
+static int module_open_area(void)
+{
+	if (modules.fa) {
+		return 0;
+	}
+
+	if (FIXED_PARTITION_SIZE(storage_partition) < MODULE_SLOT_OFFSET(CONFIG_CAN_UPDATE_MODULE_SLOTS)) {
+		LOG_ERR("Module slots do not fit in storage_partition");
+		return -ENOSPC;
+	}
+
+	return flash_area_open(FIXED_PARTITION_ID(storage_partition), &modules.fa);
+}
+
+static void module_read_header(int slot)
+{
+	struct module_slot *s = &modules.slots[slot];
+
+	s->valid = false;
+	if (flash_area_read(modules.fa, MODULE_SLOT_OFFSET(slot), &s->hdr, MODULE_HDR_SIZE)) {
+		return;
+	}
+
+	s->valid = s->hdr.magic == CAN_UPDATE_MODULE_MAGIC && s->hdr.seq != MODULE_NO_SEQ &&
+	           s->hdr.size > 0 &&
+	           s->hdr.size <= CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE - MODULE_HDR_SIZE &&
+	           memchr(s->hdr.name, '\0', sizeof(s->hdr.name)) != NULL;
+}
+
+/**
+ * @brief CRC-32 of the ELF in a slot, read back from flash
+ */
+static uint32_t module_crc(int slot, uint32_t size)
+{
+	uint8_t buf[MODULE_WRITE_CHUNK];
+	uint32_t crc = 0;
+
+	for (uint32_t off = 0; off < size; off += sizeof(buf)) {
+		uint32_t len = MIN(size - off, sizeof(buf));
+
+		if (flash_area_read(modules.fa, MODULE_SLOT_OFFSET(slot) + MODULE_HDR_SIZE + off,
+		                    buf, len)) {
+			return ~crc;
+		}
+		crc = crc32_ieee_update(crc, buf, len);
+	}
+
+	return crc;
+}
+
+static struct module_slot *module_running(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+		if (modules.slots[i].ext && strcmp(modules.slots[i].hdr.name, name) == 0) {
+			return &modules.slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Load and start the module in a slot. Called with module_lock held.
+ */
+static int module_load(int slot)
+{
+	struct module_slot *s = &modules.slots[slot];
+	const uint8_t *elf = (const uint8_t *)(MODULE_FLASH_BASE + modules.fa->fa_off +
+	                                       MODULE_SLOT_OFFSET(slot) + MODULE_HDR_SIZE);
+	struct llext_buf_loader buf_loader = LLEXT_BUF_LOADER(elf, s->hdr.size);
+	struct llext_load_param ldr_parm = LLEXT_LOAD_PARAM_DEFAULT;
+	int (*start)(void);
+	int ret;
+
+	if (module_crc(slot, s->hdr.size) != s->hdr.crc32) {
+		LOG_ERR("Module %s in slot %d fails its CRC", s->hdr.name, slot);
+		return -EBADMSG;
+	}
+
+	ret = llext_load(&buf_loader.loader, s->hdr.name, &s->ext, &ldr_parm);
+	if (ret) {
+		LOG_ERR("Failed to load module %s: %d", s->hdr.name, ret);
+		s->ext = NULL;
+		return ret;
+	}
+
+	start = llext_find_sym(&s->ext->exp_tab, CAN_UPDATE_MODULE_START_SYM);
+	ret = start ? start() : -ENOEXEC;
+	if (ret) {
+		LOG_ERR("Module %s did not start: %d", s->hdr.name, ret);
+		llext_unload(&s->ext);
+		s->ext = NULL;
+		return ret;
+	}
+
+	LOG_INF("Module %s v%u running from slot %d", s->hdr.name, s->hdr.version, slot);
+	return 0;
+}
+
+/**
+ * @brief Stop and unload a running module. Called with module_lock held.
+ */
+static void module_unload(struct module_slot *s)
+{
+	void (*stop)(void) = llext_find_sym(&s->ext->exp_tab, CAN_UPDATE_MODULE_STOP_SYM);
+
+	if (stop) {
+		stop();
+	}
+
+	llext_unload(&s->ext);
+	s->ext = NULL;
+}
+
+int can_update_modules_start(void)
+{
+	int running = 0;
+	int ret;
+
+	ret = module_open_area();
+	if (ret) {
+		return ret;
+	}
+
+	k_mutex_lock(&module_lock, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+		module_read_header(i);
+	}
+
+	/* Newest copy of each name first; older copies are the fallback */
+	for (;;) {
+		int best = -1;
+
+		for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+			struct module_slot *s = &modules.slots[i];
+
+			if (s->valid && !s->ext && !module_running(s->hdr.name) &&
+			    (best < 0 || s->hdr.seq > modules.slots[best].hdr.seq)) {
+				best = i;
+			}
+		}
+
+		if (best < 0) {
+			break;
+		}
+
+		if (module_load(best) == 0) {
+			running++;
+		} else {
+			/* Do not try this slot again */
+			modules.slots[best].valid = false;
+		}
+	}
+
+	k_mutex_unlock(&module_lock);
+	return running;
+}
+
+int can_update_module_call(const char *name, const char *sym)
+{
+	struct module_slot *s;
+	void (*fn)(void) = NULL;
+
+	k_mutex_lock(&module_lock, K_FOREVER);
+
+	s = module_running(name);
+	if (s) {
+		fn = llext_find_sym(&s->ext->exp_tab, sym);
+	}
+
+	if (fn) {
+		fn();
+	}
+
+	k_mutex_unlock(&module_lock);
+	return fn ? 0 : -ENOENT;
+}
+
+int can_update_module_version(const char *name, uint32_t *version)
+{
+	struct module_slot *s;
+
+	k_mutex_lock(&module_lock, K_FOREVER);
+	s = module_running(name);
+	if (s) {
+		*version = s->hdr.version;
+	}
+	k_mutex_unlock(&module_lock);
+
+	return s ? 0 : -ENOENT;
+}
+
+/**
+ * @brief Slot for a new module: never one a running module uses
+ *
+ * Empty slots first, then the oldest copy.
+ */
+static int module_pick_slot(void)
+{
+	int best = -1;
+
+	for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+		struct module_slot *s = &modules.slots[i];
+
+		if (s->ext) {
+			continue;
+		}
+
+		if (!s->valid) {
+			return i;
+		}
+
+		if (best < 0 || s->hdr.seq < modules.slots[best].hdr.seq) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int module_flush(void)
+{
+	size_t block = flash_get_write_block_size(flash_area_get_device(modules.fa));
+	size_t len = ROUND_UP(modules.wbuf_len, block);
+	int ret;
+
+	if (modules.wbuf_len == 0) {
+		return 0;
+	}
+
+	memset(&modules.wbuf[modules.wbuf_len], 0xFF, len - modules.wbuf_len);
+	ret = can_update_flash_write(modules.fa,
+	                             MODULE_SLOT_OFFSET(modules.rx_slot) + modules.wbuf_off,
+	                             modules.wbuf, len);
+	modules.wbuf_off += modules.wbuf_len;
+	modules.wbuf_len = 0;
+
+	return ret;
+}
+
+static int module_sink_begin(uint8_t src, uint32_t size)
+{
+	int slot;
+	int ret;
+
+	if (src != CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS) {
+		LOG_WRN("Module transfer from unexpected address 0x%02x", src);
+		return -EPERM;
+	}
+
+	if (size <= MODULE_HDR_SIZE || size > CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE) {
+		LOG_ERR("Module size %u out of range", size);
+		return -EFBIG;
+	}
+
+	ret = module_open_area();
+	if (ret) {
+		return ret;
+	}
+
+	k_mutex_lock(&module_lock, K_FOREVER);
+	for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+		if (!modules.slots[i].ext) {
+			module_read_header(i);
+		}
+	}
+	slot = module_pick_slot();
+	k_mutex_unlock(&module_lock);
+
+	if (slot < 0) {
+		LOG_ERR("No free module slot");
+		return -ENOSPC;
+	}
+
+	/* Erase first: the old header goes before anything else */
+	ret = can_update_flash_erase_range(modules.fa, MODULE_SLOT_OFFSET(slot),
+	                                   CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE);
+	if (ret) {
+		LOG_ERR("Failed to erase module slot %d: %d", slot, ret);
+		return ret;
+	}
+
+	modules.slots[slot].valid = false;
+	modules.rx_slot = slot;
+	modules.rx_size = size;
+	modules.wbuf_off = MODULE_HDR_SIZE;
+	modules.wbuf_len = 0;
+
+	LOG_INF("Receiving module into slot %d: %u bytes", slot, size);
+	return 0;
+}
+
+static int module_sink_data(uint32_t offset, const uint8_t *data, size_t len)
+{
+	int ret;
+
+	/* The header is kept in RAM and written last */
+	if (offset < MODULE_HDR_SIZE) {
+		size_t n = MIN(len, MODULE_HDR_SIZE - offset);
+
+		memcpy((uint8_t *)&modules.rx_hdr + offset, data, n);
+		offset += n;
+		data += n;
+		len -= n;
+	}
+
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(modules.wbuf) - modules.wbuf_len);
+
+		memcpy(&modules.wbuf[modules.wbuf_len], data, n);
+		modules.wbuf_len += n;
+		data += n;
+		len -= n;
+
+		if (modules.wbuf_len == sizeof(modules.wbuf)) {
+			ret = module_flush();
+			if (ret) {
+				LOG_ERR("Failed to write module: %d", ret);
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int module_sink_end(uint8_t src)
+{
+	struct module_slot *s = &modules.slots[modules.rx_slot];
+	struct can_update_module_header *hdr = &modules.rx_hdr;
+	struct module_slot *old;
+	uint32_t seq = 0;
+	int slot = modules.rx_slot;
+	int ret;
+
+	ARG_UNUSED(src);
+
+	modules.rx_slot = -1;
+
+	ret = module_flush();
+	if (ret) {
+		return ret;
+	}
+
+	if (hdr->magic != CAN_UPDATE_MODULE_MAGIC || hdr->size != modules.rx_size - MODULE_HDR_SIZE ||
+	    !memchr(hdr->name, '\0', sizeof(hdr->name))) {
+		LOG_ERR("Bad module header");
+		return -EINVAL;
+	}
+
+	if (module_crc(slot, hdr->size) != hdr->crc32) {
+		LOG_ERR("Module %s fails its CRC after writing", hdr->name);
+		return -EBADMSG;
+	}
+
+	k_mutex_lock(&module_lock, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(modules.slots); i++) {
+		if (modules.slots[i].valid) {
+			seq = MAX(seq, modules.slots[i].hdr.seq + 1);
+		}
+	}
+
+	/* Commit: a valid header makes the slot the newest copy */
+	hdr->seq = seq;
+	ret = can_update_flash_write(modules.fa, MODULE_SLOT_OFFSET(slot), hdr, MODULE_HDR_SIZE);
+	if (ret) {
+		k_mutex_unlock(&module_lock);
+		return ret;
+	}
+
+	s->hdr = *hdr;
+	s->valid = true;
+
+	/* Swap the running copy for the new one */
+	old = module_running(hdr->name);
+	if (old) {
+		module_unload(old);
+	}
+
+	ret = module_load(slot);
+	if (ret) {
+		/* Keep the old copy running and drop the new one */
+		(void)can_update_flash_erase_range(modules.fa, MODULE_SLOT_OFFSET(slot),
+		                                   CONFIG_CAN_UPDATE_MODULE_SLOT_SIZE);
+		s->valid = false;
+		if (old) {
+			module_load(old - modules.slots);
+		}
+	}
+
+	k_mutex_unlock(&module_lock);
+	return ret;
+}
+
+static void module_sink_abort(void)
+{
+	/* No header was written, so the slot stays invalid */
+	modules.rx_slot = -1;
+}
+
+const struct can_update_tp_sink can_update_module_sink = {
+	.pgn = J1939_PGN_MODULE_UPDATE,
+	.begin = module_sink_begin,
+	.data = module_sink_data,
+	.end = module_sink_end,
+	.abort = module_sink_abort,
+};
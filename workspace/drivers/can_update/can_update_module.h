@@ -0,0 +1,89 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Loadable Modules
+ * Product logic built as LLEXT modules lives in slots of
+ * storage_partition and is replaced over J1939 TP/ETP (PGN 0x1EF00)
+ * while the image keeps running: no MCUboot swap, no reboot.
+ */
+
+#ifndef CAN_UPDATE_MODULE_H_
+#define CAN_UPDATE_MODULE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Slot header magic ("CUMD") */
+#define CAN_UPDATE_MODULE_MAGIC 0x444D5543
+
+#define CAN_UPDATE_MODULE_NAME_LEN 24
+
+/**
+ * @brief Module Header
+ *
+ * Sent by the host in front of the LLEXT ELF and stored at the start of
+ * the slot. The device fills in @p seq and writes the header only after
+ * the ELF has been written and checked, so a slot with a valid header
+ * always holds a complete module.
+ */
+struct can_update_module_header {
+	uint32_t magic;                           /* CAN_UPDATE_MODULE_MAGIC */
+	char name[CAN_UPDATE_MODULE_NAME_LEN];    /* NUL-terminated */
+	uint32_t version;                         /* Product version, informational */
+	uint32_t size;                            /* ELF bytes after the header */
+	uint32_t crc32;                           /* CRC-32 (IEEE) of the ELF */
+	uint32_t seq;                             /* Install sequence; 0xFFFFFFFF from the host */
+	uint8_t reserved[20];                     /* 0xFF */
+} __packed;
+
+/*
+ * Entry points a module exports with EXPORT_SYMBOL():
+ *   int module_start(void)   - after loading; non-zero rejects the module
+ *   void module_stop(void)   - before unloading (optional)
+ * Modules must not leave threads or work items behind after module_stop().
+ */
+#define CAN_UPDATE_MODULE_START_SYM "module_start"
+#define CAN_UPDATE_MODULE_STOP_SYM  "module_stop"
+
+/**
+ * @brief Load the installed modules
+ *
+ * For every module name, loads the newest slot that passes its CRC and
+ * starts it; older copies are the fallback if that fails. Call once at
+ * boot.
+ *
+ * @return Number of modules running, negative errno on failure
+ */
+int can_update_modules_start(void);
+
+/**
+ * @brief Call a function exported by a module
+ *
+ * Calls @p sym as void (*)(void) with the module lock held, so the
+ * module cannot be replaced underneath the call. Keep the function short:
+ * an update waits for it.
+ *
+ * @param name Module name
+ * @param sym Exported symbol
+ * @return 0 on success, -ENOENT if the module is not running or does not
+ *         export @p sym
+ */
+int can_update_module_call(const char *name, const char *sym);
+
+/**
+ * @brief Version of a running module
+ *
+ * @param name Module name
+ * @param version Set to the version from the module header
+ * @return 0 on success, -ENOENT if the module is not running
+ */
+int can_update_module_version(const char *name, uint32_t *version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_MODULE_H_ */
@@ -0,0 +1,434 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Streaming Stages
+ * Received image data is copied once, from the protocol layer into a
+ * buffer of the shared pool, and from there on handed from stage to stage
+ * by reference until the terminal stage writes it to slot1.
+ */
+
+#include "can_update_stream.h"
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#if defined(CONFIG_CAN_UPDATE_STAGE_CRC32)
+#include <zephyr/sys/crc.h>
+#endif
+
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+#include "can_update_unit.h"
+#endif
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+NET_BUF_POOL_DEFINE(stream_pool, CONFIG_CAN_UPDATE_STREAM_BUF_COUNT,
+                    CONFIG_CAN_UPDATE_STREAM_BUF_SIZE, sizeof(struct can_update_buf_meta),
+                    NULL);
+
+/* Chain configuration vs. open transfer */
+static K_MUTEX_DEFINE(stream_lock);
+
+static struct {
+	struct can_update_stage *chains[CAN_UPDATE_MODE_COUNT][CONFIG_CAN_UPDATE_STREAM_MAX_STAGES];
+	uint8_t chain_len[CAN_UPDATE_MODE_COUNT];
+	bool chains_ready;
+
+	/* Open transfer */
+	struct can_update_stage *head;
+	struct net_buf *pending;  /* Partially filled buffer not yet pushed */
+	size_t flush;             /* Fill level at which a buffer is pushed */
+	uint32_t child_cycles;    /* Downstream cycles of the stage being timed */
+} stream;
+
+/**
+ * @brief Default chains from Kconfig
+ */
+static void stream_default_chains(void)
+{
+	if (stream.chains_ready) {
+		return;
+	}
+
+	for (int mode = 0; mode < CAN_UPDATE_MODE_COUNT; mode++) {
+		uint8_t n = 0;
+
+#if defined(CONFIG_CAN_UPDATE_STAGE_CRC32)
+		stream.chains[mode][n++] = &can_update_stage_crc32;
+#endif
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+		/* Last: it writes behind the image once the others have closed */
+		stream.chains[mode][n++] = &can_update_stage_unit;
+#endif
+		stream.chain_len[mode] = n;
+	}
+
+	stream.chains_ready = true;
+}
+
+/**
+ * @brief Unlink the open chain
+ *
+ * Stages are only linked while a transfer is open, so a stage run on its
+ * own never emits into the flash writer. Called with stream_lock held.
+ */
+static void stream_unlink(void)
+{
+	struct can_update_stage *stage = stream.head;
+
+	while (stage) {
+		struct can_update_stage *next = stage->next;
+
+		stage->next = NULL;
+		stage = next;
+	}
+
+	stream.head = NULL;
+}
+
+/**
+ * @brief Run one stage and account its exclusive cycles
+ *
+ * Stages call can_update_stage_emit() from within process(), so the
+ * downstream stages run nested; their cycles are collected in
+ * child_cycles and subtracted from the caller's.
+ */
+static int stage_run(struct can_update_stage *stage, struct net_buf *buf)
+{
+	uint32_t outer_child = stream.child_cycles;
+	uint32_t len = buf->len;
+	uint32_t start;
+	uint32_t total;
+	uint32_t self;
+	int ret;
+
+	stream.child_cycles = 0;
+	start = k_cycle_get_32();
+
+	ret = stage->api->process(stage, buf);
+
+	total = k_cycle_get_32() - start;
+	self = total - MIN(stream.child_cycles, total);
+
+	stage->stats.buffers++;
+	stage->stats.bytes += len;
+	stage->stats.cycles += self;
+	if (self > stage->stats.max_cycles) {
+		stage->stats.max_cycles = self;
+	}
+
+	stream.child_cycles = outer_child + total;
+	return ret;
+}
+
+struct net_buf *can_update_stream_alloc(void)
+{
+	struct net_buf *buf;
+
+	buf = net_buf_alloc(&stream_pool, K_MSEC(CONFIG_CAN_UPDATE_STREAM_ALLOC_TIMEOUT_MS));
+	if (buf) {
+		can_update_buf_meta(buf)->offset = 0;
+	}
+
+	return buf;
+}
+
+int can_update_stage_emit(struct can_update_stage *stage, struct net_buf *buf)
+{
+	if (!stage->next) {
+		/* Stage used on its own (e.g. benchmarked in isolation) */
+		net_buf_unref(buf);
+		return 0;
+	}
+
+	return stage_run(stage->next, buf);
+}
+
+int can_update_stream_set_chain(enum can_update_mode mode, struct can_update_stage *const *stages,
+                                size_t count)
+{
+	if (mode >= CAN_UPDATE_MODE_COUNT || count > CONFIG_CAN_UPDATE_STREAM_MAX_STAGES ||
+	    (count > 0 && !stages)) {
+		return -EINVAL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (!stages[i] || !stages[i]->api || !stages[i]->api->process) {
+			return -EINVAL;
+		}
+
+		for (size_t j = 0; j < i; j++) {
+			if (stages[j] == stages[i]) {
+				return -EINVAL;
+			}
+		}
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+
+	if (stream.head) {
+		k_mutex_unlock(&stream_lock);
+		return -EBUSY;
+	}
+
+	stream_default_chains();
+	memcpy(stream.chains[mode], stages, count * sizeof(stages[0]));
+	stream.chain_len[mode] = count;
+
+	k_mutex_unlock(&stream_lock);
+	return 0;
+}
+
+int can_update_stage_process(struct can_update_stage *stage, struct net_buf *buf)
+{
+	int ret;
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+
+	if (stream.head) {
+		k_mutex_unlock(&stream_lock);
+		net_buf_unref(buf);
+		return -EBUSY;
+	}
+
+	stream.child_cycles = 0;
+	ret = stage_run(stage, buf);
+
+	k_mutex_unlock(&stream_lock);
+	return ret;
+}
+
+void can_update_stage_reset_stats(struct can_update_stage *stage)
+{
+	memset(&stage->stats, 0, sizeof(stage->stats));
+}
+
+int can_update_stream_open(enum can_update_mode mode, struct can_update_stage *sink)
+{
+	struct can_update_stage *stage;
+	int ret;
+
+	if (mode >= CAN_UPDATE_MODE_COUNT) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+
+	if (stream.head) {
+		k_mutex_unlock(&stream_lock);
+		return -EBUSY;
+	}
+
+	stream_default_chains();
+
+	/* Link the mode's chain in front of the sink */
+	sink->next = NULL;
+	stage = sink;
+	for (int i = stream.chain_len[mode] - 1; i >= 0; i--) {
+		stream.chains[mode][i]->next = stage;
+		stage = stream.chains[mode][i];
+	}
+
+	stream.head = stage;
+	stream.pending = NULL;
+	stream.child_cycles = 0;
+	stream.flush = can_update_tune_flush();
+
+	for (stage = stream.head; stage; stage = stage->next) {
+		if (!stage->api->open) {
+			continue;
+		}
+
+		ret = stage->api->open(stage);
+		if (ret) {
+			LOG_ERR("Stage %s failed to open: %d", stage->name, ret);
+
+			/* Abort the stages opened so far */
+			for (struct can_update_stage *s = stream.head; s != stage; s = s->next) {
+				if (s->api->abort) {
+					s->api->abort(s);
+				}
+			}
+
+			stream_unlink();
+			k_mutex_unlock(&stream_lock);
+			return ret;
+		}
+	}
+
+	k_mutex_unlock(&stream_lock);
+	return 0;
+}
+
+int can_update_stream_sync(void)
+{
+	struct net_buf *buf = stream.pending;
+
+	if (!buf) {
+		return 0;
+	}
+
+	stream.pending = NULL;
+	return stage_run(stream.head, buf);
+}
+
+int can_update_stream_write(uint32_t offset, const uint8_t *data, size_t len)
+{
+	struct net_buf *buf;
+	size_t chunk;
+	int ret;
+
+	if (!stream.head) {
+		return -EINVAL;
+	}
+
+	while (len > 0) {
+		buf = stream.pending;
+
+		/* Data only joins a buffer it continues */
+		if (buf && offset != can_update_buf_meta(buf)->offset + buf->len) {
+			ret = can_update_stream_sync();
+			if (ret) {
+				return ret;
+			}
+			buf = NULL;
+		}
+
+		if (!buf) {
+			buf = can_update_stream_alloc();
+			if (!buf) {
+				LOG_ERR("Stream stalled: no buffer within %d ms",
+				        CONFIG_CAN_UPDATE_STREAM_ALLOC_TIMEOUT_MS);
+				return -ENOBUFS;
+			}
+
+			can_update_buf_meta(buf)->offset = offset;
+			stream.pending = buf;
+		}
+
+		chunk = MIN(len, MIN(net_buf_tailroom(buf), stream.flush - buf->len));
+		net_buf_add_mem(buf, data, chunk);
+		offset += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (buf->len >= stream.flush || net_buf_tailroom(buf) == 0) {
+			ret = can_update_stream_sync();
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int can_update_stream_close(void)
+{
+	struct can_update_stage *stage;
+	int ret;
+
+	if (!stream.head) {
+		return -EINVAL;
+	}
+
+	ret = can_update_stream_sync();
+
+	/* Head to tail, so data a stage releases on close still flows down */
+	for (stage = stream.head; stage && ret == 0; stage = stage->next) {
+		if (stage->api->close) {
+			ret = stage->api->close(stage);
+			if (ret) {
+				LOG_ERR("Stage %s failed to close: %d", stage->name, ret);
+			}
+		}
+	}
+
+	if (ret) {
+		can_update_stream_abort();
+		return ret;
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+	stream_unlink();
+	k_mutex_unlock(&stream_lock);
+	return 0;
+}
+
+void can_update_stream_abort(void)
+{
+	struct can_update_stage *stage;
+
+	if (stream.pending) {
+		net_buf_unref(stream.pending);
+		stream.pending = NULL;
+	}
+
+	for (stage = stream.head; stage; stage = stage->next) {
+		if (stage->api->abort) {
+			stage->api->abort(stage);
+		}
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+	stream_unlink();
+	k_mutex_unlock(&stream_lock);
+}
+
+#if defined(CONFIG_CAN_UPDATE_STAGE_CRC32)
+/*
+ * CRC-32 stage: checksums the image as it streams past. Buffers are in
+ * offset order for every transfer mode that writes slot1 sequentially;
+ * data resent after a rewind (verify-after-write) is only counted once.
+ */
+static uint32_t crc32_value;
+static uint32_t crc32_bytes;
+static uint32_t crc32_end;
+
+static int crc32_open(struct can_update_stage *stage)
+{
+	crc32_value = 0;
+	crc32_bytes = 0;
+	crc32_end = 0;
+	return 0;
+}
+
+static int crc32_process(struct can_update_stage *stage, struct net_buf *buf)
+{
+	uint32_t offset = can_update_buf_meta(buf)->offset;
+	uint32_t seen = offset < crc32_end ? MIN(crc32_end - offset, buf->len) : 0;
+
+	if (seen < buf->len) {
+		crc32_value = crc32_ieee_update(crc32_value, buf->data + seen, buf->len - seen);
+		crc32_bytes += buf->len - seen;
+		crc32_end = offset + buf->len;
+	}
+
+	return can_update_stage_emit(stage, buf);
+}
+
+static int crc32_close(struct can_update_stage *stage)
+{
+	LOG_INF("Image CRC-32 0x%08x (%u bytes)", crc32_value, crc32_bytes);
+	return 0;
+}
+
+static const struct can_update_stage_api crc32_api = {
+	.open = crc32_open,
+	.process = crc32_process,
+	.close = crc32_close,
+};
+
+struct can_update_stage can_update_stage_crc32 = {
+	.name = "crc32",
+	.api = &crc32_api,
+};
+
+uint32_t can_update_stage_crc32_value(void)
+{
+	return crc32_value;
+}
+#endif /* CONFIG_CAN_UPDATE_STAGE_CRC32 */
@@ -0,0 +1,171 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Streaming Stages
+ * Every transfer mode feeds received image data through a chain of
+ * stages that ends in the slot1 flash writer. Stages pass net_bufs from
+ * a shared pool without copying; ownership of a buffer moves with it.
+ */
+
+#ifndef CAN_UPDATE_STREAM_H_
+#define CAN_UPDATE_STREAM_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/buf.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Transfer Modes
+ *
+ * Each mode has its own stage chain.
+ */
+enum can_update_mode {
+	CAN_UPDATE_MODE_LEGACY,   /* Standard-ID START/DATA/END protocol */
+	CAN_UPDATE_MODE_J1939,    /* J1939 TP/ETP to PGN 0xEF00 */
+	CAN_UPDATE_MODE_DM,       /* J1939-73 DM14/DM16 memory access */
+	CAN_UPDATE_MODE_UDS,      /* UDS RequestDownload/TransferData */
+	CAN_UPDATE_MODE_CACHE,    /* Local restore from the image cache */
+	CAN_UPDATE_MODE_COUNT,
+};
+
+struct can_update_stage;
+
+/**
+ * @brief Stage Operations
+ *
+ * All operations run in the update thread, one transfer at a time.
+ */
+struct can_update_stage_api {
+	/** Start of a transfer (optional) */
+	int (*open)(struct can_update_stage *stage);
+
+	/**
+	 * Consume a buffer. The stage owns @p buf from here on: it passes
+	 * it on with can_update_stage_emit(), keeps it, or unrefs it. Data
+	 * may be modified in place.
+	 */
+	int (*process)(struct can_update_stage *stage, struct net_buf *buf);
+
+	/** End of the transfer: emit anything held back (optional) */
+	int (*close)(struct can_update_stage *stage);
+
+	/** Transfer abandoned: release held buffers (optional) */
+	void (*abort)(struct can_update_stage *stage);
+};
+
+/**
+ * @brief Per-Stage Statistics
+ *
+ * Cycles are exclusive: time spent in downstream stages is not counted.
+ */
+struct can_update_stage_stats {
+	uint32_t buffers;     /* Buffers processed */
+	uint32_t bytes;       /* Bytes processed */
+	uint64_t cycles;      /* Total cycles in process() */
+	uint32_t max_cycles;  /* Longest single process() call */
+};
+
+/**
+ * @brief Stream Stage
+ */
+struct can_update_stage {
+	const char *name;
+	const struct can_update_stage_api *api;
+	void *user_data;
+
+	/* Managed by the stream */
+	struct can_update_stage *next;
+	struct can_update_stage_stats stats;
+};
+
+/**
+ * @brief Buffer Metadata (net_buf user data)
+ */
+struct can_update_buf_meta {
+	uint32_t offset;   /* Slot1 offset of the first byte */
+};
+
+static inline struct can_update_buf_meta *can_update_buf_meta(struct net_buf *buf)
+{
+	return (struct can_update_buf_meta *)net_buf_user_data(buf);
+}
+
+/**
+ * @brief Allocate a buffer from the shared pool
+ *
+ * Waits at most CONFIG_CAN_UPDATE_STREAM_ALLOC_TIMEOUT_MS. The pool is the
+ * only back-pressure: stages that hold buffers (or hand them to another
+ * thread) slow the producer down, and a stalled chain fails the transfer
+ * instead of blocking it forever.
+ *
+ * @return Buffer, or NULL if the pool stayed empty
+ */
+struct net_buf *can_update_stream_alloc(void);
+
+/**
+ * @brief Pass a buffer to the next stage
+ *
+ * Ownership moves to the next stage, also on error.
+ *
+ * @param stage Current stage
+ * @param buf Buffer to pass on
+ * @return Result of the downstream stages
+ */
+int can_update_stage_emit(struct can_update_stage *stage, struct net_buf *buf);
+
+/**
+ * @brief Set the stage chain of a transfer mode
+ *
+ * The stages run in array order in front of the slot1 flash writer. The
+ * default chain comes from Kconfig (CONFIG_CAN_UPDATE_STAGE_*). A stage
+ * object may appear in several chains but only once per chain.
+ *
+ * @param mode Transfer mode
+ * @param stages Stages, may be NULL if @p count is 0
+ * @param count Number of stages
+ * @return 0 on success, -EINVAL if there are too many stages, -EBUSY while
+ *         a transfer is open
+ */
+int can_update_stream_set_chain(enum can_update_mode mode, struct can_update_stage *const *stages,
+                                size_t count);
+
+/**
+ * @brief Run a single stage on a buffer
+ *
+ * Calls the stage the way the stream does and updates its statistics.
+ * Meant for benchmarking a stage in isolation: with @p stage->next NULL,
+ * whatever the stage emits is released. Not while a transfer is open.
+ *
+ * @param stage Stage to run
+ * @param buf Buffer, owned by the stage afterwards
+ * @return Result of the stage, -EBUSY while a transfer is open
+ */
+int can_update_stage_process(struct can_update_stage *stage, struct net_buf *buf);
+
+/**
+ * @brief Reset the statistics of a stage
+ */
+void can_update_stage_reset_stats(struct can_update_stage *stage);
+
+#if defined(CONFIG_CAN_UPDATE_STAGE_CRC32)
+/**
+ * @brief Built-in stage: CRC-32 (IEEE) of the streamed image
+ *
+ * Passes buffers through unchanged. The result of the last transfer is
+ * logged on close and available from can_update_stage_crc32_value().
+ */
+extern struct can_update_stage can_update_stage_crc32;
+
+uint32_t can_update_stage_crc32_value(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_STREAM_H_ */
@@ -0,0 +1,469 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Transfer Tuning
+ * Two measurements feed the transfer parameters:
+ *
+ * - calibration times a page erase and stream buffer sized writes on
+ *   slot1, giving the flash rates of this board
+ * - every TP/ETP window times the spacing of its DT frames, stamped in
+ *   the receive callback, giving the rate the originator sends at
+ *
+ * From these the writer's cost per packet is the gap advertised to the
+ * host, the flush size is the largest write during which the frames
+ * arriving meanwhile fit in half the receive queue, and the CTS window is
+ * the largest one whose backlog still fits in the queue. Parameters are
+ * derived again when a session closes; the next session uses them.
+ */
+
+#include "can_update.h"
+#include "can_update_internal.h"
+#include "can_update_tune.h"
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#if defined(CONFIG_CAN_UPDATE_TUNE_SETTINGS)
+#include <zephyr/settings/settings.h>
+#endif
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+/* J1939 tuning commands, single frames on PGN 0xEF00 from the host */
+#define TUNE_CMD_PARAMS    0xD0  /* -> [window, flush LE16, gap LE16, arrival LE16] */
+#define TUNE_CMD_RATES     0xD1  /* -> [erase us/KiB LE24, program us/KiB LE24] */
+#define TUNE_CMD_CALIBRATE 0xD2  /* -> [status] when done */
+
+#define TUNE_SETTINGS_KEY "can_update/tune/rates"
+#define TUNE_RECORD_VERSION 1
+
+/* Smallest flush size; below this the per-write overhead dominates */
+#define TUNE_FLUSH_MIN MIN(64, CONFIG_CAN_UPDATE_STREAM_BUF_SIZE)
+#define TUNE_FLUSH_ALIGN 16
+
+BUILD_ASSERT(CONFIG_CAN_UPDATE_TUNE_MAX_WINDOW < CONFIG_CAN_UPDATE_RX_QUEUE_LEN,
+             "a tuned window must fit in the receive queue");
+
+#if defined(CONFIG_CAN_UPDATE_TUNE_SETTINGS)
+BUILD_ASSERT(!DT_SAME_NODE(DT_CHOSEN(zephyr_settings_partition),
+                           DT_NODELABEL(storage_partition)),
+             "settings must not share storage_partition with modules and the image cache");
+#endif
+
+/* Measurements, saved as they are */
+struct tune_record {
+	uint8_t version;
+	uint8_t reserved;
+	uint16_t arrival_us;
+	uint32_t erase_us_per_kb;
+	uint32_t program_us_per_kb;
+} __packed;
+
+/* Guards the record and the parameters derived from it, which other
+ * threads read
+ */
+static struct k_spinlock lock;
+static struct tune_record rec = {
+	.version = TUNE_RECORD_VERSION,
+};
+static struct can_update_tune params = {
+	.flush_bytes = CONFIG_CAN_UPDATE_STREAM_BUF_SIZE,
+	.window = CONFIG_CAN_UPDATE_TP_WINDOW,
+};
+
+/* can_update_tune_calibrate() hands the request to the update thread */
+static K_MUTEX_DEFINE(calibrate_lock);
+static K_SEM_DEFINE(calibrate_done, 0, 1);
+static int calibrate_result;
+
+static uint8_t calibrate_buf[CONFIG_CAN_UPDATE_STREAM_BUF_SIZE];
+
+/**
+ * @brief Derive the transfer parameters from a record
+ */
+static struct can_update_tune derive(const struct tune_record *r)
+{
+	const uint32_t queue = CONFIG_CAN_UPDATE_RX_QUEUE_LEN;
+	struct can_update_tune p = {
+		.erase_us_per_kb = r->erase_us_per_kb,
+		.program_us_per_kb = r->program_us_per_kb,
+		.arrival_us = r->arrival_us,
+		.flush_bytes = CONFIG_CAN_UPDATE_STREAM_BUF_SIZE,
+		.window = CONFIG_CAN_UPDATE_TP_WINDOW,
+	};
+	uint32_t flush_frames;
+	uint32_t limit;
+	uint64_t window;
+	uint64_t flush;
+
+	if (r->program_us_per_kb == 0) {
+		return p;
+	}
+
+	/* Writer time per 7-byte packet */
+	p.packet_gap_us = MIN(DIV_ROUND_UP(7U * r->program_us_per_kb, 1024U), UINT16_MAX);
+
+	if (r->arrival_us == 0) {
+		return p;
+	}
+
+	/* Frames arriving during one write must fit in half the queue */
+	flush = (uint64_t)(queue / 2) * r->arrival_us * 1024U / r->program_us_per_kb;
+	flush = ROUND_DOWN(flush, TUNE_FLUSH_ALIGN);
+	p.flush_bytes = CLAMP(flush, TUNE_FLUSH_MIN, CONFIG_CAN_UPDATE_STREAM_BUF_SIZE);
+
+	/* Frames that queue while one write is programmed */
+	flush_frames = DIV_ROUND_UP((uint64_t)p.flush_bytes * r->program_us_per_kb,
+	                            1024U * r->arrival_us);
+	flush_frames = MIN(flush_frames, queue - 1);
+
+	/* Program time leaves out readback, stages and budget rests, so even
+	 * a writer that keeps up never gets a window the queue cannot take
+	 */
+	limit = MIN(queue - flush_frames, CONFIG_CAN_UPDATE_TUNE_MAX_WINDOW);
+
+	if (p.packet_gap_us <= r->arrival_us) {
+		p.window = limit;
+		return p;
+	}
+
+	/* The backlog grows by (gap - arrival) / gap frames per packet and
+	 * must fit next to one write's worth of frames
+	 */
+	window = (uint64_t)(queue - flush_frames) * p.packet_gap_us /
+		 (p.packet_gap_us - r->arrival_us);
+	p.window = CLAMP(window, 1, limit);
+
+	return p;
+}
+
+static void save(const struct tune_record *r)
+{
+#if defined(CONFIG_CAN_UPDATE_TUNE_SETTINGS)
+	int ret;
+
+	/* The settings backend writes the same flash controller */
+	can_update_flash_lock();
+	ret = settings_save_one(TUNE_SETTINGS_KEY, r, sizeof(*r));
+	can_update_flash_unlock();
+
+	if (ret) {
+		LOG_WRN("Failed to save tuned parameters: %d", ret);
+	}
+#else
+	ARG_UNUSED(r);
+#endif
+}
+
+/**
+ * @brief Replace the record and derive the parameters again
+ *
+ * @param force Save even if the parameters did not change
+ */
+static void update(const struct tune_record *r, bool force)
+{
+	struct can_update_tune p = derive(r);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool changed = p.window != params.window || p.flush_bytes != params.flush_bytes ||
+		       p.packet_gap_us != params.packet_gap_us;
+
+	rec = *r;
+	params = p;
+	k_spin_unlock(&lock, key);
+
+	if (changed) {
+		LOG_INF("Tuned: window %u, flush %u bytes, gap %u us, arrival %u us",
+		        p.window, p.flush_bytes, p.packet_gap_us, p.arrival_us);
+	}
+
+	/* Arrival drifts with every transfer; only save what changes the
+	 * parameters
+	 */
+	if (changed || force) {
+		save(r);
+	}
+}
+
+static struct tune_record record_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct tune_record r = rec;
+
+	k_spin_unlock(&lock, key);
+	return r;
+}
+
+uint8_t can_update_tune_window(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t window = params.window;
+
+	k_spin_unlock(&lock, key);
+	return window;
+}
+
+size_t can_update_tune_flush(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	size_t flush = params.flush_bytes;
+
+	k_spin_unlock(&lock, key);
+	return flush;
+}
+
+void can_update_tune_window_done(uint32_t gaps, uint32_t cycles)
+{
+	k_spinlock_key_t key;
+	uint32_t sample;
+
+	if (gaps == 0) {
+		return;
+	}
+
+	sample = MIN(k_cyc_to_us_floor32(cycles) / gaps, UINT16_MAX);
+	if (sample == 0) {
+		sample = 1;
+	}
+
+	key = k_spin_lock(&lock);
+	/* Average over windows; a single window can catch bus bursts */
+	rec.arrival_us = rec.arrival_us ? (3U * rec.arrival_us + sample) / 4U : sample;
+	k_spin_unlock(&lock, key);
+}
+
+void can_update_tune_session_end(void)
+{
+	struct tune_record r = record_get();
+
+	update(&r, false);
+}
+
+/**
+ * @brief Erase the page, program part of it, erase it again
+ */
+static int measure(const struct flash_area *fa, off_t off, size_t page_size,
+                   uint32_t *erase_us, uint32_t *program_us, size_t *programmed)
+{
+	size_t len = MIN(CONFIG_CAN_UPDATE_TUNE_CALIBRATE_BYTES, page_size);
+	uint32_t start;
+	int ret;
+
+	for (size_t i = 0; i < sizeof(calibrate_buf); i++) {
+		calibrate_buf[i] = (uint8_t)(i ^ 0xA5);
+	}
+
+	start = k_cycle_get_32();
+	ret = can_update_flash_erase(fa, off, page_size);
+	*erase_us = k_cyc_to_us_ceil32(k_cycle_get_32() - start);
+	if (ret) {
+		return ret;
+	}
+
+	start = k_cycle_get_32();
+	for (size_t done = 0; done < len; done += sizeof(calibrate_buf)) {
+		ret = can_update_flash_write(fa, off + done, calibrate_buf,
+		                             MIN(sizeof(calibrate_buf), len - done));
+		if (ret) {
+			break;
+		}
+	}
+	*program_us = k_cyc_to_us_ceil32(k_cycle_get_32() - start);
+	*programmed = len;
+
+	/* Leave the page erased even if programming failed */
+	if (ret == 0) {
+		ret = can_update_flash_erase(fa, off, page_size);
+	} else {
+		(void)can_update_flash_erase(fa, off, page_size);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Calibrate on the last page of slot1, in the update thread
+ */
+static int calibrate(void)
+{
+	enum can_update_status status = can_update_get_status();
+	const struct flash_area *fa;
+	struct flash_pages_info info;
+	struct tune_record r;
+	uint32_t erase_us;
+	uint32_t program_us;
+	size_t programmed;
+	int ret;
+
+	/* Slot1 holds an image being written, a pending upgrade or the image
+	 * MCUboot reverts to
+	 */
+	if (status == CAN_UPDATE_STATUS_IN_PROGRESS || status == CAN_UPDATE_STATUS_SUCCESS ||
+	    !boot_is_img_confirmed()) {
+		return -EBUSY;
+	}
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = flash_get_page_info_by_offs(flash_area_get_device(fa),
+	                                  fa->fa_off + fa->fa_size - 1, &info);
+	if (ret == 0 && (info.start_offset < fa->fa_off ||
+	                 info.start_offset + info.size > fa->fa_off + fa->fa_size)) {
+		LOG_ERR("Last page of slot1 is shared with another partition");
+		ret = -EINVAL;
+	}
+
+	if (ret == 0) {
+		ret = measure(fa, info.start_offset - fa->fa_off, info.size,
+		              &erase_us, &program_us, &programmed);
+	}
+
+	flash_area_close(fa);
+	if (ret) {
+		LOG_ERR("Calibration failed: %d", ret);
+		return ret;
+	}
+
+	r = record_get();
+	r.erase_us_per_kb = MAX((uint64_t)erase_us * 1024U / info.size, 1);
+	r.program_us_per_kb = MAX((uint64_t)program_us * 1024U / programmed, 1);
+	LOG_INF("Calibrated: erase %u us/KiB, program %u us/KiB",
+	        r.erase_us_per_kb, r.program_us_per_kb);
+
+	update(&r, true);
+	return 0;
+}
+
+static void calibrate_handler(void)
+{
+	calibrate_result = calibrate();
+	k_sem_give(&calibrate_done);
+}
+
+int can_update_tune_calibrate(void)
+{
+	int ret;
+
+	k_mutex_lock(&calibrate_lock, K_FOREVER);
+
+	k_sem_reset(&calibrate_done);
+
+	ret = can_update_call(calibrate_handler, K_FOREVER);
+	if (ret == 0) {
+		k_sem_take(&calibrate_done, K_FOREVER);
+		ret = calibrate_result;
+	}
+
+	k_mutex_unlock(&calibrate_lock);
+	return ret;
+}
+
+void can_update_tune_get(struct can_update_tune *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = params;
+	k_spin_unlock(&lock, key);
+}
+
+void can_update_tune_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len)
+{
+	struct can_update_tune p;
+	uint8_t reply[8];
+
+	if (src != CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS || len < 8) {
+		return;
+	}
+
+	memset(reply, 0xFF, sizeof(reply));
+	reply[0] = data[0];
+
+	switch (data[0]) {
+	case TUNE_CMD_PARAMS:
+		can_update_tune_get(&p);
+		reply[1] = p.window;
+		sys_put_le16(p.flush_bytes, &reply[2]);
+		sys_put_le16(p.packet_gap_us, &reply[4]);
+		sys_put_le16(p.arrival_us, &reply[6]);
+		break;
+	case TUNE_CMD_RATES:
+		can_update_tune_get(&p);
+		sys_put_le24(MIN(p.erase_us_per_kb, 0xFFFFFFU), &reply[1]);
+		sys_put_le24(MIN(p.program_us_per_kb, 0xFFFFFFU), &reply[4]);
+		break;
+	case TUNE_CMD_CALIBRATE:
+		/* Already in the update thread */
+		reply[1] = -calibrate();
+		break;
+	default:
+		return;
+	}
+
+	can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+}
+
+#if defined(CONFIG_CAN_UPDATE_TUNE_SETTINGS)
+static int tune_settings_set(const char *key, size_t len, settings_read_cb read_cb,
+                             void *cb_arg)
+{
+	struct tune_record r;
+	const char *next;
+	ssize_t ret;
+
+	if (!settings_name_steq(key, "rates", &next) || next) {
+		return -ENOENT;
+	}
+
+	if (len != sizeof(r)) {
+		return -EINVAL;
+	}
+
+	ret = read_cb(cb_arg, &r, sizeof(r));
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* A record from another layout is measured again */
+	if (ret != sizeof(r) || r.version != TUNE_RECORD_VERSION) {
+		return 0;
+	}
+
+	k_spinlock_key_t lock_key = k_spin_lock(&lock);
+
+	rec = r;
+	params = derive(&r);
+	k_spin_unlock(&lock, lock_key);
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(can_update_tune, "can_update/tune", NULL, tune_settings_set,
+                               NULL, NULL);
+#endif /* CONFIG_CAN_UPDATE_TUNE_SETTINGS */
+
+int can_update_tune_init(void)
+{
+	struct can_update_tune p;
+	int ret = 0;
+
+#if defined(CONFIG_CAN_UPDATE_TUNE_SETTINGS)
+	ret = settings_subsys_init();
+	if (ret == 0) {
+		ret = settings_load_subtree("can_update/tune");
+	}
+	if (ret) {
+		LOG_WRN("Tuned parameters not loaded: %d", ret);
+	}
+#endif
+
+	can_update_tune_get(&p);
+	LOG_INF("Transfer window %u, flush %u bytes, gap %u us",
+	        p.window, p.flush_bytes, p.packet_gap_us);
+	return ret;
+}
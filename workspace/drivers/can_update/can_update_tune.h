@@ -0,0 +1,58 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Transfer Tuning
+ * Sizes the J1939 CTS window, the flash write size and the packet gap
+ * advertised to the host from the flash and bus rates measured on this
+ * board, so every board variant runs one firmware at its own optimum.
+ */
+
+#ifndef CAN_UPDATE_TUNE_H_
+#define CAN_UPDATE_TUNE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Tuned Transfer Parameters
+ */
+struct can_update_tune {
+	uint32_t erase_us_per_kb;    /* Measured slot1 erase time, 0 until calibrated */
+	uint32_t program_us_per_kb;  /* Measured slot1 program time, 0 until calibrated */
+	uint16_t arrival_us;         /* Observed TP.DT spacing in a window, 0 until seen */
+	uint16_t packet_gap_us;      /* Spacing the writer keeps up with, 0 if unknown */
+	uint16_t flush_bytes;        /* Bytes collected per flash write */
+	uint8_t window;              /* Packets granted per CTS */
+};
+
+/**
+ * @brief Read the parameters the next transfer will use
+ *
+ * @param out Filled with a snapshot
+ */
+void can_update_tune_get(struct can_update_tune *out);
+
+/**
+ * @brief Measure the erase and program rates of slot1
+ *
+ * Erases the last page of slot1, programs part of it in stream buffer
+ * sized writes, erases it again and derives the transfer parameters from
+ * the timings. With CONFIG_CAN_UPDATE_TUNE_SETTINGS the result is saved
+ * and loaded again at boot. Blocks for one page erase twice over; must
+ * be called from thread context, not from the update thread.
+ *
+ * @return 0 on success, -EBUSY during an update, with an upgrade pending
+ *         or while the running image is not confirmed (slot1 holds the
+ *         image to revert to), -EINVAL if the last page of slot1 is
+ *         shared with another partition, negative errno on flash failure
+ */
+int can_update_tune_calibrate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_TUNE_H_ */
@@ -0,0 +1,638 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * UDS (ISO 14229) Flashing Services over ISO-TP
+ * Server subset for workshop testers: DiagnosticSessionControl,
+ * TesterPresent, RequestDownload, TransferData, RequestTransferExit and
+ * RoutineControl (eraseMemory, checkProgrammingDependencies). Requests
+ * are reassembled by the ISO-TP thread and executed in the update thread
+ * against the slot1 writer.
+ */
+
+#include "can_update.h"
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/canbus/isotp.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+/**
+ * @brief UDS Service Identifiers
+ */
+#define UDS_SID_SESSION_CONTROL      0x10
+#define UDS_SID_ROUTINE_CONTROL      0x31
+#define UDS_SID_REQUEST_DOWNLOAD     0x34
+#define UDS_SID_TRANSFER_DATA        0x36
+#define UDS_SID_REQUEST_TRANSFER_EXIT 0x37
+#define UDS_SID_TESTER_PRESENT       0x3E
+#define UDS_SID_NEGATIVE_RESPONSE    0x7F
+
+#define UDS_POSITIVE_RESPONSE(sid)   ((sid) + 0x40)
+#define UDS_SUPPRESS_POS_RSP         0x80
+
+/**
+ * @brief UDS Negative Response Codes
+ */
+#define UDS_NRC_SERVICE_NOT_SUPPORTED    0x11
+#define UDS_NRC_SUBFUNCTION_NOT_SUPPORTED 0x12
+#define UDS_NRC_INCORRECT_LENGTH         0x13
+#define UDS_NRC_CONDITIONS_NOT_CORRECT   0x22
+#define UDS_NRC_REQUEST_SEQUENCE_ERROR   0x24
+#define UDS_NRC_REQUEST_OUT_OF_RANGE     0x31
+#define UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED 0x70
+#define UDS_NRC_TRANSFER_DATA_SUSPENDED  0x71
+#define UDS_NRC_GENERAL_PROGRAMMING_FAILURE 0x72
+#define UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER 0x73
+#define UDS_NRC_RESPONSE_PENDING         0x78
+
+/**
+ * @brief RoutineControl
+ */
+#define UDS_ROUTINE_START                0x01
+#define UDS_RID_ERASE_MEMORY             0xFF00
+#define UDS_RID_CHECK_DEPENDENCIES       0xFF01
+
+#define UDS_SESSION_DEFAULT              0x01
+#define UDS_SESSION_PROGRAMMING          0x02
+
+#define UDS_THREAD_STACK_SIZE 1024
+
+/*
+ * One request in flight at a time: the ISO-TP thread fills uds_buf, the
+ * update thread replaces the request with the response in place.
+ */
+static uint8_t uds_buf[CONFIG_CAN_UPDATE_UDS_MAX_BLOCK_LEN];
+static size_t uds_len;
+static K_SEM_DEFINE(uds_done, 0, 1);
+
+static const struct device *uds_can_dev;
+static struct isotp_recv_ctx recv_ctx;
+static struct isotp_send_ctx send_ctx;
+
+static const struct isotp_msg_id rx_addr = {
+	.std_id = CONFIG_CAN_UPDATE_UDS_RX_ID,
+	.flags = IS_ENABLED(CONFIG_CAN_UPDATE_UDS_EXT_ID) ? ISOTP_MSG_IDE : 0,
+};
+
+static const struct isotp_msg_id tx_addr = {
+	.std_id = CONFIG_CAN_UPDATE_UDS_TX_ID,
+	.flags = IS_ENABLED(CONFIG_CAN_UPDATE_UDS_EXT_ID) ? ISOTP_MSG_IDE : 0,
+};
+
+static const struct isotp_fc_opts fc_opts = {
+	.bs = CONFIG_CAN_UPDATE_UDS_BS,
+	.stmin = CONFIG_CAN_UPDATE_UDS_STMIN,
+};
+
+static K_THREAD_STACK_DEFINE(uds_thread_stack, UDS_THREAD_STACK_SIZE);
+static struct k_thread uds_thread_data;
+
+/**
+ * @brief Download started by RequestDownload
+ */
+static struct {
+	bool active;
+	bool writer_open;     /* Slot1 writer opened by UDS */
+	uint8_t next_bsc;     /* blockSequenceCounter expected next */
+	uint32_t start;       /* Slot1 offset of the download */
+	uint32_t size;        /* memorySize of the download */
+	uint32_t received;    /* Bytes written so far */
+	uint32_t last_len;    /* Length of the last accepted block */
+} download;
+
+static uint8_t session = UDS_SESSION_DEFAULT;
+
+static void respond_negative(uint8_t sid, uint8_t nrc)
+{
+	uds_buf[0] = UDS_SID_NEGATIVE_RESPONSE;
+	uds_buf[1] = sid;
+	uds_buf[2] = nrc;
+	uds_len = 3;
+}
+
+/**
+ * @brief Parse an addressAndLengthFormatIdentifier and the fields behind it
+ *
+ * @return Number of bytes consumed, or 0 if the format is invalid
+ */
+static size_t parse_addr_len(const uint8_t *data, size_t len, uint32_t *addr,
+                             uint32_t *size)
+{
+	uint8_t size_bytes = data[0] >> 4;
+	uint8_t addr_bytes = data[0] & 0x0F;
+
+	if (addr_bytes == 0 || addr_bytes > 4 || size_bytes == 0 || size_bytes > 4 ||
+	    len < 1U + addr_bytes + size_bytes) {
+		return 0;
+	}
+
+	*addr = 0;
+	for (uint8_t i = 0; i < addr_bytes; i++) {
+		*addr = (*addr << 8) | data[1 + i];
+	}
+
+	*size = 0;
+	for (uint8_t i = 0; i < size_bytes; i++) {
+		*size = (*size << 8) | data[1 + addr_bytes + i];
+	}
+
+	return 1 + addr_bytes + size_bytes;
+}
+
+/**
+ * @brief Translate a tester memory range into slot1 offsets
+ *
+ * @return true if the range lies inside slot1
+ */
+static bool map_range(uint32_t addr, uint32_t size, uint32_t *offset)
+{
+	uint32_t capacity = can_update_writer_capacity();
+
+	if (addr < CONFIG_CAN_UPDATE_UDS_BASE_ADDRESS) {
+		return false;
+	}
+
+	*offset = addr - CONFIG_CAN_UPDATE_UDS_BASE_ADDRESS;
+
+	return size != 0 && *offset < capacity && size <= capacity - *offset;
+}
+
+static int uds_writer_open(void)
+{
+	int ret;
+
+	if (download.writer_open) {
+		return 0;
+	}
+
+	ret = can_update_writer_open(CAN_UPDATE_MODE_UDS, false);
+	if (ret == 0) {
+		download.writer_open = true;
+	}
+
+	return ret;
+}
+
+static void uds_writer_abort(void)
+{
+	if (download.writer_open) {
+		can_update_writer_abort();
+	}
+
+	memset(&download, 0, sizeof(download));
+}
+
+static void handle_session_control(void)
+{
+	uint8_t type = uds_buf[1] & ~UDS_SUPPRESS_POS_RSP;
+
+	if (uds_len != 2) {
+		respond_negative(UDS_SID_SESSION_CONTROL, UDS_NRC_INCORRECT_LENGTH);
+		return;
+	}
+
+	if (type != UDS_SESSION_DEFAULT && type != UDS_SESSION_PROGRAMMING) {
+		respond_negative(UDS_SID_SESSION_CONTROL, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+		return;
+	}
+
+	if (type == UDS_SESSION_DEFAULT && session != UDS_SESSION_DEFAULT) {
+		/* Leaving the programming session drops an unfinished download */
+		uds_writer_abort();
+	}
+	session = type;
+
+	if (uds_buf[1] & UDS_SUPPRESS_POS_RSP) {
+		uds_len = 0;
+		return;
+	}
+
+	/* P2 in ms, P2* in units of 10 ms */
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_SESSION_CONTROL);
+	uds_buf[1] = type;
+	uds_buf[2] = (CONFIG_CAN_UPDATE_UDS_P2_MS >> 8) & 0xFF;
+	uds_buf[3] = CONFIG_CAN_UPDATE_UDS_P2_MS & 0xFF;
+	uds_buf[4] = ((CONFIG_CAN_UPDATE_UDS_P2_STAR_MS / 10) >> 8) & 0xFF;
+	uds_buf[5] = (CONFIG_CAN_UPDATE_UDS_P2_STAR_MS / 10) & 0xFF;
+	uds_len = 6;
+}
+
+static void handle_tester_present(void)
+{
+	if (uds_len != 2 || (uds_buf[1] & ~UDS_SUPPRESS_POS_RSP) != 0) {
+		respond_negative(UDS_SID_TESTER_PRESENT, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+		return;
+	}
+
+	if (uds_buf[1] & UDS_SUPPRESS_POS_RSP) {
+		uds_len = 0;
+		return;
+	}
+
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_TESTER_PRESENT);
+	uds_buf[1] = 0x00;
+	uds_len = 2;
+}
+
+/**
+ * @brief RequestDownload (0x34)
+ *
+ * The response advertises maxNumberOfBlockLength, the largest
+ * TransferData request (SID and counter included) the server accepts.
+ */
+static void handle_request_download(void)
+{
+	uint32_t addr;
+	uint32_t size;
+	uint32_t offset;
+	int ret;
+
+	if (uds_len < 4) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_INCORRECT_LENGTH);
+		return;
+	}
+
+	if (download.active) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_CONDITIONS_NOT_CORRECT);
+		return;
+	}
+
+	/* dataFormatIdentifier: no compression or encryption */
+	if (uds_buf[1] != 0x00) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_REQUEST_OUT_OF_RANGE);
+		return;
+	}
+
+	if (parse_addr_len(&uds_buf[2], uds_len - 2, &addr, &size) != uds_len - 2) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_INCORRECT_LENGTH);
+		return;
+	}
+
+	if (!map_range(addr, size, &offset)) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_REQUEST_OUT_OF_RANGE);
+		return;
+	}
+
+	ret = uds_writer_open();
+	if (ret) {
+		respond_negative(UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED);
+		return;
+	}
+
+	download.active = true;
+	download.next_bsc = 1;
+	download.start = offset;
+	download.size = size;
+	download.received = 0;
+	download.last_len = 0;
+
+	LOG_INF("UDS download: 0x%08x, %u bytes", addr, size);
+
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_REQUEST_DOWNLOAD);
+	uds_buf[1] = 0x20; /* maxNumberOfBlockLength is 2 bytes */
+	uds_buf[2] = (sizeof(uds_buf) >> 8) & 0xFF;
+	uds_buf[3] = sizeof(uds_buf) & 0xFF;
+	uds_len = 4;
+}
+
+/**
+ * @brief TransferData (0x36)
+ *
+ * A repeat of the last accepted block (the tester missed our response)
+ * is acknowledged again without rewriting flash.
+ */
+static void handle_transfer_data(void)
+{
+	uint8_t bsc;
+	uint32_t len;
+	int ret;
+
+	if (uds_len < 2) {
+		respond_negative(UDS_SID_TRANSFER_DATA, UDS_NRC_INCORRECT_LENGTH);
+		return;
+	}
+
+	if (!download.active) {
+		respond_negative(UDS_SID_TRANSFER_DATA, UDS_NRC_REQUEST_SEQUENCE_ERROR);
+		return;
+	}
+
+	bsc = uds_buf[1];
+	len = uds_len - 2;
+
+	if (bsc == (uint8_t)(download.next_bsc - 1) && download.received > 0 &&
+	    len == download.last_len) {
+		uds_len = 2;
+		uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_TRANSFER_DATA);
+		return;
+	}
+
+	if (bsc != download.next_bsc) {
+		respond_negative(UDS_SID_TRANSFER_DATA, UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER);
+		return;
+	}
+
+	if (len > download.size - download.received) {
+		respond_negative(UDS_SID_TRANSFER_DATA, UDS_NRC_TRANSFER_DATA_SUSPENDED);
+		return;
+	}
+
+	ret = can_update_writer_write(download.start + download.received, &uds_buf[2], len);
+	if (ret == 0) {
+		ret = can_update_writer_sync();
+	}
+	if (ret) {
+		download.writer_open = false;
+		uds_writer_abort();
+		respond_negative(UDS_SID_TRANSFER_DATA, UDS_NRC_GENERAL_PROGRAMMING_FAILURE);
+		return;
+	}
+
+	download.received += len;
+	download.last_len = len;
+	download.next_bsc++;
+
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_TRANSFER_DATA);
+	uds_buf[1] = bsc;
+	uds_len = 2;
+}
+
+/**
+ * @brief RequestTransferExit (0x37)
+ */
+static void handle_request_transfer_exit(void)
+{
+	if (!download.active) {
+		respond_negative(UDS_SID_REQUEST_TRANSFER_EXIT, UDS_NRC_REQUEST_SEQUENCE_ERROR);
+		return;
+	}
+
+	if (download.received != download.size) {
+		LOG_ERR("UDS download incomplete: %u/%u bytes",
+		        download.received, download.size);
+		respond_negative(UDS_SID_REQUEST_TRANSFER_EXIT, UDS_NRC_REQUEST_SEQUENCE_ERROR);
+		return;
+	}
+
+	/* The writer stays open for further downloads until the dependency check */
+	download.active = false;
+
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_REQUEST_TRANSFER_EXIT);
+	uds_len = 1;
+}
+
+static int routine_erase_memory(const uint8_t *options, size_t len)
+{
+	uint32_t addr;
+	uint32_t size;
+	uint32_t offset;
+	int ret;
+
+	if (len == 0 || parse_addr_len(options, len, &addr, &size) != len) {
+		return UDS_NRC_INCORRECT_LENGTH;
+	}
+
+	if (!map_range(addr, size, &offset)) {
+		return UDS_NRC_REQUEST_OUT_OF_RANGE;
+	}
+
+	ret = uds_writer_open();
+	if (ret) {
+		return UDS_NRC_CONDITIONS_NOT_CORRECT;
+	}
+
+	LOG_INF("UDS erase: 0x%08x, %u bytes", addr, size);
+
+	ret = can_update_writer_erase(offset, size);
+	if (ret) {
+		return UDS_NRC_GENERAL_PROGRAMMING_FAILURE;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief checkProgrammingDependencies: stage slot1 for MCUboot
+ */
+static int routine_check_dependencies(void)
+{
+	int ret;
+
+	if (download.active || !download.writer_open) {
+		return UDS_NRC_REQUEST_SEQUENCE_ERROR;
+	}
+
+	ret = can_update_writer_finish();
+	download.writer_open = false;
+	if (ret) {
+		return UDS_NRC_GENERAL_PROGRAMMING_FAILURE;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief RoutineControl (0x31)
+ */
+static void handle_routine_control(void)
+{
+	uint8_t sub;
+	uint16_t rid;
+	int nrc;
+
+	if (uds_len < 4) {
+		respond_negative(UDS_SID_ROUTINE_CONTROL, UDS_NRC_INCORRECT_LENGTH);
+		return;
+	}
+
+	sub = uds_buf[1] & ~UDS_SUPPRESS_POS_RSP;
+	rid = (uds_buf[2] << 8) | uds_buf[3];
+
+	if (rid != UDS_RID_ERASE_MEMORY && rid != UDS_RID_CHECK_DEPENDENCIES) {
+		respond_negative(UDS_SID_ROUTINE_CONTROL, UDS_NRC_REQUEST_OUT_OF_RANGE);
+		return;
+	}
+
+	if (sub != UDS_ROUTINE_START) {
+		respond_negative(UDS_SID_ROUTINE_CONTROL, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+		return;
+	}
+
+	if (download.active) {
+		respond_negative(UDS_SID_ROUTINE_CONTROL, UDS_NRC_CONDITIONS_NOT_CORRECT);
+		return;
+	}
+
+	if (rid == UDS_RID_ERASE_MEMORY) {
+		nrc = routine_erase_memory(&uds_buf[4], uds_len - 4);
+	} else {
+		nrc = routine_check_dependencies();
+	}
+
+	if (nrc) {
+		respond_negative(UDS_SID_ROUTINE_CONTROL, nrc);
+		return;
+	}
+
+	if (uds_buf[1] & UDS_SUPPRESS_POS_RSP) {
+		uds_len = 0;
+		return;
+	}
+
+	/* routineInfo: 0 = completed successfully */
+	uds_buf[0] = UDS_POSITIVE_RESPONSE(UDS_SID_ROUTINE_CONTROL);
+	uds_buf[4] = 0x00;
+	uds_len = 5;
+}
+
+/**
+ * @brief Execute the request in uds_buf (runs in the update thread)
+ */
+static void uds_process(void)
+{
+	uint8_t sid = uds_buf[0];
+
+	switch (sid) {
+	case UDS_SID_SESSION_CONTROL:
+		handle_session_control();
+		break;
+	case UDS_SID_TESTER_PRESENT:
+		handle_tester_present();
+		break;
+	case UDS_SID_REQUEST_DOWNLOAD:
+	case UDS_SID_TRANSFER_DATA:
+	case UDS_SID_REQUEST_TRANSFER_EXIT:
+	case UDS_SID_ROUTINE_CONTROL:
+		if (session != UDS_SESSION_PROGRAMMING) {
+			respond_negative(sid, UDS_NRC_CONDITIONS_NOT_CORRECT);
+		} else if (sid == UDS_SID_REQUEST_DOWNLOAD) {
+			handle_request_download();
+		} else if (sid == UDS_SID_TRANSFER_DATA) {
+			handle_transfer_data();
+		} else if (sid == UDS_SID_REQUEST_TRANSFER_EXIT) {
+			handle_request_transfer_exit();
+		} else {
+			handle_routine_control();
+		}
+		break;
+	default:
+		respond_negative(sid, UDS_NRC_SERVICE_NOT_SUPPORTED);
+		break;
+	}
+
+	k_sem_give(&uds_done);
+}
+
+/**
+ * @brief Receive one complete request into uds_buf
+ *
+ * @return Request length, 0 if the request was dropped, negative on ISO-TP error
+ */
+static int uds_receive(void)
+{
+	struct net_buf *buf;
+	size_t len = 0;
+	bool overflow = false;
+	int rem;
+
+	do {
+		rem = isotp_recv_net(&recv_ctx, &buf, K_FOREVER);
+		if (rem < 0) {
+			return rem;
+		}
+
+		while (buf != NULL) {
+			if (len + buf->len <= sizeof(uds_buf)) {
+				memcpy(&uds_buf[len], buf->data, buf->len);
+				len += buf->len;
+			} else {
+				overflow = true;
+			}
+			buf = net_buf_frag_del(NULL, buf);
+		}
+	} while (rem > 0);
+
+	if (overflow) {
+		LOG_WRN("UDS request longer than %zu bytes dropped", sizeof(uds_buf));
+		return 0;
+	}
+
+	return len;
+}
+
+static void uds_send(const uint8_t *data, size_t len)
+{
+	int ret = isotp_send(&send_ctx, uds_can_dev, data, len, &tx_addr, &rx_addr,
+	                     NULL, NULL);
+
+	if (ret != ISOTP_N_OK) {
+		LOG_WRN("UDS response failed: %d", ret);
+	}
+}
+
+/**
+ * @brief ISO-TP thread: reassembles requests and sends responses
+ *
+ * While the update thread works on a request (an erase can take
+ * seconds), responsePending is sent every P2* so the tester keeps
+ * waiting.
+ */
+static void uds_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	k_timeout_t wait;
+	uint8_t pending[3];
+	int ret;
+
+	while (1) {
+		ret = uds_receive();
+		if (ret <= 0) {
+			continue;
+		}
+
+		uds_len = ret;
+		pending[0] = UDS_SID_NEGATIVE_RESPONSE;
+		pending[1] = uds_buf[0];
+		pending[2] = UDS_NRC_RESPONSE_PENDING;
+
+		can_update_call(uds_process, K_FOREVER);
+
+		wait = K_MSEC(CONFIG_CAN_UPDATE_UDS_P2_MS);
+		while (k_sem_take(&uds_done, wait) != 0) {
+			uds_send(pending, sizeof(pending));
+			wait = K_MSEC(CONFIG_CAN_UPDATE_UDS_P2_STAR_MS * 9 / 10);
+		}
+
+		if (uds_len > 0) {
+			uds_send(uds_buf, uds_len);
+		}
+	}
+}
+
+int can_update_uds_init(const struct device *dev)
+{
+	int ret;
+
+	uds_can_dev = dev;
+
+	ret = isotp_bind(&recv_ctx, dev, &rx_addr, &tx_addr, &fc_opts, K_NO_WAIT);
+	if (ret != ISOTP_N_OK) {
+		return -EIO;
+	}
+
+	k_thread_create(&uds_thread_data, uds_thread_stack,
+	                K_THREAD_STACK_SIZEOF(uds_thread_stack),
+	                uds_thread, NULL, NULL, NULL,
+	                CONFIG_CAN_UPDATE_UDS_THREAD_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&uds_thread_data, "can_update_uds");
+
+	LOG_INF("UDS server on 0x%x/0x%x, max block %zu bytes",
+	        CONFIG_CAN_UPDATE_UDS_RX_ID, CONFIG_CAN_UPDATE_UDS_TX_ID, sizeof(uds_buf));
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Personalization Record
+ * The signed image is the same on every unit; what differs sits in a
+ * 64-byte record behind it, outside the part MCUboot hashes and checks
+ * the signature of. MCUboot swaps whole sectors up to the end of the
+ * image, so a record in the image's last sector moves with the image
+ * between slot1 and slot0, and a revert brings the old image back with
+ * its own record.
+ *
+ * The record of the running image is read from slot0 at init. The stage
+ * at the end of the default chains appends it, or a record staged by the
+ * application or the host, to every image written to slot1.
+ */
+
+#include "can_update.h"
+#include "can_update_internal.h"
+#include "can_update_unit.h"
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <stddef.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+/* J1939 record commands, single frames on PGN 0xEF00 from the host */
+#define UNIT_CMD_READ   0xE0  /* [chunk] -> [chunk, 6 record bytes] */
+#define UNIT_CMD_WRITE  0xE1  /* [chunk, 6 record bytes] -> [chunk, status] */
+#define UNIT_CMD_COMMIT 0xE2  /* -> [status]: the written bytes become the staged record */
+
+#define UNIT_CHUNK 6
+#define UNIT_CHUNKS DIV_ROUND_UP(sizeof(struct can_update_unit_record), UNIT_CHUNK)
+#define UNIT_CHUNK_STAGED 0x80  /* READ reply: bytes of the staged record */
+#define UNIT_CHUNK_NONE   0xFF  /* READ reply: no record, errno follows */
+
+#define UNIT_ALIGN 8
+#define UNIT_IDENTITY_MAX 0x1FFFFF
+
+/* MCUboot image format (bootutil/image.h) */
+#define IMAGE_MAGIC          0x96f3b83d
+#define IMAGE_TLV_INFO_MAGIC 0x6907
+
+struct unit_image_header {
+	uint32_t magic;
+	uint32_t load_addr;
+	uint16_t hdr_size;
+	uint16_t protect_tlv_size;
+	uint32_t img_size;
+} __packed;
+
+struct unit_tlv_info {
+	uint16_t magic;
+	uint16_t tlv_tot;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct can_update_unit_record) == 64, "Record layout changed");
+BUILD_ASSERT(sizeof(struct can_update_unit_record) <= CONFIG_CAN_UPDATE_STREAM_BUF_SIZE,
+             "Record must fit in one stream buffer");
+
+/* Guards the records, which the application reads and stages from its
+ * own threads
+ */
+static struct k_spinlock lock;
+
+static struct {
+	struct can_update_unit_record running;
+	struct can_update_unit_record staged;
+	bool has_running;
+	bool has_staged;
+
+	/* Update thread only */
+	uint8_t incoming[sizeof(struct can_update_unit_record)];  /* UNIT_CMD_WRITE */
+	uint32_t written_end;  /* End of the data the open transfer wrote */
+} unit;
+
+static uint32_t record_crc(const struct can_update_unit_record *r)
+{
+	return crc32_ieee((const uint8_t *)r, offsetof(struct can_update_unit_record, crc));
+}
+
+static bool record_valid(const struct can_update_unit_record *r)
+{
+	return r->magic == CAN_UPDATE_UNIT_MAGIC && r->version == CAN_UPDATE_UNIT_VERSION &&
+	       r->identity <= UNIT_IDENTITY_MAX && r->crc == record_crc(r);
+}
+
+/**
+ * @brief Record the next image gets: the staged one, else the running one
+ *
+ * @return true if there is one
+ */
+static bool next_record(struct can_update_unit_record *out, bool *staged)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool found = unit.has_staged || unit.has_running;
+
+	*out = unit.has_staged ? unit.staged : unit.running;
+	*staged = unit.has_staged;
+	k_spin_unlock(&lock, key);
+
+	return found;
+}
+
+static void stage_record(const struct can_update_unit_record *r)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	unit.staged = *r;
+	unit.has_staged = true;
+	k_spin_unlock(&lock, key);
+}
+
+static void log_record(const char *what, const struct can_update_unit_record *r)
+{
+	/* The serial number field is not terminated when it is full */
+	char serial[CAN_UPDATE_UNIT_SERIAL_LEN + 1];
+
+	memcpy(serial, r->serial, CAN_UPDATE_UNIT_SERIAL_LEN);
+	serial[CAN_UPDATE_UNIT_SERIAL_LEN] = '\0';
+	LOG_INF("%s record: unit %s, identity %u", what, serial, r->identity);
+}
+
+/**
+ * @brief End of the MCUboot image in a slot: header, image and TLV areas
+ */
+static int image_end(const struct flash_area *fa, uint32_t *end)
+{
+	struct unit_image_header ih;
+	struct unit_tlv_info info;
+	uint32_t off;
+	int ret;
+
+	ret = flash_area_read(fa, 0, &ih, sizeof(ih));
+	if (ret) {
+		return ret;
+	}
+	if (ih.magic != IMAGE_MAGIC) {
+		return -ENOENT;
+	}
+
+	/* Unprotected TLV area, behind the protected one */
+	off = ih.hdr_size + ih.img_size + ih.protect_tlv_size;
+	if (off + sizeof(info) > flash_area_get_size(fa)) {
+		return -E2BIG;
+	}
+
+	ret = flash_area_read(fa, off, &info, sizeof(info));
+	if (ret) {
+		return ret;
+	}
+	if (info.magic != IMAGE_TLV_INFO_MAGIC) {
+		return -ENOENT;
+	}
+
+	*end = off + info.tlv_tot;
+	return 0;
+}
+
+static uint32_t record_offset(uint32_t end)
+{
+	return ROUND_UP(end, UNIT_ALIGN);
+}
+
+/**
+ * @brief Check that a record behind the image in slot1 reaches slot0
+ *
+ * MCUboot swaps the sectors the image occupies, so the record has to end
+ * within the image's last sector, and that must not be the last sector of
+ * the slot, where MCUboot keeps its swap trailer.
+ */
+static int check_placement(const struct flash_area *fa, uint32_t end, uint32_t offset)
+{
+	const struct device *flash_dev = flash_area_get_device(fa);
+	struct flash_pages_info image_page;
+	struct flash_pages_info trailer_page;
+	int ret;
+
+	ret = flash_get_page_info_by_offs(flash_dev, fa->fa_off + end - 1, &image_page);
+	if (ret == 0) {
+		ret = flash_get_page_info_by_offs(flash_dev, fa->fa_off + fa->fa_size - 1,
+		                                  &trailer_page);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	if (fa->fa_off + offset + sizeof(struct can_update_unit_record) >
+	    image_page.start_offset + image_page.size ||
+	    image_page.start_offset == trailer_page.start_offset) {
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+int can_update_unit_get(struct can_update_unit_record *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int ret = unit.has_running ? 0 : -ENOENT;
+
+	if (ret == 0) {
+		*out = unit.running;
+	}
+	k_spin_unlock(&lock, key);
+
+	return ret;
+}
+
+int can_update_unit_set(const struct can_update_unit_record *record)
+{
+	struct can_update_unit_record r = *record;
+
+	if (r.identity > UNIT_IDENTITY_MAX) {
+		return -EINVAL;
+	}
+
+	r.magic = CAN_UPDATE_UNIT_MAGIC;
+	r.version = CAN_UPDATE_UNIT_VERSION;
+	memset(r.reserved, 0, sizeof(r.reserved));
+	r.crc = record_crc(&r);
+
+	stage_record(&r);
+	return 0;
+}
+
+uint32_t can_update_unit_identity(uint32_t fallback)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t identity = unit.has_running ? unit.running.identity : fallback;
+
+	k_spin_unlock(&lock, key);
+	return identity;
+}
+
+int can_update_unit_init(void)
+{
+	struct can_update_unit_record r;
+	const struct flash_area *fa;
+	uint32_t end;
+	int ret;
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot0_partition), &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = image_end(fa, &end);
+	if (ret == 0) {
+		if (record_offset(end) + sizeof(r) > flash_area_get_size(fa)) {
+			ret = -ENOENT;
+		} else {
+			ret = flash_area_read(fa, record_offset(end), &r, sizeof(r));
+		}
+	}
+	flash_area_close(fa);
+
+	/* Erased flash behind the image: the unit was never personalized */
+	if (ret == 0 && !record_valid(&r)) {
+		ret = -ENOENT;
+	}
+	if (ret) {
+		LOG_WRN("No personalization record: %d", ret);
+		return ret;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	unit.running = r;
+	unit.has_running = true;
+	k_spin_unlock(&lock, key);
+
+	log_record("Running", &r);
+	return 0;
+}
+
+void can_update_unit_handle_cmd(uint8_t src, const uint8_t *data, uint8_t len)
+{
+	struct can_update_unit_record r;
+	uint8_t reply[8];
+	uint8_t chunk;
+	size_t n;
+	bool staged;
+
+	if (src != CONFIG_CAN_UPDATE_J1939_HOST_ADDRESS || len < 8) {
+		return;
+	}
+
+	memset(reply, 0xFF, sizeof(reply));
+	reply[0] = data[0];
+	chunk = data[1];
+	n = chunk < UNIT_CHUNKS ? MIN(UNIT_CHUNK, sizeof(r) - chunk * UNIT_CHUNK) : 0;
+
+	switch (data[0]) {
+	case UNIT_CMD_READ:
+		if (!next_record(&r, &staged)) {
+			reply[1] = UNIT_CHUNK_NONE;
+			reply[2] = ENOENT;
+		} else if (n == 0) {
+			reply[1] = UNIT_CHUNK_NONE;
+			reply[2] = EINVAL;
+		} else {
+			reply[1] = chunk | (staged ? UNIT_CHUNK_STAGED : 0);
+			memcpy(&reply[2], (const uint8_t *)&r + chunk * UNIT_CHUNK, n);
+		}
+		break;
+	case UNIT_CMD_WRITE:
+		reply[1] = chunk;
+		if (n == 0) {
+			reply[2] = EINVAL;
+			break;
+		}
+
+		memcpy(&unit.incoming[chunk * UNIT_CHUNK], &data[2], n);
+		reply[2] = 0;
+		break;
+	case UNIT_CMD_COMMIT:
+		memcpy(&r, unit.incoming, sizeof(r));
+		if (!record_valid(&r)) {
+			reply[1] = EINVAL;
+			break;
+		}
+
+		stage_record(&r);
+		log_record("Staged", &r);
+		reply[1] = 0;
+		break;
+	default:
+		return;
+	}
+
+	can_update_j1939_send(J1939_PGN_FIRMWARE_UPDATE, src, reply, sizeof(reply));
+}
+
+/*
+ * Record stage: passes the image through and writes the record behind it
+ * once the transfer is complete and the image's TLV area is in slot1.
+ */
+static int unit_open(struct can_update_stage *stage)
+{
+	unit.written_end = 0;
+	return 0;
+}
+
+static int unit_process(struct can_update_stage *stage, struct net_buf *buf)
+{
+	unit.written_end = MAX(unit.written_end, can_update_buf_meta(buf)->offset + buf->len);
+	return can_update_stage_emit(stage, buf);
+}
+
+static int unit_close(struct can_update_stage *stage)
+{
+	struct can_update_unit_record r;
+	const struct flash_area *fa;
+	struct net_buf *buf;
+	uint32_t offset = 0;
+	uint32_t end;
+	bool staged;
+	int ret;
+
+	if (!next_record(&r, &staged)) {
+		/* Not personalized: nothing to carry over */
+		return 0;
+	}
+
+	ret = flash_area_open(FIXED_PARTITION_ID(slot1_partition), &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = image_end(fa, &end);
+	if (ret == 0) {
+		offset = record_offset(end);
+		/* A padded image has already written over the record's place */
+		ret = unit.written_end > offset ? -ENOSPC : check_placement(fa, end, offset);
+	}
+	flash_area_close(fa);
+
+	if (ret == -ENOENT) {
+		/* MCUboot refuses it anyway */
+		LOG_WRN("Slot1 holds no MCUboot image, no record written");
+		return 0;
+	}
+	if (ret) {
+		LOG_ERR("No room for the personalization record behind the image: %d", ret);
+		return ret;
+	}
+
+	buf = can_update_stream_alloc();
+	if (!buf) {
+		return -ENOBUFS;
+	}
+
+	can_update_buf_meta(buf)->offset = offset;
+	net_buf_add_mem(buf, &r, sizeof(r));
+
+	LOG_INF("%s record written at slot1 0x%x", staged ? "Staged" : "Running", offset);
+	return can_update_stage_emit(stage, buf);
+}
+
+static const struct can_update_stage_api unit_api = {
+	.open = unit_open,
+	.process = unit_process,
+	.close = unit_close,
+};
+
+struct can_update_stage can_update_stage_unit = {
+	.name = "unit",
+	.api = &unit_api,
+};
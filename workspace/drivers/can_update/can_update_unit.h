@@ -0,0 +1,79 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Personalization Record
+ * Serial number, NAME identity and calibration offsets of one unit, kept
+ * right behind the MCUboot image instead of in it. Every unit runs the
+ * same signed image, so one broadcast updates a whole fleet; the update
+ * pipeline appends each unit's own record to the image it writes.
+ */
+
+#ifndef CAN_UPDATE_UNIT_H_
+#define CAN_UPDATE_UNIT_H_
+
+#include <stdint.h>
+#include "can_update_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAN_UPDATE_UNIT_MAGIC 0x54494e55  /* "UNIT" */
+#define CAN_UPDATE_UNIT_VERSION 1
+#define CAN_UPDATE_UNIT_SERIAL_LEN 16
+#define CAN_UPDATE_UNIT_CAL_COUNT 8
+
+/**
+ * @brief Personalization Record
+ *
+ * Little endian, 64 bytes. Stored at the first 8-byte boundary after the
+ * unprotected TLV area of the image in slot0 and slot1.
+ */
+struct can_update_unit_record {
+	uint32_t magic;                               /* CAN_UPDATE_UNIT_MAGIC */
+	uint8_t version;                              /* CAN_UPDATE_UNIT_VERSION */
+	uint8_t reserved[3];                          /* 0 */
+	uint32_t identity;                            /* J1939 NAME identity number, 21 bits */
+	char serial[CAN_UPDATE_UNIT_SERIAL_LEN];      /* Serial number, NUL padded */
+	int32_t calibration[CAN_UPDATE_UNIT_CAL_COUNT]; /* Product-defined offsets */
+	uint32_t crc;                                 /* CRC-32 (IEEE) of the bytes above */
+} __packed;
+
+/**
+ * @brief Read the record of the running image
+ *
+ * @param out Filled with the record found behind the image in slot0
+ * @return 0 on success, -ENOENT if the unit is not personalized
+ */
+int can_update_unit_get(struct can_update_unit_record *out);
+
+/**
+ * @brief Set the record written with the next image
+ *
+ * Magic, version and CRC are filled in here. The record is kept in RAM
+ * and appended to every image written to slot1 until the next reboot,
+ * which makes it the running record. Without a staged record the running
+ * one is carried over.
+ *
+ * @param record Identity, serial number and calibration offsets
+ * @return 0 on success, -EINVAL if the identity does not fit in 21 bits
+ */
+int can_update_unit_set(const struct can_update_unit_record *record);
+
+#if defined(CONFIG_CAN_UPDATE_UNIT_RECORD)
+/**
+ * @brief Built-in stage: append the unit's record to the image
+ *
+ * Passes buffers through unchanged and writes the record behind the
+ * image's TLV area on close. Part of the default chain of every mode;
+ * keep it last in a chain set with can_update_stream_set_chain(), or
+ * the unit loses its record with the update.
+ */
+extern struct can_update_stage can_update_stage_unit;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAN_UPDATE_UNIT_H_ */
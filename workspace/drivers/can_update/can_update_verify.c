@@ -0,0 +1,156 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * CAN Update Verify-After-Write
+ * Every block the flash stage programs is queued with the CRC-32 of the
+ * data it was given. The update thread reads the blocks back while it
+ * waits for the next frames, so verification costs no transfer time as
+ * long as the bus is slower than a flash read.
+ */
+
+#include "can_update_internal.h"
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(can_update, CONFIG_LOG_DEFAULT_LEVEL);
+
+/* Readback chunk; on the update thread's stack */
+#define VERIFY_CHUNK 64
+
+struct verify_block {
+	uint32_t offset;
+	uint32_t len;
+	uint32_t crc;
+};
+
+static struct {
+	struct verify_block queue[CONFIG_CAN_UPDATE_VERIFY_QUEUE_LEN];
+	uint8_t head;
+	uint8_t count;
+	bool failed;          /* A block checked on queue overflow did not match */
+	uint32_t bad_offset;  /* Lowest offset of such a block */
+} verify;
+
+void can_update_verify_reset(void)
+{
+	verify.head = 0;
+	verify.count = 0;
+	verify.failed = false;
+}
+
+bool can_update_verify_pending(void)
+{
+	return verify.count > 0 || verify.failed;
+}
+
+/**
+ * @brief Read back and check the oldest queued block
+ */
+static int verify_oldest(const struct flash_area *fa)
+{
+	struct verify_block *blk = &verify.queue[verify.head];
+	uint8_t buf[VERIFY_CHUNK];
+	uint32_t crc = 0;
+	uint32_t done = 0;
+	int ret;
+
+	while (done < blk->len) {
+		uint32_t chunk = MIN(blk->len - done, sizeof(buf));
+
+		ret = flash_area_read(fa, blk->offset + done, buf, chunk);
+		if (ret) {
+			LOG_ERR("Readback at 0x%x failed: %d", blk->offset + done, ret);
+			return ret;
+		}
+
+		crc = crc32_ieee_update(crc, buf, chunk);
+		done += chunk;
+	}
+
+	verify.head = (verify.head + 1) % ARRAY_SIZE(verify.queue);
+	verify.count--;
+
+	if (crc != blk->crc) {
+		LOG_ERR("Block 0x%x+0x%x failed verification (0x%08x != 0x%08x)",
+		        blk->offset, blk->len, crc, blk->crc);
+		/* The rewind from the lowest bad offset rewrites any later one */
+		verify.bad_offset = verify.failed ? MIN(verify.bad_offset, blk->offset)
+		                                  : blk->offset;
+		verify.failed = true;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int can_update_verify_add(const struct flash_area *fa, uint32_t offset,
+                          const uint8_t *data, size_t len)
+{
+	struct verify_block *blk;
+	int ret;
+
+	if (verify.count == ARRAY_SIZE(verify.queue)) {
+		/* No idle time yet: check the oldest block now */
+		ret = verify_oldest(fa);
+		if (ret && ret != -EIO) {
+			return ret;
+		}
+	}
+
+	blk = &verify.queue[(verify.head + verify.count) % ARRAY_SIZE(verify.queue)];
+	blk->offset = offset;
+	blk->len = len;
+	blk->crc = crc32_ieee(data, len);
+	verify.count++;
+
+	return 0;
+}
+
+int can_update_verify_step(const struct flash_area *fa, uint32_t *bad_offset)
+{
+	int ret = 0;
+
+	if (!verify.failed && verify.count > 0) {
+		ret = verify_oldest(fa);
+	}
+
+	if (verify.failed) {
+		*bad_offset = verify.bad_offset;
+		verify.failed = false;
+		return -EIO;
+	}
+
+	return ret;
+}
+
+int can_update_verify_all(const struct flash_area *fa, uint32_t *bad_offset)
+{
+	int ret;
+
+	do {
+		ret = can_update_verify_step(fa, bad_offset);
+	} while (ret == 0 && verify.count > 0);
+
+	return ret;
+}
+
+void can_update_verify_discard_from(uint32_t offset)
+{
+	uint8_t kept = 0;
+
+	/* Blocks are queued in write order; keep those before @p offset */
+	for (uint8_t i = 0; i < verify.count; i++) {
+		const struct verify_block *blk =
+			&verify.queue[(verify.head + i) % ARRAY_SIZE(verify.queue)];
+
+		if (blk->offset < offset) {
+			verify.queue[(verify.head + kept) % ARRAY_SIZE(verify.queue)] = *blk;
+			kept++;
+		}
+	}
+
+	verify.count = kept;
+}
@@ -0,0 +1,244 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "flash_async.h"
+#include "flash_async_backend.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(flash_async, CONFIG_LOG_DEFAULT_LEVEL);
+
+/* Set from start until the completion callback is taken */
+static atomic_t busy;
+
+static struct flash_async_req req;
+static uint32_t start_cycles;
+
+/* Callback of the running operation; cleared by a waiter that timed out */
+static struct k_spinlock lock;
+static flash_async_done_t done_cb;
+static void *done_user_data;
+
+static struct flash_async_stats stats;
+
+/**
+ * @brief Check that a range lies on the device
+ *
+ * @param first Set to the page holding the first byte
+ * @param last Set to the page holding the last byte
+ */
+static int range_pages(const struct device *dev, off_t offset, size_t len,
+                       struct flash_pages_info *first, struct flash_pages_info *last)
+{
+	if (len == 0 || offset < 0) {
+		return -EINVAL;
+	}
+
+	if (flash_get_page_info_by_offs(dev, offset, first) ||
+	    flash_get_page_info_by_offs(dev, offset + len - 1, last)) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int start(enum flash_async_op op, const struct device *dev, off_t offset,
+                 const void *data, size_t len, flash_async_done_t done, void *user_data)
+{
+	struct flash_pages_info first;
+	struct flash_pages_info last;
+	k_spinlock_key_t key;
+	int ret;
+
+	ret = range_pages(dev, offset, len, &first, &last);
+	if (ret) {
+		return ret;
+	}
+
+	if (op == FLASH_ASYNC_OP_ERASE &&
+	    (first.start_offset != offset ||
+	     last.start_offset + last.size != offset + len)) {
+		return -EINVAL;
+	}
+
+	if (!atomic_cas(&busy, 0, 1)) {
+		return -EBUSY;
+	}
+
+	req = (struct flash_async_req){
+		.op = op,
+		.dev = dev,
+		.offset = offset,
+		.data = data,
+		.len = len,
+		.first_page = first.index,
+		.last_page = last.index,
+	};
+
+	key = k_spin_lock(&lock);
+	done_cb = done;
+	done_user_data = user_data;
+	k_spin_unlock(&lock, key);
+
+	start_cycles = k_cycle_get_32();
+	ret = flash_async_backend_start(&req);
+	if (ret) {
+		atomic_clear(&busy);
+	}
+
+	return ret;
+}
+
+void flash_async_complete(int result)
+{
+	uint32_t busy_us = k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+	flash_async_done_t done;
+	void *user_data;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lock);
+	done = done_cb;
+	user_data = done_user_data;
+	done_cb = NULL;
+
+	if (result) {
+		stats.errors++;
+	} else if (req.op == FLASH_ASYNC_OP_ERASE) {
+		stats.erases++;
+	} else {
+		stats.writes++;
+	}
+	stats.busy_us += busy_us;
+	stats.max_busy_us = MAX(stats.max_busy_us, busy_us);
+	k_spin_unlock(&lock, key);
+
+	/* The callback may start the next operation */
+	atomic_clear(&busy);
+
+	if (done) {
+		done(result, user_data);
+	}
+}
+
+int flash_async_erase_start(const struct device *dev, off_t offset, size_t size,
+                            flash_async_done_t done, void *user_data)
+{
+	return start(FLASH_ASYNC_OP_ERASE, dev, offset, NULL, size, done, user_data);
+}
+
+int flash_async_write_start(const struct device *dev, off_t offset, const void *data,
+                            size_t len, flash_async_done_t done, void *user_data)
+{
+	return start(FLASH_ASYNC_OP_WRITE, dev, offset, data, len, done, user_data);
+}
+
+struct waiter {
+	struct k_sem sem;
+	int result;
+};
+
+static void wake(int result, void *user_data)
+{
+	struct waiter *w = user_data;
+
+	w->result = result;
+	k_sem_give(&w->sem);
+}
+
+/**
+ * @brief Sleep until the operation started for @p w completes
+ *
+ * A waiter that gives up detaches its callback first, so a late
+ * completion does not touch its stack.
+ */
+static int wait(struct waiter *w)
+{
+	k_spinlock_key_t key;
+
+	if (k_sem_take(&w->sem, K_MSEC(CONFIG_FLASH_ASYNC_TIMEOUT_MS)) == 0) {
+		return w->result;
+	}
+
+	key = k_spin_lock(&lock);
+	if (done_cb == wake && done_user_data == w) {
+		done_cb = NULL;
+		k_spin_unlock(&lock, key);
+		LOG_ERR("No completion after %d ms", CONFIG_FLASH_ASYNC_TIMEOUT_MS);
+		return -ETIMEDOUT;
+	}
+	k_spin_unlock(&lock, key);
+
+	/* Completed between the timeout and the lock */
+	k_sem_take(&w->sem, K_FOREVER);
+	return w->result;
+}
+
+int flash_async_erase(const struct device *dev, off_t offset, size_t size)
+{
+	struct waiter w = { .result = 0 };
+	int ret;
+
+	k_sem_init(&w.sem, 0, 1);
+
+	ret = flash_async_erase_start(dev, offset, size, wake, &w);
+	if (ret) {
+		return ret;
+	}
+
+	return wait(&w);
+}
+
+int flash_async_write(const struct device *dev, off_t offset, const void *data, size_t len)
+{
+	struct waiter w = { .result = 0 };
+	int ret;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	k_sem_init(&w.sem, 0, 1);
+
+	ret = flash_async_write_start(dev, offset, data, len, wake, &w);
+	if (ret) {
+		return ret;
+	}
+
+	return wait(&w);
+}
+
+int flash_async_area_erase(const struct flash_area *fa, off_t offset, size_t len)
+{
+	if (offset < 0 || offset > fa->fa_size || len > fa->fa_size - offset) {
+		return -EINVAL;
+	}
+
+	return flash_async_erase(flash_area_get_device(fa), fa->fa_off + offset, len);
+}
+
+int flash_async_area_write(const struct flash_area *fa, off_t offset, const void *data,
+                           size_t len)
+{
+	if (offset < 0 || offset > fa->fa_size || len > fa->fa_size - offset) {
+		return -EINVAL;
+	}
+
+	return flash_async_write(flash_area_get_device(fa), fa->fa_off + offset, data, len);
+}
+
+bool flash_async_busy(void)
+{
+	return atomic_get(&busy) != 0;
+}
+
+void flash_async_get_stats(struct flash_async_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
@@ -0,0 +1,122 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Interrupt-Driven Flash Erase/Program
+ * Starts an erase or program operation on the flash controller and
+ * completes it from the controller's end-of-operation interrupt. The
+ * calling thread sleeps meanwhile instead of busy-waiting like the
+ * Zephyr flash API, so other threads get the CPU during a multi-second
+ * sector erase.
+ */
+
+#ifndef FLASH_ASYNC_H_
+#define FLASH_ASYNC_H_
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Completion callback
+ *
+ * Runs in interrupt context.
+ *
+ * @param result 0 on success, -EIO if the controller reported an error
+ * @param user_data Pointer passed when the operation was started
+ */
+typedef void (*flash_async_done_t)(int result, void *user_data);
+
+/**
+ * @brief Statistics
+ */
+struct flash_async_stats {
+	uint32_t erases;          /* Erase operations completed */
+	uint32_t writes;          /* Program operations completed */
+	uint32_t errors;          /* Operations failed by the controller */
+	uint64_t busy_us;         /* Total time from start to completion */
+	uint32_t max_busy_us;     /* Longest single operation */
+};
+
+/**
+ * @brief Start erasing a range
+ *
+ * @p offset and @p size must cover whole erase pages. Returns as soon as
+ * the controller runs; @p done is called from the interrupt when the
+ * last page is erased. One operation at a time.
+ *
+ * @param dev Flash device the range belongs to
+ * @param offset Offset from the start of the flash device
+ * @param size Size of the range
+ * @param done Completion callback
+ * @param user_data Passed to @p done
+ * @return 0 if started, -EBUSY while another operation runs, -EINVAL for
+ *         a range that is not page aligned or a device the back end does
+ *         not drive
+ */
+int flash_async_erase_start(const struct device *dev, off_t offset, size_t size,
+                            flash_async_done_t done, void *user_data);
+
+/**
+ * @brief Start programming a range
+ *
+ * @p data must stay valid until @p done is called. The range must be
+ * erased.
+ *
+ * @return See flash_async_erase_start()
+ */
+int flash_async_write_start(const struct device *dev, off_t offset, const void *data,
+                            size_t len, flash_async_done_t done, void *user_data);
+
+/**
+ * @brief Erase a range and sleep until it is done
+ *
+ * @return 0 on success, negative errno from the start or the completion
+ */
+int flash_async_erase(const struct device *dev, off_t offset, size_t size);
+
+/**
+ * @brief Program a range and sleep until it is done
+ *
+ * @return 0 on success, negative errno from the start or the completion
+ */
+int flash_async_write(const struct device *dev, off_t offset, const void *data, size_t len);
+
+/**
+ * @brief flash_area_erase() that sleeps instead of busy-waiting
+ *
+ * @param fa Open flash area
+ * @param offset Offset from the start of @p fa
+ * @param len Length, whole erase pages
+ * @return 0 on success, -EINVAL outside @p fa, otherwise see
+ *         flash_async_erase()
+ */
+int flash_async_area_erase(const struct flash_area *fa, off_t offset, size_t len);
+
+/**
+ * @brief flash_area_write() that sleeps instead of busy-waiting
+ */
+int flash_async_area_write(const struct flash_area *fa, off_t offset, const void *data,
+                           size_t len);
+
+/**
+ * @brief Whether an operation is running
+ */
+bool flash_async_busy(void);
+
+/**
+ * @brief Copy the statistics
+ */
+void flash_async_get_stats(struct flash_async_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLASH_ASYNC_H_ */
@@ -0,0 +1,51 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Back end interface of the interrupt-driven flash driver
+ * A back end drives one flash controller. flash_async.c validates each
+ * request, allows one at a time and keeps the statistics.
+ */
+
+#ifndef FLASH_ASYNC_BACKEND_H_
+#define FLASH_ASYNC_BACKEND_H_
+
+#include <zephyr/device.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+enum flash_async_op {
+	FLASH_ASYNC_OP_ERASE,
+	FLASH_ASYNC_OP_WRITE,
+};
+
+struct flash_async_req {
+	enum flash_async_op op;
+	const struct device *dev;
+	off_t offset;          /* From the start of dev */
+	const uint8_t *data;   /* FLASH_ASYNC_OP_WRITE */
+	size_t len;
+	uint32_t first_page;   /* FLASH_ASYNC_OP_ERASE: page indices */
+	uint32_t last_page;
+};
+
+/**
+ * @brief Start an operation
+ *
+ * The range is on @p req->dev, and page aligned for an erase. The request
+ * stays valid until the back end calls flash_async_complete().
+ *
+ * @return 0 if the controller runs, negative errno if nothing was started
+ */
+int flash_async_backend_start(const struct flash_async_req *req);
+
+/**
+ * @brief Report the end of the running operation
+ *
+ * Called by the back end, normally from its interrupt handler.
+ *
+ * @param result 0 on success, -EIO on a controller error
+ */
+void flash_async_complete(int result);
+
+#endif /* FLASH_ASYNC_BACKEND_H_ */
@@ -0,0 +1,71 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Flash simulator back end
+ * Performs the operation on the simulator right away and reports the
+ * completion from a timer with the latency of the real controller, so
+ * code using flash_async sleeps as long as it would on hardware. The
+ * timer expiry runs in the system clock interrupt, like a controller's
+ * end-of-operation interrupt.
+ */
+
+#include "flash_async_backend.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/sys/util.h>
+
+#define SIM_FLASH_NODE DT_INST(0, zephyr_sim_flash)
+
+static const struct device *const sim_dev = DEVICE_DT_GET(SIM_FLASH_NODE);
+
+static int sim_result;
+
+static void sim_done(struct k_timer *timer)
+{
+	ARG_UNUSED(timer);
+
+	flash_async_complete(sim_result);
+}
+
+static K_TIMER_DEFINE(sim_timer, sim_done, NULL);
+
+/**
+ * @brief Emulated duration of an operation
+ */
+static uint32_t sim_latency_us(const struct flash_async_req *req)
+{
+	uint32_t us_per_kb = req->op == FLASH_ASYNC_OP_ERASE
+				     ? CONFIG_FLASH_ASYNC_SIM_ERASE_US_PER_KB
+				     : CONFIG_FLASH_ASYNC_SIM_WRITE_US_PER_KB;
+
+	return (uint32_t)DIV_ROUND_UP((uint64_t)req->len * us_per_kb, 1024);
+}
+
+int flash_async_backend_start(const struct flash_async_req *req)
+{
+	int ret;
+
+	if (req->dev != sim_dev) {
+		return -EINVAL;
+	}
+
+	if (req->op == FLASH_ASYNC_OP_ERASE) {
+		ret = flash_erase(req->dev, req->offset, req->len);
+	} else {
+		ret = flash_write(req->dev, req->offset, req->data, req->len);
+	}
+
+	/* Alignment and range errors are refused up front, as the
+	 * controller back ends do
+	 */
+	if (ret == -EINVAL) {
+		return ret;
+	}
+
+	sim_result = ret ? -EIO : 0;
+	k_timer_start(&sim_timer, K_USEC(sim_latency_us(req)), K_NO_WAIT);
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * STM32F7 back end
+ * Sector erase and programming with the end-of-operation (EOPIE) and
+ * error (ERRIE) interrupts enabled. The interrupt handler starts the
+ * next sector or word until the request is done, so the CPU is only
+ * busy for a few register accesses per step.
+ *
+ * The controller is shared with the Zephyr flash driver, which polls
+ * and has no lock this back end could take: while an operation runs,
+ * nothing else may erase or program flash. In single-bank mode the CPU
+ * also stalls on every instruction fetch from flash until the operation
+ * ends; the full benefit needs the code running from the other bank
+ * (stm32f7_custom_dualbank) or from RAM.
+ */
+
+#include "flash_async_backend.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/init.h>
+#include <zephyr/irq.h>
+#include <zephyr/cache.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/sys/barrier.h>
+#include <zephyr/sys/byteorder.h>
+#include <soc.h>
+
+#define FLASH_CTRL_NODE DT_INST(0, st_stm32_flash_controller)
+#define FLASH_MEM_BASE DT_REG_ADDR(DT_CHOSEN(zephyr_flash))
+
+#define FLASH_UNLOCK_KEY1 0x45670123U
+#define FLASH_UNLOCK_KEY2 0xCDEF89ABU
+
+#define FLASH_SR_ERRORS (FLASH_SR_OPERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+                         FLASH_SR_PGPERR | FLASH_SR_ERSERR)
+
+/* Program and erase 32 bits at a time (2.7 V to 3.6 V supply) */
+#define FLASH_CR_PSIZE_X32 FLASH_CR_PSIZE_1
+
+static const struct device *const flash_dev = DEVICE_DT_GET(FLASH_CTRL_NODE);
+
+/* Progress of the running request */
+static struct {
+	bool erase;
+	uint32_t page;       /* Next sector (page index) to erase */
+	uint32_t last_page;
+	uintptr_t addr;      /* Next address to program */
+	const uint8_t *data;
+	size_t left;
+	uintptr_t start;     /* Range to invalidate in the data cache */
+	size_t len;
+} op;
+
+/**
+ * @brief SNB value of a sector
+ *
+ * In dual-bank mode (nDBANK cleared) the second bank's sectors are
+ * numbered from 16, with page indices continuing from 12.
+ */
+static uint32_t sector_number(uint32_t page)
+{
+#if defined(FLASH_OPTCR_nDBANK)
+	if ((FLASH->OPTCR & FLASH_OPTCR_nDBANK) == 0U && page >= 12U) {
+		return page + 4U;
+	}
+#endif
+	return page;
+}
+
+static void erase_next(void)
+{
+	uint32_t cr = FLASH->CR & ~(FLASH_CR_PG | FLASH_CR_SNB | FLASH_CR_PSIZE);
+
+	FLASH->CR = cr | FLASH_CR_SER | FLASH_CR_PSIZE_X32 | FLASH_CR_EOPIE | FLASH_CR_ERRIE |
+		    (sector_number(op.page) << FLASH_CR_SNB_Pos);
+	FLASH->CR |= FLASH_CR_STRT;
+	barrier_dsync_fence_full();
+}
+
+/**
+ * @brief Program the next word, or byte where a word does not fit
+ */
+static void program_next(void)
+{
+	uint32_t cr = FLASH->CR & ~(FLASH_CR_SER | FLASH_CR_SNB | FLASH_CR_PSIZE);
+	uintptr_t addr = op.addr;
+	const uint8_t *data = op.data;
+	bool word = (addr & 3U) == 0U && op.left >= 4U;
+	size_t step = word ? 4 : 1;
+
+	/* Advance first: the interrupt for this word may come before the
+	 * store below returns
+	 */
+	op.addr += step;
+	op.data += step;
+	op.left -= step;
+
+	if (word) {
+		FLASH->CR = cr | FLASH_CR_PG | FLASH_CR_PSIZE_X32 | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+		barrier_dsync_fence_full();
+		*(volatile uint32_t *)addr = sys_get_le32(data);
+	} else {
+		FLASH->CR = cr | FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+		barrier_dsync_fence_full();
+		*(volatile uint8_t *)addr = *data;
+	}
+	barrier_dsync_fence_full();
+}
+
+static void finish(int result)
+{
+	FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_PG | FLASH_CR_SNB | FLASH_CR_EOPIE |
+		       FLASH_CR_ERRIE);
+	FLASH->CR |= FLASH_CR_LOCK;
+
+	/* Reads through the cache must see the new contents */
+	sys_cache_data_invd_range((void *)op.start, op.len);
+
+	flash_async_complete(result);
+}
+
+static void flash_async_stm32f7_isr(const void *arg)
+{
+	uint32_t sr = FLASH->SR;
+
+	ARG_UNUSED(arg);
+
+	/* Write 1 to clear */
+	FLASH->SR = sr & (FLASH_SR_EOP | FLASH_SR_ERRORS);
+
+	if (sr & FLASH_SR_ERRORS) {
+		finish(-EIO);
+		return;
+	}
+
+	if ((sr & FLASH_SR_EOP) == 0U) {
+		return;
+	}
+
+	if (op.erase) {
+		if (op.page < op.last_page) {
+			op.page++;
+			erase_next();
+			return;
+		}
+	} else if (op.left > 0) {
+		program_next();
+		return;
+	}
+
+	finish(0);
+}
+
+int flash_async_backend_start(const struct flash_async_req *req)
+{
+	if (req->dev != flash_dev) {
+		return -EINVAL;
+	}
+
+	/* The Zephyr driver is in the middle of an operation */
+	if (FLASH->SR & FLASH_SR_BSY) {
+		return -EBUSY;
+	}
+
+	if (FLASH->CR & FLASH_CR_LOCK) {
+		FLASH->KEYR = FLASH_UNLOCK_KEY1;
+		FLASH->KEYR = FLASH_UNLOCK_KEY2;
+		if (FLASH->CR & FLASH_CR_LOCK) {
+			return -EIO;
+		}
+	}
+
+	FLASH->SR = FLASH_SR_EOP | FLASH_SR_ERRORS;
+
+	op.erase = req->op == FLASH_ASYNC_OP_ERASE;
+	op.start = FLASH_MEM_BASE + req->offset;
+	op.len = req->len;
+
+	if (op.erase) {
+		op.page = req->first_page;
+		op.last_page = req->last_page;
+		erase_next();
+	} else {
+		op.addr = op.start;
+		op.data = req->data;
+		op.left = req->len;
+		program_next();
+	}
+
+	return 0;
+}
+
+static int flash_async_stm32f7_init(void)
+{
+	IRQ_CONNECT(FLASH_IRQn, CONFIG_FLASH_ASYNC_IRQ_PRIORITY, flash_async_stm32f7_isr, NULL, 0);
+	irq_enable(FLASH_IRQn);
+
+	return 0;
+}
+
+SYS_INIT(flash_async_stm32f7_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE);
@@ -0,0 +1,62 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Trusted Fast Boot Library Implementation
+ */
+
+#include "fast_boot.h"
+#include "fast_boot_log.h"
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(fast_boot, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define FAST_BOOT_PARTITION_ID FIXED_PARTITION_ID(fast_boot_partition)
+
+int fast_boot_get_info(struct fast_boot_info *info)
+{
+	const struct flash_area *fa;
+	struct fast_boot_log_state state;
+	int ret;
+
+	ret = flash_area_open(FAST_BOOT_PARTITION_ID, &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = fast_boot_log_scan(fa, &state);
+	flash_area_close(fa);
+	if (ret) {
+		return ret;
+	}
+
+	if (!state.valid) {
+		return -ENOENT;
+	}
+
+	info->fast = state.last_fast;
+	info->bootloader_us = state.last_boot_us;
+	info->boots_since_check = state.ticks;
+	return 0;
+}
+
+int fast_boot_invalidate(void)
+{
+	const struct flash_area *fa;
+	int ret;
+
+	ret = flash_area_open(FAST_BOOT_PARTITION_ID, &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = flash_area_erase(fa, 0, fa->fa_size);
+	flash_area_close(fa);
+
+	if (ret) {
+		LOG_ERR("Failed to erase fast boot log: %d", ret);
+	}
+
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Trusted Fast Boot Library
+ * Application side of the MCUboot fast boot hooks: reports how the
+ * current image was booted and how long MCUboot took.
+ */
+
+#ifndef FAST_BOOT_H_
+#define FAST_BOOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Boot information recorded by MCUboot
+ */
+struct fast_boot_info {
+	bool fast;                    /* slot0 hash was skipped */
+	uint32_t bootloader_us;       /* MCUboot start to image found */
+	uint32_t boots_since_check;   /* Fast boots since the last full validation */
+};
+
+/**
+ * @brief Read the boot information for the running image
+ *
+ * @param info Filled with the information of the last boot
+ * @return 0 on success, -ENOENT if MCUboot recorded nothing (fast boot
+ *         disabled in the bootloader), negative errno on flash errors
+ */
+int fast_boot_get_info(struct fast_boot_info *info);
+
+/**
+ * @brief Force a full slot0 validation on the next boot
+ *
+ * Erases the validated-image log.
+ *
+ * @return 0 on success, negative errno on failure
+ */
+int fast_boot_invalidate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAST_BOOT_H_ */
@@ -0,0 +1,188 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Trusted Fast Boot Log Implementation
+ */
+
+#include "fast_boot_log.h"
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <errno.h>
+#include <string.h>
+
+BUILD_ASSERT(sizeof(struct fast_boot_record) % 16 == 0, "record must keep write alignment");
+BUILD_ASSERT(sizeof(struct fast_boot_tick) % 16 == 0, "tick must keep write alignment");
+
+static uint32_t entry_crc(const void *entry, size_t len)
+{
+	/* The CRC is the last word of every entry */
+	return crc32_ieee(entry, len - sizeof(uint32_t));
+}
+
+int fast_boot_log_scan(const struct flash_area *fa, struct fast_boot_log_state *state)
+{
+	uint32_t off = 0;
+	uint32_t magic;
+	int ret;
+
+	memset(state, 0, sizeof(*state));
+
+	while (off + sizeof(magic) <= fa->fa_size) {
+		ret = flash_area_read(fa, off, &magic, sizeof(magic));
+		if (ret) {
+			return ret;
+		}
+
+		if (magic == FAST_BOOT_MAGIC_RECORD) {
+			struct fast_boot_record rec;
+
+			if (off + sizeof(rec) > fa->fa_size) {
+				break;
+			}
+
+			ret = flash_area_read(fa, off, &rec, sizeof(rec));
+			if (ret) {
+				return ret;
+			}
+
+			if (rec.crc != entry_crc(&rec, sizeof(rec))) {
+				break;
+			}
+
+			state->valid = true;
+			state->last_fast = false;
+			state->ticks = rec.ticks;
+			state->last_boot_us = rec.boot_us;
+			memcpy(state->fingerprint, rec.fingerprint, sizeof(state->fingerprint));
+			off += sizeof(rec);
+		} else if (magic == FAST_BOOT_MAGIC_TICK) {
+			struct fast_boot_tick tick;
+
+			if (off + sizeof(tick) > fa->fa_size) {
+				break;
+			}
+
+			ret = flash_area_read(fa, off, &tick, sizeof(tick));
+			if (ret) {
+				return ret;
+			}
+
+			if (tick.crc != entry_crc(&tick, sizeof(tick))) {
+				break;
+			}
+
+			state->last_fast = true;
+			state->ticks++;
+			state->last_boot_us = tick.boot_us;
+			off += sizeof(tick);
+		} else if (magic == 0xFFFFFFFF) {
+			state->write_off = off;
+			return 0;
+		} else {
+			break;
+		}
+	}
+
+	if (off + sizeof(magic) <= fa->fa_size) {
+		/* Torn write or foreign data: nothing in the log is trusted */
+		state->valid = false;
+		state->corrupt = true;
+	}
+
+	state->write_off = off;
+	return 0;
+}
+
+static int log_append(const struct flash_area *fa, struct fast_boot_log_state *state,
+                      const void *entry, size_t len)
+{
+	int ret;
+
+	if (state->corrupt || state->write_off + len > fa->fa_size) {
+		ret = flash_area_erase(fa, 0, fa->fa_size);
+		if (ret) {
+			return ret;
+		}
+
+		state->corrupt = false;
+		state->write_off = 0;
+	}
+
+	ret = flash_area_write(fa, state->write_off, entry, len);
+	if (ret) {
+		return ret;
+	}
+
+	state->write_off += len;
+	return 0;
+}
+
+static int log_append_record(const struct flash_area *fa, struct fast_boot_log_state *state,
+                             const uint8_t *fingerprint, uint32_t boot_us, uint32_t ticks)
+{
+	struct fast_boot_record rec = {
+		.magic = FAST_BOOT_MAGIC_RECORD,
+		.boot_us = boot_us,
+		.ticks = ticks,
+	};
+	int ret;
+
+	memcpy(rec.fingerprint, fingerprint, sizeof(rec.fingerprint));
+	rec.crc = entry_crc(&rec, sizeof(rec));
+
+	ret = log_append(fa, state, &rec, sizeof(rec));
+	if (ret) {
+		return ret;
+	}
+
+	state->valid = true;
+	state->last_fast = false;
+	state->ticks = ticks;
+	state->last_boot_us = boot_us;
+	memcpy(state->fingerprint, fingerprint, sizeof(state->fingerprint));
+	return 0;
+}
+
+int fast_boot_log_append_record(const struct flash_area *fa, struct fast_boot_log_state *state,
+                                const uint8_t *fingerprint, uint32_t boot_us)
+{
+	return log_append_record(fa, state, fingerprint, boot_us, 0);
+}
+
+int fast_boot_log_append_tick(const struct flash_area *fa, struct fast_boot_log_state *state,
+                              uint32_t boot_us)
+{
+	struct fast_boot_tick tick = {
+		.magic = FAST_BOOT_MAGIC_TICK,
+		.boot_us = boot_us,
+		.reserved = 0xFFFFFFFF,
+	};
+	int ret;
+
+	if (!state->valid) {
+		return -EINVAL;
+	}
+
+	if (state->corrupt || state->write_off + sizeof(tick) > fa->fa_size) {
+		uint8_t fingerprint[FAST_BOOT_FINGERPRINT_LEN];
+
+		/* Compact: the new record keeps the count towards revalidation */
+		memcpy(fingerprint, state->fingerprint, sizeof(fingerprint));
+		ret = log_append_record(fa, state, fingerprint, boot_us, state->ticks);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	tick.crc = entry_crc(&tick, sizeof(tick));
+
+	ret = log_append(fa, state, &tick, sizeof(tick));
+	if (ret) {
+		return ret;
+	}
+
+	state->last_fast = true;
+	state->ticks++;
+	state->last_boot_us = boot_us;
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Trusted Fast Boot Log
+ * Append-only log in fast_boot_partition, shared by the MCUboot hooks
+ * (writer) and the application (reader).
+ *
+ * A RECORD is written after MCUboot fully validated slot0 and holds the
+ * fingerprint of the validated image. Each later boot that skipped the
+ * hash appends a TICK. The log is only erased when it is full or
+ * corrupt, so a boot costs one small flash write and no erase.
+ */
+
+#ifndef FAST_BOOT_LOG_H_
+#define FAST_BOOT_LOG_H_
+
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/toolchain.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FAST_BOOT_MAGIC_RECORD 0x52425346 /* "FSBR" */
+#define FAST_BOOT_MAGIC_TICK   0x54425346 /* "FSBT" */
+
+#define FAST_BOOT_FINGERPRINT_LEN 32
+
+/* Erasing the log must never touch the bootloader, which the update
+ * path cannot restore
+ */
+BUILD_ASSERT(FIXED_PARTITION_OFFSET(fast_boot_partition) >=
+             FIXED_PARTITION_OFFSET(boot_partition) + FIXED_PARTITION_SIZE(boot_partition) ||
+             FIXED_PARTITION_OFFSET(fast_boot_partition) + FIXED_PARTITION_SIZE(fast_boot_partition) <=
+             FIXED_PARTITION_OFFSET(boot_partition),
+             "fast_boot_partition must not overlap boot_partition");
+
+/**
+ * @brief Slot0 validated by a full hash and signature check
+ */
+struct fast_boot_record {
+	uint32_t magic;
+	uint32_t boot_us;     /* MCUboot start to image found */
+	uint8_t fingerprint[FAST_BOOT_FINGERPRINT_LEN];
+	uint32_t ticks;       /* Fast boots carried over when the log was compacted */
+	uint32_t crc;         /* CRC-32 of the fields above */
+};
+
+/**
+ * @brief Boot that trusted the last record instead of hashing slot0
+ */
+struct fast_boot_tick {
+	uint32_t magic;
+	uint32_t boot_us;
+	uint32_t reserved;
+	uint32_t crc;
+};
+
+/**
+ * @brief Result of scanning the log
+ */
+struct fast_boot_log_state {
+	bool valid;           /* A record with a good CRC was found */
+	bool corrupt;         /* Scan stopped at garbage; erase before writing */
+	bool last_fast;       /* Last entry is a tick */
+	uint8_t fingerprint[FAST_BOOT_FINGERPRINT_LEN];
+	uint32_t ticks;       /* Fast boots since the last record */
+	uint32_t last_boot_us;
+	uint32_t write_off;   /* First erased byte */
+};
+
+/**
+ * @brief Scan the log
+ *
+ * @param fa Opened fast_boot_partition
+ * @param state Filled with the log state
+ * @return 0 on success, negative errno on flash errors
+ */
+int fast_boot_log_scan(const struct flash_area *fa, struct fast_boot_log_state *state);
+
+/**
+ * @brief Append a record, erasing the log first if it is full or corrupt
+ */
+int fast_boot_log_append_record(const struct flash_area *fa, struct fast_boot_log_state *state,
+                                const uint8_t *fingerprint, uint32_t boot_us);
+
+/**
+ * @brief Append a tick
+ *
+ * When the log is full it is compacted into a fresh record carrying the
+ * current fingerprint.
+ */
+int fast_boot_log_append_tick(const struct flash_area *fa, struct fast_boot_log_state *state,
+                              uint32_t boot_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAST_BOOT_LOG_H_ */
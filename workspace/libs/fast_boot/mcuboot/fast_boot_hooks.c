@@ -0,0 +1,249 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Trusted Fast Boot MCUboot Hooks
+ * Skips the slot0 hash and signature check when slot0 is unchanged since
+ * the last fully validated boot, and records the bootloader run time of
+ * every boot in the fast boot log.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <string.h>
+
+#include "bootutil/bootutil.h"
+#include "bootutil/bootutil_log.h"
+#include "bootutil/boot_hooks.h"
+#include "bootutil/fault_injection_hardening.h"
+#include "bootutil/image.h"
+#include "bootutil/mcuboot_status.h"
+#include "bootutil/crypto/sha.h"
+#include "sysflash/sysflash.h"
+
+#include "fast_boot_log.h"
+
+BOOT_LOG_MODULE_DECLARE(mcuboot);
+
+#define FAST_BOOT_PARTITION_ID FIXED_PARTITION_ID(fast_boot_partition)
+
+/* Large enough for SHA-256 and SHA-512 builds; the first 32 bytes are kept */
+#define FINGERPRINT_DIGEST_MAX 64
+
+static struct {
+	uint32_t start_cycles;
+	bool fast;            /* slot0 check skipped on this boot */
+	bool record_pending;  /* slot0 goes through the full check, record it if it passes */
+	uint8_t fingerprint[FAST_BOOT_FINGERPRINT_LEN];
+	struct fast_boot_log_state log;
+} fb;
+
+/**
+ * @brief Fingerprint the primary slot of image 0
+ *
+ * Covers the slot location, the image header and the whole TLV area. The
+ * TLV area holds the image hash and signature, so any differently built
+ * or signed image gives a different fingerprint, at the cost of reading
+ * a few hundred bytes instead of the whole slot.
+ */
+static int slot0_fingerprint(uint8_t *out)
+{
+	const struct flash_area *fa;
+	struct image_header hdr;
+	struct image_tlv_info info;
+	bootutil_sha_context sha;
+	uint8_t digest[FINGERPRINT_DIGEST_MAX];
+	uint8_t buf[64];
+	uint32_t tlv_off;
+	uint32_t tlv_len;
+	uint32_t loc[2];
+	int ret;
+
+	ret = flash_area_open(FLASH_AREA_IMAGE_PRIMARY(0), &fa);
+	if (ret) {
+		return ret;
+	}
+
+	ret = flash_area_read(fa, 0, &hdr, sizeof(hdr));
+	if (ret || hdr.ih_magic != IMAGE_MAGIC) {
+		ret = ret ? ret : -ENOENT;
+		goto out;
+	}
+
+	tlv_off = hdr.ih_hdr_size + hdr.ih_img_size;
+	ret = flash_area_read(fa, tlv_off + hdr.ih_protect_tlv_size, &info, sizeof(info));
+	if (ret || info.it_magic != IMAGE_TLV_INFO_MAGIC) {
+		ret = ret ? ret : -ENOENT;
+		goto out;
+	}
+
+	tlv_len = hdr.ih_protect_tlv_size + info.it_tlv_tot;
+	if (tlv_len > CONFIG_MCUBOOT_FAST_BOOT_MAX_TLV ||
+	    tlv_off + tlv_len > flash_area_get_size(fa)) {
+		ret = -E2BIG;
+		goto out;
+	}
+
+	loc[0] = fa->fa_off;
+	loc[1] = fa->fa_size;
+
+	bootutil_sha_init(&sha);
+	bootutil_sha_update(&sha, loc, sizeof(loc));
+	bootutil_sha_update(&sha, &hdr, sizeof(hdr));
+
+	while (tlv_len > 0) {
+		uint32_t chunk = MIN(tlv_len, sizeof(buf));
+
+		ret = flash_area_read(fa, tlv_off, buf, chunk);
+		if (ret) {
+			break;
+		}
+
+		bootutil_sha_update(&sha, buf, chunk);
+		tlv_off += chunk;
+		tlv_len -= chunk;
+	}
+
+	bootutil_sha_finish(&sha, digest);
+	bootutil_sha_drop(&sha);
+
+	if (ret == 0) {
+		memcpy(out, digest, FAST_BOOT_FINGERPRINT_LEN);
+	}
+
+out:
+	flash_area_close(fa);
+	return ret;
+}
+
+static bool revalidation_due(void)
+{
+	return CONFIG_MCUBOOT_FAST_BOOT_REVALIDATE_BOOTS > 0 &&
+	       fb.log.ticks >= CONFIG_MCUBOOT_FAST_BOOT_REVALIDATE_BOOTS;
+}
+
+fih_ret boot_image_check_hook(int img_index, int slot)
+{
+	const struct flash_area *fa;
+	int ret;
+
+	if (img_index != 0 || slot != BOOT_PRIMARY_SLOT) {
+		/* Candidate images are always fully checked */
+		FIH_RET(FIH_BOOT_HOOK_REGULAR);
+	}
+
+	fb.fast = false;
+	fb.record_pending = false;
+
+	if (slot0_fingerprint(fb.fingerprint) != 0) {
+		FIH_RET(FIH_BOOT_HOOK_REGULAR);
+	}
+
+	ret = flash_area_open(FAST_BOOT_PARTITION_ID, &fa);
+	if (ret == 0) {
+		ret = fast_boot_log_scan(fa, &fb.log);
+		flash_area_close(fa);
+	}
+
+	/* Without a readable log, still validate and try to record */
+	fb.record_pending = true;
+	if (ret) {
+		FIH_RET(FIH_BOOT_HOOK_REGULAR);
+	}
+
+	if (!fb.log.valid ||
+	    memcmp(fb.log.fingerprint, fb.fingerprint, FAST_BOOT_FINGERPRINT_LEN) != 0) {
+		BOOT_LOG_INF("Fast boot: slot0 changed, full validation");
+		FIH_RET(FIH_BOOT_HOOK_REGULAR);
+	}
+
+	if (revalidation_due()) {
+		BOOT_LOG_INF("Fast boot: periodic full validation");
+		FIH_RET(FIH_BOOT_HOOK_REGULAR);
+	}
+
+	fb.fast = true;
+	fb.record_pending = false;
+	BOOT_LOG_INF("Fast boot: slot0 unchanged, hash skipped (%u/%u)",
+	             fb.log.ticks + 1, CONFIG_MCUBOOT_FAST_BOOT_REVALIDATE_BOOTS);
+	FIH_RET(FIH_SUCCESS);
+}
+
+/**
+ * @brief Append this boot to the log once an image was found bootable
+ */
+static void record_boot(void)
+{
+	const struct flash_area *fa;
+	uint32_t boot_us = k_cyc_to_us_floor32(k_cycle_get_32() - fb.start_cycles);
+	int ret;
+
+	if (!fb.fast && !fb.record_pending) {
+		/* slot0 was not checked through the hook (e.g. right after a swap) */
+		return;
+	}
+
+	ret = flash_area_open(FAST_BOOT_PARTITION_ID, &fa);
+	if (ret) {
+		return;
+	}
+
+	if (fb.fast) {
+		ret = fast_boot_log_append_tick(fa, &fb.log, boot_us);
+	} else {
+		ret = fast_boot_log_append_record(fa, &fb.log, fb.fingerprint, boot_us);
+	}
+
+	flash_area_close(fa);
+
+	if (ret) {
+		BOOT_LOG_WRN("Fast boot: failed to update log: %d", ret);
+	}
+}
+
+void mcuboot_status_change(mcuboot_status_type_t status)
+{
+	switch (status) {
+	case MCUBOOT_STATUS_STARTING:
+		fb.start_cycles = k_cycle_get_32();
+		break;
+	case MCUBOOT_STATUS_BOOTABLE_IMAGE_FOUND:
+		record_boot();
+		break;
+	default:
+		break;
+	}
+}
+
+int boot_perform_update_hook(int img_index, struct image_header *img_head,
+                             const struct flash_area *area)
+{
+	/* slot0 is about to be rewritten; whatever was decided no longer holds */
+	fb.fast = false;
+	fb.record_pending = false;
+	return BOOT_HOOK_REGULAR;
+}
+
+int boot_read_image_header_hook(int img_index, int slot, struct image_header *img_head)
+{
+	return BOOT_HOOK_REGULAR;
+}
+
+int boot_copy_region_post_hook(int img_index, const struct flash_area *area, size_t size)
+{
+	return 0;
+}
+
+int boot_read_swap_state_primary_slot_hook(int image_index, struct boot_swap_state *state)
+{
+	return BOOT_HOOK_REGULAR;
+}
+
+int boot_serial_uploaded_hook(int img_index, const struct flash_area *area, size_t size)
+{
+	return 0;
+}
+
+int boot_img_install_stat_hook(int image_index, int slot, int *img_install_stat)
+{
+	return BOOT_HOOK_REGULAR;
+}
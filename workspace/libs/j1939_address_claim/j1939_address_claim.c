@@ -2,20 +2,40 @@
  * SPDX-License-Identifier: Apache-2.0
  *
  * J1939 Address Claim Implementation
+ * Any number of control functions (CFs) share one RX filter, one address
+ * table and one TX queue. Received claims are queued from the RX callback
+ * and handled on the system work queue, one contention pass per claim.
  */
 
 #include "j1939_address_claim.h"
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/can.h>
+#include <zephyr/sys/util.h>
 #include <zephyr/logging/log.h>
 #include <string.h>
 
 LOG_MODULE_REGISTER(j1939_ac, CONFIG_LOG_DEFAULT_LEVEL);
 
-/* Address Claim State */
-static struct {
-	const struct device *can_dev;
+/* Self-configurable address range (J1939-81), where arbitrary CFs start */
+#define J1939_AC_ARBITRARY_START 0x80
+
+#define J1939_AC_TABLE_SIZE (J1939_MAX_UNICAST_ADDRESS + 1)
+
+/**
+ * @brief Address Claimed message, received or to be sent
+ */
+struct ac_claim {
+	uint64_t name;
+	uint8_t address;
+	uint8_t priority;
+};
+
+/**
+ * @brief Control Function State
+ */
+struct ac_cf {
+	bool used;
 	j1939_name_t name;
 	uint8_t current_address;
 	uint8_t preferred_address;
@@ -26,26 +46,34 @@ static struct {
 	j1939_ac_callback_t callback;
 	void *user_data;
 	struct k_work_delayable claim_work;
-	struct k_mutex mutex;
+};
+
+/* Shared Address Claim State */
+static struct {
+	const struct device *can_dev;
 	int filter_id;
+	int default_cf;   /* CF of the j1939_address_claim_*() API */
+	struct ac_cf cf[CONFIG_J1939_AC_MAX_CF];
+
+	/* NAME last seen claiming each address */
+	uint64_t table_name[J1939_AC_TABLE_SIZE];
+	ATOMIC_DEFINE(table_valid, J1939_AC_TABLE_SIZE);
 } ac_state = {
-	.current_address = J1939_NULL_ADDRESS,
-	.state = J1939_AC_STATE_INIT,
+	.filter_id = -1,
+	.default_cf = -1,
 };
 
-/* Forward declarations */
-static void send_address_claimed(uint8_t address);
-static void claim_timeout_handler(struct k_work *work);
-static void can_rx_address_claimed_callback(const struct device *dev,
-                                             struct can_frame *frame,
-                                             void *user_data);
+static K_MUTEX_DEFINE(ac_mutex);
+
+K_MSGQ_DEFINE(ac_rx_msgq, sizeof(struct ac_claim), CONFIG_J1939_AC_RX_QUEUE_LEN, 8);
+K_MSGQ_DEFINE(ac_tx_msgq, sizeof(struct ac_claim), CONFIG_J1939_AC_TX_QUEUE_LEN, 8);
 
 /**
  * @brief Build J1939 29-bit CAN ID
  */
 static inline uint32_t build_can_id(uint8_t priority, uint32_t pgn, uint8_t src_addr)
 {
-	uint32_t can_id = 0x80000000; /* Extended frame */
+	uint32_t can_id = 0; /* Extended frame is flagged with CAN_FRAME_IDE */
 	can_id |= (priority & 0x07) << 26;
 	can_id |= (pgn & 0x3FFFF) << 8;
 	can_id |= (src_addr & 0xFF);
@@ -76,125 +104,258 @@ static inline uint8_t extract_source_addr(uint32_t can_id)
 	return (can_id & 0xFF);
 }
 
+static struct ac_cf *get_cf(int cf)
+{
+	if (cf < 0 || cf >= ARRAY_SIZE(ac_state.cf) || !ac_state.cf[cf].used) {
+		return NULL;
+	}
+
+	return &ac_state.cf[cf];
+}
+
 /**
- * @brief Send Address Claimed message
+ * @brief Send the queued Address Claimed messages
+ *
+ * All CFs transmit through this one queue, so a burst of claims at
+ * bring-up goes out in order without blocking the caller.
  */
-static void send_address_claimed(uint8_t address)
+static void tx_work_handler(struct k_work *work)
 {
+	struct ac_claim claim;
 	struct can_frame frame;
-	uint32_t can_id;
 	int ret;
 
-	/* Build CAN ID with ADDRESS_CLAIMED PGN */
-	can_id = build_can_id(ac_state.priority, J1939_PGN_ADDRESS_CLAIMED, address);
+	ARG_UNUSED(work);
 
-	frame.id = can_id;
-	frame.flags = CAN_FRAME_IDE; /* Extended ID */
-	frame.dlc = 8;
+	while (k_msgq_get(&ac_tx_msgq, &claim, K_NO_WAIT) == 0) {
+		/* Address Claimed goes to the global address */
+		frame.id = build_can_id(claim.priority,
+		                        J1939_PGN_ADDRESS_CLAIMED | J1939_BROADCAST_ADDRESS,
+		                        claim.address);
+		frame.flags = CAN_FRAME_IDE; /* Extended ID */
+		frame.dlc = 8;
+
+		/* Pack NAME into data bytes (little-endian) */
+		for (int i = 0; i < 8; i++) {
+			frame.data[i] = (claim.name >> (i * 8)) & 0xFF;
+		}
 
-	/* Pack NAME into data bytes (little-endian) */
-	for (int i = 0; i < 8; i++) {
-		frame.data[i] = (ac_state.name.value >> (i * 8)) & 0xFF;
+		ret = can_send(ac_state.can_dev, &frame, K_MSEC(100), NULL, NULL);
+		if (ret) {
+			LOG_ERR("Failed to send Address Claimed: %d", ret);
+			continue;
+		}
+
+		LOG_INF("Sent Address Claimed: addr=0x%02X, NAME=0x%016llX",
+		        claim.address, claim.name);
 	}
+}
 
-	ret = can_send(ac_state.can_dev, &frame, K_MSEC(100), NULL, NULL);
-	if (ret) {
-		LOG_ERR("Failed to send Address Claimed: %d", ret);
+static K_WORK_DEFINE(ac_tx_work, tx_work_handler);
+
+/**
+ * @brief Queue an Address Claimed message for a CF
+ */
+static void send_address_claimed(const struct ac_cf *cf, uint8_t address)
+{
+	struct ac_claim claim = {
+		.name = cf->name.value,
+		.address = address,
+		.priority = cf->priority,
+	};
+
+	if (k_msgq_put(&ac_tx_msgq, &claim, K_NO_WAIT) != 0) {
+		LOG_ERR("TX queue full, dropped claim for 0x%02X", address);
 		return;
 	}
 
-	LOG_INF("Sent Address Claimed: addr=0x%02X, NAME=0x%016llX",
-	        address, ac_state.name.value);
+	k_work_submit(&ac_tx_work);
+}
+
+static void notify(struct ac_cf *cf)
+{
+	if (cf->callback) {
+		cf->callback(cf->current_address, cf->state, cf->user_data);
+	}
 }
 
 /**
- * @brief Handle contention - another node has higher priority NAME
+ * @brief Record a claim seen on the bus
+ *
+ * A NAME holds one address, so a claim for a new address (or Cannot
+ * Claim) drops the NAME's old entry.
  */
-static void handle_contention(uint8_t conflicting_address, j1939_name_t other_name)
+static void table_update(uint64_t name, uint8_t address)
 {
-	int name_cmp = j1939_name_compare(ac_state.name, other_name);
+	for (int i = 0; i < J1939_AC_TABLE_SIZE; i++) {
+		if (i != address && ac_state.table_name[i] == name &&
+		    atomic_test_bit(ac_state.table_valid, i)) {
+			atomic_clear_bit(ac_state.table_valid, i);
+		}
+	}
 
-	LOG_WRN("Address contention detected: addr=0x%02X", conflicting_address);
-	LOG_DBG("Our NAME: 0x%016llX, Other NAME: 0x%016llX",
-	        ac_state.name.value, other_name.value);
+	if (address <= J1939_MAX_UNICAST_ADDRESS) {
+		ac_state.table_name[address] = name;
+		atomic_set_bit(ac_state.table_valid, address);
+	}
+}
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+/**
+ * @brief CF holding or claiming an address, other than @p except
+ */
+static struct ac_cf *local_holder(uint8_t address, const struct ac_cf *except)
+{
+	for (int i = 0; i < ARRAY_SIZE(ac_state.cf); i++) {
+		struct ac_cf *cf = &ac_state.cf[i];
 
-	if (name_cmp < 0) {
-		/* Our NAME has higher priority - we keep the address */
-		LOG_INF("Our NAME has higher priority, keeping address 0x%02X",
-		        ac_state.current_address);
-		ac_state.state = J1939_AC_STATE_CLAIMED;
+		if (cf->used && cf != except && cf->current_address == address &&
+		    (cf->state == J1939_AC_STATE_CLAIMING || cf->state == J1939_AC_STATE_CLAIMED)) {
+			return cf;
+		}
+	}
+
+	return NULL;
+}
 
-		if (ac_state.callback) {
-			ac_state.callback(ac_state.current_address, ac_state.state,
-			                  ac_state.user_data);
+/**
+ * @brief Address is worth claiming for a CF
+ *
+ * Not held by another of our CFs, and not by a higher priority NAME on
+ * the bus; a lower priority holder would lose the contention.
+ */
+static bool address_available(const struct ac_cf *cf, uint8_t address)
+{
+	if (address > J1939_MAX_UNICAST_ADDRESS || local_holder(address, cf)) {
+		return false;
+	}
+
+	return !atomic_test_bit(ac_state.table_valid, address) ||
+	       ac_state.table_name[address] >= cf->name.value;
+}
+
+/**
+ * @brief First address from @p start a CF can claim
+ *
+ * @return Address, or J1939_NULL_ADDRESS if there is none
+ */
+static uint8_t pick_address(const struct ac_cf *cf, uint8_t start)
+{
+	uint8_t address = start;
+
+	if (address > J1939_MAX_UNICAST_ADDRESS) {
+		if (!cf->arbitrary_capable) {
+			return J1939_NULL_ADDRESS;
 		}
-	} else if (name_cmp > 0) {
-		/* Other NAME has higher priority - we must find new address */
-		LOG_WRN("Other NAME has higher priority, must find new address");
-		ac_state.state = J1939_AC_STATE_CONTENTION;
-
-		if (ac_state.arbitrary_capable) {
-			/* Find next available address */
-			uint8_t new_addr = (ac_state.current_address + 1) & 0xFF;
-
-			/* Search for free address */
-			while (new_addr != ac_state.current_address) {
-				if (new_addr >= J1939_MIN_UNICAST_ADDRESS &&
-				    new_addr <= J1939_MAX_UNICAST_ADDRESS) {
-					/* Try this address */
-					ac_state.current_address = new_addr;
-					ac_state.state = J1939_AC_STATE_CLAIMING;
-
-					LOG_INF("Trying new address: 0x%02X", new_addr);
-					send_address_claimed(new_addr);
-
-					/* Wait for contention again */
-					k_work_reschedule(&ac_state.claim_work,
-					                  K_MSEC(ac_state.claim_timeout_ms));
-					break;
-				}
-				new_addr = (new_addr + 1) & 0xFF;
-			}
+		address = J1939_AC_ARBITRARY_START;
+	}
 
-			if (new_addr == ac_state.current_address) {
-				/* No available addresses */
-				LOG_ERR("No available addresses found");
-				ac_state.state = J1939_AC_STATE_CANNOT_CLAIM;
-				ac_state.current_address = J1939_NULL_ADDRESS;
+	for (int n = 0; n < J1939_AC_TABLE_SIZE; n++) {
+		if (address_available(cf, address)) {
+			return address;
+		}
 
-				if (ac_state.callback) {
-					ac_state.callback(J1939_NULL_ADDRESS, ac_state.state,
-					                  ac_state.user_data);
-				}
-			}
-		} else {
-			/* Not arbitrary capable - cannot claim */
-			LOG_ERR("Cannot claim address (not arbitrary capable)");
-			ac_state.state = J1939_AC_STATE_CANNOT_CLAIM;
-			ac_state.current_address = J1939_NULL_ADDRESS;
-
-			if (ac_state.callback) {
-				ac_state.callback(J1939_NULL_ADDRESS, ac_state.state,
-				                  ac_state.user_data);
+		if (!cf->arbitrary_capable) {
+			break;
+		}
+
+		address = address >= J1939_MAX_UNICAST_ADDRESS ? 0 : address + 1;
+	}
+
+	return J1939_NULL_ADDRESS;
+}
+
+/**
+ * @brief Claim an address, or announce that the CF cannot claim one
+ */
+static void claim_address(struct ac_cf *cf, uint8_t address)
+{
+	if (address == J1939_NULL_ADDRESS) {
+		LOG_ERR("NAME 0x%016llX cannot claim an address", cf->name.value);
+		k_work_cancel_delayable(&cf->claim_work);
+		cf->state = J1939_AC_STATE_CANNOT_CLAIM;
+		cf->current_address = J1939_NULL_ADDRESS;
+		send_address_claimed(cf, J1939_NULL_ADDRESS);
+		notify(cf);
+		return;
+	}
+
+	cf->current_address = address;
+	cf->state = J1939_AC_STATE_CLAIMING;
+	send_address_claimed(cf, address);
+
+	/* Wait for contention */
+	k_work_reschedule(&cf->claim_work, K_MSEC(cf->claim_timeout_ms));
+}
+
+/**
+ * @brief Contention pass for one received claim
+ *
+ * Records the claim and checks it against every CF once. A CF whose
+ * address is claimed by a higher priority NAME moves on; one with the
+ * higher priority NAME defends its address by claiming it again.
+ */
+static void handle_claim(const struct ac_claim *claim)
+{
+	struct ac_cf *cf;
+
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(ac_state.cf); i++) {
+		cf = &ac_state.cf[i];
+
+		if (cf->used && cf->name.value == claim->name) {
+			/* Our own claim looped back, or another node with our NAME */
+			if (claim->address != cf->current_address) {
+				LOG_ERR("Duplicate NAME detected! This violates J1939 spec");
 			}
+			k_mutex_unlock(&ac_mutex);
+			return;
 		}
-	} else {
-		/* Identical NAMEs - this should not happen! */
-		LOG_ERR("Duplicate NAME detected! This violates J1939 spec");
-		ac_state.state = J1939_AC_STATE_CANNOT_CLAIM;
-		ac_state.current_address = J1939_NULL_ADDRESS;
-
-		if (ac_state.callback) {
-			ac_state.callback(J1939_NULL_ADDRESS, ac_state.state,
-			                  ac_state.user_data);
+	}
+
+	table_update(claim->name, claim->address);
+
+	cf = local_holder(claim->address, NULL);
+	if (!cf) {
+		k_mutex_unlock(&ac_mutex);
+		return;
+	}
+
+	LOG_WRN("Address contention detected: addr=0x%02X", claim->address);
+	LOG_DBG("Our NAME: 0x%016llX, Other NAME: 0x%016llX", cf->name.value, claim->name);
+
+	if (cf->name.value < claim->name) {
+		/* Our NAME has higher priority - we keep the address */
+		LOG_INF("Our NAME has higher priority, keeping address 0x%02X",
+		        cf->current_address);
+		send_address_claimed(cf, cf->current_address);
+		if (cf->state == J1939_AC_STATE_CLAIMING) {
+			k_work_reschedule(&cf->claim_work, K_MSEC(cf->claim_timeout_ms));
 		}
+	} else {
+		/* Other NAME has higher priority - we must find new address */
+		LOG_WRN("Other NAME has higher priority, must find new address");
+		cf->state = J1939_AC_STATE_CONTENTION;
+		notify(cf);
+		claim_address(cf, pick_address(cf, cf->current_address));
 	}
 
-	k_mutex_unlock(&ac_state.mutex);
+	k_mutex_unlock(&ac_mutex);
+}
+
+static void rx_work_handler(struct k_work *work)
+{
+	struct ac_claim claim;
+
+	ARG_UNUSED(work);
+
+	while (k_msgq_get(&ac_rx_msgq, &claim, K_NO_WAIT) == 0) {
+		handle_claim(&claim);
+	}
 }
 
+static K_WORK_DEFINE(ac_rx_work, rx_work_handler);
+
 /**
  * @brief CAN RX callback for Address Claimed messages
  */
@@ -202,6 +363,8 @@ static void can_rx_address_claimed_callback(const struct device *dev,
                                              struct can_frame *frame,
                                              void *user_data)
 {
+	struct ac_claim claim;
+
 	ARG_UNUSED(dev);
 	ARG_UNUSED(user_data);
 
@@ -209,23 +372,19 @@ static void can_rx_address_claimed_callback(const struct device *dev,
 		return;
 	}
 
-	uint8_t claimed_addr = extract_source_addr(frame->id);
-	j1939_name_t other_name = extract_name_from_frame(frame);
+	claim.address = extract_source_addr(frame->id);
+	claim.name = extract_name_from_frame(frame).value;
 
 	LOG_DBG("Received Address Claimed: addr=0x%02X, NAME=0x%016llX",
-	        claimed_addr, other_name.value);
-
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+	        claim.address, claim.name);
 
-	/* Check if this conflicts with our address */
-	if (claimed_addr == ac_state.current_address &&
-	    ac_state.state == J1939_AC_STATE_CLAIMING) {
-		k_mutex_unlock(&ac_state.mutex);
-		handle_contention(claimed_addr, other_name);
+	/* Handled on the work queue; the RX callback may run in an ISR */
+	if (k_msgq_put(&ac_rx_msgq, &claim, K_NO_WAIT) != 0) {
+		LOG_WRN("RX queue full, dropped claim for 0x%02X", claim.address);
 		return;
 	}
 
-	k_mutex_unlock(&ac_state.mutex);
+	k_work_submit(&ac_rx_work);
 }
 
 /**
@@ -233,29 +392,27 @@ static void can_rx_address_claimed_callback(const struct device *dev,
  */
 static void claim_timeout_handler(struct k_work *work)
 {
-	ARG_UNUSED(work);
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct ac_cf *cf = CONTAINER_OF(dwork, struct ac_cf, claim_work);
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+	k_mutex_lock(&ac_mutex, K_FOREVER);
 
-	if (ac_state.state == J1939_AC_STATE_CLAIMING) {
+	if (cf->used && cf->state == J1939_AC_STATE_CLAIMING) {
 		/* No contention detected - address is claimed! */
-		ac_state.state = J1939_AC_STATE_CLAIMED;
-		LOG_INF("Address 0x%02X successfully claimed", ac_state.current_address);
-
-		if (ac_state.callback) {
-			ac_state.callback(ac_state.current_address, ac_state.state,
-			                  ac_state.user_data);
-		}
+		cf->state = J1939_AC_STATE_CLAIMED;
+		LOG_INF("Address 0x%02X successfully claimed", cf->current_address);
+		notify(cf);
 	}
 
-	k_mutex_unlock(&ac_state.mutex);
+	k_mutex_unlock(&ac_mutex);
 }
 
-int j1939_address_claim_init(const struct j1939_ac_config *config,
-                              j1939_ac_callback_t callback,
-                              void *user_data)
+int j1939_ac_cf_add(const struct j1939_ac_config *config, j1939_ac_callback_t callback,
+                    void *user_data)
 {
 	struct can_filter filter;
+	struct ac_cf *cf = NULL;
+	int index = -1;
 	int ret;
 
 	if (!config || !config->can_dev) {
@@ -268,141 +425,312 @@ int j1939_address_claim_init(const struct j1939_ac_config *config,
 		return -ENODEV;
 	}
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+	k_mutex_lock(&ac_mutex, K_FOREVER);
 
-	/* Initialize state */
-	ac_state.can_dev = config->can_dev;
-	ac_state.name = config->name;
-	ac_state.preferred_address = config->preferred_address;
-	ac_state.current_address = J1939_NULL_ADDRESS;
-	ac_state.priority = config->priority;
-	ac_state.arbitrary_capable = config->arbitrary_capable;
-	ac_state.claim_timeout_ms = config->claim_timeout_ms;
-	ac_state.callback = callback;
-	ac_state.user_data = user_data;
-	ac_state.state = J1939_AC_STATE_INIT;
-
-	k_mutex_unlock(&ac_state.mutex);
+	if (ac_state.can_dev && ac_state.can_dev != config->can_dev) {
+		LOG_ERR("All control functions must share one CAN device");
+		k_mutex_unlock(&ac_mutex);
+		return -EINVAL;
+	}
 
-	/* Initialize work item */
-	k_work_init_delayable(&ac_state.claim_work, claim_timeout_handler);
+	for (int i = 0; i < ARRAY_SIZE(ac_state.cf); i++) {
+		if (ac_state.cf[i].used && ac_state.cf[i].name.value == config->name.value) {
+			k_mutex_unlock(&ac_mutex);
+			return -EALREADY;
+		}
 
-	/* Setup filter for Address Claimed messages (global broadcast) */
-	filter.id = build_can_id(6, J1939_PGN_ADDRESS_CLAIMED, 0);
-	filter.mask = 0x00FFFF00; /* Match PGN only, any source address */
-	filter.flags = CAN_FILTER_IDE;
+		if (!ac_state.cf[i].used && index < 0) {
+			index = i;
+		}
+	}
 
-	ret = can_add_rx_filter(ac_state.can_dev, can_rx_address_claimed_callback,
-	                        NULL, &filter);
-	if (ret < 0) {
-		LOG_ERR("Failed to add Address Claimed filter: %d", ret);
-		return ret;
+	if (index < 0) {
+		k_mutex_unlock(&ac_mutex);
+		return -ENOMEM;
 	}
 
-	ac_state.filter_id = ret;
+	if (ac_state.filter_id < 0) {
+		/* One filter for all CFs: Address Claimed to any destination */
+		filter.id = build_can_id(0, J1939_PGN_ADDRESS_CLAIMED, 0);
+		filter.mask = 0x03FF0000; /* Match DP and PF only, any DA and SA */
+		filter.flags = CAN_FILTER_IDE;
+
+		ret = can_add_rx_filter(config->can_dev, can_rx_address_claimed_callback,
+		                        NULL, &filter);
+		if (ret < 0) {
+			LOG_ERR("Failed to add Address Claimed filter: %d", ret);
+			k_mutex_unlock(&ac_mutex);
+			return ret;
+		}
 
-	LOG_INF("J1939 Address Claim initialized");
-	LOG_INF("NAME: 0x%016llX, Preferred Address: 0x%02X",
-	        ac_state.name.value, ac_state.preferred_address);
+		ac_state.filter_id = ret;
+		ac_state.can_dev = config->can_dev;
+	}
 
-	return 0;
+	cf = &ac_state.cf[index];
+	*cf = (struct ac_cf) {
+		.used = true,
+		.name = config->name,
+		.current_address = J1939_NULL_ADDRESS,
+		.preferred_address = config->preferred_address,
+		.priority = config->priority,
+		.state = J1939_AC_STATE_INIT,
+		.arbitrary_capable = config->arbitrary_capable,
+		.claim_timeout_ms = config->claim_timeout_ms,
+		.callback = callback,
+		.user_data = user_data,
+	};
+	k_work_init_delayable(&cf->claim_work, claim_timeout_handler);
+
+	k_mutex_unlock(&ac_mutex);
+
+	LOG_INF("NAME: 0x%016llX, Preferred Address: 0x%02X (CF %d)",
+	        cf->name.value, cf->preferred_address, index);
+
+	return index;
 }
 
-int j1939_address_claim_start(void)
+int j1939_ac_cf_start(int handle)
 {
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+	struct ac_cf *cf;
+
+	k_mutex_lock(&ac_mutex, K_FOREVER);
 
-	if (!ac_state.can_dev) {
+	cf = get_cf(handle);
+	if (!cf) {
 		LOG_ERR("Not initialized");
-		k_mutex_unlock(&ac_state.mutex);
+		k_mutex_unlock(&ac_mutex);
 		return -EINVAL;
 	}
 
-	if (ac_state.state == J1939_AC_STATE_CLAIMED) {
-		LOG_WRN("Address already claimed: 0x%02X", ac_state.current_address);
-		k_mutex_unlock(&ac_state.mutex);
+	if (cf->state == J1939_AC_STATE_CLAIMED) {
+		LOG_WRN("Address already claimed: 0x%02X", cf->current_address);
+		k_mutex_unlock(&ac_mutex);
 		return 0;
 	}
 
-	/* Start with preferred address */
-	ac_state.current_address = ac_state.preferred_address;
-	ac_state.state = J1939_AC_STATE_CLAIMING;
+	/* Start with preferred address, unless it is known to be taken */
+	claim_address(cf, pick_address(cf, cf->preferred_address));
 
-	k_mutex_unlock(&ac_state.mutex);
-
-	/* Send Address Claimed message */
-	send_address_claimed(ac_state.current_address);
-
-	/* Start timeout - if no contention, address is claimed */
-	k_work_reschedule(&ac_state.claim_work, K_MSEC(ac_state.claim_timeout_ms));
-
-	LOG_INF("Address claim procedure started for 0x%02X", ac_state.current_address);
+	LOG_INF("Address claim procedure started for 0x%02X", cf->current_address);
 
+	k_mutex_unlock(&ac_mutex);
 	return 0;
 }
 
-int j1939_address_claim_stop(void)
+int j1939_ac_cf_stop(int handle)
 {
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
+	struct ac_cf *cf;
 
-	if (!ac_state.can_dev) {
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+
+	cf = get_cf(handle);
+	if (!cf) {
 		LOG_ERR("Not initialized");
-		k_mutex_unlock(&ac_state.mutex);
+		k_mutex_unlock(&ac_mutex);
 		return -EINVAL;
 	}
 
 	/* Cancel any pending work */
-	k_work_cancel_delayable(&ac_state.claim_work);
+	k_work_cancel_delayable(&cf->claim_work);
 
-	/* Remove filter */
-	if (ac_state.filter_id >= 0) {
-		can_remove_rx_filter(ac_state.can_dev, ac_state.filter_id);
+	/* Send Address Claimed with NULL address to release */
+	if (cf->current_address != J1939_NULL_ADDRESS) {
+		send_address_claimed(cf, J1939_NULL_ADDRESS);
 	}
 
-	/* Send Address Claimed with NULL address to release */
-	if (ac_state.current_address != J1939_NULL_ADDRESS) {
-		send_address_claimed(J1939_NULL_ADDRESS);
+	cf->current_address = J1939_NULL_ADDRESS;
+	cf->state = J1939_AC_STATE_INIT;
+
+	k_mutex_unlock(&ac_mutex);
+
+	LOG_INF("Address claim stopped (CF %d)", handle);
+
+	return 0;
+}
+
+int j1939_ac_cf_remove(int handle)
+{
+	int ret;
+
+	ret = j1939_ac_cf_stop(handle);
+	if (ret) {
+		return ret;
 	}
 
-	ac_state.current_address = J1939_NULL_ADDRESS;
-	ac_state.state = J1939_AC_STATE_INIT;
+	k_mutex_lock(&ac_mutex, K_FOREVER);
 
-	k_mutex_unlock(&ac_state.mutex);
+	ac_state.cf[handle].used = false;
+	if (ac_state.default_cf == handle) {
+		ac_state.default_cf = -1;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(ac_state.cf); i++) {
+		if (ac_state.cf[i].used) {
+			k_mutex_unlock(&ac_mutex);
+			return 0;
+		}
+	}
 
-	LOG_INF("Address claim stopped");
+	/* Last CF: remove the filter */
+	can_remove_rx_filter(ac_state.can_dev, ac_state.filter_id);
+	ac_state.filter_id = -1;
+	ac_state.can_dev = NULL;
 
+	k_mutex_unlock(&ac_mutex);
 	return 0;
 }
 
-uint8_t j1939_address_claim_get_address(void)
+uint8_t j1939_ac_cf_get_address(int handle)
 {
+	struct ac_cf *cf;
 	uint8_t addr;
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
-	addr = ac_state.current_address;
-	k_mutex_unlock(&ac_state.mutex);
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+	cf = get_cf(handle);
+	addr = cf ? cf->current_address : J1939_NULL_ADDRESS;
+	k_mutex_unlock(&ac_mutex);
 
 	return addr;
 }
 
-enum j1939_ac_state j1939_address_claim_get_state(void)
+enum j1939_ac_state j1939_ac_cf_get_state(int handle)
 {
+	struct ac_cf *cf;
 	enum j1939_ac_state state;
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
-	state = ac_state.state;
-	k_mutex_unlock(&ac_state.mutex);
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+	cf = get_cf(handle);
+	state = cf ? cf->state : J1939_AC_STATE_INIT;
+	k_mutex_unlock(&ac_mutex);
 
 	return state;
 }
 
-uint64_t j1939_address_claim_get_name(void)
+uint64_t j1939_ac_cf_get_name(int handle)
 {
+	struct ac_cf *cf;
 	uint64_t name;
 
-	k_mutex_lock(&ac_state.mutex, K_FOREVER);
-	name = ac_state.name.value;
-	k_mutex_unlock(&ac_state.mutex);
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+	cf = get_cf(handle);
+	name = cf ? cf->name.value : 0;
+	k_mutex_unlock(&ac_mutex);
 
 	return name;
 }
+
+int j1939_ac_cf_find(uint8_t address)
+{
+	struct ac_cf *cf;
+	int ret = -ENOENT;
+
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+	cf = local_holder(address, NULL);
+	if (cf) {
+		ret = cf - ac_state.cf;
+	}
+	k_mutex_unlock(&ac_mutex);
+
+	return ret;
+}
+
+int j1939_ac_request_claimed(uint8_t dst)
+{
+	int count = 0;
+
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(ac_state.cf); i++) {
+		struct ac_cf *cf = &ac_state.cf[i];
+
+		if (!cf->used) {
+			continue;
+		}
+
+		if (cf->state == J1939_AC_STATE_CLAIMING || cf->state == J1939_AC_STATE_CLAIMED) {
+			if (dst == J1939_BROADCAST_ADDRESS || dst == cf->current_address) {
+				send_address_claimed(cf, cf->current_address);
+				count++;
+			}
+		} else if (cf->state == J1939_AC_STATE_CANNOT_CLAIM &&
+		           dst == J1939_BROADCAST_ADDRESS) {
+			send_address_claimed(cf, J1939_NULL_ADDRESS);
+			count++;
+		}
+	}
+
+	k_mutex_unlock(&ac_mutex);
+
+	return count;
+}
+
+int j1939_ac_table_get(uint8_t address, uint64_t *name)
+{
+	int ret = -ENOENT;
+
+	if (address > J1939_MAX_UNICAST_ADDRESS) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&ac_mutex, K_FOREVER);
+	if (atomic_test_bit(ac_state.table_valid, address)) {
+		*name = ac_state.table_name[address];
+		ret = 0;
+	}
+	k_mutex_unlock(&ac_mutex);
+
+	return ret;
+}
+
+int j1939_address_claim_init(const struct j1939_ac_config *config,
+                              j1939_ac_callback_t callback,
+                              void *user_data)
+{
+	int ret;
+
+	if (ac_state.default_cf >= 0) {
+		j1939_ac_cf_remove(ac_state.default_cf);
+	}
+
+	ret = j1939_ac_cf_add(config, callback, user_data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ac_state.default_cf = ret;
+
+	LOG_INF("J1939 Address Claim initialized");
+
+	return 0;
+}
+
+int j1939_address_claim_start(void)
+{
+	return j1939_ac_cf_start(ac_state.default_cf);
+}
+
+int j1939_address_claim_stop(void)
+{
+	return j1939_ac_cf_stop(ac_state.default_cf);
+}
+
+uint8_t j1939_address_claim_get_address(void)
+{
+	return j1939_ac_cf_get_address(ac_state.default_cf);
+}
+
+enum j1939_ac_state j1939_address_claim_get_state(void)
+{
+	return j1939_ac_cf_get_state(ac_state.default_cf);
+}
+
+uint64_t j1939_address_claim_get_name(void)
+{
+	return j1939_ac_cf_get_name(ac_state.default_cf);
+}
+
+int j1939_address_claim_get_cf(void)
+{
+	return ac_state.default_cf >= 0 ? ac_state.default_cf : -ENODEV;
+}
@@ -103,6 +103,9 @@ typedef void (*j1939_ac_callback_t)(uint8_t address, enum j1939_ac_state state,
 /**
  * @brief Initialize J1939 Address Claim
  *
+ * Registers the device's default control function; a second call
+ * replaces it. Further control functions are added with j1939_ac_cf_add().
+ *
  * @param config Configuration structure
  * @param callback Callback function for state changes
  * @param user_data User data passed to callback
@@ -155,6 +158,107 @@ enum j1939_ac_state j1939_address_claim_get_state(void);
  */
 uint64_t j1939_address_claim_get_name(void);
 
+/**
+ * @brief Handle of the default Control Function
+ *
+ * For the j1939_ac_cf_*() API and libraries that take a CF handle.
+ *
+ * @return CF handle, -ENODEV before j1939_address_claim_init()
+ */
+int j1939_address_claim_get_cf(void);
+
+/**
+ * @brief Add a Control Function
+ *
+ * Every control function (CF) has its own NAME, address and claim state
+ * machine. All CFs of the device share one RX filter for Address Claimed,
+ * one table of the addresses claimed on the bus and one TX queue; each
+ * received claim is checked against all CFs in a single pass on the
+ * system work queue. All CFs must use the same CAN device.
+ *
+ * @param config Configuration of the CF
+ * @param callback Callback for state changes of this CF
+ * @param user_data User data passed to callback
+ * @return CF handle (>= 0), -ENOMEM if CONFIG_J1939_AC_MAX_CF are in use,
+ *         -EALREADY if the NAME is already registered, negative errno on
+ *         failure
+ */
+int j1939_ac_cf_add(const struct j1939_ac_config *config, j1939_ac_callback_t callback,
+                    void *user_data);
+
+/**
+ * @brief Remove a Control Function
+ *
+ * Releases its address; the RX filter goes with the last CF.
+ *
+ * @param cf CF handle
+ * @return 0 on success, -EINVAL for an unknown handle
+ */
+int j1939_ac_cf_remove(int cf);
+
+/**
+ * @brief Start the address claim of a Control Function
+ *
+ * Starts at the preferred address, or the next one not held by another
+ * CF or by a higher priority NAME in the address table.
+ *
+ * @param cf CF handle
+ * @return 0 on success, -EINVAL for an unknown handle
+ */
+int j1939_ac_cf_start(int cf);
+
+/**
+ * @brief Stop a Control Function and release its address
+ *
+ * @param cf CF handle
+ * @return 0 on success, -EINVAL for an unknown handle
+ */
+int j1939_ac_cf_stop(int cf);
+
+/**
+ * @brief Address of a Control Function (J1939_NULL_ADDRESS if not claimed)
+ */
+uint8_t j1939_ac_cf_get_address(int cf);
+
+/**
+ * @brief State of a Control Function
+ */
+enum j1939_ac_state j1939_ac_cf_get_state(int cf);
+
+/**
+ * @brief NAME of a Control Function (0 for an unknown handle)
+ */
+uint64_t j1939_ac_cf_get_name(int cf);
+
+/**
+ * @brief Control Function holding an address
+ *
+ * @param address Address claimed (or being claimed) by one of our CFs
+ * @return CF handle, -ENOENT if no CF holds @p address
+ */
+int j1939_ac_cf_find(uint8_t address);
+
+/**
+ * @brief Answer a Request for Address Claimed
+ *
+ * Queues Address Claimed for the CF holding @p dst, or for every CF if
+ * @p dst is J1939_BROADCAST_ADDRESS; CFs that could not claim an address
+ * answer a global request with Cannot Claim Address.
+ *
+ * @param dst Destination of the request
+ * @return Number of claims queued
+ */
+int j1939_ac_request_claimed(uint8_t dst);
+
+/**
+ * @brief Look up the NAME last seen claiming an address on the bus
+ *
+ * @param address Unicast address
+ * @param name Set to the NAME
+ * @return 0 on success, -ENOENT if no claim for the address was seen
+ */
+int j1939_ac_table_get(uint8_t address, uint64_t *name);
+
 /**
  * @brief Helper to build J1939 NAME
  *
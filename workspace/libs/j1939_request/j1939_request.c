@@ -0,0 +1,515 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * J1939 Request PGN Responder Implementation
+ * Replies are encoded into ready-to-send frames when they are registered
+ * or updated. The RX callback only queues the request; the system work
+ * queue looks it up and sends single-frame replies at once, and
+ * multi-packet replies go to the BAM queue, which paces their packets
+ * with asynchronous can_send() calls.
+ */
+
+#include "j1939_request.h"
+#include "j1939_address_claim.h"
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(j1939_req, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define J1939_PGN_TP_CM 0xEC00
+#define J1939_PGN_TP_DT 0xEB00
+#define J1939_TP_CM_BAM 32
+#define J1939_TP_PRIORITY 7
+
+#define REQ_BYTES_PER_PACKET 7
+#define REQ_ACK_NACK 1
+
+/**
+ * @brief Request received on the bus
+ */
+struct req_request {
+	uint32_t pgn;
+	uint8_t src;
+	uint8_t dst;
+};
+
+/**
+ * @brief Registered reply
+ *
+ * Two buffers of @p capacity frames: requests are answered from
+ * @p active while an update encodes into the other one.
+ */
+struct req_reply {
+	bool used;
+	int cf;
+	uint32_t pgn;
+	uint16_t capacity;        /* Frames per buffer */
+	uint16_t frames[2];       /* Encoded frames per buffer */
+	uint8_t active;
+	uint8_t bam_refs[2];      /* Queued or running BAMs reading each buffer */
+	uint8_t (*buf[2])[8];
+};
+
+/**
+ * @brief Multi-packet reply queued for the BAM work item
+ */
+struct req_bam {
+	uint8_t reply;
+	uint8_t buf;
+	uint8_t src;
+	uint16_t next;            /* Frame to send next; 0 is the TP.CM BAM */
+};
+
+static struct {
+	const struct device *can_dev;
+	int filter_id;
+	struct req_reply reply[CONFIG_J1939_REQ_MAX_REPLIES];
+	uint8_t pool[CONFIG_J1939_REQ_POOL_FRAMES][8];
+	size_t pool_used;
+
+	/* Only touched by the BAM work item */
+	struct req_bam bam;
+	bool bam_running;
+} req_state = {
+	.filter_id = -1,
+};
+
+static K_MUTEX_DEFINE(req_mutex);
+
+K_MSGQ_DEFINE(req_rx_msgq, sizeof(struct req_request), CONFIG_J1939_REQ_RX_QUEUE_LEN, 4);
+K_MSGQ_DEFINE(req_bam_msgq, sizeof(struct req_bam), CONFIG_J1939_REQ_TX_QUEUE_LEN, 4);
+
+/**
+ * @brief Build J1939 29-bit CAN ID
+ */
+static inline uint32_t build_can_id(uint8_t priority, uint32_t pgn, uint8_t src_addr)
+{
+	uint32_t can_id = 0; /* Extended frame is flagged with CAN_FRAME_IDE */
+	can_id |= (priority & 0x07) << 26;
+	can_id |= (pgn & 0x3FFFF) << 8;
+	can_id |= (src_addr & 0xFF);
+	return can_id;
+}
+
+/**
+ * @brief PGN with the destination filled in for PDU1 formats
+ */
+static inline uint32_t pgn_to(uint32_t pgn, uint8_t dst)
+{
+	if (((pgn >> 8) & 0xFF) < 240) {
+		return (pgn & 0x3FF00) | dst;
+	}
+
+	return pgn;
+}
+
+static inline size_t frames_for(size_t len)
+{
+	return len <= 8 ? 1 : 1 + DIV_ROUND_UP(len, REQ_BYTES_PER_PACKET);
+}
+
+/**
+ * @brief Encode reply data into one buffer of a reply
+ */
+static void encode(struct req_reply *reply, uint8_t buf, const uint8_t *data, size_t len)
+{
+	uint8_t (*frame)[8] = reply->buf[buf];
+	size_t packets;
+
+	if (len <= 8) {
+		memset(frame[0], 0xFF, 8);
+		memcpy(frame[0], data, len);
+		reply->frames[buf] = 1;
+		return;
+	}
+
+	packets = DIV_ROUND_UP(len, REQ_BYTES_PER_PACKET);
+
+	frame[0][0] = J1939_TP_CM_BAM;
+	frame[0][1] = len & 0xFF;
+	frame[0][2] = (len >> 8) & 0xFF;
+	frame[0][3] = packets;
+	frame[0][4] = 0xFF;
+	frame[0][5] = reply->pgn & 0xFF;
+	frame[0][6] = (reply->pgn >> 8) & 0xFF;
+	frame[0][7] = (reply->pgn >> 16) & 0xFF;
+
+	for (size_t i = 0; i < packets; i++) {
+		size_t offset = i * REQ_BYTES_PER_PACKET;
+
+		memset(frame[1 + i], 0xFF, 8);
+		frame[1 + i][0] = i + 1;
+		memcpy(&frame[1 + i][1], &data[offset], MIN(REQ_BYTES_PER_PACKET, len - offset));
+	}
+
+	reply->frames[buf] = 1 + packets;
+}
+
+static void tx_done(const struct device *dev, int error, void *user_data)
+{
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	if (error) {
+		LOG_WRN("Reply frame not sent: %d", error);
+	}
+}
+
+static int send_frame(uint32_t id, const uint8_t *data)
+{
+	struct can_frame frame = {
+		.id = id,
+		.flags = CAN_FRAME_IDE,
+		.dlc = 8,
+	};
+
+	memcpy(frame.data, data, 8);
+
+	/* Returns once a TX mailbox has the frame; tx_done reports the result */
+	return can_send(req_state.can_dev, &frame, K_MSEC(10), tx_done, NULL);
+}
+
+/**
+ * @brief Send the next frame of the running BAM, or start the next BAM
+ *
+ * TP.DT packets of a BAM are spaced by CONFIG_J1939_REQ_BAM_INTERVAL_MS
+ * (50-200 ms in J1939-21). One BAM runs at a time.
+ */
+static void bam_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(bam_work, bam_work_handler);
+
+static void bam_work_handler(struct k_work *work)
+{
+	struct req_bam *bam = &req_state.bam;
+	struct req_reply *reply;
+	uint8_t data[8];
+	uint16_t frames;
+	uint32_t id;
+	int ret;
+
+	ARG_UNUSED(work);
+
+	if (!req_state.bam_running) {
+		if (k_msgq_get(&req_bam_msgq, bam, K_NO_WAIT) != 0) {
+			return;
+		}
+		req_state.bam_running = true;
+	}
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+	reply = &req_state.reply[bam->reply];
+	frames = reply->frames[bam->buf];
+	memcpy(data, reply->buf[bam->buf][bam->next], sizeof(data));
+	k_mutex_unlock(&req_mutex);
+
+	id = build_can_id(J1939_TP_PRIORITY,
+	                  (bam->next == 0 ? J1939_PGN_TP_CM : J1939_PGN_TP_DT) |
+	                  J1939_BROADCAST_ADDRESS, bam->src);
+
+	ret = send_frame(id, data);
+	if (ret == -EAGAIN) {
+		/* No free mailbox; try the same packet again shortly */
+		k_work_reschedule(&bam_work, K_MSEC(1));
+		return;
+	}
+
+	if (ret) {
+		LOG_ERR("BAM for PGN 0x%05X aborted: %d", reply->pgn, ret);
+		bam->next = frames;
+	} else {
+		bam->next++;
+	}
+
+	if (bam->next < frames) {
+		k_work_reschedule(&bam_work, K_MSEC(CONFIG_J1939_REQ_BAM_INTERVAL_MS));
+		return;
+	}
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+	reply->bam_refs[bam->buf]--;
+	k_mutex_unlock(&req_mutex);
+
+	req_state.bam_running = false;
+
+	if (k_msgq_num_used_get(&req_bam_msgq) > 0) {
+		k_work_reschedule(&bam_work, K_MSEC(CONFIG_J1939_REQ_BAM_INTERVAL_MS));
+	}
+}
+
+/**
+ * @brief Answer a request with a registered reply
+ *
+ * Called with req_mutex held. Nothing is encoded here: a single frame
+ * only gets its identifier, a multi-packet reply is queued as is.
+ */
+static void answer(int index, uint8_t src, uint8_t dst)
+{
+	struct req_reply *reply = &req_state.reply[index];
+	struct req_bam bam = {
+		.reply = index,
+		.buf = reply->active,
+		.src = src,
+	};
+	int ret;
+
+	if (reply->frames[reply->active] == 1) {
+		ret = send_frame(build_can_id(CONFIG_J1939_REQ_PRIORITY, pgn_to(reply->pgn, dst), src),
+		                 reply->buf[reply->active][0]);
+		if (ret) {
+			LOG_WRN("Failed to send PGN 0x%05X: %d", reply->pgn, ret);
+		}
+		return;
+	}
+
+	if (k_msgq_put(&req_bam_msgq, &bam, K_NO_WAIT) != 0) {
+		LOG_WRN("BAM queue full, dropped PGN 0x%05X", reply->pgn);
+		return;
+	}
+
+	reply->bam_refs[bam.buf]++;
+	k_work_schedule(&bam_work, K_NO_WAIT);
+}
+
+/**
+ * @brief NACK a destination specific request for a PGN we do not have
+ */
+static void send_nack(uint8_t src, uint8_t requester, uint32_t pgn)
+{
+	uint8_t data[8] = {
+		REQ_ACK_NACK, 0xFF, 0xFF, 0xFF, requester,
+		pgn & 0xFF, (pgn >> 8) & 0xFF, (pgn >> 16) & 0xFF,
+	};
+	int ret;
+
+	ret = send_frame(build_can_id(CONFIG_J1939_REQ_PRIORITY,
+	                              J1939_PGN_ACKNOWLEDGMENT | J1939_BROADCAST_ADDRESS, src),
+	                 data);
+	if (ret) {
+		LOG_WRN("Failed to NACK PGN 0x%05X: %d", pgn, ret);
+	}
+}
+
+static void handle_request(const struct req_request *req)
+{
+	bool global = req->dst == J1939_BROADCAST_ADDRESS;
+	/* Requests from the null address are answered globally (J1939-21) */
+	uint8_t reply_dst = global || req->src == J1939_NULL_ADDRESS ?
+	                    J1939_BROADCAST_ADDRESS : req->src;
+	bool answered = false;
+	int target = -1;
+
+	if (req->pgn == J1939_PGN_ADDRESS_CLAIMED) {
+		(void)j1939_ac_request_claimed(req->dst);
+		return;
+	}
+
+	if (!global) {
+		target = j1939_ac_cf_find(req->dst);
+		if (target < 0) {
+			return;
+		}
+	}
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(req_state.reply); i++) {
+		struct req_reply *reply = &req_state.reply[i];
+		uint8_t src;
+
+		if (!reply->used || reply->pgn != req->pgn) {
+			continue;
+		}
+
+		if (global) {
+			if (j1939_ac_cf_get_state(reply->cf) != J1939_AC_STATE_CLAIMED) {
+				continue;
+			}
+			src = j1939_ac_cf_get_address(reply->cf);
+		} else {
+			if (reply->cf != target) {
+				continue;
+			}
+			src = req->dst;
+		}
+
+		answer(i, src, reply_dst);
+		answered = true;
+	}
+
+	k_mutex_unlock(&req_mutex);
+
+	if (!answered && !global && IS_ENABLED(CONFIG_J1939_REQ_NACK)) {
+		send_nack(req->dst, req->src, req->pgn);
+	}
+}
+
+static void rx_work_handler(struct k_work *work)
+{
+	struct req_request req;
+
+	ARG_UNUSED(work);
+
+	while (k_msgq_get(&req_rx_msgq, &req, K_NO_WAIT) == 0) {
+		handle_request(&req);
+	}
+}
+
+static K_WORK_DEFINE(req_rx_work, rx_work_handler);
+
+/**
+ * @brief CAN RX callback for Request PGN
+ */
+static void can_rx_request_callback(const struct device *dev, struct can_frame *frame,
+                                    void *user_data)
+{
+	struct req_request req;
+
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	if (frame->dlc < 3) {
+		return;
+	}
+
+	req.pgn = (frame->data[0] | (frame->data[1] << 8) | (frame->data[2] << 16)) & 0x3FFFF;
+	req.src = frame->id & 0xFF;
+	req.dst = (frame->id >> 8) & 0xFF;
+
+	/* Handled on the work queue; the RX callback may run in an ISR */
+	if (k_msgq_put(&req_rx_msgq, &req, K_NO_WAIT) != 0) {
+		LOG_WRN("RX queue full, dropped request for PGN 0x%05X", req.pgn);
+		return;
+	}
+
+	k_work_submit(&req_rx_work);
+}
+
+int j1939_req_init(const struct device *can_dev)
+{
+	struct can_filter filter;
+	int ret;
+
+	if (!device_is_ready(can_dev)) {
+		LOG_ERR("CAN device not ready");
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+
+	if (req_state.filter_id >= 0) {
+		k_mutex_unlock(&req_mutex);
+		return 0;
+	}
+
+	/* Request PGN to any destination */
+	filter.id = build_can_id(0, J1939_PGN_REQUEST, 0);
+	filter.mask = 0x03FF0000; /* Match DP and PF only, any DA and SA */
+	filter.flags = CAN_FILTER_IDE;
+
+	ret = can_add_rx_filter(can_dev, can_rx_request_callback, NULL, &filter);
+	if (ret < 0) {
+		LOG_ERR("Failed to add Request filter: %d", ret);
+		k_mutex_unlock(&req_mutex);
+		return ret;
+	}
+
+	req_state.filter_id = ret;
+	req_state.can_dev = can_dev;
+
+	k_mutex_unlock(&req_mutex);
+
+	LOG_INF("J1939 Request responder initialized");
+
+	return 0;
+}
+
+int j1939_req_register(int cf, uint32_t pgn, const uint8_t *data, size_t len, size_t max_len)
+{
+	struct req_reply *reply;
+	size_t capacity;
+	int index = -1;
+
+	if (cf < 0 || len == 0 || len > max_len || max_len > J1939_REQ_MAX_LEN) {
+		return -EINVAL;
+	}
+
+	capacity = frames_for(max_len);
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+
+	for (int i = 0; i < ARRAY_SIZE(req_state.reply); i++) {
+		if (req_state.reply[i].used && req_state.reply[i].cf == cf &&
+		    req_state.reply[i].pgn == pgn) {
+			k_mutex_unlock(&req_mutex);
+			return -EALREADY;
+		}
+
+		if (!req_state.reply[i].used && index < 0) {
+			index = i;
+		}
+	}
+
+	if (index < 0 || req_state.pool_used + 2 * capacity > ARRAY_SIZE(req_state.pool)) {
+		k_mutex_unlock(&req_mutex);
+		LOG_ERR("No room for PGN 0x%05X (%zu frames)", pgn, 2 * capacity);
+		return -ENOMEM;
+	}
+
+	reply = &req_state.reply[index];
+	*reply = (struct req_reply) {
+		.used = true,
+		.cf = cf,
+		.pgn = pgn,
+		.capacity = capacity,
+		.buf = {
+			&req_state.pool[req_state.pool_used],
+			&req_state.pool[req_state.pool_used + capacity],
+		},
+	};
+	req_state.pool_used += 2 * capacity;
+
+	encode(reply, 0, data, len);
+
+	k_mutex_unlock(&req_mutex);
+
+	LOG_INF("Answering PGN 0x%05X from CF %d (%zu bytes, %u frames)",
+	        pgn, cf, len, reply->frames[0]);
+
+	return index;
+}
+
+int j1939_req_update(int handle, const uint8_t *data, size_t len)
+{
+	struct req_reply *reply;
+	uint8_t next;
+
+	if (handle < 0 || handle >= ARRAY_SIZE(req_state.reply) || len == 0) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&req_mutex, K_FOREVER);
+
+	reply = &req_state.reply[handle];
+	if (!reply->used || frames_for(len) > reply->capacity) {
+		k_mutex_unlock(&req_mutex);
+		return -EINVAL;
+	}
+
+	next = reply->active ^ 1;
+	if (reply->bam_refs[next] > 0) {
+		k_mutex_unlock(&req_mutex);
+		return -EBUSY;
+	}
+
+	encode(reply, next, data, len);
+	reply->active = next;
+
+	k_mutex_unlock(&req_mutex);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * J1939 Request PGN Responder
+ * Answers Request (PGN 0xEA00) for registered PGNs from frames encoded
+ * ahead of time, and Request for Address Claimed through the address
+ * claim library.
+ */
+
+#ifndef J1939_REQUEST_H_
+#define J1939_REQUEST_H_
+
+#include <zephyr/device.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Common PGNs that service tools request
+ */
+#define J1939_PGN_SOFTWARE_ID     0xFEDA  /* SOFT: software identification */
+#define J1939_PGN_ECU_ID          0xFDC5  /* ECUID: ECU identification */
+#define J1939_PGN_COMPONENT_ID    0xFEEB  /* CI: component identification */
+#define J1939_PGN_ACKNOWLEDGMENT  0xE800  /* ACK/NACK */
+
+/** Largest reply: one TP session of 255 packets */
+#define J1939_REQ_MAX_LEN 1785
+
+/**
+ * @brief Initialize the responder
+ *
+ * Adds the RX filter for Request PGN. The CAN device must be the one the
+ * address claim library uses and must already be started.
+ *
+ * @param can_dev CAN device
+ * @return 0 on success, negative errno on failure
+ */
+int j1939_req_init(const struct device *can_dev);
+
+/**
+ * @brief Register the reply to a PGN
+ *
+ * Encodes @p data into the frames that answer a request: one frame for up
+ * to 8 bytes, otherwise a TP.CM BAM followed by the TP.DT packets. The
+ * reply is sent from the address of @p cf when it is claimed, to a global
+ * request or to one addressed to @p cf.
+ *
+ * @param cf Control function handle (j1939_address_claim_get_cf() or
+ *           j1939_ac_cf_add())
+ * @param pgn PGN answered
+ * @param data Reply data
+ * @param len Length of @p data
+ * @param max_len Largest length later passed to j1939_req_update()
+ * @return Reply handle (>= 0), -ENOMEM if no reply slot or pool space is
+ *         left, -EALREADY if @p cf already answers @p pgn, -EINVAL for a
+ *         bad length
+ */
+int j1939_req_register(int cf, uint32_t pgn, const uint8_t *data, size_t len, size_t max_len);
+
+/**
+ * @brief Change the data of a reply
+ *
+ * Encodes into the reply's second buffer and switches to it, so requests
+ * answered meanwhile see either the old or the new data in full.
+ *
+ * @param handle Reply handle
+ * @param data Reply data
+ * @param len Length of @p data, up to the registered max_len
+ * @return 0 on success, -EINVAL for a bad handle or length, -EBUSY if a
+ *         multi-packet reply is still reading the buffer (retry after
+ *         the BAM, at most 255 x CONFIG_J1939_REQ_BAM_INTERVAL_MS)
+ */
+int j1939_req_update(int handle, const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* J1939_REQUEST_H_ */
@@ -79,6 +79,25 @@ int update_protocol_encode_start(uint8_t *buffer, size_t buf_len, uint32_t image
 	return 5;
 }
 
+int update_protocol_encode_start_acked(uint8_t *buffer, size_t buf_len, uint32_t image_size,
+                                       uint8_t ack_window)
+{
+	int ret;
+
+	if (ack_window == 0) {
+		return -EINVAL;
+	}
+
+	if (buf_len < 6) {
+		return -ENOBUFS;
+	}
+
+	ret = update_protocol_encode_start(buffer, buf_len, image_size);
+	buffer[ret] = ack_window;
+
+	return ret + 1;
+}
+
 int update_protocol_encode_data(uint8_t *buffer, size_t buf_len,
                                  uint16_t sequence, const uint8_t *data,
                                  size_t data_len)
@@ -113,3 +132,36 @@ int update_protocol_encode_end(uint8_t *buffer, size_t buf_len, uint32_t crc32)
 
 	return 5;
 }
+
+int update_protocol_decode_reply(const uint8_t *buffer, size_t buf_len,
+                                 struct update_protocol_reply *reply)
+{
+	if (buf_len < 8) {
+		return -EINVAL;
+	}
+
+	memset(reply, 0, sizeof(*reply));
+	reply->type = buffer[0];
+
+	switch (buffer[0]) {
+	case 0x05: /* STATUS */
+		reply->status = buffer[1];
+		buffer++;
+		break;
+	case 0x06: /* ACK */
+		break;
+	case 0x07: /* NACK */
+		reply->next_sequence = buffer[1] | (buffer[2] << 8);
+		reply->error = buffer[3];
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	/* STATUS carries the ACK fields one byte later */
+	reply->next_sequence = buffer[1] | (buffer[2] << 8);
+	reply->committed = buffer[3] | (buffer[4] << 8) | ((uint32_t)buffer[5] << 16);
+	reply->headroom = buffer[6];
+
+	return 0;
+}
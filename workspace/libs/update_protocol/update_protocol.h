@@ -34,6 +34,21 @@ uint32_t update_protocol_crc32(const uint8_t *data, size_t len);
  */
 int update_protocol_encode_start(uint8_t *buffer, size_t buf_len, uint32_t image_size);
 
+/**
+ * @brief Encode start message asking for acknowledgments
+ *
+ * The device replies with an ACK once slot1 is erased and after every
+ * @p ack_window DATA frames, and with a NACK for the first missing one.
+ *
+ * @param buffer Output buffer
+ * @param buf_len Buffer length
+ * @param image_size Total image size
+ * @param ack_window DATA frames per ACK (1-255)
+ * @return Number of bytes written, or negative error code
+ */
+int update_protocol_encode_start_acked(uint8_t *buffer, size_t buf_len, uint32_t image_size,
+                                       uint8_t ack_window);
+
 /**
  * @brief Encode data message
  *
@@ -58,6 +73,29 @@ int update_protocol_encode_data(uint8_t *buffer, size_t buf_len,
  */
 int update_protocol_encode_end(uint8_t *buffer, size_t buf_len, uint32_t crc32);
 
+/**
+ * @brief Device reply (ACK, NACK or STATUS)
+ */
+struct update_protocol_reply {
+	uint8_t type;           /* 0x05 STATUS, 0x06 ACK, 0x07 NACK */
+	uint8_t status;         /* STATUS: device update status */
+	uint8_t error;          /* NACK: errno of the failure */
+	uint16_t next_sequence; /* Sequence number the device expects next */
+	uint32_t committed;     /* ACK, STATUS: bytes programmed into slot1 */
+	uint8_t headroom;       /* ACK, STATUS: free receive queue entries */
+};
+
+/**
+ * @brief Decode a device reply
+ *
+ * @param buffer Received frame data
+ * @param buf_len Frame length
+ * @param reply Decoded reply
+ * @return 0 on success, -EINVAL if the frame is not a reply
+ */
+int update_protocol_decode_reply(const uint8_t *buffer, size_t buf_len,
+                                 struct update_protocol_reply *reply);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1054 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * XCP-on-CAN Slave Implementation
+ */
+
+#include "xcp_slave.h"
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(xcp_slave, CONFIG_LOG_DEFAULT_LEVEL);
+
+/**
+ * @brief XCP Command Codes
+ */
+#define XCP_CMD_CONNECT                 0xFF
+#define XCP_CMD_DISCONNECT              0xFE
+#define XCP_CMD_GET_STATUS              0xFD
+#define XCP_CMD_SYNCH                   0xFC
+#define XCP_CMD_GET_COMM_MODE_INFO      0xFB
+#define XCP_CMD_SET_MTA                 0xF6
+#define XCP_CMD_UPLOAD                  0xF5
+#define XCP_CMD_SHORT_UPLOAD            0xF4
+#define XCP_CMD_DOWNLOAD                0xF0
+#define XCP_CMD_CLEAR_DAQ_LIST          0xE3
+#define XCP_CMD_SET_DAQ_PTR             0xE2
+#define XCP_CMD_WRITE_DAQ               0xE1
+#define XCP_CMD_SET_DAQ_LIST_MODE       0xE0
+#define XCP_CMD_GET_DAQ_LIST_MODE       0xDF
+#define XCP_CMD_START_STOP_DAQ_LIST     0xDE
+#define XCP_CMD_START_STOP_SYNCH        0xDD
+#define XCP_CMD_GET_DAQ_CLOCK           0xDC
+#define XCP_CMD_GET_DAQ_PROCESSOR_INFO  0xDA
+#define XCP_CMD_GET_DAQ_RESOLUTION_INFO 0xD9
+#define XCP_CMD_GET_DAQ_EVENT_INFO      0xD7
+#define XCP_CMD_FREE_DAQ                0xD6
+#define XCP_CMD_ALLOC_DAQ               0xD5
+#define XCP_CMD_ALLOC_ODT               0xD4
+#define XCP_CMD_ALLOC_ODT_ENTRY         0xD3
+
+/**
+ * @brief XCP Packet Identifiers and Error Codes
+ */
+#define XCP_PID_RES                     0xFF
+#define XCP_PID_ERR                     0xFE
+
+#define XCP_ERR_CMD_SYNCH               0x00
+#define XCP_ERR_DAQ_ACTIVE              0x11
+#define XCP_ERR_CMD_UNKNOWN             0x20
+#define XCP_ERR_CMD_SYNTAX              0x21
+#define XCP_ERR_OUT_OF_RANGE            0x22
+#define XCP_ERR_ACCESS_DENIED           0x24
+#define XCP_ERR_MODE_NOT_VALID          0x27
+#define XCP_ERR_SEQUENCE                0x29
+#define XCP_ERR_DAQ_CONFIG              0x2A
+#define XCP_ERR_MEMORY_OVERFLOW         0x30
+
+/**
+ * @brief DAQ List Mode Bits
+ */
+#define XCP_DAQ_MODE_DIRECTION          0x02  /* STIM, not supported */
+#define XCP_DAQ_MODE_TIMESTAMP          0x10
+#define XCP_DAQ_MODE_PID_OFF            0x20  /* Not supported */
+#define XCP_DAQ_MODE_SELECTED           0x40
+#define XCP_DAQ_MODE_RUNNING            0x80
+
+#define XCP_RESOURCE_CAL_PAG            0x01
+#define XCP_RESOURCE_DAQ                0x04
+#define XCP_SESSION_DAQ_RUNNING         0x40
+
+/* 4-byte timestamp, unit 1 us */
+#define XCP_TIMESTAMP_MODE              0x34
+
+#define XCP_MAX_CTO 8
+#define XCP_MAX_DTO 8
+
+/* Identification field: one byte absolute ODT number */
+#define XCP_ODT_PAYLOAD (XCP_MAX_DTO - 1)
+#define XCP_TIMESTAMP_SIZE 4
+
+#define XCP_CMD_QUEUE_LEN 8
+
+struct xcp_odt_entry {
+	uintptr_t addr;
+	uint8_t size;
+};
+
+struct xcp_odt {
+	uint16_t first_entry;
+	uint8_t entry_count;
+};
+
+struct xcp_daq_list {
+	uint16_t first_odt;
+	uint8_t odt_count;
+	uint8_t mode;
+	uint8_t event;
+	uint8_t prescaler;
+	uint8_t prescaler_count;
+};
+
+struct xcp_event_channel {
+	const char *name;
+	uint32_t period_us;
+};
+
+static struct {
+	const struct device *can_dev;
+	bool connected;
+	uintptr_t mta;
+
+	/* Dynamic DAQ configuration, allocated front to back */
+	struct xcp_daq_list daq[CONFIG_XCP_SLAVE_MAX_DAQ];
+	struct xcp_odt odt[CONFIG_XCP_SLAVE_MAX_ODT];
+	struct xcp_odt_entry entry[CONFIG_XCP_SLAVE_MAX_ODT_ENTRIES];
+	uint16_t daq_count;
+	uint16_t odt_count;
+	uint16_t entry_count;
+
+	/* SET_DAQ_PTR position */
+	uint16_t ptr_entry;
+	uint16_t ptr_end;
+
+	struct xcp_event_channel events[CONFIG_XCP_SLAVE_MAX_EVENTS];
+	uint8_t event_count;
+
+	struct xcp_slave_stats stats;
+} xcp = {
+	.events = {
+		[XCP_EVENT_TIMER] = {
+			.name = "timer",
+			.period_us = CONFIG_XCP_SLAVE_TIMER_EVENT_MS * 1000,
+		},
+	},
+	.event_count = 1,
+};
+
+/**
+ * @brief Memory the master may address
+ *
+ * Anything else (peripherals, unmapped space) can fault, and DAQ lists
+ * are sampled in the timer interrupt, so every MTA and ODT entry is
+ * checked against these when it is set.
+ */
+struct xcp_region {
+	const char *start;
+	const char *end;
+	bool writable;
+};
+
+#if defined(CONFIG_ARCH_POSIX)
+/* Host linker symbols of the native_sim executable */
+extern const char __executable_start[];
+extern const char __data_start[];
+extern const char end[];
+#endif
+
+#define XCP_DT_REGION(node, wr) \
+	{ (const char *)DT_REG_ADDR(node), (const char *)DT_REG_ADDR(node) + DT_REG_SIZE(node), wr }
+
+static const struct xcp_region xcp_regions[] = {
+#if defined(CONFIG_ARCH_POSIX)
+	{ __executable_start, end, false },
+	{ __data_start, end, true },
+#else
+#if DT_HAS_CHOSEN(zephyr_sram)
+	XCP_DT_REGION(DT_CHOSEN(zephyr_sram), true),
+#endif
+#if DT_HAS_CHOSEN(zephyr_dtcm)
+	XCP_DT_REGION(DT_CHOSEN(zephyr_dtcm), true),
+#endif
+#if DT_HAS_CHOSEN(zephyr_flash)
+	XCP_DT_REGION(DT_CHOSEN(zephyr_flash), false),
+#endif
+#endif
+};
+
+static bool access_allowed(uintptr_t addr, size_t len, bool write)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(xcp_regions); i++) {
+		const struct xcp_region *r = &xcp_regions[i];
+		uintptr_t start = (uintptr_t)r->start;
+		uintptr_t end_addr = (uintptr_t)r->end;
+
+		if ((r->writable || !write) && addr >= start && addr <= end_addr &&
+		    len <= end_addr - addr) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Guards the DAQ tables against xcp_event() from other contexts */
+static struct k_spinlock daq_lock;
+
+K_MSGQ_DEFINE(xcp_cmd_msgq, XCP_MAX_CTO, XCP_CMD_QUEUE_LEN, 1);
+
+static void cmd_work_handler(struct k_work *work);
+static K_WORK_DEFINE(cmd_work, cmd_work_handler);
+
+/**
+ * @brief DAQ clock in microseconds
+ */
+static uint32_t daq_clock(void)
+{
+#if defined(CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER)
+	return (uint32_t)k_cyc_to_us_floor64(k_cycle_get_64());
+#else
+	return (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+#endif
+}
+
+static uint32_t build_dto_id(void)
+{
+	return CONFIG_XCP_SLAVE_DTO_ID;
+}
+
+static void dto_tx_callback(const struct device *dev, int error, void *user_data)
+{
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	if (error) {
+		xcp.stats.dto_dropped++;
+	}
+}
+
+/**
+ * @brief Queue one packet on the DTO identifier
+ *
+ * Never blocks, so DAQ sampling can run in interrupt context.
+ */
+static int send_dto(const uint8_t *data, uint8_t len)
+{
+	struct can_frame frame = {
+		.id = build_dto_id(),
+		.flags = IS_ENABLED(CONFIG_XCP_SLAVE_EXT_ID) ? CAN_FRAME_IDE : 0,
+		.dlc = len,
+	};
+
+	memcpy(frame.data, data, len);
+
+	return can_send(xcp.can_dev, &frame, K_NO_WAIT, dto_tx_callback, NULL);
+}
+
+static void send_response(const uint8_t *data, uint8_t len)
+{
+	struct can_frame frame = {
+		.id = build_dto_id(),
+		.flags = IS_ENABLED(CONFIG_XCP_SLAVE_EXT_ID) ? CAN_FRAME_IDE : 0,
+		.dlc = len,
+	};
+
+	memcpy(frame.data, data, len);
+
+	can_send(xcp.can_dev, &frame, K_MSEC(100), NULL, NULL);
+}
+
+static void send_error(uint8_t code)
+{
+	uint8_t res[2] = { XCP_PID_ERR, code };
+
+	send_response(res, sizeof(res));
+}
+
+/**
+ * @brief Payload bytes available to an ODT
+ */
+static uint8_t odt_capacity(const struct xcp_daq_list *daq, uint16_t odt)
+{
+	if (odt == daq->first_odt && (daq->mode & XCP_DAQ_MODE_TIMESTAMP)) {
+		return XCP_ODT_PAYLOAD - XCP_TIMESTAMP_SIZE;
+	}
+
+	return XCP_ODT_PAYLOAD;
+}
+
+/**
+ * @brief Check that every ODT of a DAQ list fits one DTO
+ */
+static bool daq_list_valid(const struct xcp_daq_list *daq)
+{
+	if (daq->odt_count == 0 || daq->event >= xcp.event_count) {
+		return false;
+	}
+
+	for (uint16_t o = daq->first_odt; o < daq->first_odt + daq->odt_count; o++) {
+		const struct xcp_odt *odt = &xcp.odt[o];
+		uint16_t bytes = 0;
+
+		for (uint16_t e = odt->first_entry; e < odt->first_entry + odt->entry_count; e++) {
+			bytes += xcp.entry[e].size;
+		}
+
+		if (bytes > odt_capacity(daq, o)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void stop_all_daq(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&daq_lock);
+
+	for (uint16_t i = 0; i < xcp.daq_count; i++) {
+		xcp.daq[i].mode &= ~(XCP_DAQ_MODE_RUNNING | XCP_DAQ_MODE_SELECTED);
+	}
+
+	k_spin_unlock(&daq_lock, key);
+}
+
+static bool daq_running(void)
+{
+	for (uint16_t i = 0; i < xcp.daq_count; i++) {
+		if (xcp.daq[i].mode & XCP_DAQ_MODE_RUNNING) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void xcp_event(uint8_t channel)
+{
+	uint8_t dto[CONFIG_XCP_SLAVE_MAX_ODT][XCP_MAX_DTO];
+	uint8_t dto_len[CONFIG_XCP_SLAVE_MAX_ODT];
+	size_t dto_count = 0;
+	k_spinlock_key_t key;
+	uint32_t timestamp;
+
+	if (!xcp.connected || channel >= xcp.event_count) {
+		return;
+	}
+
+	timestamp = daq_clock();
+
+	/* Sample under the lock, send after releasing it */
+	key = k_spin_lock(&daq_lock);
+
+	for (uint16_t i = 0; i < xcp.daq_count; i++) {
+		struct xcp_daq_list *daq = &xcp.daq[i];
+
+		if (!(daq->mode & XCP_DAQ_MODE_RUNNING) || daq->event != channel) {
+			continue;
+		}
+
+		if (++daq->prescaler_count < daq->prescaler) {
+			continue;
+		}
+		daq->prescaler_count = 0;
+
+		for (uint16_t o = daq->first_odt; o < daq->first_odt + daq->odt_count; o++) {
+			const struct xcp_odt *odt = &xcp.odt[o];
+			uint8_t *pkt = dto[dto_count];
+			uint8_t len = 0;
+
+			pkt[len++] = o;
+
+			if (o == daq->first_odt && (daq->mode & XCP_DAQ_MODE_TIMESTAMP)) {
+				sys_put_le32(timestamp, &pkt[len]);
+				len += XCP_TIMESTAMP_SIZE;
+			}
+
+			for (uint16_t e = odt->first_entry;
+			     e < odt->first_entry + odt->entry_count; e++) {
+				memcpy(&pkt[len], (const void *)xcp.entry[e].addr, xcp.entry[e].size);
+				len += xcp.entry[e].size;
+			}
+
+			dto_len[dto_count++] = len;
+		}
+	}
+
+	k_spin_unlock(&daq_lock, key);
+
+	for (size_t i = 0; i < dto_count; i++) {
+		xcp.stats.dto_sent++;
+		if (send_dto(dto[i], dto_len[i]) != 0) {
+			xcp.stats.dto_dropped++;
+		}
+	}
+}
+
+static void cmd_connect(void)
+{
+	uint8_t res[8];
+
+	xcp.connected = true;
+
+	res[0] = XCP_PID_RES;
+	res[1] = XCP_RESOURCE_DAQ |
+	         (IS_ENABLED(CONFIG_XCP_SLAVE_DOWNLOAD) ? XCP_RESOURCE_CAL_PAG : 0);
+	res[2] = 0x00; /* Intel byte order, byte granularity, no block mode */
+	res[3] = XCP_MAX_CTO;
+	sys_put_le16(XCP_MAX_DTO, &res[4]);
+	res[6] = 0x01; /* Protocol layer version */
+	res[7] = 0x01; /* Transport layer version */
+
+	send_response(res, sizeof(res));
+	LOG_INF("XCP master connected");
+}
+
+static void cmd_disconnect(void)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+
+	stop_all_daq();
+	xcp.connected = false;
+	send_response(res, sizeof(res));
+	LOG_INF("XCP master disconnected");
+}
+
+static void cmd_get_status(void)
+{
+	uint8_t res[6] = { XCP_PID_RES };
+
+	res[1] = daq_running() ? XCP_SESSION_DAQ_RUNNING : 0;
+	res[2] = 0x00; /* No resource protection */
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_comm_mode_info(void)
+{
+	uint8_t res[8] = { XCP_PID_RES };
+
+	res[7] = 0x10; /* Driver version 1.0 */
+	send_response(res, sizeof(res));
+}
+
+static void cmd_upload(uint8_t count)
+{
+	uint8_t res[XCP_MAX_CTO] = { XCP_PID_RES };
+
+	if (count == 0 || count > XCP_MAX_CTO - 1) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (!access_allowed(xcp.mta, count, false)) {
+		send_error(XCP_ERR_ACCESS_DENIED);
+		return;
+	}
+
+	memcpy(&res[1], (const void *)xcp.mta, count);
+	xcp.mta += count;
+	send_response(res, count + 1);
+}
+
+static void cmd_download(const uint8_t *cmd, uint8_t len)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	uint8_t count = cmd[1];
+
+	if (!IS_ENABLED(CONFIG_XCP_SLAVE_DOWNLOAD)) {
+		send_error(XCP_ERR_ACCESS_DENIED);
+		return;
+	}
+
+	if (count == 0 || count > len - 2) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (!access_allowed(xcp.mta, count, true)) {
+		send_error(XCP_ERR_ACCESS_DENIED);
+		return;
+	}
+
+	memcpy((void *)xcp.mta, &cmd[2], count);
+	xcp.mta += count;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_daq_processor_info(void)
+{
+	uint8_t res[8] = { XCP_PID_RES };
+
+	res[1] = 0x01 | 0x02 | 0x10; /* Dynamic config, prescaler, timestamps */
+	sys_put_le16(CONFIG_XCP_SLAVE_MAX_DAQ, &res[2]);
+	sys_put_le16(xcp.event_count, &res[4]);
+	res[6] = 0;    /* MIN_DAQ: no predefined lists */
+	res[7] = 0x00; /* Absolute ODT number identification */
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_daq_resolution_info(void)
+{
+	uint8_t res[8] = { XCP_PID_RES };
+
+	res[1] = 1;                  /* ODT entry granularity (DAQ) */
+	res[2] = XCP_ODT_PAYLOAD;    /* Max ODT entry size (DAQ) */
+	res[3] = 1;                  /* ODT entry granularity (STIM) */
+	res[4] = 0;                  /* STIM not supported */
+	res[5] = XCP_TIMESTAMP_MODE;
+	sys_put_le16(1, &res[6]);    /* Timestamp ticks per unit */
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_daq_event_info(uint16_t channel)
+{
+	uint8_t res[7] = { XCP_PID_RES };
+	const struct xcp_event_channel *ev;
+	uint32_t period_ms;
+
+	if (channel >= xcp.event_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	ev = &xcp.events[channel];
+	period_ms = ev->period_us / 1000;
+
+	res[1] = 0x04;                    /* DAQ direction */
+	res[2] = 0xFF;                    /* Any number of DAQ lists */
+	res[3] = strlen(ev->name);
+	res[4] = MIN(period_ms, 255);     /* Time cycle, 0 = sporadic */
+	res[5] = 6;                       /* Time unit 1 ms */
+	res[6] = 0;                       /* Priority */
+
+	/* The name is read with UPLOAD */
+	xcp.mta = (uintptr_t)ev->name;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_free_daq(void)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	k_spinlock_key_t key = k_spin_lock(&daq_lock);
+
+	xcp.daq_count = 0;
+	xcp.odt_count = 0;
+	xcp.entry_count = 0;
+	xcp.ptr_entry = 0;
+	xcp.ptr_end = 0;
+
+	k_spin_unlock(&daq_lock, key);
+	send_response(res, sizeof(res));
+}
+
+static void cmd_alloc_daq(uint16_t count)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+
+	if (xcp.odt_count > 0) {
+		send_error(XCP_ERR_SEQUENCE);
+		return;
+	}
+
+	if (count > CONFIG_XCP_SLAVE_MAX_DAQ) {
+		send_error(XCP_ERR_MEMORY_OVERFLOW);
+		return;
+	}
+
+	memset(xcp.daq, 0, sizeof(xcp.daq));
+	for (uint16_t i = 0; i < count; i++) {
+		xcp.daq[i].prescaler = 1;
+	}
+	xcp.daq_count = count;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_alloc_odt(uint16_t daq_num, uint8_t count)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	struct xcp_daq_list *daq;
+
+	if (daq_num >= xcp.daq_count || xcp.entry_count > 0) {
+		send_error(XCP_ERR_SEQUENCE);
+		return;
+	}
+
+	daq = &xcp.daq[daq_num];
+
+	/* ODTs are handed out front to back, one DAQ list after the other */
+	if (daq->odt_count > 0 ||
+	    (daq_num + 1U < xcp.daq_count && xcp.daq[daq_num + 1].odt_count > 0)) {
+		send_error(XCP_ERR_SEQUENCE);
+		return;
+	}
+
+	if (xcp.odt_count + count > CONFIG_XCP_SLAVE_MAX_ODT) {
+		send_error(XCP_ERR_MEMORY_OVERFLOW);
+		return;
+	}
+
+	daq->first_odt = xcp.odt_count;
+	daq->odt_count = count;
+	memset(&xcp.odt[xcp.odt_count], 0, count * sizeof(xcp.odt[0]));
+	xcp.odt_count += count;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_alloc_odt_entry(uint16_t daq_num, uint8_t odt_num, uint8_t count)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	struct xcp_odt *odt;
+
+	if (daq_num >= xcp.daq_count || odt_num >= xcp.daq[daq_num].odt_count) {
+		send_error(XCP_ERR_SEQUENCE);
+		return;
+	}
+
+	odt = &xcp.odt[xcp.daq[daq_num].first_odt + odt_num];
+	if (odt->entry_count > 0) {
+		send_error(XCP_ERR_SEQUENCE);
+		return;
+	}
+
+	if (xcp.entry_count + count > CONFIG_XCP_SLAVE_MAX_ODT_ENTRIES) {
+		send_error(XCP_ERR_MEMORY_OVERFLOW);
+		return;
+	}
+
+	odt->first_entry = xcp.entry_count;
+	odt->entry_count = count;
+	memset(&xcp.entry[xcp.entry_count], 0, count * sizeof(xcp.entry[0]));
+	xcp.entry_count += count;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_set_daq_ptr(uint16_t daq_num, uint8_t odt_num, uint8_t entry_num)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	const struct xcp_odt *odt;
+
+	if (daq_num >= xcp.daq_count || odt_num >= xcp.daq[daq_num].odt_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (xcp.daq[daq_num].mode & XCP_DAQ_MODE_RUNNING) {
+		send_error(XCP_ERR_DAQ_ACTIVE);
+		return;
+	}
+
+	odt = &xcp.odt[xcp.daq[daq_num].first_odt + odt_num];
+	if (entry_num >= odt->entry_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	xcp.ptr_entry = odt->first_entry + entry_num;
+	xcp.ptr_end = odt->first_entry + odt->entry_count;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_write_daq(const uint8_t *cmd)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	uint8_t bit_offset = cmd[1];
+	uint8_t size = cmd[2];
+	uint32_t addr = sys_get_le32(&cmd[4]);
+
+	if (xcp.ptr_entry >= xcp.ptr_end) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (bit_offset != 0xFF || size == 0 || size > XCP_ODT_PAYLOAD) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	/* Sampled in interrupt context, where a fault takes the ECU down */
+	if (!access_allowed(addr, size, false)) {
+		send_error(XCP_ERR_ACCESS_DENIED);
+		return;
+	}
+
+	xcp.entry[xcp.ptr_entry].addr = addr;
+	xcp.entry[xcp.ptr_entry].size = size;
+	xcp.ptr_entry++;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_set_daq_list_mode(const uint8_t *cmd)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	uint16_t daq_num = sys_get_le16(&cmd[2]);
+	uint16_t event = sys_get_le16(&cmd[4]);
+	uint8_t mode = cmd[1];
+	struct xcp_daq_list *daq;
+
+	if (daq_num >= xcp.daq_count || event >= xcp.event_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (mode & (XCP_DAQ_MODE_DIRECTION | XCP_DAQ_MODE_PID_OFF)) {
+		send_error(XCP_ERR_MODE_NOT_VALID);
+		return;
+	}
+
+	daq = &xcp.daq[daq_num];
+	if (daq->mode & XCP_DAQ_MODE_RUNNING) {
+		send_error(XCP_ERR_DAQ_ACTIVE);
+		return;
+	}
+
+	daq->mode = (daq->mode & XCP_DAQ_MODE_SELECTED) | (mode & XCP_DAQ_MODE_TIMESTAMP);
+	daq->event = event;
+	daq->prescaler = MAX(cmd[6], 1);
+	daq->prescaler_count = 0;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_daq_list_mode(uint16_t daq_num)
+{
+	uint8_t res[8] = { XCP_PID_RES };
+	const struct xcp_daq_list *daq;
+
+	if (daq_num >= xcp.daq_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	daq = &xcp.daq[daq_num];
+	res[1] = daq->mode;
+	sys_put_le16(daq->event, &res[4]);
+	res[6] = daq->prescaler;
+	res[7] = 0;
+	send_response(res, sizeof(res));
+}
+
+static void cmd_clear_daq_list(uint16_t daq_num)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	k_spinlock_key_t key;
+
+	if (daq_num >= xcp.daq_count) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	key = k_spin_lock(&daq_lock);
+	xcp.daq[daq_num].mode = 0;
+	xcp.daq[daq_num].event = 0;
+	xcp.daq[daq_num].prescaler = 1;
+	k_spin_unlock(&daq_lock, key);
+
+	send_response(res, sizeof(res));
+}
+
+static void cmd_start_stop_daq_list(uint8_t mode, uint16_t daq_num)
+{
+	uint8_t res[2] = { XCP_PID_RES };
+	struct xcp_daq_list *daq;
+	k_spinlock_key_t key;
+
+	if (daq_num >= xcp.daq_count || mode > 2) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	daq = &xcp.daq[daq_num];
+	if (mode != 0 && !daq_list_valid(daq)) {
+		send_error(XCP_ERR_DAQ_CONFIG);
+		return;
+	}
+
+	key = k_spin_lock(&daq_lock);
+	switch (mode) {
+	case 0:
+		daq->mode &= ~XCP_DAQ_MODE_RUNNING;
+		break;
+	case 1:
+		daq->prescaler_count = 0;
+		daq->mode |= XCP_DAQ_MODE_RUNNING;
+		break;
+	case 2:
+		daq->mode |= XCP_DAQ_MODE_SELECTED;
+		break;
+	}
+	k_spin_unlock(&daq_lock, key);
+
+	res[1] = daq->first_odt; /* FIRST_PID */
+	send_response(res, sizeof(res));
+}
+
+static void cmd_start_stop_synch(uint8_t mode)
+{
+	uint8_t res[1] = { XCP_PID_RES };
+	k_spinlock_key_t key;
+
+	if (mode > 2) {
+		send_error(XCP_ERR_OUT_OF_RANGE);
+		return;
+	}
+
+	if (mode == 0) {
+		stop_all_daq();
+		send_response(res, sizeof(res));
+		return;
+	}
+
+	key = k_spin_lock(&daq_lock);
+	for (uint16_t i = 0; i < xcp.daq_count; i++) {
+		struct xcp_daq_list *daq = &xcp.daq[i];
+
+		if (!(daq->mode & XCP_DAQ_MODE_SELECTED)) {
+			continue;
+		}
+
+		if (mode == 1) {
+			daq->prescaler_count = 0;
+			daq->mode |= XCP_DAQ_MODE_RUNNING;
+		} else {
+			daq->mode &= ~XCP_DAQ_MODE_RUNNING;
+		}
+		daq->mode &= ~XCP_DAQ_MODE_SELECTED;
+	}
+	k_spin_unlock(&daq_lock, key);
+
+	send_response(res, sizeof(res));
+}
+
+static void cmd_get_daq_clock(void)
+{
+	uint8_t res[8] = { XCP_PID_RES };
+
+	sys_put_le32(daq_clock(), &res[4]);
+	send_response(res, sizeof(res));
+}
+
+/**
+ * @brief Process one command packet (runs in the system work queue)
+ */
+static void process_command(const uint8_t *cmd, uint8_t len)
+{
+	uint8_t pid = cmd[0];
+
+	xcp.stats.commands++;
+
+	if (!xcp.connected && pid != XCP_CMD_CONNECT) {
+		/* Commands are ignored until CONNECT */
+		return;
+	}
+
+	switch (pid) {
+	case XCP_CMD_CONNECT:
+		cmd_connect();
+		break;
+	case XCP_CMD_DISCONNECT:
+		cmd_disconnect();
+		break;
+	case XCP_CMD_GET_STATUS:
+		cmd_get_status();
+		break;
+	case XCP_CMD_SYNCH:
+		send_error(XCP_ERR_CMD_SYNCH);
+		break;
+	case XCP_CMD_GET_COMM_MODE_INFO:
+		cmd_get_comm_mode_info();
+		break;
+	case XCP_CMD_SET_MTA:
+		if (len < 8) {
+			send_error(XCP_ERR_CMD_SYNTAX);
+			break;
+		}
+		if (!access_allowed(sys_get_le32(&cmd[4]), 1, false)) {
+			send_error(XCP_ERR_ACCESS_DENIED);
+			break;
+		}
+		xcp.mta = sys_get_le32(&cmd[4]);
+		send_response((const uint8_t[]){ XCP_PID_RES }, 1);
+		break;
+	case XCP_CMD_UPLOAD:
+		cmd_upload(cmd[1]);
+		break;
+	case XCP_CMD_SHORT_UPLOAD:
+		if (len < 8) {
+			send_error(XCP_ERR_CMD_SYNTAX);
+			break;
+		}
+		xcp.mta = sys_get_le32(&cmd[4]);
+		cmd_upload(cmd[1]);
+		break;
+	case XCP_CMD_DOWNLOAD:
+		cmd_download(cmd, len);
+		break;
+	case XCP_CMD_CLEAR_DAQ_LIST:
+		cmd_clear_daq_list(sys_get_le16(&cmd[2]));
+		break;
+	case XCP_CMD_SET_DAQ_PTR:
+		cmd_set_daq_ptr(sys_get_le16(&cmd[2]), cmd[4], cmd[5]);
+		break;
+	case XCP_CMD_WRITE_DAQ:
+		cmd_write_daq(cmd);
+		break;
+	case XCP_CMD_SET_DAQ_LIST_MODE:
+		cmd_set_daq_list_mode(cmd);
+		break;
+	case XCP_CMD_GET_DAQ_LIST_MODE:
+		cmd_get_daq_list_mode(sys_get_le16(&cmd[2]));
+		break;
+	case XCP_CMD_START_STOP_DAQ_LIST:
+		cmd_start_stop_daq_list(cmd[1], sys_get_le16(&cmd[2]));
+		break;
+	case XCP_CMD_START_STOP_SYNCH:
+		cmd_start_stop_synch(cmd[1]);
+		break;
+	case XCP_CMD_GET_DAQ_CLOCK:
+		cmd_get_daq_clock();
+		break;
+	case XCP_CMD_GET_DAQ_PROCESSOR_INFO:
+		cmd_get_daq_processor_info();
+		break;
+	case XCP_CMD_GET_DAQ_RESOLUTION_INFO:
+		cmd_get_daq_resolution_info();
+		break;
+	case XCP_CMD_GET_DAQ_EVENT_INFO:
+		cmd_get_daq_event_info(sys_get_le16(&cmd[2]));
+		break;
+	case XCP_CMD_FREE_DAQ:
+		if (daq_running()) {
+			send_error(XCP_ERR_DAQ_ACTIVE);
+			break;
+		}
+		cmd_free_daq();
+		break;
+	case XCP_CMD_ALLOC_DAQ:
+		cmd_alloc_daq(sys_get_le16(&cmd[2]));
+		break;
+	case XCP_CMD_ALLOC_ODT:
+		cmd_alloc_odt(sys_get_le16(&cmd[2]), cmd[4]);
+		break;
+	case XCP_CMD_ALLOC_ODT_ENTRY:
+		cmd_alloc_odt_entry(sys_get_le16(&cmd[2]), cmd[4], cmd[5]);
+		break;
+	default:
+		send_error(XCP_ERR_CMD_UNKNOWN);
+		break;
+	}
+}
+
+static void cmd_work_handler(struct k_work *work)
+{
+	uint8_t cmd[XCP_MAX_CTO];
+
+	ARG_UNUSED(work);
+
+	while (k_msgq_get(&xcp_cmd_msgq, cmd, K_NO_WAIT) == 0) {
+		/* Short commands are zero-padded by the RX callback */
+		process_command(cmd, XCP_MAX_CTO);
+	}
+}
+
+/**
+ * @brief CAN RX callback for the CRO identifier
+ *
+ * Runs in interrupt context; commands are handled in the system work
+ * queue.
+ */
+static void can_rx_cro_callback(const struct device *dev, struct can_frame *frame,
+                                void *user_data)
+{
+	uint8_t cmd[XCP_MAX_CTO] = { 0 };
+
+	ARG_UNUSED(dev);
+	ARG_UNUSED(user_data);
+
+	if (frame->dlc == 0) {
+		return;
+	}
+
+	memcpy(cmd, frame->data, MIN(frame->dlc, XCP_MAX_CTO));
+	if (k_msgq_put(&xcp_cmd_msgq, cmd, K_NO_WAIT) == 0) {
+		k_work_submit(&cmd_work);
+	}
+}
+
+#if CONFIG_XCP_SLAVE_TIMER_EVENT_MS > 0
+static void timer_event_handler(struct k_timer *timer)
+{
+	ARG_UNUSED(timer);
+
+	xcp_event(XCP_EVENT_TIMER);
+}
+
+static K_TIMER_DEFINE(timer_event, timer_event_handler, NULL);
+#endif
+
+int xcp_slave_init(const struct device *can_dev)
+{
+	struct can_filter filter = {
+		.id = CONFIG_XCP_SLAVE_CRO_ID,
+		.mask = IS_ENABLED(CONFIG_XCP_SLAVE_EXT_ID) ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK,
+		.flags = IS_ENABLED(CONFIG_XCP_SLAVE_EXT_ID) ? CAN_FILTER_IDE : 0,
+	};
+	int ret;
+
+	if (!device_is_ready(can_dev)) {
+		LOG_ERR("CAN device not ready");
+		return -ENODEV;
+	}
+
+	if (xcp.can_dev) {
+		return -EALREADY;
+	}
+
+	xcp.can_dev = can_dev;
+
+	ret = can_add_rx_filter(can_dev, can_rx_cro_callback, NULL, &filter);
+	if (ret < 0) {
+		LOG_ERR("Failed to add CRO filter: %d", ret);
+		xcp.can_dev = NULL;
+		return ret;
+	}
+
+#if CONFIG_XCP_SLAVE_TIMER_EVENT_MS > 0
+	k_timer_start(&timer_event, K_MSEC(CONFIG_XCP_SLAVE_TIMER_EVENT_MS),
+	              K_MSEC(CONFIG_XCP_SLAVE_TIMER_EVENT_MS));
+#endif
+
+	LOG_INF("XCP slave on CRO 0x%x / DTO 0x%x, %u event channels",
+	        CONFIG_XCP_SLAVE_CRO_ID, CONFIG_XCP_SLAVE_DTO_ID, xcp.event_count);
+	return 0;
+}
+
+int xcp_slave_add_event(const char *name, uint32_t period_us, uint8_t *channel)
+{
+	unsigned int key = irq_lock();
+
+	if (xcp.event_count >= CONFIG_XCP_SLAVE_MAX_EVENTS) {
+		irq_unlock(key);
+		return -ENOMEM;
+	}
+
+	*channel = xcp.event_count;
+	xcp.events[*channel].name = name;
+	xcp.events[*channel].period_us = period_us;
+	xcp.event_count++;
+
+	irq_unlock(key);
+	return 0;
+}
+
+bool xcp_slave_connected(void)
+{
+	return xcp.connected;
+}
+
+void xcp_slave_get_stats(struct xcp_slave_stats *stats)
+{
+	*stats = xcp.stats;
+}
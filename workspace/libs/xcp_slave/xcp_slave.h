@@ -0,0 +1,92 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * XCP-on-CAN Slave Library
+ * Implements the ASAM XCP 1.x measurement subset on classic CAN: memory
+ * upload/download and dynamic DAQ lists sampled on event channels.
+ */
+
+#ifndef XCP_SLAVE_H_
+#define XCP_SLAVE_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Built-in periodic event channel
+ *
+ * Triggered every CONFIG_XCP_SLAVE_TIMER_EVENT_MS while the slave is
+ * initialized. Further channels are added with xcp_slave_add_event().
+ */
+#define XCP_EVENT_TIMER 0
+
+/**
+ * @brief XCP Slave Statistics
+ */
+struct xcp_slave_stats {
+	uint32_t commands;      /* Command packets processed */
+	uint32_t dto_sent;      /* DAQ packets queued for transmission */
+	uint32_t dto_dropped;   /* DAQ packets lost (no free TX mailbox) */
+};
+
+/**
+ * @brief Initialize the XCP slave on a CAN device
+ *
+ * Installs the CRO (command) filter and starts the periodic event
+ * channel. The CAN device must already be started; it can be shared
+ * with other users such as the CAN update listener.
+ *
+ * @param can_dev CAN device
+ * @return 0 on success, negative errno on failure
+ */
+int xcp_slave_init(const struct device *can_dev);
+
+/**
+ * @brief Register an event channel
+ *
+ * May be called before xcp_slave_init(). The name is reported to the
+ * master in GET_DAQ_EVENT_INFO and must stay valid.
+ *
+ * @param name Channel name
+ * @param period_us Nominal trigger period, 0 if sporadic
+ * @param channel Filled with the channel number
+ * @return 0 on success, -ENOMEM if all channels are in use
+ */
+int xcp_slave_add_event(const char *name, uint32_t period_us, uint8_t *channel);
+
+/**
+ * @brief Trigger an event channel
+ *
+ * Samples every running DAQ list bound to @p channel and queues the
+ * resulting DTO packets. Cheap when no DAQ list uses the channel. Safe
+ * to call from thread and interrupt context.
+ *
+ * @param channel Event channel number
+ */
+void xcp_event(uint8_t channel);
+
+/**
+ * @brief Check if a master is connected
+ *
+ * @return true if connected
+ */
+bool xcp_slave_connected(void);
+
+/**
+ * @brief Get slave statistics
+ *
+ * @param stats Filled with a snapshot of the current counters
+ */
+void xcp_slave_get_stats(struct xcp_slave_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XCP_SLAVE_H_ */
@@ -0,0 +1,347 @@
+#!/usr/bin/env python3
+"""
+Stable Link Layout
+Keeps consecutive builds of an application binary-similar, so deltas
+between release images stay small.
+
+The layout file pins the application's objects into groups at the start
+of flash, in a fixed order. Each group lists its functions (one input
+section each) in the order they were first linked; new functions go to
+the end of their group. Every group owns a fixed padding budget, so a
+group that grows within its budget does not move the groups behind it.
+
+Commands:
+    linker  Turn the layout file into a linker script snippet (run by
+            CMake with CONFIG_APP_STABLE_LAYOUT)
+    update  Refresh the layout file from a linker map: keep the order,
+            append new functions and objects, grow budgets that overflow
+    delta   Report how much two images differ
+
+Usage:
+    python3 stable_layout.py linker stable_layout.txt -o stable_layout.ld
+    python3 stable_layout.py update stable_layout.txt build/zephyr/zephyr.map
+    python3 stable_layout.py delta old/zephyr.signed.bin new/zephyr.signed.bin
+"""
+
+import argparse
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import zlib
+from fnmatch import fnmatch
+from pathlib import Path
+
+# Input sections kept inside a group (per-function and per-object data)
+GROUP_SECTIONS = '.text .text.* .rodata .rodata.*'
+
+# Map file lines for an input section: name on its own line when long
+MAP_SECTION = re.compile(r'^ (\.(?:text|rodata)\S*)'
+                         r'(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.+))?$')
+MAP_CONT = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.+)$')
+MAP_ARCHIVE = re.compile(r'^(?:.*/)?([^/(]+)\((.+)\)$')
+
+DEFAULT_SLACK = 0.25     # Headroom added when a budget is (re)computed
+DEFAULT_ALIGN = 256      # Budgets are multiples of this
+SECTION_ALIGN = 4        # Worst-case padding per input section
+DEFAULT_BLOCK = 4096     # Block size for the delta report
+
+
+class Group:
+    """One pinned group of input sections"""
+
+    def __init__(self, name: str, budget: int, pattern: str):
+        self.name = name
+        self.budget = budget
+        self.pattern = pattern
+        self.entries = []
+
+
+def read_layout(path: Path) -> list:
+    """
+    Parse a layout file
+
+    Format:
+        group <name> <budget> <object pattern>
+            <input section>
+            ...
+    The object pattern is 'archive:member' as in a linker script.
+    """
+    groups = []
+    for lineno, raw in enumerate(path.read_text().splitlines(), 1):
+        line = raw.split('#', 1)[0].strip()
+        if not line:
+            continue
+
+        fields = line.split()
+        if fields[0] == 'group':
+            if len(fields) != 4:
+                raise ValueError(f"{path}:{lineno}: expected 'group <name> <budget> <pattern>'")
+            groups.append(Group(fields[1], int(fields[2], 0), fields[3]))
+        elif len(fields) == 1 and groups:
+            groups[-1].entries.append(fields[0])
+        else:
+            raise ValueError(f"{path}:{lineno}: section outside a group: {line}")
+
+    names = [g.name for g in groups]
+    duplicates = {n for n in names if names.count(n) > 1}
+    if duplicates:
+        raise ValueError(f"{path}: duplicate groups: {', '.join(sorted(duplicates))}")
+
+    return groups
+
+
+def write_layout(path: Path, groups: list):
+    """Write a layout file"""
+    lines = [
+        '# Stable link layout for CONFIG_APP_STABLE_LAYOUT',
+        '#',
+        '# Groups are placed in this order at the start of flash, each in a',
+        '# fixed budget. Refresh after a build with:',
+        '#   python3 workspace/scripts/stable_layout.py update <this file> build/zephyr/zephyr.map',
+        '# and commit the result together with the release.',
+        '',
+    ]
+    for group in groups:
+        lines.append(f'group {group.name} 0x{group.budget:X} {group.pattern}')
+        lines.extend(f'\t{entry}' for entry in group.entries)
+        lines.append('')
+
+    path.write_text('\n'.join(lines))
+
+
+def symbol(name: str) -> str:
+    """Linker symbol fragment for a group name"""
+    return re.sub(r'\W', '_', name)
+
+
+def generate_linker(groups: list, source: str) -> str:
+    """Linker script snippet placing the groups in order"""
+    out = [
+        f'/* Generated by stable_layout.py from {source}, do not edit */',
+        '',
+        '. = ALIGN(4);',
+        '__stable_layout_start = .;',
+    ]
+    for group in groups:
+        start = f'__stable_{symbol(group.name)}_start'
+        out += [
+            '',
+            f'/* {group.name}: 0x{group.budget:X} bytes */',
+            f'{start} = .;',
+        ]
+        out += [f'{group.pattern}({entry})' for entry in group.entries]
+        out += [
+            f'{group.pattern}({GROUP_SECTIONS})',
+            f'ASSERT(. <= {start} + 0x{group.budget:X}, '
+            f'"stable layout: group {group.name} exceeds its budget, run stable_layout.py update");',
+            f'. = {start} + 0x{group.budget:X};',
+        ]
+    out += ['', '__stable_layout_end = .;', '']
+
+    return '\n'.join(out)
+
+
+def read_map(path: Path) -> dict:
+    """
+    Collect text and rodata input sections from a GNU ld map file
+
+    Returns:
+        {'archive:member' or object name: [(section, size), ...]} in link order
+    """
+    objects = {}
+    in_memory_map = False
+    pending = None
+
+    for line in path.read_text(errors='replace').splitlines():
+        if not in_memory_map:
+            in_memory_map = line.startswith('Linker script and memory map')
+            continue
+
+        if pending:
+            match = MAP_CONT.match(line)
+            name, pending = pending, None
+            if match:
+                add_map_section(objects, name, int(match.group(2), 16), match.group(3))
+                continue
+
+        match = MAP_SECTION.match(line)
+        if not match:
+            continue
+        if match.group(2) is None:
+            pending = match.group(1)
+        else:
+            add_map_section(objects, match.group(1), int(match.group(3), 16), match.group(4))
+
+    return objects
+
+
+def add_map_section(objects: dict, name: str, size: int, origin: str):
+    """Record one input section under its object"""
+    if size == 0:
+        return
+
+    match = MAP_ARCHIVE.match(origin.strip())
+    key = f'{match.group(1)}:{match.group(2)}' if match else Path(origin.strip()).name
+    objects.setdefault(key, []).append((name, size))
+
+
+def budget_for(used: int, slack: float, align: int) -> int:
+    """Budget for a group using the given number of bytes"""
+    budget = int(used * (1 + slack))
+    return max(align, (budget + align - 1) // align * align)
+
+
+def group_name_for(key: str) -> str:
+    """Default group name for an object ('libapp.a:main.c.obj' -> 'main')"""
+    member = key.split(':')[-1]
+    return re.sub(r'(\.c|\.cpp|\.S)?\.(obj|o)$', '', member)
+
+
+def cmd_linker(args) -> int:
+    groups = read_layout(args.layout)
+    snippet = generate_linker(groups, args.layout.name)
+
+    if args.output:
+        # Leave the file alone if nothing changed, so the link is not redone
+        if not args.output.exists() or args.output.read_text() != snippet:
+            args.output.write_text(snippet)
+    else:
+        sys.stdout.write(snippet)
+
+    return 0
+
+
+def cmd_update(args) -> int:
+    groups = read_layout(args.layout) if args.layout.exists() else []
+    objects = read_map(args.map)
+    covered = set()
+    moved = False
+
+    for index, group in enumerate(groups):
+        keys = [key for key in objects if fnmatch(key, group.pattern)]
+        if not keys:
+            print(f"  {group.name}: not linked, keeping it as is")
+            continue
+
+        covered.update(keys)
+        sections = [section for key in keys for section in objects[key]]
+        used = sum(size + SECTION_ALIGN for _, size in sections)
+        functions = [name for name, _ in sections if name.startswith('.text.')]
+
+        kept = [entry for entry in group.entries if entry in functions]
+        added = [name for name in functions if name not in group.entries]
+        removed = [entry for entry in group.entries if entry not in functions]
+        group.entries = kept + added
+
+        if added or removed:
+            print(f"  {group.name}: +{len(added)} -{len(removed)} functions")
+
+        if used > group.budget:
+            old_budget = group.budget
+            group.budget = budget_for(used, args.slack, args.align)
+            behind = len(groups) - index - 1
+            print(f"  {group.name}: {used} bytes over budget 0x{old_budget:X}, "
+                  f"now 0x{group.budget:X}" + (f" ({behind} groups behind it move)" if behind else ""))
+            moved = moved or behind > 0
+
+    # Objects seen for the first time go to the end, so nothing else moves
+    for key, sections in objects.items():
+        if key in covered or not any(fnmatch(key, pattern) for pattern in args.objects):
+            continue
+
+        name = group_name_for(key)
+        while any(g.name == name for g in groups):
+            name += '_'
+        group = Group(name, 0, f'*{key}')
+        group.entries = [n for n, _ in sections if n.startswith('.text.')]
+        group.budget = budget_for(sum(size + SECTION_ALIGN for _, size in sections),
+                                  args.slack, args.align)
+        groups.append(group)
+        print(f"  {name}: new group for {key}, 0x{group.budget:X} bytes")
+
+    write_layout(args.layout, groups)
+    total = sum(g.budget for g in groups)
+    print(f"✓ {args.layout}: {len(groups)} groups, {total} bytes pinned")
+    if moved:
+        print("  Budgets grew: the next image differs from the last release behind the grown group")
+
+    return 0
+
+
+def cmd_delta(args) -> int:
+    old = args.old.read_bytes()
+    new = args.new.read_bytes()
+    common = min(len(old), len(new))
+
+    changed = sum(1 for a, b in zip(old, new) if a != b) + len(new) - common
+    blocks = []
+    for offset in range(0, len(new), args.block):
+        if old[offset:offset + args.block] != new[offset:offset + args.block]:
+            blocks.append(offset)
+
+    total_blocks = (len(new) + args.block - 1) // args.block
+    xor = bytes(a ^ b for a, b in zip(old, new)) + new[common:]
+    in_place = len(zlib.compress(xor, 9))
+
+    print(f"old: {args.old} ({len(old)} bytes)")
+    print(f"new: {args.new} ({len(new)} bytes)")
+    print(f"changed bytes:    {changed} ({100.0 * changed / max(len(new), 1):.1f}%)")
+    if blocks:
+        print(f"changed blocks:   {len(blocks)}/{total_blocks} of {args.block} bytes "
+              f"(first at 0x{blocks[0]:X}, last at 0x{blocks[-1]:X})")
+    else:
+        print(f"changed blocks:   0/{total_blocks} of {args.block} bytes")
+    print(f"delta (xor+zlib): {in_place} bytes")
+
+    bsdiff = shutil.which('bsdiff')
+    if bsdiff:
+        with tempfile.NamedTemporaryFile(suffix='.patch') as patch:
+            subprocess.run([bsdiff, str(args.old), str(args.new), patch.name], check=True)
+            print(f"delta (bsdiff):   {Path(patch.name).stat().st_size} bytes")
+
+    print(f"full image (zlib): {len(zlib.compress(new, 9))} bytes")
+
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Stable link layout for small binary deltas between builds')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    linker = commands.add_parser('linker', help='Generate the linker script snippet')
+    linker.add_argument('layout', type=Path, help='Layout file')
+    linker.add_argument('-o', '--output', type=Path,
+                        help='Output file (default: stdout)')
+    linker.set_defaults(func=cmd_linker)
+
+    update = commands.add_parser('update', help='Refresh the layout file from a linker map')
+    update.add_argument('layout', type=Path, help='Layout file (created if missing)')
+    update.add_argument('map', type=Path, help='Linker map (build/zephyr/zephyr.map)')
+    update.add_argument('--objects', nargs='+', default=['*libapp.a:*'],
+                        help="Patterns of objects that get new groups (default: '*libapp.a:*')")
+    update.add_argument('--slack', type=float, default=DEFAULT_SLACK,
+                        help=f'Headroom for new or grown budgets (default: {DEFAULT_SLACK})')
+    update.add_argument('--align', type=int, default=DEFAULT_ALIGN,
+                        help=f'Budget granularity in bytes (default: {DEFAULT_ALIGN})')
+    update.set_defaults(func=cmd_update)
+
+    delta = commands.add_parser('delta', help='Report how much two images differ')
+    delta.add_argument('old', type=Path, help='Previous image (.bin)')
+    delta.add_argument('new', type=Path, help='New image (.bin)')
+    delta.add_argument('--block', type=int, default=DEFAULT_BLOCK,
+                       help=f'Block size for the changed-block count (default: {DEFAULT_BLOCK})')
+    delta.set_defaults(func=cmd_delta)
+
+    args = parser.parse_args()
+    try:
+        return args.func(args)
+    except (OSError, ValueError) as e:
+        print(f"✗ {e}", file=sys.stderr)
+        return 1
+
+
+if __name__ == '__main__':
+    exit(main())
@@ -0,0 +1,398 @@
+#!/usr/bin/env python3
+"""
+Minimal XCP-on-CAN Master
+Connects to the XCP slave (workspace/libs/xcp_slave), lists its event
+channels, configures one DAQ list with the requested variables and
+streams the samples.
+
+Requirements:
+    pip3 install python-can
+
+Usage:
+    python3 xcp_master.py -i vcan0 --elf build/zephyr/zephyr.elf \\
+        --event control demo_angle:i16 demo_speed demo_iterations
+    python3 xcp_master.py -i can0 --event upd_write 0x20001000:4
+"""
+
+import argparse
+import struct
+import subprocess
+import sys
+import time
+import can
+from typing import Dict, List, Optional, Tuple
+
+# XCP Command Codes
+XCP_CMD_CONNECT = 0xFF
+XCP_CMD_DISCONNECT = 0xFE
+XCP_CMD_UPLOAD = 0xF5
+XCP_CMD_SET_DAQ_PTR = 0xE2
+XCP_CMD_WRITE_DAQ = 0xE1
+XCP_CMD_SET_DAQ_LIST_MODE = 0xE0
+XCP_CMD_START_STOP_DAQ_LIST = 0xDE
+XCP_CMD_START_STOP_SYNCH = 0xDD
+XCP_CMD_GET_DAQ_PROCESSOR_INFO = 0xDA
+XCP_CMD_GET_DAQ_EVENT_INFO = 0xD7
+XCP_CMD_FREE_DAQ = 0xD6
+XCP_CMD_ALLOC_DAQ = 0xD5
+XCP_CMD_ALLOC_ODT = 0xD4
+XCP_CMD_ALLOC_ODT_ENTRY = 0xD3
+
+XCP_PID_RES = 0xFF
+XCP_PID_ERR = 0xFE
+
+XCP_DAQ_MODE_TIMESTAMP = 0x10
+
+# Default identifiers (CONFIG_XCP_SLAVE_CRO_ID / CONFIG_XCP_SLAVE_DTO_ID)
+DEFAULT_CRO_ID = 0x551
+DEFAULT_DTO_ID = 0x552
+
+# One byte absolute ODT number, 4 byte timestamp in the first ODT
+ODT_PAYLOAD = 7
+TIMESTAMP_SIZE = 4
+
+# Struct formats for typed signals
+SIGNAL_TYPES = {
+    'u8': '<B', 'i8': '<b', 'u16': '<H', 'i16': '<h',
+    'u32': '<I', 'i32': '<i', 'f32': '<f',
+}
+DEFAULT_TYPES = {1: 'u8', 2: 'u16', 4: 'u32'}
+
+
+class XcpError(Exception):
+    """XCP command failed"""
+
+
+class Signal:
+    """A measured variable"""
+
+    def __init__(self, name: str, address: int, size: int, sig_type: str):
+        self.name = name
+        self.address = address
+        self.size = size
+        self.sig_type = sig_type
+
+    def decode(self, data: bytes):
+        return struct.unpack(SIGNAL_TYPES[self.sig_type], data)[0]
+
+
+class XcpMaster:
+    """XCP-on-CAN Master"""
+
+    def __init__(self, interface: str, cro_id: int = DEFAULT_CRO_ID,
+                 dto_id: int = DEFAULT_DTO_ID, extended: bool = False,
+                 timeout: float = 0.5):
+        """
+        Initialize XCP Master
+
+        Args:
+            interface: SocketCAN interface name (e.g., 'vcan0')
+            cro_id: CAN identifier for commands
+            dto_id: CAN identifier for responses and DAQ packets
+            extended: Use 29-bit identifiers
+            timeout: Command response timeout in seconds
+        """
+        self.interface = interface
+        self.cro_id = cro_id
+        self.dto_id = dto_id
+        self.extended = extended
+        self.timeout = timeout
+        self.bus: Optional[can.Bus] = None
+        self.pending_daq: List[can.Message] = []
+
+    def connect(self):
+        """Open the CAN interface and CONNECT to the slave"""
+        mask = 0x1FFFFFFF if self.extended else 0x7FF
+        self.bus = can.Bus(interface='socketcan', channel=self.interface,
+                           can_filters=[{'can_id': self.dto_id, 'can_mask': mask,
+                                         'extended': self.extended}],
+                           receive_own_messages=False)
+
+        res = self.command([XCP_CMD_CONNECT, 0x00])
+        print(f"✓ Connected: resources 0x{res[1]:02x}, "
+              f"MAX_CTO {res[3]}, MAX_DTO {res[4] | (res[5] << 8)}")
+
+    def disconnect(self):
+        """DISCONNECT and close the CAN interface"""
+        if self.bus:
+            try:
+                self.command([XCP_CMD_DISCONNECT])
+            except XcpError as e:
+                print(f"✗ Disconnect failed: {e}")
+            self.bus.shutdown()
+            self.bus = None
+            print("✓ Disconnected")
+
+    def command(self, cmd: List[int]) -> bytes:
+        """
+        Send a command and wait for its response
+
+        DAQ packets received meanwhile are kept for read_daq().
+
+        Returns:
+            Positive response packet
+
+        Raises:
+            XcpError on error packet or timeout
+        """
+        msg = can.Message(arbitration_id=self.cro_id, is_extended_id=self.extended,
+                          data=bytes(cmd))
+        self.bus.send(msg)
+
+        deadline = time.time() + self.timeout
+        while time.time() < deadline:
+            rx = self.bus.recv(timeout=deadline - time.time())
+            if rx is None or len(rx.data) == 0:
+                continue
+            if rx.data[0] == XCP_PID_RES:
+                return bytes(rx.data)
+            if rx.data[0] == XCP_PID_ERR:
+                code = rx.data[1] if len(rx.data) > 1 else 0xFF
+                raise XcpError(f"command 0x{cmd[0]:02x} failed with error 0x{code:02x}")
+            self.pending_daq.append(rx)
+
+        raise XcpError(f"timeout waiting for response to 0x{cmd[0]:02x}")
+
+    def upload(self, length: int) -> bytes:
+        """Read memory at the MTA (set by a previous command)"""
+        data = b''
+        while len(data) < length:
+            count = min(length - len(data), ODT_PAYLOAD)
+            res = self.command([XCP_CMD_UPLOAD, count])
+            data += res[1:1 + count]
+        return data
+
+    def event_channels(self) -> List[Tuple[str, int, int]]:
+        """
+        List the slave's event channels
+
+        Returns:
+            List of (name, cycle, time unit) per channel number
+        """
+        res = self.command([XCP_CMD_GET_DAQ_PROCESSOR_INFO])
+        max_event = res[4] | (res[5] << 8)
+
+        channels = []
+        for ev in range(max_event):
+            info = self.command([XCP_CMD_GET_DAQ_EVENT_INFO, 0, ev & 0xFF, ev >> 8])
+            name = self.upload(info[3]).decode('ascii', errors='replace')
+            channels.append((name, info[4], info[5]))
+        return channels
+
+    def configure_daq(self, signals: List[Signal], event: int,
+                      prescaler: int = 1) -> List[List[Signal]]:
+        """
+        Configure DAQ list 0 with the given signals
+
+        Returns:
+            ODT layout (signals per ODT)
+        """
+        odts: List[List[Signal]] = [[]]
+        room = ODT_PAYLOAD - TIMESTAMP_SIZE
+        for sig in signals:
+            if sig.size > ODT_PAYLOAD:
+                raise XcpError(f"{sig.name}: {sig.size} bytes do not fit one ODT")
+            if sig.size > room:
+                odts.append([])
+                room = ODT_PAYLOAD
+            odts[-1].append(sig)
+            room -= sig.size
+
+        # A previous session may have left DAQ running
+        self.command([XCP_CMD_START_STOP_SYNCH, 0x00])
+        self.command([XCP_CMD_FREE_DAQ])
+        self.command([XCP_CMD_ALLOC_DAQ, 0, 1, 0])
+        self.command([XCP_CMD_ALLOC_ODT, 0, 0, 0, len(odts)])
+        for i, odt in enumerate(odts):
+            self.command([XCP_CMD_ALLOC_ODT_ENTRY, 0, 0, 0, i, len(odt)])
+        for i, odt in enumerate(odts):
+            if not odt:
+                # First ODT carries only the timestamp
+                continue
+            self.command([XCP_CMD_SET_DAQ_PTR, 0, 0, 0, i, 0])
+            for sig in odt:
+                self.command([XCP_CMD_WRITE_DAQ, 0xFF, sig.size, 0] +
+                             list(struct.pack('<I', sig.address)))
+
+        self.command([XCP_CMD_SET_DAQ_LIST_MODE, XCP_DAQ_MODE_TIMESTAMP, 0, 0,
+                      event & 0xFF, event >> 8, prescaler, 0])
+        return odts
+
+    def start_daq(self) -> int:
+        """Select DAQ list 0 and start it; returns its first PID"""
+        res = self.command([XCP_CMD_START_STOP_DAQ_LIST, 0x02, 0, 0])
+        self.command([XCP_CMD_START_STOP_SYNCH, 0x01])
+        return res[1]
+
+    def stop_daq(self):
+        """Stop all DAQ lists"""
+        self.command([XCP_CMD_START_STOP_SYNCH, 0x00])
+
+    def read_daq(self, timeout: float) -> Optional[can.Message]:
+        """Receive the next DAQ packet"""
+        if self.pending_daq:
+            return self.pending_daq.pop(0)
+        rx = self.bus.recv(timeout=timeout)
+        if rx is None or len(rx.data) == 0 or rx.data[0] >= XCP_PID_ERR:
+            return None
+        return rx
+
+
+def load_symbols(elf: str) -> Dict[str, Tuple[int, int]]:
+    """Read symbol addresses and sizes with nm"""
+    out = subprocess.run(['nm', '-S', '--defined-only', elf], check=True,
+                         capture_output=True, text=True).stdout
+    symbols = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 4:
+            symbols.setdefault(parts[3], (int(parts[0], 16), int(parts[1], 16)))
+    return symbols
+
+
+def parse_signal(spec: str, symbols: Dict[str, Tuple[int, int]]) -> Signal:
+    """
+    Parse a signal given as NAME[+OFFSET][:TYPE] or ADDRESS:SIZE[:TYPE]
+    """
+    parts = spec.split(':')
+    if parts[0].lower().startswith('0x'):
+        if len(parts) < 2:
+            raise ValueError(f"{spec}: raw addresses need a size")
+        address = int(parts[0], 16)
+        size = int(parts[1])
+        sig_type = parts[2] if len(parts) > 2 else DEFAULT_TYPES.get(size)
+    else:
+        # NAME+OFFSET selects a member of a struct; the type is then required
+        name, _, offset = parts[0].partition('+')
+        if name not in symbols:
+            raise ValueError(f"{name}: symbol not found (use --elf)")
+        address, size = symbols[name]
+        if offset:
+            if len(parts) < 2:
+                raise ValueError(f"{spec}: struct members need a type")
+            address += int(offset, 0)
+            size = struct.calcsize(SIGNAL_TYPES.get(parts[1], ''))
+        sig_type = parts[1] if len(parts) > 1 else DEFAULT_TYPES.get(size)
+
+    if sig_type not in SIGNAL_TYPES:
+        raise ValueError(f"{spec}: unsupported type or size")
+    if struct.calcsize(SIGNAL_TYPES[sig_type]) != size:
+        raise ValueError(f"{spec}: type {sig_type} does not match size {size}")
+    if address > 0xFFFFFFFF:
+        raise ValueError(f"{spec}: address does not fit 32 bits")
+
+    return Signal(parts[0], address, size, sig_type)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Minimal XCP-on-CAN master for DAQ measurement',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="""
+Examples:
+  # List event channels only
+  %(prog)s -i vcan0 --list
+
+  # Sample three variables on the "control" event for 10 seconds
+  %(prog)s -i vcan0 --elf zephyr.elf --event control -t 10 demo_angle:i16 demo_speed demo_iterations
+        """)
+
+    parser.add_argument('-i', '--interface', default='vcan0',
+                        help='SocketCAN interface (default: vcan0)')
+    parser.add_argument('--cro-id', type=lambda x: int(x, 0), default=DEFAULT_CRO_ID,
+                        help='Command CAN ID (default: 0x551)')
+    parser.add_argument('--dto-id', type=lambda x: int(x, 0), default=DEFAULT_DTO_ID,
+                        help='Response/DAQ CAN ID (default: 0x552)')
+    parser.add_argument('--extended', action='store_true',
+                        help='Use 29-bit identifiers')
+    parser.add_argument('--elf', help='ELF file to resolve symbol names')
+    parser.add_argument('--event', default='timer',
+                        help='Event channel name or number (default: timer)')
+    parser.add_argument('--prescaler', type=int, default=1,
+                        help='Sample every Nth event (default: 1)')
+    parser.add_argument('-t', '--time', type=float, default=5.0,
+                        help='Measurement duration in seconds (default: 5)')
+    parser.add_argument('-q', '--quiet', action='store_true',
+                        help='Only print the summary')
+    parser.add_argument('--list', action='store_true',
+                        help='List event channels and exit')
+    parser.add_argument('signals', nargs='*',
+                        help='NAME[:TYPE], NAME+OFFSET:TYPE or 0xADDR:SIZE[:TYPE], TYPE one of '
+                             + ', '.join(SIGNAL_TYPES))
+
+    args = parser.parse_args()
+
+    symbols = load_symbols(args.elf) if args.elf else {}
+    try:
+        signals = [parse_signal(s, symbols) for s in args.signals]
+    except ValueError as e:
+        print(f"✗ {e}")
+        return 1
+
+    if not signals and not args.list:
+        parser.error('no signals given')
+
+    master = XcpMaster(args.interface, args.cro_id, args.dto_id, args.extended)
+    try:
+        master.connect()
+
+        channels = master.event_channels()
+        for num, (name, cycle, unit) in enumerate(channels):
+            period = f"{cycle} ms" if cycle else "sporadic"
+            print(f"  event {num}: {name} ({period})")
+        if args.list:
+            return 0
+
+        names = [c[0] for c in channels]
+        event = int(args.event, 0) if args.event[0].isdigit() else names.index(args.event)
+
+        odts = master.configure_daq(signals, event, args.prescaler)
+        print(f"✓ DAQ list: {len(signals)} signals in {len(odts)} ODTs on event {event}")
+
+        first_pid = master.start_daq()
+        start = time.time()
+        samples = 0
+        stamps: List[int] = []
+        values: Dict[str, object] = {}
+
+        while time.time() - start < args.time:
+            rx = master.read_daq(0.1)
+            if rx is None:
+                continue
+            odt = rx.data[0] - first_pid
+            if odt < 0 or odt >= len(odts):
+                continue
+
+            pos = 1
+            if odt == 0:
+                stamps.append(struct.unpack_from('<I', rx.data, pos)[0])
+                pos += TIMESTAMP_SIZE
+            for sig in odts[odt]:
+                values[sig.name] = sig.decode(bytes(rx.data[pos:pos + sig.size]))
+                pos += sig.size
+
+            if odt == len(odts) - 1:
+                samples += 1
+                if not args.quiet:
+                    fields = ' '.join(f"{k}={v}" for k, v in values.items())
+                    print(f"{stamps[-1] if stamps else 0:>10} us  {fields}")
+
+        master.stop_daq()
+        elapsed = time.time() - start
+
+        print(f"\n✓ {samples} samples in {elapsed:.1f} s ({samples / elapsed:.1f} Hz)")
+        if len(stamps) > 1:
+            deltas = [(b - a) & 0xFFFFFFFF for a, b in zip(stamps, stamps[1:])]
+            print(f"  slave period: min {min(deltas)} us, "
+                  f"mean {sum(deltas) / len(deltas):.0f} us, max {max(deltas)} us")
+    except (XcpError, ValueError) as e:
+        print(f"✗ {e}")
+        return 1
+    finally:
+        master.disconnect()
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())